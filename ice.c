@@ -280,15 +280,333 @@ static gboolean janus_is_rtcp(gchar *buf) {
 #define JANUS_ICE_PACKET_VIDEO	1
 #define JANUS_ICE_PACKET_DATA	2
 /* Janus enqueued (S)RTP/(S)RTCP packet to send */
+/* Size of the buffer embedded in each queued packet: larger packets get their own allocation */
+#define JANUS_ICE_PACKET_BUFSIZE	1500
+/* Room we leave after the payload when protecting packets, for the SRTP/SRTCP trailer */
+#define JANUS_ICE_SRTP_TRAILER	64
+struct janus_ice_packet_pool;
 typedef struct janus_ice_queued_packet {
 	char *data;
 	gint length;
 	gint type;
 	gboolean control;
 	gboolean encrypted;
+	/* If this is a shared RTP packet from a plugin, data points to its buffer,
+	 * and the overlay contains the header changes to apply when sending it */
+	janus_plugin_rtp_shared *shared;
+	janus_plugin_rtp_overlay overlay;
+	/* Pool this packet will be returned to when we're done with it */
+	struct janus_ice_packet_pool *pool;
+	/* Next packet in the pool, when this one is not in use */
+	struct janus_ice_queued_packet *next;
+	char buffer[JANUS_ICE_PACKET_BUFSIZE];
 } janus_ice_queued_packet;
-/* This is a static, fake, message we use as a trigger to send a DTLS alert */
-static janus_ice_queued_packet janus_ice_dtls_alert;
+
+/* Queued packets are recycled rather than allocated and freed for each packet
+ * we send: to limit contention, handles are spread over a few independent pools.
+ * Pools are not per worker thread, as packets are taken by plugin threads and
+ * given back by send threads (or static loops), which would drain one thread
+ * cache and fill another: sharding by handle keeps both sides on the same pool */
+#define JANUS_ICE_PACKET_POOLS		16
+#define JANUS_ICE_PACKET_POOL_MAX	512
+typedef struct janus_ice_packet_pool {
+	janus_mutex mutex;
+	janus_ice_queued_packet *free;
+	guint available;
+	guint64 hits, misses, oversized;
+} janus_ice_packet_pool;
+static janus_ice_packet_pool packet_pools[JANUS_ICE_PACKET_POOLS];
+static void janus_ice_packet_pools_init(void) {
+	int i = 0;
+	for(i=0; i<JANUS_ICE_PACKET_POOLS; i++) {
+		janus_mutex_init(&packet_pools[i].mutex);
+		packet_pools[i].free = NULL;
+		packet_pools[i].available = 0;
+		packet_pools[i].hits = 0;
+		packet_pools[i].misses = 0;
+		packet_pools[i].oversized = 0;
+	}
+}
+static void janus_ice_packet_pools_deinit(void) {
+	int i = 0;
+	for(i=0; i<JANUS_ICE_PACKET_POOLS; i++) {
+		janus_ice_packet_pool *pool = &packet_pools[i];
+		janus_mutex_lock(&pool->mutex);
+		while(pool->free != NULL) {
+			janus_ice_queued_packet *pkt = pool->free;
+			pool->free = pkt->next;
+			g_free(pkt);
+		}
+		pool->available = 0;
+		janus_mutex_unlock(&pool->mutex);
+	}
+}
+void janus_ice_get_packet_pool_stats(guint64 *hits, guint64 *misses, guint64 *oversized, guint *available) {
+	guint64 h = 0, m = 0, o = 0;
+	guint a = 0;
+	int i = 0;
+	for(i=0; i<JANUS_ICE_PACKET_POOLS; i++) {
+		janus_ice_packet_pool *pool = &packet_pools[i];
+		janus_mutex_lock(&pool->mutex);
+		h += pool->hits;
+		m += pool->misses;
+		o += pool->oversized;
+		a += pool->available;
+		janus_mutex_unlock(&pool->mutex);
+	}
+	if(hits)
+		*hits = h;
+	if(misses)
+		*misses = m;
+	if(oversized)
+		*oversized = o;
+	if(available)
+		*available = a;
+}
+/* Get a packet from the pool the handle uses (data is not set) */
+static janus_ice_queued_packet *janus_ice_queued_packet_get(janus_ice_handle *handle, gboolean oversized) {
+	janus_ice_packet_pool *pool = &packet_pools[handle->handle_id % JANUS_ICE_PACKET_POOLS];
+	janus_ice_queued_packet *pkt = NULL;
+	janus_mutex_lock(&pool->mutex);
+	if(pool->free != NULL) {
+		pkt = pool->free;
+		pool->free = pkt->next;
+		pool->available--;
+		pool->hits++;
+	} else {
+		pool->misses++;
+	}
+	if(oversized)
+		pool->oversized++;
+	janus_mutex_unlock(&pool->mutex);
+	if(pkt == NULL)
+		pkt = (janus_ice_queued_packet *)g_malloc(sizeof(janus_ice_queued_packet));
+	pkt->pool = pool;
+	pkt->next = NULL;
+	pkt->data = NULL;
+	pkt->length = 0;
+	pkt->type = 0;
+	pkt->control = FALSE;
+	pkt->encrypted = FALSE;
+	pkt->shared = NULL;
+	return pkt;
+}
+/* Get a packet from the pool the handle uses, and copy the provided data in it */
+static janus_ice_queued_packet *janus_ice_queued_packet_new(janus_ice_handle *handle, const char *buf, int len) {
+	janus_ice_queued_packet *pkt = janus_ice_queued_packet_get(handle, len > JANUS_ICE_PACKET_BUFSIZE);
+	pkt->data = (len > JANUS_ICE_PACKET_BUFSIZE) ? g_malloc(len) : pkt->buffer;
+	memcpy(pkt->data, buf, len);
+	pkt->length = len;
+	return pkt;
+}
+/* Give a packet back to its pool (or free it, if the pool is full) */
+static void janus_ice_queued_packet_free(janus_ice_queued_packet *pkt) {
+	if(pkt == NULL)
+		return;
+	if(pkt->shared != NULL) {
+		/* The data belongs to a shared packet, just release our reference */
+		janus_plugin_rtp_shared_unref(pkt->shared);
+		pkt->shared = NULL;
+	} else if(pkt->data != pkt->buffer) {
+		g_free(pkt->data);
+	}
+	pkt->data = NULL;
+	janus_ice_packet_pool *pool = pkt->pool;
+	if(pool != NULL) {
+		janus_mutex_lock(&pool->mutex);
+		if(pool->available < JANUS_ICE_PACKET_POOL_MAX) {
+			pkt->next = pool->free;
+			pool->free = pkt;
+			pool->available++;
+			pkt = NULL;
+		}
+		janus_mutex_unlock(&pool->mutex);
+	}
+	g_free(pkt);
+}
+
+/* Outgoing packets are queued in a bounded lock-free ring (based on Dmitry Vyukov's
+ * bounded MPMC queue): plugins and the core push from any thread, while the send
+ * thread (or static event loop) drains them in batches. When the ring is full, video
+ * packets make room by dropping the oldest packet in the queue (a stale frame is of
+ * little use anyway), while anything else is dropped instead of being queued */
+#define JANUS_ICE_QUEUE_DEFAULT_SIZE	1024
+#define JANUS_ICE_QUEUE_BATCH	32
+static uint outgoing_queue_size = JANUS_ICE_QUEUE_DEFAULT_SIZE;
+void janus_ice_set_outgoing_queue_size(uint size) {
+	/* The ring size needs to be a power of two */
+	uint qs = 64;
+	while(qs < size && qs < 65536)
+		qs <<= 1;
+	outgoing_queue_size = qs;
+	JANUS_LOG(LOG_VERB, "Setting outgoing queue size to %u packets\n", outgoing_queue_size);
+}
+uint janus_ice_get_outgoing_queue_size(void) {
+	return outgoing_queue_size;
+}
+typedef struct janus_ice_queue_slot {
+	volatile gint sequence;
+	janus_ice_queued_packet *pkt;
+} janus_ice_queue_slot;
+struct janus_ice_packet_queue {
+	janus_ice_queue_slot *slots;
+	guint mask;
+	volatile gint enqueue_pos;
+	volatile gint dequeue_pos;
+	/* Whether a DTLS alert should be sent (the PeerConnection is going away) */
+	volatile gint alert;
+	/* Whether a send thread is waiting on the condition for new packets */
+	volatile gint waiting;
+	volatile gint dropped_oldest, dropped_newest;
+	janus_mutex mutex;
+	janus_condition cond;
+};
+static janus_ice_packet_queue *janus_ice_packet_queue_new(guint size) {
+	janus_ice_packet_queue *queue = g_malloc0(sizeof(janus_ice_packet_queue));
+	queue->slots = g_malloc0(size*sizeof(janus_ice_queue_slot));
+	queue->mask = size-1;
+	guint i = 0;
+	for(i=0; i<size; i++)
+		queue->slots[i].sequence = i;
+	janus_mutex_init(&queue->mutex);
+	janus_condition_init(&queue->cond);
+	return queue;
+}
+static guint janus_ice_packet_queue_length(janus_ice_packet_queue *queue) {
+	guint len = (guint)g_atomic_int_get(&queue->enqueue_pos) - (guint)g_atomic_int_get(&queue->dequeue_pos);
+	return len > queue->mask+1 ? queue->mask+1 : len;
+}
+/* Add a packet to the ring, if there's room: on success, the position it got is returned in pos */
+static gboolean janus_ice_packet_queue_try_push(janus_ice_packet_queue *queue, janus_ice_queued_packet *pkt, guint *pos) {
+	janus_ice_queue_slot *slot = NULL;
+	guint p = (guint)g_atomic_int_get(&queue->enqueue_pos);
+	while(TRUE) {
+		slot = &queue->slots[p & queue->mask];
+		gint diff = (gint)((guint)g_atomic_int_get(&slot->sequence) - p);
+		if(diff == 0) {
+			/* This slot is free, try to claim it */
+			if(g_atomic_int_compare_and_exchange(&queue->enqueue_pos, (gint)p, (gint)(p+1)))
+				break;
+		} else if(diff < 0) {
+			/* The ring is full */
+			return FALSE;
+		}
+		/* Somebody else got there first, try again */
+		p = (guint)g_atomic_int_get(&queue->enqueue_pos);
+	}
+	slot->pkt = pkt;
+	g_atomic_int_set(&slot->sequence, (gint)(p+1));
+	if(pos)
+		*pos = p;
+	return TRUE;
+}
+/* Take the oldest packet from the ring, if any */
+static janus_ice_queued_packet *janus_ice_packet_queue_try_pop(janus_ice_packet_queue *queue) {
+	janus_ice_queue_slot *slot = NULL;
+	guint p = (guint)g_atomic_int_get(&queue->dequeue_pos);
+	while(TRUE) {
+		slot = &queue->slots[p & queue->mask];
+		gint diff = (gint)((guint)g_atomic_int_get(&slot->sequence) - (p+1));
+		if(diff == 0) {
+			/* There's a packet here, try to claim it (producers may be dropping it) */
+			if(g_atomic_int_compare_and_exchange(&queue->dequeue_pos, (gint)p, (gint)(p+1)))
+				break;
+		} else if(diff < 0) {
+			/* The ring is empty */
+			return NULL;
+		}
+		p = (guint)g_atomic_int_get(&queue->dequeue_pos);
+	}
+	janus_ice_queued_packet *pkt = slot->pkt;
+	slot->pkt = NULL;
+	g_atomic_int_set(&slot->sequence, (gint)(p+queue->mask+1));
+	return pkt;
+}
+/* Take up to max packets from the ring at once */
+static guint janus_ice_packet_queue_pop_batch(janus_ice_packet_queue *queue, janus_ice_queued_packet **pkts, guint max) {
+	guint count = 0;
+	while(count < max) {
+		janus_ice_queued_packet *pkt = janus_ice_packet_queue_try_pop(queue);
+		if(pkt == NULL)
+			break;
+		pkts[count] = pkt;
+		count++;
+	}
+	return count;
+}
+/* Wake up the send thread, if it's waiting for packets */
+static void janus_ice_packet_queue_notify(janus_ice_packet_queue *queue) {
+	if(!g_atomic_int_get(&queue->waiting))
+		return;
+	janus_mutex_lock(&queue->mutex);
+	janus_condition_signal(&queue->cond);
+	janus_mutex_unlock(&queue->mutex);
+}
+/* Add a packet to the ring, applying the overflow policy if needed: returns TRUE if
+ * the packet ended up at the head of the ring, meaning the consumer may be idle */
+static gboolean janus_ice_packet_queue_push(janus_ice_packet_queue *queue, janus_ice_queued_packet *pkt) {
+	gboolean drop_oldest = (!pkt->control && pkt->type == JANUS_ICE_PACKET_VIDEO);
+	guint pos = 0;
+	while(!janus_ice_packet_queue_try_push(queue, pkt, &pos)) {
+		if(!drop_oldest) {
+			g_atomic_int_inc(&queue->dropped_newest);
+			janus_ice_queued_packet_free(pkt);
+			return FALSE;
+		}
+		/* Make room by getting rid of the oldest packet */
+		janus_ice_queued_packet *old = janus_ice_packet_queue_try_pop(queue);
+		if(old != NULL) {
+			g_atomic_int_inc(&queue->dropped_oldest);
+			janus_ice_queued_packet_free(old);
+		}
+	}
+	janus_ice_packet_queue_notify(queue);
+	return (pos == (guint)g_atomic_int_get(&queue->dequeue_pos));
+}
+/* Tell the consumer it should send a DTLS alert and stop */
+static void janus_ice_packet_queue_alert(janus_ice_packet_queue *queue) {
+	g_atomic_int_set(&queue->alert, 1);
+	janus_ice_packet_queue_notify(queue);
+}
+static gboolean janus_ice_packet_queue_take_alert(janus_ice_packet_queue *queue) {
+	return g_atomic_int_compare_and_exchange(&queue->alert, 1, 0);
+}
+/* Wait at most timeout microseconds for packets (or an alert) to be available */
+static void janus_ice_packet_queue_wait(janus_ice_packet_queue *queue, gint64 timeout) {
+	janus_mutex_lock(&queue->mutex);
+	g_atomic_int_set(&queue->waiting, 1);
+	if(janus_ice_packet_queue_length(queue) == 0 && !g_atomic_int_get(&queue->alert)) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		gint64 nsec = ts.tv_nsec + (timeout % G_USEC_PER_SEC)*1000;
+		ts.tv_sec += timeout/G_USEC_PER_SEC + nsec/1000000000;
+		ts.tv_nsec = nsec % 1000000000;
+		janus_condition_timedwait(&queue->cond, &queue->mutex, &ts);
+	}
+	g_atomic_int_set(&queue->waiting, 0);
+	janus_mutex_unlock(&queue->mutex);
+}
+static void janus_ice_packet_queue_flush(janus_ice_packet_queue *queue) {
+	janus_ice_queued_packet *pkt = NULL;
+	while((pkt = janus_ice_packet_queue_try_pop(queue)) != NULL)
+		janus_ice_queued_packet_free(pkt);
+}
+static void janus_ice_packet_queue_destroy(janus_ice_packet_queue *queue) {
+	janus_ice_packet_queue_flush(queue);
+	janus_mutex_destroy(&queue->mutex);
+	janus_condition_destroy(&queue->cond);
+	g_free(queue->slots);
+	g_free(queue);
+}
+void janus_ice_handle_get_queue_stats(janus_ice_handle *handle, guint *queued, guint *dropped_oldest, guint *dropped_newest) {
+	janus_ice_packet_queue *queue = handle ? handle->queued_packets : NULL;
+	if(queued)
+		*queued = queue ? janus_ice_packet_queue_length(queue) : 0;
+	if(dropped_oldest)
+		*dropped_oldest = queue ? (guint)g_atomic_int_get(&queue->dropped_oldest) : 0;
+	if(dropped_newest)
+		*dropped_newest = queue ? (guint)g_atomic_int_get(&queue->dropped_newest) : 0;
+}
 
 
 /* Time, in seconds, that should pass with no media (audio or video) being
@@ -323,25 +641,146 @@ void janus_set_max_nack_queue(uint mnq) {
 uint janus_get_max_nack_queue(void) {
 	return max_nack_queue;
 }
+/* Sent packets are stored for retransmissions in a fixed-size ring per medium,
+ * indexed by sequence number: lookups and expiration are O(1), and the buffers
+ * of expired packets are kept aside and reused for the next ones we send */
+#define JANUS_ICE_NACK_RING_SIZE	1024
+#define JANUS_ICE_NACK_BUFSIZE		1500
+#define JANUS_ICE_NACK_SPARE_MAX	64
+typedef struct janus_ice_nack_buffer {
+	struct janus_ice_nack_buffer *next;
+	gint size;
+	char data[];
+} janus_ice_nack_buffer;
+typedef struct janus_ice_nack_slot {
+	janus_ice_nack_buffer *buffer;
+	gint length;
+	guint16 seq;
+	gboolean valid;
+	gint64 created;
+	gint64 last_retransmit;
+} janus_ice_nack_slot;
+struct janus_ice_nack_ring {
+	janus_ice_nack_slot slots[JANUS_ICE_NACK_RING_SIZE];
+	/* Oldest and most recent sequence numbers we may have in the ring */
+	guint16 tail, head;
+	gboolean empty;
+	/* Buffers of expired packets we can reuse */
+	janus_ice_nack_buffer *spare;
+	guint spare_count;
+};
+static janus_ice_nack_ring *janus_ice_nack_ring_new(void) {
+	janus_ice_nack_ring *ring = g_malloc0(sizeof(janus_ice_nack_ring));
+	ring->empty = TRUE;
+	return ring;
+}
+static void janus_ice_nack_ring_release(janus_ice_nack_ring *ring, janus_ice_nack_slot *slot) {
+	janus_ice_nack_buffer *buffer = slot->buffer;
+	slot->buffer = NULL;
+	slot->valid = FALSE;
+	if(buffer == NULL)
+		return;
+	if(ring->spare_count < JANUS_ICE_NACK_SPARE_MAX) {
+		buffer->next = ring->spare;
+		ring->spare = buffer;
+		ring->spare_count++;
+	} else {
+		g_free(buffer);
+	}
+}
+static void janus_ice_nack_ring_destroy(janus_ice_nack_ring *ring) {
+	if(ring == NULL)
+		return;
+	int i = 0;
+	for(i=0; i<JANUS_ICE_NACK_RING_SIZE; i++)
+		g_free(ring->slots[i].buffer);
+	while(ring->spare != NULL) {
+		janus_ice_nack_buffer *buffer = ring->spare;
+		ring->spare = buffer->next;
+		g_free(buffer);
+	}
+	g_free(ring);
+}
+/* Store a copy of an (already encrypted) RTP packet we just sent */
+static void janus_ice_nack_ring_store(janus_ice_nack_ring *ring, guint16 seq, char *buf, int len, gint64 now) {
+	if(ring->empty) {
+		ring->tail = seq;
+		ring->head = seq;
+		ring->empty = FALSE;
+	} else {
+		gint16 delta = (gint16)(seq - ring->head);
+		if(delta > 0) {
+			/* Newer packet: move the head, and the tail too if we're wrapping */
+			ring->head = seq;
+			if((guint16)(ring->head - ring->tail) >= JANUS_ICE_NACK_RING_SIZE)
+				ring->tail = ring->head - JANUS_ICE_NACK_RING_SIZE + 1;
+		} else if((guint16)(ring->head - seq) >= JANUS_ICE_NACK_RING_SIZE) {
+			/* Too old for the ring, nothing we can do */
+			return;
+		} else if((gint16)(seq - ring->tail) < 0) {
+			ring->tail = seq;
+		}
+	}
+	janus_ice_nack_slot *slot = &ring->slots[seq % JANUS_ICE_NACK_RING_SIZE];
+	janus_ice_nack_buffer *buffer = slot->buffer;
+	if(buffer == NULL && ring->spare != NULL) {
+		buffer = ring->spare;
+		ring->spare = buffer->next;
+		ring->spare_count--;
+	}
+	if(buffer != NULL && buffer->size < len) {
+		g_free(buffer);
+		buffer = NULL;
+	}
+	if(buffer == NULL) {
+		gint size = MAX(len, JANUS_ICE_NACK_BUFSIZE);
+		buffer = g_malloc(sizeof(janus_ice_nack_buffer) + size);
+		buffer->size = size;
+	}
+	buffer->next = NULL;
+	memcpy(buffer->data, buf, len);
+	slot->buffer = buffer;
+	slot->length = len;
+	slot->seq = seq;
+	slot->valid = TRUE;
+	slot->created = now;
+	slot->last_retransmit = 0;
+}
+/* Look for a packet we sent with this sequence number */
+static janus_ice_nack_slot *janus_ice_nack_ring_find(janus_ice_nack_ring *ring, guint16 seq) {
+	if(ring == NULL || ring->empty)
+		return NULL;
+	janus_ice_nack_slot *slot = &ring->slots[seq % JANUS_ICE_NACK_RING_SIZE];
+	if(!slot->valid || slot->seq != seq)
+		return NULL;
+	return slot;
+}
+/* Get rid of the packets that exceed the queue time limit, starting from the oldest */
+static void janus_ice_nack_ring_expire(janus_ice_nack_ring *ring, gint64 now) {
+	if(ring == NULL)
+		return;
+	while(!ring->empty) {
+		janus_ice_nack_slot *slot = &ring->slots[ring->tail % JANUS_ICE_NACK_RING_SIZE];
+		if(slot->valid && slot->seq == ring->tail) {
+			if(now - slot->created < (gint64)max_nack_queue*1000)
+				break;
+			/* Packet is too old, get rid of it */
+			janus_ice_nack_ring_release(ring, slot);
+		}
+		if(ring->tail == ring->head) {
+			ring->empty = TRUE;
+			break;
+		}
+		ring->tail++;
+	}
+}
 /* Helper to clean old NACK packets in the buffer when they exceed the queue time limit */
 static void janus_cleanup_nack_buffer(gint64 now, janus_ice_stream *stream) {
 	if(stream && stream->rtp_component) {
 		janus_ice_component *component = stream->rtp_component;
 		janus_mutex_lock(&component->mutex);
-		if(component->retransmit_buffer) {
-			GList *first = g_list_first(component->retransmit_buffer);
-			janus_rtp_packet *p = (janus_rtp_packet *)first->data;
-			while(p && (now - p->created >= (gint64)max_nack_queue*1000)) {
-				/* Packet is too old, get rid of it */
-				first->data = NULL;
-				component->retransmit_buffer = g_list_delete_link(component->retransmit_buffer, first);
-				g_free(p->data);
-				p->data = NULL;
-				g_free(p);
-				first = g_list_first(component->retransmit_buffer);
-				p = (janus_rtp_packet *)(first ? first->data : NULL);
-			}
-		}
+		janus_ice_nack_ring_expire(component->audio_retransmit_buffer, now);
+		janus_ice_nack_ring_expire(component->video_retransmit_buffer, now);
 		janus_mutex_unlock(&component->mutex);
 	}
 }
@@ -402,6 +841,166 @@ static int janus_seq_in_range(guint16 seqn, guint16 start, guint16 len) {
 void janus_ice_relay_rtcp_internal(janus_ice_handle *handle, int video, char *buf, int len, gboolean filter_rtcp);
 
 
+/* Static event loops: by default each handle gets its own libnice loop
+ * thread and send thread, but a fixed pool of loops can be used instead */
+static int static_event_loops = 0;
+static GSList *event_loops = NULL, *current_loop = NULL;
+static janus_mutex event_loops_mutex;
+/* Batch of outgoing packets (defined later) */
+typedef struct janus_ice_send_batch janus_ice_send_batch;
+static void janus_ice_send_batch_destroy(janus_ice_send_batch *batch);
+typedef struct janus_ice_static_event_loop {
+	int id;
+	GMainContext *mainctx;
+	GMainLoop *mainloop;
+	GThread *thread;
+	janus_ice_send_batch *batch;	/* Shared by all the handles this loop serves (only used by the loop thread) */
+} janus_ice_static_event_loop;
+static void *janus_ice_static_event_loop_thread(void *data) {
+	janus_ice_static_event_loop *loop = (janus_ice_static_event_loop *)data;
+	JANUS_LOG(LOG_VERB, "[loop#%d] Event loop thread started\n", loop->id);
+	if(loop->mainloop == NULL) {
+		JANUS_LOG(LOG_ERR, "[loop#%d] Invalid loop...\n", loop->id);
+		return NULL;
+	}
+	JANUS_LOG(LOG_DBG, "[loop#%d] Looping...\n", loop->id);
+	g_main_loop_run(loop->mainloop);
+	JANUS_LOG(LOG_VERB, "[loop#%d] Event loop thread ended!\n", loop->id);
+	return NULL;
+}
+int janus_ice_get_static_event_loops(void) {
+	return static_event_loops;
+}
+void janus_ice_set_static_event_loops(int loops) {
+	if(loops == 0)
+		return;
+	else if(loops < 1) {
+		JANUS_LOG(LOG_WARN, "Invalid number of static event loops (%d), disabling them\n", loops);
+		return;
+	}
+	/* Create a pool of new event loops */
+	janus_mutex_init(&event_loops_mutex);
+	int i = 0;
+	for(i=0; i<loops; i++) {
+		janus_ice_static_event_loop *loop = g_malloc0(sizeof(janus_ice_static_event_loop));
+		loop->id = static_event_loops;
+		loop->mainctx = g_main_context_new();
+		loop->mainloop = g_main_loop_new(loop->mainctx, FALSE);
+		/* Now spawn a thread for this loop */
+		GError *error = NULL;
+		char tname[16];
+		g_snprintf(tname, sizeof(tname), "hloop %d", loop->id);
+		loop->thread = g_thread_try_new(tname, &janus_ice_static_event_loop_thread, loop, &error);
+		if(error != NULL) {
+			g_main_loop_unref(loop->mainloop);
+			g_main_context_unref(loop->mainctx);
+			g_free(loop);
+			JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch a new event loop thread...\n",
+				error->code, error->message ? error->message : "??");
+			break;
+		}
+		event_loops = g_slist_append(event_loops, loop);
+		static_event_loops++;
+	}
+	current_loop = event_loops;
+	JANUS_LOG(LOG_INFO, "Spawned %d static event loops (handles won't have a dedicated loop)\n", static_event_loops);
+	return;
+}
+void janus_ice_stop_static_event_loops(void) {
+	if(static_event_loops < 1)
+		return;
+	/* Quit all the static loops and wait for the threads to leave */
+	janus_mutex_lock(&event_loops_mutex);
+	GSList *l = event_loops;
+	while(l) {
+		janus_ice_static_event_loop *loop = (janus_ice_static_event_loop *)l->data;
+		if(loop->mainloop != NULL && g_main_loop_is_running(loop->mainloop))
+			g_main_loop_quit(loop->mainloop);
+		g_thread_join(loop->thread);
+		g_main_loop_unref(loop->mainloop);
+		g_main_context_unref(loop->mainctx);
+		janus_ice_send_batch_destroy(loop->batch);
+		loop->batch = NULL;
+		l = l->next;
+	}
+	g_slist_free_full(event_loops, (GDestroyNotify)g_free);
+	event_loops = NULL;
+	current_loop = NULL;
+	static_event_loops = 0;
+	janus_mutex_unlock(&event_loops_mutex);
+}
+/* Helper to pick the next static event loop to assign a new handle to (round robin) */
+static janus_ice_static_event_loop *janus_ice_static_event_loop_next(void) {
+	if(static_event_loops < 1)
+		return NULL;
+	janus_mutex_lock(&event_loops_mutex);
+	if(current_loop == NULL)
+		current_loop = event_loops;
+	janus_ice_static_event_loop *loop = current_loop ? (janus_ice_static_event_loop *)current_loop->data : NULL;
+	if(current_loop)
+		current_loop = current_loop->next;
+	janus_mutex_unlock(&event_loops_mutex);
+	return loop;
+}
+/* Helper to wrap up a PeerConnection when the handle is served by a static event loop (defined later) */
+static void janus_ice_static_event_loop_wrapup(janus_ice_handle *handle);
+/* Helper to create the source taking care of outgoing traffic in a static event loop (defined later) */
+static GSource *janus_ice_outgoing_traffic_create(janus_ice_handle *handle);
+
+
+/* Helper to stop receiving packets from libnice for all the streams/components of a handle */
+static void janus_ice_detach_recv(janus_ice_handle *handle) {
+	if(handle == NULL || handle->agent == NULL || handle->icectx == NULL)
+		return;
+	if(handle->audio_id > 0) {
+		nice_agent_attach_recv(handle->agent, handle->audio_id, 1, handle->icectx, NULL, NULL);
+		if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX))
+			nice_agent_attach_recv(handle->agent, handle->audio_id, 2, handle->icectx, NULL, NULL);
+	}
+	if(handle->video_id > 0) {
+		nice_agent_attach_recv(handle->agent, handle->video_id, 1, handle->icectx, NULL, NULL);
+		if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX))
+			nice_agent_attach_recv(handle->agent, handle->video_id, 2, handle->icectx, NULL, NULL);
+	}
+	if(handle->data_id > 0) {
+		nice_agent_attach_recv(handle->agent, handle->data_id, 1, handle->icectx, NULL, NULL);
+	}
+}
+
+/* Helper to enqueue a packet for a handle, and wake up whoever is going to send it */
+static void janus_ice_queue_packet(janus_ice_handle *handle, janus_ice_queued_packet *pkt) {
+	if(handle->queued_packets == NULL) {
+		janus_ice_queued_packet_free(pkt);
+		return;
+	}
+	gboolean head = janus_ice_packet_queue_push(handle->queued_packets, pkt);
+	if(head && handle->static_event_loop != NULL) {
+		/* There's no send thread waiting on the queue, poke the loop instead: we only
+		 * need to do that when the queue was empty, as the loop will check it again anyway */
+		janus_ice_static_event_loop *loop = (janus_ice_static_event_loop *)handle->static_event_loop;
+		g_main_context_wakeup(loop->mainctx);
+	}
+}
+
+/* Helper to tell whoever is sending packets for a handle that a DTLS alert is needed */
+static void janus_ice_queue_alert(janus_ice_handle *handle) {
+	if(handle->queued_packets == NULL)
+		return;
+	janus_ice_packet_queue_alert(handle->queued_packets);
+	if(handle->static_event_loop != NULL) {
+		janus_ice_static_event_loop *loop = (janus_ice_static_event_loop *)handle->static_event_loop;
+		g_main_context_wakeup(loop->mainctx);
+	}
+}
+
+/* Helper to get rid of all the packets still queued for a handle */
+static void janus_ice_flush_queue(janus_ice_handle *handle) {
+	if(handle->queued_packets == NULL)
+		return;
+	janus_ice_packet_queue_flush(handle->queued_packets);
+}
+
+
 /* Map of old plugin sessions that have been closed */
 static GHashTable *old_plugin_sessions;
 static janus_mutex old_plugin_sessions_mutex;
@@ -425,6 +1024,11 @@ static janus_mutex old_handles_mutex;
 
 static gboolean janus_ice_handles_cleanup(gpointer user_data) {
 	janus_ice_handle *handle = (janus_ice_handle *) user_data;
+	if(g_atomic_int_get(&handle->loop_refs) > 0) {
+		/* A static event loop is still using this handle, try again later */
+		JANUS_LOG(LOG_VERB, "Handle %"SCNu64" still referenced by its event loop, postponing cleanup\n", handle->handle_id);
+		return G_SOURCE_CONTINUE;
+	}
 
 	JANUS_LOG(LOG_INFO, "Cleaning up handle %"SCNu64"...\n", handle->handle_id);
 	janus_ice_free(handle);
@@ -701,6 +1305,9 @@ void janus_ice_init(gboolean ice_lite, gboolean ice_tcp, gboolean ipv6, uint16_t
 #endif
 	}
 
+	/* Prepare the pools we'll take outgoing packets from */
+	janus_ice_packet_pools_init();
+
 	/* We keep track of old plugin sessions to avoid problems */
 	old_plugin_sessions = g_hash_table_new(NULL, NULL);
 	janus_mutex_init(&old_plugin_sessions_mutex);
@@ -731,6 +1338,8 @@ void janus_ice_deinit(void) {
 	handles_watchdog = NULL;
 	g_main_loop_unref(handles_watchdog_loop);
 	g_main_context_unref(handles_watchdog_context);
+	janus_ice_stop_static_event_loops();
+	janus_ice_packet_pools_deinit();
 	janus_mutex_lock(&old_handles_mutex);
 	if(old_handles != NULL)
 		g_hash_table_destroy(old_handles);
@@ -944,10 +1553,232 @@ const gchar *janus_get_ice_state_name(gint state) {
 	return janus_ice_state_name[state];
 }
 
+/* Peer SSRCs */
+static guint janus_ice_ssrc_hash(guint32 ssrc, guint size) {
+	return (ssrc * 2654435761U) & (size-1);
+}
+
+static void janus_ice_ssrc_table_insert(janus_ice_ssrc_table *table, guint32 ssrc, guint8 type, guint8 layer, guint8 extra) {
+	if(ssrc == 0)
+		return;
+	if(table->entries == NULL || (table->count+1)*2 > table->size) {
+		/* Grow the table (and rehash what we have) to keep probes short */
+		janus_ice_ssrc_entry *old = table->entries;
+		guint old_size = table->size, i = 0;
+		table->size = old_size ? old_size*2 : 8;
+		table->entries = g_malloc0(table->size * sizeof(janus_ice_ssrc_entry));
+		table->count = 0;
+		for(i=0; i<old_size; i++) {
+			if(old[i].ssrc != 0)
+				janus_ice_ssrc_table_insert(table, old[i].ssrc, old[i].type, old[i].layer, old[i].extra);
+		}
+		g_free(old);
+	}
+	guint index = janus_ice_ssrc_hash(ssrc, table->size);
+	while(table->entries[index].ssrc != 0 && table->entries[index].ssrc != ssrc)
+		index = (index+1) & (table->size-1);
+	if(table->entries[index].ssrc == 0)
+		table->count++;
+	table->entries[index].ssrc = ssrc;
+	table->entries[index].type = type;
+	table->entries[index].layer = layer;
+	table->entries[index].extra = extra;
+}
+
+static const janus_ice_ssrc_entry *janus_ice_ssrc_table_find(janus_ice_ssrc_table *table, guint32 ssrc) {
+	if(table->entries == NULL || ssrc == 0)
+		return NULL;
+	guint index = janus_ice_ssrc_hash(ssrc, table->size);
+	while(table->entries[index].ssrc != 0) {
+		if(table->entries[index].ssrc == ssrc)
+			return &table->entries[index];
+		index = (index+1) & (table->size-1);
+	}
+	return NULL;
+}
+
+static void janus_ice_ssrc_table_copy_extra(janus_ice_ssrc_table *dst, janus_ice_ssrc_table *src) {
+	if(src == NULL)
+		return;
+	guint i = 0;
+	for(i=0; i<src->size; i++) {
+		if(src->entries[i].ssrc != 0 && src->entries[i].extra && janus_ice_ssrc_table_find(dst, src->entries[i].ssrc) == NULL)
+			janus_ice_ssrc_table_insert(dst, src->entries[i].ssrc, src->entries[i].type, src->entries[i].layer, TRUE);
+	}
+}
+
+static janus_ice_ssrc_table *janus_ice_ssrc_table_dup(janus_ice_ssrc_table *src) {
+	janus_ice_ssrc_table *table = g_malloc0(sizeof(janus_ice_ssrc_table));
+	if(src != NULL && src->entries != NULL) {
+		table->entries = g_malloc(src->size * sizeof(janus_ice_ssrc_entry));
+		memcpy(table->entries, src->entries, src->size * sizeof(janus_ice_ssrc_entry));
+		table->size = src->size;
+		table->count = src->count;
+	}
+	return table;
+}
+
+static void janus_ice_ssrc_table_free(gpointer data) {
+	janus_ice_ssrc_table *table = (janus_ice_ssrc_table *)data;
+	if(table == NULL)
+		return;
+	g_free(table->entries);
+	g_free(table);
+}
+
+static gboolean janus_ice_ssrc_table_retired(gpointer user_data) {
+	/* Nothing to do: the table is freed by the destroy notify of the source */
+	return G_SOURCE_REMOVE;
+}
+
+/* The table of a stream is probed by the loop of the handle for every incoming packet,
+ * without any lock: it's an immutable snapshot, and writers (e.g., on a renegotiation)
+ * serialize on the stream mutex, build a new table on the side and swap the pointer.
+ * The old table can only be freed once the loop is done with the packet it may be
+ * handling right now, so we do that in a source dispatched by the loop itself */
+static void janus_ice_stream_swap_peer_ssrcs(janus_ice_stream *stream, janus_ice_ssrc_table *table) {
+	janus_ice_ssrc_table *old = g_atomic_pointer_get(&stream->peer_ssrcs);
+	g_atomic_pointer_set(&stream->peer_ssrcs, table);
+	if(old == NULL)
+		return;
+	GMainContext *icectx = stream->handle ? stream->handle->icectx : NULL;
+	if(icectx == NULL) {
+		/* The loop may be going away, keep the table around until the stream is freed */
+		stream->retired_ssrcs = g_slist_prepend(stream->retired_ssrcs, old);
+		return;
+	}
+	GSource *source = g_idle_source_new();
+	g_source_set_priority(source, G_PRIORITY_DEFAULT);
+	g_source_set_callback(source, janus_ice_ssrc_table_retired, old, janus_ice_ssrc_table_free);
+	g_source_attach(source, icectx);
+	g_source_unref(source);
+}
+
+static gboolean janus_ice_stream_find_peer_ssrc(janus_ice_stream *stream, guint32 ssrc, janus_ice_ssrc_entry *entry) {
+	janus_ice_ssrc_table *table = g_atomic_pointer_get(&stream->peer_ssrcs);
+	const janus_ice_ssrc_entry *found = table ? janus_ice_ssrc_table_find(table, ssrc) : NULL;
+	if(found != NULL)
+		*entry = *found;
+	return (found != NULL);
+}
+
+void janus_ice_stream_add_peer_ssrc(janus_ice_stream *stream, guint32 ssrc, janus_ice_ssrc_type type, int layer) {
+	if(stream == NULL || ssrc == 0)
+		return;
+	janus_mutex_lock_nodebug(&stream->mutex);
+	janus_ice_ssrc_table *table = janus_ice_ssrc_table_dup(stream->peer_ssrcs);
+	janus_ice_ssrc_table_insert(table, ssrc, type, layer, TRUE);
+	janus_ice_stream_swap_peer_ssrcs(stream, table);
+	janus_mutex_unlock_nodebug(&stream->mutex);
+}
+
+void janus_ice_stream_copy_peer_ssrcs(janus_ice_stream *stream, janus_ice_stream *from) {
+	if(stream == NULL || from == NULL || stream == from)
+		return;
+	/* Take a snapshot of the SSRCs that were added explicitly to the other stream */
+	janus_ice_ssrc_table extra = { NULL, 0, 0 };
+	janus_mutex_lock_nodebug(&from->mutex);
+	janus_ice_ssrc_table_copy_extra(&extra, from->peer_ssrcs);
+	janus_mutex_unlock_nodebug(&from->mutex);
+	if(extra.count > 0) {
+		janus_mutex_lock_nodebug(&stream->mutex);
+		janus_ice_ssrc_table *table = janus_ice_ssrc_table_dup(stream->peer_ssrcs);
+		guint i = 0;
+		for(i=0; i<extra.size; i++) {
+			if(extra.entries[i].ssrc != 0)
+				janus_ice_ssrc_table_insert(table, extra.entries[i].ssrc, extra.entries[i].type, extra.entries[i].layer, TRUE);
+		}
+		janus_ice_stream_swap_peer_ssrcs(stream, table);
+		janus_mutex_unlock_nodebug(&stream->mutex);
+	}
+	g_free(extra.entries);
+}
+
+void janus_ice_stream_update_peer_ssrcs(janus_ice_stream *stream) {
+	if(stream == NULL)
+		return;
+	/* Start from scratch, but keep the SSRCs that were added explicitly */
+	janus_ice_ssrc_table *table = g_malloc0(sizeof(janus_ice_ssrc_table));
+	janus_mutex_lock_nodebug(&stream->mutex);
+	janus_ice_ssrc_table_insert(table, stream->audio_ssrc_peer, JANUS_ICE_SSRC_AUDIO, 0, FALSE);
+	janus_ice_ssrc_table_insert(table, stream->video_ssrc_peer, JANUS_ICE_SSRC_VIDEO, 0, FALSE);
+	janus_ice_ssrc_table_insert(table, stream->video_ssrc_peer_rtx, JANUS_ICE_SSRC_VIDEO_RTX, 0, FALSE);
+	janus_ice_ssrc_table_insert(table, stream->video_ssrc_peer_sim_1, JANUS_ICE_SSRC_VIDEO_SIM, 1, FALSE);
+	janus_ice_ssrc_table_insert(table, stream->video_ssrc_peer_sim_2, JANUS_ICE_SSRC_VIDEO_SIM, 2, FALSE);
+	janus_ice_ssrc_table_copy_extra(table, stream->peer_ssrcs);
+	janus_ice_stream_swap_peer_ssrcs(stream, table);
+	janus_mutex_unlock_nodebug(&stream->mutex);
+}
+
+void janus_ice_stream_set_payload_types(janus_ice_stream *stream, int video, GList *ptypes) {
+	if(stream == NULL)
+		return;
+	/* Build the new bitmap from scratch, so that payload types that were removed aren't accepted anymore */
+	guint32 pts[4] = { 0, 0, 0, 0 };
+	while(ptypes) {
+		int pt = GPOINTER_TO_INT(ptypes->data);
+		if(pt >= 0 && pt <= 127)
+			pts[pt >> 5] |= (1U << (pt & 31));
+		ptypes = ptypes->next;
+	}
+	/* The bitmap is checked by the loop without locking, so each word is published atomically */
+	volatile gint *words = video ? stream->video_payload_types : stream->audio_payload_types;
+	int i = 0;
+	for(i=0; i<4; i++)
+		g_atomic_int_set(&words[i], (gint)pts[i]);
+}
+
+static gboolean janus_ice_stream_has_payload_type(janus_ice_stream *stream, int video, int pt) {
+	volatile gint *words = video ? stream->video_payload_types : stream->audio_payload_types;
+	guint32 word = (guint32)g_atomic_int_get(&words[(pt & 127) >> 5]);
+	return (word & (1U << (pt & 31))) != 0;
+}
+
 /* Stats */
-static void janus_ice_stats_queue_free(gpointer data) {
-	janus_ice_stats_item *s = (janus_ice_stats_item *)data;
-	g_free(s);
+/* Totals are updated without locking, as they can be read by other threads (e.g., the Admin API) */
+#define janus_ice_stats_add(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+static uint stats_window_buckets = G_USEC_PER_SEC/JANUS_ICE_STATS_BUCKET_DURATION;
+void janus_ice_set_stats_window(uint window) {
+	uint buckets = (window*1000 + JANUS_ICE_STATS_BUCKET_DURATION/2)/JANUS_ICE_STATS_BUCKET_DURATION;
+	if(buckets < 1)
+		buckets = 1;
+	if(buckets > JANUS_ICE_STATS_MAX_BUCKETS)
+		buckets = JANUS_ICE_STATS_MAX_BUCKETS;
+	stats_window_buckets = buckets;
+	JANUS_LOG(LOG_VERB, "Setting stats window to %ums\n", janus_ice_get_stats_window());
+}
+uint janus_ice_get_stats_window(void) {
+	return stats_window_buckets*JANUS_ICE_STATS_BUCKET_DURATION/1000;
+}
+
+void janus_ice_stats_window_update(janus_ice_stats_window *window, gint64 now, guint32 bytes) {
+	if(window == NULL)
+		return;
+	gint64 period = now/JANUS_ICE_STATS_BUCKET_DURATION;
+	int index = period % JANUS_ICE_STATS_MAX_BUCKETS;
+	if(window->period[index] != period) {
+		/* This bucket was used for an older period, start over */
+		window->bytes[index] = 0;
+		window->packets[index] = 0;
+		window->period[index] = period;
+	}
+	window->bytes[index] += bytes;
+	window->packets[index]++;
+	window->last_update = now;
+}
+
+guint64 janus_ice_stats_window_get_bytes(janus_ice_stats_window *window, gint64 now) {
+	if(window == NULL || window->last_update == 0)
+		return 0;
+	gint64 period = now/JANUS_ICE_STATS_BUCKET_DURATION;
+	guint64 bytes = 0;
+	uint i = 0;
+	for(i=0; i<stats_window_buckets; i++) {
+		int index = (period-i) % JANUS_ICE_STATS_MAX_BUCKETS;
+		if(window->period[index] == period-i)
+			bytes += window->bytes[index];
+	}
+	return bytes*G_USEC_PER_SEC/((guint64)stats_window_buckets*JANUS_ICE_STATS_BUCKET_DURATION);
 }
 
 void janus_ice_stats_reset(janus_ice_stats *stats) {
@@ -955,16 +1786,12 @@ void janus_ice_stats_reset(janus_ice_stats *stats) {
 		return;
 	stats->audio_packets = 0;
 	stats->audio_bytes = 0;
-	if(stats->audio_bytes_lastsec)
-		g_list_free_full(stats->audio_bytes_lastsec, &janus_ice_stats_queue_free);
-	stats->audio_bytes_lastsec = NULL;
+	memset(&stats->audio_bytes_lastsec, 0, sizeof(stats->audio_bytes_lastsec));
 	stats->audio_notified_lastsec = FALSE;
 	stats->audio_nacks = 0;
 	stats->video_packets = 0;
 	stats->video_bytes = 0;
-	if(stats->video_bytes_lastsec)
-		g_list_free_full(stats->video_bytes_lastsec, &janus_ice_stats_queue_free);
-	stats->video_bytes_lastsec = NULL;
+	memset(&stats->video_bytes_lastsec, 0, sizeof(stats->video_bytes_lastsec));
 	stats->video_notified_lastsec = FALSE;
 	stats->video_nacks = 0;
 	stats->data_packets = 0;
@@ -1001,7 +1828,8 @@ janus_ice_handle *janus_ice_handle_create(void *gateway_session, const char *opa
 	handle->handle_id = handle_id;
 	handle->app = NULL;
 	handle->app_handle = NULL;
-	handle->queued_packets = g_async_queue_new();
+	handle->queued_packets = janus_ice_packet_queue_new(outgoing_queue_size);
+	handle->static_event_loop = janus_ice_static_event_loop_next();
 	janus_mutex_init(&handle->mutex);
 
 	/* Set up other stuff. */
@@ -1074,22 +1902,15 @@ gint janus_ice_handle_destroy(void *gateway_session, guint64 handle_id) {
 		/* There was no plugin attached, probably something went wrong there */
 		janus_flags_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT);
 		janus_flags_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_STOP);
-		if(handle->iceloop) {
-			if(handle->audio_id > 0) {
-				nice_agent_attach_recv(handle->agent, handle->audio_id, 1, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-				if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX))
-					nice_agent_attach_recv(handle->agent, handle->audio_id, 2, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-			}
-			if(handle->video_id > 0) {
-				nice_agent_attach_recv(handle->agent, handle->video_id, 1, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-				if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX))
-					nice_agent_attach_recv(handle->agent, handle->video_id, 2, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-			}
-			if(handle->data_id > 0) {
-				nice_agent_attach_recv(handle->agent, handle->data_id, 1, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-			}
-			g_main_loop_quit(handle->iceloop);
+		janus_ice_detach_recv(handle);
+		if(handle->incoming_batch != NULL)
+			g_source_destroy(handle->incoming_batch);
+		if(handle->outgoing_source != NULL) {
+			/* The shared loop will send the alerts and tear the source down itself */
+			janus_ice_queue_alert(handle);
 		}
+		if(handle->iceloop)
+			g_main_loop_quit(handle->iceloop);
 		return 0;
 	}
 	JANUS_LOG(LOG_INFO, "Detaching handle from %s\n", plugin_t->get_name());
@@ -1106,22 +1927,16 @@ gint janus_ice_handle_destroy(void *gateway_session, guint64 handle_id) {
 	/* Get rid of the handle now */
 	janus_flags_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT);
 	janus_flags_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_STOP);
-	if(handle->iceloop) {
-		if(handle->audio_id > 0) {
-			nice_agent_attach_recv(handle->agent, handle->audio_id, 1, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-			if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX))
-				nice_agent_attach_recv(handle->agent, handle->audio_id, 2, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-		}
-		if(handle->video_id > 0) {
-			nice_agent_attach_recv(handle->agent, handle->video_id, 1, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-			if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX))
-				nice_agent_attach_recv(handle->agent, handle->video_id, 2, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-		}
-		if(handle->data_id > 0) {
-			nice_agent_attach_recv(handle->agent, handle->data_id, 1, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-		}
+	janus_ice_detach_recv(handle);
+	if(handle->incoming_batch != NULL)
+		g_source_destroy(handle->incoming_batch);
+	if(handle->outgoing_source != NULL) {
+		/* Don't destroy the source from here, or the alerts would never be sent:
+		 * the shared loop will send them and tear the source down itself */
+		janus_ice_queue_alert(handle);
+	}
+	if(handle->iceloop)
 		g_main_loop_quit(handle->iceloop);
-	}
 
 	/* Prepare JSON event to notify user/application */
 	json_t *event = json_object();
@@ -1147,15 +1962,8 @@ void janus_ice_free(janus_ice_handle *handle) {
 	if(handle == NULL)
 		return;
 	janus_mutex_lock(&handle->mutex);
-	janus_ice_queued_packet *pkt = NULL;
-	while(g_async_queue_length(handle->queued_packets) > 0) {
-		pkt = g_async_queue_try_pop(handle->queued_packets);
-		if(pkt != NULL && pkt != &janus_ice_dtls_alert) {
-			g_free(pkt->data);
-			g_free(pkt);
-		}
-	}
-	g_async_queue_unref(handle->queued_packets);
+	janus_ice_flush_queue(handle);
+	janus_ice_packet_queue_destroy(handle->queued_packets);
 	handle->queued_packets = NULL;
 	handle->session = NULL;
 	handle->app = NULL;
@@ -1192,24 +2000,15 @@ void janus_ice_webrtc_hangup(janus_ice_handle *handle, const char *reason) {
 			plugin->hangup_media(handle->app_handle);
 		janus_ice_notify_hangup(handle, reason);
 	}
-	if(handle->queued_packets != NULL)
-		g_async_queue_push(handle->queued_packets, &janus_ice_dtls_alert);
-	if(handle->send_thread == NULL) {
+	janus_ice_queue_alert(handle);
+	if(handle->static_event_loop != NULL) {
+		/* The loop is shared: if nobody is going to process the alert, wrap up here */
+		if(handle->outgoing_source == NULL)
+			janus_ice_static_event_loop_wrapup(handle);
+	} else if(handle->send_thread == NULL) {
 		/* Get rid of the loop */
 		if(handle->iceloop) {
-			if(handle->audio_id > 0) {
-				nice_agent_attach_recv(handle->agent, handle->audio_id, 1, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-				if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX))
-					nice_agent_attach_recv(handle->agent, handle->audio_id, 2, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-			}
-			if(handle->video_id > 0) {
-				nice_agent_attach_recv(handle->agent, handle->video_id, 1, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-				if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX))
-					nice_agent_attach_recv(handle->agent, handle->video_id, 2, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-			}
-			if(handle->data_id > 0) {
-				nice_agent_attach_recv(handle->agent, handle->data_id, 1, g_main_loop_get_context (handle->iceloop), NULL, NULL);
-			}
+			janus_ice_detach_recv(handle);
 			gint64 waited = 0;
 			while(handle->iceloop && !g_main_loop_is_running(handle->iceloop)) {
 				JANUS_LOG(LOG_VERB, "[%"SCNu64"] ICE loop exists but is not running, waiting for it to run\n", handle->handle_id);
@@ -1235,6 +2034,18 @@ void janus_ice_webrtc_free(janus_ice_handle *handle) {
 		return;
 	janus_mutex_lock(&handle->mutex);
 	janus_flags_clear(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_READY);
+	if(handle->incoming_batch != NULL) {
+		g_source_destroy(handle->incoming_batch);
+		g_source_unref(handle->incoming_batch);
+		handle->incoming_batch = NULL;
+	}
+	if(handle->outgoing_source != NULL) {
+		g_source_destroy(handle->outgoing_source);
+		g_source_unref(handle->outgoing_source);
+		handle->outgoing_source = NULL;
+		/* Make sure a new source can be created, if this handle is reused */
+		g_atomic_int_set(&handle->send_thread_created, 0);
+	}
 	if(handle->iceloop != NULL) {
 		g_main_loop_unref (handle->iceloop);
 		handle->iceloop = NULL;
@@ -1329,10 +2140,13 @@ void janus_ice_stream_free(GHashTable *streams, janus_ice_stream *stream) {
 	stream->rid[1] = NULL;
 	g_free(stream->rid[2]);
 	stream->rid[2] = NULL;
-	g_list_free(stream->audio_payload_types);
-	stream->audio_payload_types = NULL;
-	g_list_free(stream->video_payload_types);
-	stream->video_payload_types = NULL;
+	/* The loop of the handle is gone by now, so nobody can be probing the tables anymore */
+	janus_mutex_lock_nodebug(&stream->mutex);
+	janus_ice_ssrc_table_free(stream->peer_ssrcs);
+	stream->peer_ssrcs = NULL;
+	g_slist_free_full(stream->retired_ssrcs, janus_ice_ssrc_table_free);
+	stream->retired_ssrcs = NULL;
+	janus_mutex_unlock_nodebug(&stream->mutex);
 	g_free(stream->audio_rtcp_ctx);
 	stream->audio_rtcp_ctx = NULL;
 	g_free(stream->video_rtcp_ctx);
@@ -1374,19 +2188,10 @@ void janus_ice_component_free(GHashTable *components, janus_ice_component *compo
 		janus_dtls_srtp_destroy(component->dtls);
 		component->dtls = NULL;
 	}
-	if(component->retransmit_buffer != NULL) {
-		janus_rtp_packet *p = NULL;
-		GList *first = g_list_first(component->retransmit_buffer);
-		while(first != NULL) {
-			p = (janus_rtp_packet *)first->data;
-			first->data = NULL;
-			component->retransmit_buffer = g_list_delete_link(component->retransmit_buffer, first);
-			g_free(p->data);
-			p->data = NULL;
-			g_free(p);
-			first = g_list_first(component->retransmit_buffer);
-		}
-	}
+	janus_ice_nack_ring_destroy(component->audio_retransmit_buffer);
+	component->audio_retransmit_buffer = NULL;
+	janus_ice_nack_ring_destroy(component->video_retransmit_buffer);
+	component->video_retransmit_buffer = NULL;
 	if(component->candidates != NULL) {
 		GSList *i = NULL, *candidates = component->candidates;
 		for (i = candidates; i; i = i->next) {
@@ -1625,6 +2430,12 @@ static void janus_ice_cb_component_state_changed(NiceAgent *agent, guint stream_
 		if(!g_atomic_int_compare_and_exchange(&handle->send_thread_created, 0, 1)) {
 			return;
 		}
+		if(handle->static_event_loop != NULL) {
+			/* No dedicated thread: outgoing data will be handled by a source in the shared loop */
+			handle->outgoing_source = janus_ice_outgoing_traffic_create(handle);
+			g_source_attach(handle->outgoing_source, handle->icectx);
+			return;
+		}
 		/* Start the outgoing data thread */
 		GError *error = NULL;
 		char tname[16];
@@ -1928,6 +2739,102 @@ candidatedone:
 	return;
 }
 
+/* libnice owns the sockets and notifies us about one packet at a time, so when
+ * batched receiving is enabled, the RTP packets that arrive for a handle in the
+ * same loop iteration are collected here, and delivered to plugins that support
+ * it all at once via incoming_rtp_batch, from a source that fires right after */
+static gboolean batched_receive = FALSE;
+void janus_ice_set_batched_receive(gboolean enabled) {
+	batched_receive = enabled;
+	JANUS_LOG(LOG_VERB, "Batched receiving %s\n", batched_receive ? "enabled" : "disabled");
+}
+gboolean janus_ice_is_batched_receive_enabled(void) {
+	return batched_receive;
+}
+#define JANUS_ICE_INCOMING_BUFSIZE	1500
+typedef struct janus_ice_incoming_batch {
+	GSource parent;
+	janus_ice_handle *handle;
+	int video;
+	guint count;
+	char *bufs[JANUS_ICE_RECV_BATCH_MAX];
+	int lens[JANUS_ICE_RECV_BATCH_MAX];
+	char buffers[JANUS_ICE_RECV_BATCH_MAX][JANUS_ICE_INCOMING_BUFSIZE];
+} janus_ice_incoming_batch;
+
+static void janus_ice_incoming_batch_flush(janus_ice_incoming_batch *batch) {
+	if(batch == NULL || batch->count == 0)
+		return;
+	janus_ice_handle *handle = batch->handle;
+	janus_plugin *plugin = (janus_plugin *)handle->app;
+	if(plugin && plugin->incoming_rtp_batch && handle->app_handle) {
+		plugin->incoming_rtp_batch(handle->app_handle, batch->video, batch->bufs, batch->lens, batch->count);
+		handle->recv_batches[batch->count-1]++;
+	}
+	batch->count = 0;
+}
+
+/* Add a packet to the batch: returns FALSE if it can't be batched, and must be passed to the plugin right away */
+static gboolean janus_ice_incoming_batch_add(janus_ice_incoming_batch *batch, int video, char *buf, int len) {
+	if(batch == NULL)
+		return FALSE;
+	if(batch->count > 0 && batch->video != video) {
+		/* Only contiguous packets of the same medium are delivered together */
+		janus_ice_incoming_batch_flush(batch);
+	}
+	if(len > JANUS_ICE_INCOMING_BUFSIZE) {
+		janus_ice_incoming_batch_flush(batch);
+		return FALSE;
+	}
+	batch->video = video;
+	memcpy(batch->buffers[batch->count], buf, len);
+	batch->lens[batch->count] = len;
+	batch->count++;
+	if(batch->count == JANUS_ICE_RECV_BATCH_MAX)
+		janus_ice_incoming_batch_flush(batch);
+	return TRUE;
+}
+
+static gboolean janus_ice_incoming_batch_prepare(GSource *source, gint *timeout) {
+	janus_ice_incoming_batch *batch = (janus_ice_incoming_batch *)source;
+	*timeout = -1;
+	return batch->count > 0;
+}
+
+static gboolean janus_ice_incoming_batch_check(GSource *source) {
+	janus_ice_incoming_batch *batch = (janus_ice_incoming_batch *)source;
+	return batch->count > 0;
+}
+
+static gboolean janus_ice_incoming_batch_dispatch(GSource *source, GSourceFunc callback, gpointer user_data) {
+	janus_ice_incoming_batch *batch = (janus_ice_incoming_batch *)source;
+	janus_ice_incoming_batch_flush(batch);
+	return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs janus_ice_incoming_batch_funcs = {
+	janus_ice_incoming_batch_prepare,
+	janus_ice_incoming_batch_check,
+	janus_ice_incoming_batch_dispatch,
+	NULL, NULL, NULL
+};
+
+static GSource *janus_ice_incoming_batch_create(janus_ice_handle *handle) {
+	GSource *source = g_source_new(&janus_ice_incoming_batch_funcs, sizeof(janus_ice_incoming_batch));
+	janus_ice_incoming_batch *batch = (janus_ice_incoming_batch *)source;
+	char name[255];
+	g_snprintf(name, sizeof(name), "incoming-%"SCNu64, handle->handle_id);
+	g_source_set_name(source, name);
+	g_source_set_priority(source, G_PRIORITY_DEFAULT);
+	batch->handle = handle;
+	batch->video = 0;
+	batch->count = 0;
+	guint i = 0;
+	for(i=0; i<JANUS_ICE_RECV_BATCH_MAX; i++)
+		batch->bufs[i] = batch->buffers[i];
+	return source;
+}
+
 static void janus_ice_cb_nice_recv(NiceAgent *agent, guint stream_id, guint component_id, guint len, gchar *buf, gpointer ice) {
 	janus_ice_component *component = (janus_ice_component *)ice;
 	if(!component) {
@@ -1977,60 +2884,34 @@ static void janus_ice_cb_nice_recv(NiceAgent *agent, guint stream_id, guint comp
 			} else {
 				/* Bundled streams, check SSRC */
 				guint32 packet_ssrc = ntohl(header->ssrc);
-				video = ((stream->video_ssrc_peer == packet_ssrc
-					|| stream->video_ssrc_peer_rtx == packet_ssrc
-					|| stream->video_ssrc_peer_sim_1 == packet_ssrc
-					|| stream->video_ssrc_peer_sim_2 == packet_ssrc) ? 1 : 0);
-				if(!video && stream->audio_ssrc_peer != packet_ssrc) {
-					/* FIXME In case it happens, we should check what it is */
-					if(stream->audio_ssrc_peer == 0 || stream->video_ssrc_peer == 0) {
-						/* Apparently we were not told the peer SSRCs, try to guess from the payload type */
-						gboolean found = FALSE;
-						guint16 pt = header->type;
-						if(stream->audio_ssrc_peer == 0 && stream->audio_payload_types) {
-							GList *pts = stream->audio_payload_types;
-							while(pts) {
-								guint16 audio_pt = GPOINTER_TO_UINT(pts->data);
-								if(pt == audio_pt) {
-									JANUS_LOG(LOG_VERB, "[%"SCNu64"] Unadvertized SSRC (%"SCNu32") is audio! (payload type %"SCNu16")\n", handle->handle_id, packet_ssrc, pt);
-									video = 0;
-									stream->audio_ssrc_peer = packet_ssrc;
-									found = TRUE;
-									break;
-								}
-								pts = pts->next;
-							}
-						}
-						if(!found && stream->video_ssrc_peer == 0 && stream->video_payload_types) {
-							GList *pts = stream->video_payload_types;
-							while(pts) {
-								guint16 video_pt = GPOINTER_TO_UINT(pts->data);
-								if(pt == video_pt) {
-									JANUS_LOG(LOG_VERB, "[%"SCNu64"] Unadvertized SSRC (%"SCNu32") is video! (payload type %"SCNu16")\n", handle->handle_id, packet_ssrc, pt);
-									video = 1;
-									stream->video_ssrc_peer = packet_ssrc;
-									found = TRUE;
-									break;
-								}
-								pts = pts->next;
-							}
-						}
-					}
-					if(!video && stream->audio_ssrc_peer != packet_ssrc) {
-						JANUS_LOG(LOG_WARN, "[%"SCNu64"] Not video and not audio? dropping (SSRC %"SCNu32")...\n", handle->handle_id, packet_ssrc);
-						return;
+				janus_ice_ssrc_entry peer;
+				gboolean found = janus_ice_stream_find_peer_ssrc(stream, packet_ssrc, &peer);
+				if(!found && (stream->audio_ssrc_peer == 0 || stream->video_ssrc_peer == 0)) {
+					/* Apparently we were not told the peer SSRCs, try to guess from the payload type */
+					guint16 pt = header->type;
+					if(stream->audio_ssrc_peer == 0 && janus_ice_stream_has_payload_type(stream, 0, pt)) {
+						JANUS_LOG(LOG_VERB, "[%"SCNu64"] Unadvertized SSRC (%"SCNu32") is audio! (payload type %"SCNu16")\n", handle->handle_id, packet_ssrc, pt);
+						stream->audio_ssrc_peer = packet_ssrc;
+						janus_ice_stream_update_peer_ssrcs(stream);
+					} else if(stream->video_ssrc_peer == 0 && janus_ice_stream_has_payload_type(stream, 1, pt)) {
+						JANUS_LOG(LOG_VERB, "[%"SCNu64"] Unadvertized SSRC (%"SCNu32") is video! (payload type %"SCNu16")\n", handle->handle_id, packet_ssrc, pt);
+						stream->video_ssrc_peer = packet_ssrc;
+						janus_ice_stream_update_peer_ssrcs(stream);
 					}
+					found = janus_ice_stream_find_peer_ssrc(stream, packet_ssrc, &peer);
 				}
-				if(stream->video_ssrc_peer_rtx == packet_ssrc) {
+				if(!found) {
+					JANUS_LOG(LOG_WARN, "[%"SCNu64"] Not video and not audio? dropping (SSRC %"SCNu32")...\n", handle->handle_id, packet_ssrc);
+					return;
+				}
+				video = (peer.type != JANUS_ICE_SSRC_AUDIO);
+				if(peer.type == JANUS_ICE_SSRC_VIDEO_RTX) {
 					/* FIXME This is a video retransmission: set the regular peer SSRC so
 					 * that we avoid outgoing SRTP errors in case we got the packet already */
 					header->ssrc = htonl(stream->video_ssrc_peer);
-				} else if(stream->video_ssrc_peer_sim_1 == packet_ssrc) {
-					/* FIXME Simulcast (1) */
-					JANUS_LOG(LOG_HUGE, "[%"SCNu64"] Simulcast #1 (SSRC %"SCNu32")...\n", handle->handle_id, packet_ssrc);
-				} else if(stream->video_ssrc_peer_sim_2 == packet_ssrc) {
-					/* FIXME Simulcast (2) */
-					JANUS_LOG(LOG_HUGE, "[%"SCNu64"] Simulcast #2 (SSRC %"SCNu32")...\n", handle->handle_id, packet_ssrc);
+				} else if(peer.type == JANUS_ICE_SSRC_VIDEO_SIM) {
+					/* FIXME Simulcast */
+					JANUS_LOG(LOG_HUGE, "[%"SCNu64"] Simulcast #%d (SSRC %"SCNu32")...\n", handle->handle_id, peer.layer, packet_ssrc);
 				}
 				//~ JANUS_LOG(LOG_VERB, "[RTP] Bundling: this is %s (video=%"SCNu64", audio=%"SCNu64", got %ld)\n",
 					//~ video ? "video" : "audio", stream->video_ssrc_peer, stream->audio_ssrc_peer, ntohl(header->ssrc));
@@ -2050,59 +2931,44 @@ static void janus_ice_cb_nice_recv(NiceAgent *agent, guint stream_id, guint comp
 				if(video) {
 					if(stream->video_ssrc_peer == 0) {
 						stream->video_ssrc_peer = ntohl(header->ssrc);
+						janus_ice_stream_update_peer_ssrcs(stream);
 						JANUS_LOG(LOG_VERB, "[%"SCNu64"]     Peer video SSRC: %u\n", handle->handle_id, stream->video_ssrc_peer);
 					}
 				} else {
 					if(stream->audio_ssrc_peer == 0) {
 						stream->audio_ssrc_peer = ntohl(header->ssrc);
+						janus_ice_stream_update_peer_ssrcs(stream);
 						JANUS_LOG(LOG_VERB, "[%"SCNu64"]     Peer audio SSRC: %u\n", handle->handle_id, stream->audio_ssrc_peer);
 					}
 				}
-				/* Pass the data to the responsible plugin */
+				/* Pass the data to the responsible plugin (or batch it, if we can) */
 				janus_plugin *plugin = (janus_plugin *)handle->app;
-				if(plugin && plugin->incoming_rtp)
+				if(janus_ice_incoming_batch_add((janus_ice_incoming_batch *)handle->incoming_batch, video, buf, buflen)) {
+					/* The plugin will get this packet at the end of this loop iteration */
+				} else if(plugin && plugin->incoming_rtp) {
 					plugin->incoming_rtp(handle->app_handle, video, buf, buflen);
-				/* Update stats (TODO Do the same for the last second window as well) */
+				}
+				/* Update stats: the totals are updated atomically, as they may be read by
+				 * other threads, while the last second window is only updated here */
 				if(buflen > 0) {
-					/* Update the last sec queue as well */
-					janus_ice_stats_item *s = g_malloc0(sizeof(janus_ice_stats_item));
-					s->bytes = buflen;
-					s->when = janus_get_monotonic_time();
-					janus_mutex_lock(&component->mutex);
+					gint64 now = janus_get_monotonic_time();
 					if(!video) {
-						if(component->in_stats.audio_bytes == 0 || component->in_stats.audio_notified_lastsec) {
+						if(janus_ice_stats_add(component->in_stats.audio_bytes, buflen) == 0 ||
+								g_atomic_int_compare_and_exchange(&component->in_stats.audio_notified_lastsec, TRUE, FALSE)) {
 							/* We either received our first audio packet, or we started receiving it again after missing more than a second */
-							component->in_stats.audio_notified_lastsec = FALSE;
 							janus_ice_notify_media(handle, FALSE, TRUE);
 						}
-						component->in_stats.audio_packets++;
-						component->in_stats.audio_bytes += buflen;
-						component->in_stats.audio_bytes_lastsec = g_list_append(component->in_stats.audio_bytes_lastsec, s);
-						if(g_list_length(component->in_stats.audio_bytes_lastsec) > 100) {
-							GList *first = g_list_first(component->in_stats.audio_bytes_lastsec);
-							s = (janus_ice_stats_item *)first->data;
-							first->data = NULL;
-							component->in_stats.audio_bytes_lastsec = g_list_delete_link(component->in_stats.audio_bytes_lastsec, first);
-							g_free(s);
-						}
+						janus_ice_stats_add(component->in_stats.audio_packets, 1);
+						janus_ice_stats_window_update(&component->in_stats.audio_bytes_lastsec, now, buflen);
 					} else {
-						if(component->in_stats.video_bytes == 0 || component->in_stats.video_notified_lastsec) {
+						if(janus_ice_stats_add(component->in_stats.video_bytes, buflen) == 0 ||
+								g_atomic_int_compare_and_exchange(&component->in_stats.video_notified_lastsec, TRUE, FALSE)) {
 							/* We either received our first video packet, or we started receiving it again after missing more than a second */
-							component->in_stats.video_notified_lastsec = FALSE;
 							janus_ice_notify_media(handle, TRUE, TRUE);
 						}
-						component->in_stats.video_packets++;
-						component->in_stats.video_bytes += buflen;
-						component->in_stats.video_bytes_lastsec = g_list_append(component->in_stats.video_bytes_lastsec, s);
-						if(g_list_length(component->in_stats.video_bytes_lastsec) > 100) {
-							GList *first = g_list_first(component->in_stats.video_bytes_lastsec);
-							s = (janus_ice_stats_item *)first->data;
-							first->data = NULL;
-							component->in_stats.video_bytes_lastsec = g_list_delete_link(component->in_stats.video_bytes_lastsec, first);
-							g_free(s);
-						}
+						janus_ice_stats_add(component->in_stats.video_packets, 1);
+						janus_ice_stats_window_update(&component->in_stats.video_bytes_lastsec, now, buflen);
 					}
-					janus_mutex_unlock(&component->mutex);
 				}
 
 				/* FIXME Don't handle RTCP or stats for the simulcasted SSRCs, for now */
@@ -2272,19 +3138,14 @@ static void janus_ice_cb_nice_recv(NiceAgent *agent, guint stream_id, guint comp
 						} else {
 							/* Check the remote SSRC, compare it to what we have */
 							guint32 rtcp_ssrc = janus_rtcp_get_sender_ssrc(buf, len);
-							if(rtcp_ssrc == stream->audio_ssrc_peer) {
-								video = 0;
-							} else if(rtcp_ssrc == stream->video_ssrc_peer) {
-								video = 1;
-							} else {
-								/* If we're simulcasting, let's compare to the other SSRCs too */
-								if((stream->video_ssrc_peer_sim_1 && rtcp_ssrc == stream->video_ssrc_peer_sim_1) ||
-										(stream->video_ssrc_peer_sim_2 && rtcp_ssrc == stream->video_ssrc_peer_sim_2)) {
-									/* FIXME RTCP for simulcasting SSRC, let's drop it for now... */
-									JANUS_LOG(LOG_HUGE, "Dropping RTCP packet for SSRC %"SCNu32"\n", rtcp_ssrc);
-									return;
-								}
+							janus_ice_ssrc_entry peer;
+							gboolean found = janus_ice_stream_find_peer_ssrc(stream, rtcp_ssrc, &peer);
+							if(found && peer.type == JANUS_ICE_SSRC_VIDEO_SIM) {
+								/* FIXME RTCP for simulcasting SSRC, let's drop it for now... */
+								JANUS_LOG(LOG_HUGE, "Dropping RTCP packet for SSRC %"SCNu32"\n", rtcp_ssrc);
+								return;
 							}
+							video = (found && peer.type != JANUS_ICE_SSRC_AUDIO);
 							JANUS_LOG(LOG_HUGE, "[%"SCNu64"] Incoming RTCP, bundling: this is %s (remote SSRC: video=%"SCNu32", audio=%"SCNu32", got %"SCNu32")\n",
 								handle->handle_id, video ? "video" : "audio", stream->video_ssrc_peer, stream->audio_ssrc_peer, rtcp_ssrc);
 						}
@@ -2308,34 +3169,23 @@ static void janus_ice_cb_nice_recv(NiceAgent *agent, guint stream_id, guint comp
 					while(list) {
 						unsigned int seqnr = GPOINTER_TO_UINT(list->data);
 						JANUS_LOG(LOG_DBG, "[%"SCNu64"]   >> %u\n", handle->handle_id, seqnr);
-						GList *rp = component->retransmit_buffer;
-						while(rp) {
-							janus_rtp_packet *p = (janus_rtp_packet *)rp->data;
-							if(p) {
-								rtp_header *rh = (rtp_header *)p->data;
-								if(ntohs(rh->seq_number) == seqnr) {
-									/* Should we retransmit this packet? */
-									if((p->last_retransmit > 0) && (now-p->last_retransmit < MAX_NACK_IGNORE)) {
-										JANUS_LOG(LOG_HUGE, "[%"SCNu64"]   >> >> Packet %u was retransmitted just %"SCNi64"ms ago, skipping\n", handle->handle_id, seqnr, now-p->last_retransmit);
-										break;
-									}
-									JANUS_LOG(LOG_HUGE, "[%"SCNu64"]   >> >> Scheduling %u for retransmission due to NACK\n", handle->handle_id, seqnr);
-									p->last_retransmit = now;
-									retransmits_cnt++;
-									/* Enqueue it */
-									janus_ice_queued_packet *pkt = (janus_ice_queued_packet *)g_malloc0(sizeof(janus_ice_queued_packet));
-									pkt->data = g_malloc0(p->length);
-									memcpy(pkt->data, p->data, p->length);
-									pkt->length = p->length;
-									pkt->type = video ? JANUS_ICE_PACKET_VIDEO : JANUS_ICE_PACKET_AUDIO;
-									pkt->control = FALSE;
-									pkt->encrypted = TRUE;	/* This was already encrypted before */
-									if(handle->queued_packets != NULL)
-										g_async_queue_push(handle->queued_packets, pkt);
-									break;
-								}
+						janus_ice_nack_slot *p = janus_ice_nack_ring_find(video ?
+							component->video_retransmit_buffer : component->audio_retransmit_buffer, seqnr);
+						if(p != NULL) {
+							/* Should we retransmit this packet? */
+							if((p->last_retransmit > 0) && (now-p->last_retransmit < MAX_NACK_IGNORE)) {
+								JANUS_LOG(LOG_HUGE, "[%"SCNu64"]   >> >> Packet %u was retransmitted just %"SCNi64"ms ago, skipping\n", handle->handle_id, seqnr, now-p->last_retransmit);
+							} else {
+								JANUS_LOG(LOG_HUGE, "[%"SCNu64"]   >> >> Scheduling %u for retransmission due to NACK\n", handle->handle_id, seqnr);
+								p->last_retransmit = now;
+								retransmits_cnt++;
+								/* Enqueue it */
+								janus_ice_queued_packet *pkt = janus_ice_queued_packet_new(handle, p->buffer->data, p->length);
+								pkt->type = video ? JANUS_ICE_PACKET_VIDEO : JANUS_ICE_PACKET_AUDIO;
+								pkt->control = FALSE;
+								pkt->encrypted = TRUE;	/* This was already encrypted before */
+								janus_ice_queue_packet(handle, pkt);
 							}
-							rp = rp->next;
 						}
 						list = list->next;
 					}
@@ -2362,6 +3212,8 @@ static void janus_ice_cb_nice_recv(NiceAgent *agent, guint stream_id, guint comp
 					component->retransmit_log_ts = now;
 				}
 
+				/* Make sure the plugin gets any RTP packet we batched before this RTCP message */
+				janus_ice_incoming_batch_flush((janus_ice_incoming_batch *)handle->incoming_batch);
 				janus_plugin *plugin = (janus_plugin *)handle->app;
 				if(plugin && plugin->incoming_rtcp)
 					plugin->incoming_rtcp(handle->app_handle, video, buf, buflen);
@@ -2794,17 +3646,32 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
 	janus_flags_clear(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALL_TRICKLES);
 	janus_flags_clear(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_TRICKLE_SYNCED);
 
-	handle->icectx = g_main_context_new();
-	handle->iceloop = g_main_loop_new(handle->icectx, FALSE);
-	GError *error = NULL;
-	char tname[16];
-	g_snprintf(tname, sizeof(tname), "iceloop %"SCNu64, handle->handle_id);
-	handle->icethread = g_thread_try_new(tname, &janus_ice_thread, handle, &error);
-	if(error != NULL) {
-		/* FIXME We should clear some resources... */
-		JANUS_LOG(LOG_ERR, "[%"SCNu64"] Got error %d (%s) trying to launch the ICE thread...\n", handle->handle_id, error->code, error->message ? error->message : "??");
-		janus_flags_clear(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_HAS_AGENT);
-		return -1;
+	if(handle->static_event_loop != NULL) {
+		/* This handle was assigned to one of the static event loops, no need for a dedicated thread */
+		janus_ice_static_event_loop *loop = (janus_ice_static_event_loop *)handle->static_event_loop;
+		handle->icectx = g_main_context_ref(loop->mainctx);
+		handle->iceloop = NULL;
+		handle->icethread = NULL;
+		JANUS_LOG(LOG_VERB, "[%"SCNu64"] Using static event loop #%d\n", handle->handle_id, loop->id);
+	} else {
+		handle->icectx = g_main_context_new();
+		handle->iceloop = g_main_loop_new(handle->icectx, FALSE);
+		GError *error = NULL;
+		char tname[16];
+		g_snprintf(tname, sizeof(tname), "iceloop %"SCNu64, handle->handle_id);
+		handle->icethread = g_thread_try_new(tname, &janus_ice_thread, handle, &error);
+		if(error != NULL) {
+			/* FIXME We should clear some resources... */
+			JANUS_LOG(LOG_ERR, "[%"SCNu64"] Got error %d (%s) trying to launch the ICE thread...\n", handle->handle_id, error->code, error->message ? error->message : "??");
+			janus_flags_clear(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_HAS_AGENT);
+			return -1;
+		}
+	}
+	janus_plugin *plugin = (janus_plugin *)handle->app;
+	if(batched_receive && plugin != NULL && plugin->incoming_rtp_batch != NULL && handle->incoming_batch == NULL) {
+		/* The plugin can receive RTP packets in batches */
+		handle->incoming_batch = janus_ice_incoming_batch_create(handle);
+		g_source_attach(handle->incoming_batch, handle->icectx);
 	}
 	/* Note: NICE_COMPATIBILITY_RFC5245 is only available in more recent versions of libnice */
 	handle->controlling = janus_ice_lite_enabled ? FALSE : !offer;
@@ -3012,7 +3879,8 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
 		audio_rtp->dtls = NULL;
 		audio_rtp->do_audio_nacks = FALSE;
 		audio_rtp->do_video_nacks = FALSE;
-		audio_rtp->retransmit_buffer = NULL;
+		audio_rtp->audio_retransmit_buffer = NULL;
+		audio_rtp->video_retransmit_buffer = NULL;
 		audio_rtp->retransmit_log_ts = 0;
 		audio_rtp->retransmit_recent_cnt = 0;
 		audio_rtp->nack_sent_log_ts = 0;
@@ -3078,7 +3946,8 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
 			audio_rtcp->dtls = NULL;
 			audio_rtcp->do_audio_nacks = FALSE;
 			audio_rtcp->do_video_nacks = FALSE;
-			audio_rtcp->retransmit_buffer = NULL;
+			audio_rtcp->audio_retransmit_buffer = NULL;
+			audio_rtcp->video_retransmit_buffer = NULL;
 			audio_rtcp->retransmit_log_ts = 0;
 			audio_rtcp->retransmit_recent_cnt = 0;
 			janus_ice_stats_reset(&audio_rtcp->in_stats);
@@ -3092,9 +3961,9 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
 #endif
 		}
 		nice_agent_gather_candidates(handle->agent, handle->audio_id);
-		nice_agent_attach_recv(handle->agent, handle->audio_id, 1, g_main_loop_get_context (handle->iceloop), janus_ice_cb_nice_recv, audio_rtp);
+		nice_agent_attach_recv(handle->agent, handle->audio_id, 1, handle->icectx, janus_ice_cb_nice_recv, audio_rtp);
 		if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX) && audio_rtcp != NULL)
-			nice_agent_attach_recv(handle->agent, handle->audio_id, 2, g_main_loop_get_context (handle->iceloop), janus_ice_cb_nice_recv, audio_rtcp);
+			nice_agent_attach_recv(handle->agent, handle->audio_id, 2, handle->icectx, janus_ice_cb_nice_recv, audio_rtcp);
 	}
 	if(video && (!audio || !janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_BUNDLE))) {
 		/* Add a video stream */
@@ -3175,7 +4044,8 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
 		video_rtp->dtls = NULL;
 		video_rtp->do_audio_nacks = FALSE;
 		video_rtp->do_video_nacks = FALSE;
-		video_rtp->retransmit_buffer = NULL;
+		video_rtp->audio_retransmit_buffer = NULL;
+		video_rtp->video_retransmit_buffer = NULL;
 		video_rtp->retransmit_log_ts = 0;
 		video_rtp->retransmit_recent_cnt = 0;
 		video_rtp->nack_sent_log_ts = 0;
@@ -3241,7 +4111,8 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
 			video_rtcp->dtls = NULL;
 			video_rtcp->do_audio_nacks = FALSE;
 			video_rtcp->do_video_nacks = FALSE;
-			video_rtcp->retransmit_buffer = NULL;
+			video_rtcp->audio_retransmit_buffer = NULL;
+			video_rtcp->video_retransmit_buffer = NULL;
 			video_rtcp->retransmit_log_ts = 0;
 			video_rtcp->retransmit_recent_cnt = 0;
 			janus_ice_stats_reset(&video_rtcp->in_stats);
@@ -3255,9 +4126,9 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
 #endif
 		}
 		nice_agent_gather_candidates(handle->agent, handle->video_id);
-		nice_agent_attach_recv(handle->agent, handle->video_id, 1, g_main_loop_get_context (handle->iceloop), janus_ice_cb_nice_recv, video_rtp);
+		nice_agent_attach_recv(handle->agent, handle->video_id, 1, handle->icectx, janus_ice_cb_nice_recv, video_rtp);
 		if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX) && video_rtcp != NULL)
-			nice_agent_attach_recv(handle->agent, handle->video_id, 2, g_main_loop_get_context (handle->iceloop), janus_ice_cb_nice_recv, video_rtcp);
+			nice_agent_attach_recv(handle->agent, handle->video_id, 2, handle->icectx, janus_ice_cb_nice_recv, video_rtcp);
 	}
 #ifndef HAVE_SCTP
 	handle->data_id = 0;
@@ -3333,7 +4204,8 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
 		data_component->dtls = NULL;
 		data_component->do_audio_nacks = FALSE;
 		data_component->do_video_nacks = FALSE;
-		data_component->retransmit_buffer = NULL;
+		data_component->audio_retransmit_buffer = NULL;
+		data_component->video_retransmit_buffer = NULL;
 		data_component->retransmit_log_ts = 0;
 		data_component->retransmit_recent_cnt = 0;
 		janus_ice_stats_reset(&data_component->in_stats);
@@ -3346,7 +4218,7 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
 		nice_agent_set_port_range(handle->agent, handle->data_id, 1, rtp_range_min, rtp_range_max);
 #endif
 		nice_agent_gather_candidates(handle->agent, handle->data_id);
-		nice_agent_attach_recv(handle->agent, handle->data_id, 1, g_main_loop_get_context (handle->iceloop), janus_ice_cb_nice_recv, data_component);
+		nice_agent_attach_recv(handle->agent, handle->data_id, 1, handle->icectx, janus_ice_cb_nice_recv, data_component);
 	}
 #endif
 #ifdef HAVE_LIBCURL
@@ -3358,111 +4230,85 @@ int janus_ice_setup_local(janus_ice_handle *handle, int offer, int audio, int vi
 	return 0;
 }
 
-void *janus_ice_send_thread(void *data) {
-	janus_ice_handle *handle = (janus_ice_handle *)data;
+/* Timers used by the periodic tasks on the outgoing path (RTCP, events, cleanups) */
+typedef struct janus_ice_send_timers {
+	gint64 media_check;
+	gint64 audio_rtcp_last_rr, audio_rtcp_last_sr, audio_last_event;
+	gint64 video_rtcp_last_rr, video_rtcp_last_sr, video_last_event;
+	gint64 last_srtp_summary, last_nack_cleanup;
+} janus_ice_send_timers;
+static void janus_ice_send_timers_init(janus_ice_send_timers *timers) {
+	gint64 now = janus_get_monotonic_time();
+	timers->media_check = now;
+	timers->audio_rtcp_last_rr = now;
+	timers->audio_rtcp_last_sr = now;
+	timers->audio_last_event = now;
+	timers->video_rtcp_last_rr = now;
+	timers->video_rtcp_last_sr = now;
+	timers->video_last_event = now;
+	timers->last_srtp_summary = now;
+	timers->last_nack_cleanup = now;
+}
+
+/* Periodic tasks on the outgoing path: media timeouts, RTCP RR/SR, stats events and cleanups */
+static void janus_ice_send_periodic(janus_ice_handle *handle, janus_ice_send_timers *timers, gint64 now) {
 	janus_session *session = (janus_session *)handle->session;
-	JANUS_LOG(LOG_VERB, "[%"SCNu64"] ICE send thread started...\n", handle->handle_id);
-	janus_ice_queued_packet *pkt = NULL;
-	gint64 before = janus_get_monotonic_time(),
-		audio_rtcp_last_rr = before, audio_rtcp_last_sr = before, audio_last_event = before,
-		video_rtcp_last_rr = before, video_rtcp_last_sr = before, video_last_event = before,
-		last_srtp_summary = before, last_nack_cleanup = before;
-	while(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_STOP)) {
-		if(handle->queued_packets != NULL) {
-			pkt = g_async_queue_timeout_pop(handle->queued_packets, 500000);
-		} else {
-			g_usleep(100000);
-		}
-		if(pkt == &janus_ice_dtls_alert) {
-			/* The session is over, send an alert on all streams and components */
-			if(handle->streams != NULL) {
-				if(handle->audio_stream) {
-					janus_ice_stream *stream = handle->audio_stream;
-					if(stream->rtp_component)
-						janus_dtls_srtp_send_alert(stream->rtp_component->dtls);
-					if(stream->rtcp_component)
-						janus_dtls_srtp_send_alert(stream->rtcp_component->dtls);
-				}
-				if(handle->video_stream) {
-					janus_ice_stream *stream = handle->video_stream;
-					if(stream->rtp_component)
-						janus_dtls_srtp_send_alert(stream->rtp_component->dtls);
-					if(stream->rtcp_component)
-						janus_dtls_srtp_send_alert(stream->rtcp_component->dtls);
-				}
-				if(handle->data_stream) {
-					janus_ice_stream *stream = handle->data_stream;
-					if(stream->rtp_component)
-						janus_dtls_srtp_send_alert(stream->rtp_component->dtls);
-					if(stream->rtcp_component)
-						janus_dtls_srtp_send_alert(stream->rtcp_component->dtls);
-				}
-			}
-			while(g_async_queue_length(handle->queued_packets) > 0) {
-				pkt = g_async_queue_try_pop(handle->queued_packets);
-				if(pkt != NULL && pkt != &janus_ice_dtls_alert) {
-					g_free(pkt->data);
-					pkt->data = NULL;
-					g_free(pkt);
-					pkt = NULL;
-				}
+	/* First of all, let's see if everything's fine on the recv side */
+	if(no_media_timer > 0 && now-timers->media_check >= G_USEC_PER_SEC) {
+		if(handle->audio_stream && handle->audio_stream->rtp_component) {
+			janus_ice_component *component = handle->audio_stream->rtp_component;
+			gint64 last = component->in_stats.audio_bytes_lastsec.last_update;
+			if(last && now-last >= (gint64)no_media_timer*G_USEC_PER_SEC &&
+					g_atomic_int_compare_and_exchange(&component->in_stats.audio_notified_lastsec, FALSE, TRUE)) {
+				/* We missed more than no_second_timer seconds of audio! */
+				JANUS_LOG(LOG_WARN, "[%"SCNu64"] Didn't receive audio for more than %d seconds...\n", handle->handle_id, no_media_timer);
+				janus_ice_notify_media(handle, FALSE, FALSE);
 			}
-			if(handle->iceloop) {
-				g_main_loop_quit(handle->iceloop);
-				handle->iceloop = NULL;
-				g_main_context_wakeup(handle->icectx);
-				handle->icectx = NULL;
-			}
-			continue;
-		}
-		if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_READY)) {
-			if(pkt)
-				g_free(pkt->data);
-			g_free(pkt);
-			pkt = NULL;
-			continue;
-		}
-		/* First of all, let's see if everything's fine on the recv side */
-		gint64 now = janus_get_monotonic_time();
-		if(no_media_timer > 0 && now-before >= G_USEC_PER_SEC) {
-			if(handle->audio_stream && handle->audio_stream->rtp_component) {
-				janus_ice_component *component = handle->audio_stream->rtp_component;
-				GList *lastitem = g_list_last(component->in_stats.audio_bytes_lastsec);
-				janus_ice_stats_item *last = lastitem ? ((janus_ice_stats_item *)lastitem->data) : NULL;
-				if(!component->in_stats.audio_notified_lastsec && last && now-last->when >= (gint64)no_media_timer*G_USEC_PER_SEC) {
-					/* We missed more than no_second_timer seconds of audio! */
-					component->in_stats.audio_notified_lastsec = TRUE;
-					JANUS_LOG(LOG_WARN, "[%"SCNu64"] Didn't receive audio for more than %d seconds...\n", handle->handle_id, no_media_timer);
-					janus_ice_notify_media(handle, FALSE, FALSE);
-				}
-				if(!component->in_stats.video_notified_lastsec && janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_BUNDLE)) {
-					lastitem = g_list_last(component->in_stats.video_bytes_lastsec);
-					last = lastitem ? ((janus_ice_stats_item *)lastitem->data) : NULL;
-					if(last && now-last->when >= (gint64)no_media_timer*G_USEC_PER_SEC) {
-						/* We missed more than no_second_timer seconds of video! */
-						component->in_stats.video_notified_lastsec = TRUE;
-						JANUS_LOG(LOG_WARN, "[%"SCNu64"] Didn't receive video for more than %d seconds...\n", handle->handle_id, no_media_timer);
-						janus_ice_notify_media(handle, TRUE, FALSE);
-					}
-				}
-			}
-			if(handle->video_stream && handle->video_stream->rtp_component) {
-				janus_ice_component *component = handle->video_stream->rtp_component;
-				GList *lastitem = g_list_last(component->in_stats.video_bytes_lastsec);
-				janus_ice_stats_item *last = lastitem ? ((janus_ice_stats_item *)lastitem->data) : NULL;
-				if(!component->in_stats.video_notified_lastsec && last && now-last->when >= (gint64)no_media_timer*G_USEC_PER_SEC) {
+			if(janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_BUNDLE)) {
+				last = component->in_stats.video_bytes_lastsec.last_update;
+				if(last && now-last >= (gint64)no_media_timer*G_USEC_PER_SEC &&
+						g_atomic_int_compare_and_exchange(&component->in_stats.video_notified_lastsec, FALSE, TRUE)) {
 					/* We missed more than no_second_timer seconds of video! */
-					component->in_stats.video_notified_lastsec = TRUE;
-					JANUS_LOG(LOG_WARN, "[%"SCNu64"] Didn't receive video for more than a second...\n", handle->handle_id);
+					JANUS_LOG(LOG_WARN, "[%"SCNu64"] Didn't receive video for more than %d seconds...\n", handle->handle_id, no_media_timer);
 					janus_ice_notify_media(handle, TRUE, FALSE);
 				}
 			}
-			before = now;
 		}
-		/* Let's check if it's time to send a RTCP RR as well */
-		if(now-audio_rtcp_last_rr >= 5*G_USEC_PER_SEC) {
-			janus_ice_stream *stream = handle->audio_stream;
-			if(handle->audio_stream && stream->audio_rtcp_ctx && stream->audio_rtcp_ctx->rtp_recvd) {
+		if(handle->video_stream && handle->video_stream->rtp_component) {
+			janus_ice_component *component = handle->video_stream->rtp_component;
+			gint64 last = component->in_stats.video_bytes_lastsec.last_update;
+			if(last && now-last >= (gint64)no_media_timer*G_USEC_PER_SEC &&
+					g_atomic_int_compare_and_exchange(&component->in_stats.video_notified_lastsec, FALSE, TRUE)) {
+				/* We missed more than no_second_timer seconds of video! */
+				JANUS_LOG(LOG_WARN, "[%"SCNu64"] Didn't receive video for more than a second...\n", handle->handle_id);
+				janus_ice_notify_media(handle, TRUE, FALSE);
+			}
+		}
+		timers->media_check = now;
+	}
+	/* Let's check if it's time to send a RTCP RR as well */
+	if(now-timers->audio_rtcp_last_rr >= 5*G_USEC_PER_SEC) {
+		janus_ice_stream *stream = handle->audio_stream;
+		if(handle->audio_stream && stream->audio_rtcp_ctx && stream->audio_rtcp_ctx->rtp_recvd) {
+			/* Create a RR */
+			int rrlen = 32;
+			char rtcpbuf[32];
+			memset(rtcpbuf, 0, sizeof(rtcpbuf));
+			rtcp_rr *rr = (rtcp_rr *)&rtcpbuf;
+			rr->header.version = 2;
+			rr->header.type = RTCP_RR;
+			rr->header.rc = 1;
+			rr->header.length = htons((rrlen/4)-1);
+			janus_rtcp_report_block(stream->audio_rtcp_ctx, &rr->rb[0]);
+			/* Enqueue it, we'll send it later */
+			janus_ice_relay_rtcp_internal(handle, 0, rtcpbuf, 32, FALSE);
+		}
+		timers->audio_rtcp_last_rr = now;
+	}
+	if(now-timers->video_rtcp_last_rr >= 5*G_USEC_PER_SEC) {
+		janus_ice_stream *stream = janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_BUNDLE) ? (handle->audio_stream ? handle->audio_stream : handle->video_stream) : (handle->video_stream);
+		if(stream) {
+			if(stream->video_rtcp_ctx && stream->video_rtcp_ctx->rtp_recvd) {
 				/* Create a RR */
 				int rrlen = 32;
 				char rtcpbuf[32];
@@ -3472,517 +4318,809 @@ void *janus_ice_send_thread(void *data) {
 				rr->header.type = RTCP_RR;
 				rr->header.rc = 1;
 				rr->header.length = htons((rrlen/4)-1);
-				janus_rtcp_report_block(stream->audio_rtcp_ctx, &rr->rb[0]);
+				janus_rtcp_report_block(stream->video_rtcp_ctx, &rr->rb[0]);
 				/* Enqueue it, we'll send it later */
-				janus_ice_relay_rtcp_internal(handle, 0, rtcpbuf, 32, FALSE);
+				janus_ice_relay_rtcp_internal(handle, 1, rtcpbuf, 32, FALSE);
 			}
-			audio_rtcp_last_rr = now;
 		}
-		if(now-video_rtcp_last_rr >= 5*G_USEC_PER_SEC) {
-			janus_ice_stream *stream = janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_BUNDLE) ? (handle->audio_stream ? handle->audio_stream : handle->video_stream) : (handle->video_stream);
-			if(stream) {
-				if(stream->video_rtcp_ctx && stream->video_rtcp_ctx->rtp_recvd) {
-					/* Create a RR */
-					int rrlen = 32;
-					char rtcpbuf[32];
-					memset(rtcpbuf, 0, sizeof(rtcpbuf));
-					rtcp_rr *rr = (rtcp_rr *)&rtcpbuf;
-					rr->header.version = 2;
-					rr->header.type = RTCP_RR;
-					rr->header.rc = 1;
-					rr->header.length = htons((rrlen/4)-1);
-					janus_rtcp_report_block(stream->video_rtcp_ctx, &rr->rb[0]);
-					/* Enqueue it, we'll send it later */
-					janus_ice_relay_rtcp_internal(handle, 1, rtcpbuf, 32, FALSE);
-				}
+		timers->video_rtcp_last_rr = now;
+	}
+	/* Do the same with SR/SDES */
+	if(now-timers->audio_rtcp_last_sr >= 5*G_USEC_PER_SEC) {
+		janus_ice_stream *stream = handle->audio_stream;
+		if(stream && stream->rtp_component && stream->rtp_component->out_stats.audio_packets > 0) {
+			/* Create a SR/SDES compound */
+			int srlen = 28;
+			int sdeslen = 20;
+			char rtcpbuf[srlen+sdeslen];
+			memset(rtcpbuf, 0, sizeof(rtcpbuf));
+			rtcp_sr *sr = (rtcp_sr *)&rtcpbuf;
+			sr->header.version = 2;
+			sr->header.type = RTCP_SR;
+			sr->header.rc = 0;
+			sr->header.length = htons((srlen/4)-1);
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			uint32_t s = tv.tv_sec + 2208988800u;
+			uint32_t u = tv.tv_usec;
+			uint32_t f = (u << 12) + (u << 8) - ((u * 3650) >> 6);
+			sr->si.ntp_ts_msw = htonl(s);
+			sr->si.ntp_ts_lsw = htonl(f);
+			/* Compute an RTP timestamp coherent with the NTP one */
+			rtcp_context *rtcp_ctx = stream->audio_rtcp_ctx;
+			if(rtcp_ctx == NULL) {
+				sr->si.rtp_ts = htonl(stream->audio_last_ts);	/* FIXME */
+			} else {
+				int64_t ntp = tv.tv_sec*G_USEC_PER_SEC + tv.tv_usec;
+				uint32_t rtp_ts = ((ntp-stream->audio_first_ntp_ts)/1000)*(rtcp_ctx->tb/1000) + stream->audio_first_rtp_ts;
+				sr->si.rtp_ts = htonl(rtp_ts);
 			}
-			video_rtcp_last_rr = now;
+			sr->si.s_packets = htonl(stream->rtp_component->out_stats.audio_packets);
+			sr->si.s_octets = htonl(stream->rtp_component->out_stats.audio_bytes);
+			rtcp_sdes *sdes = (rtcp_sdes *)&rtcpbuf[28];
+			janus_rtcp_sdes((char *)sdes, sdeslen, "janusaudio", 10);
+			/* Enqueue it, we'll send it later */
+			janus_ice_relay_rtcp_internal(handle, 0, rtcpbuf, srlen+sdeslen, FALSE);
 		}
-		/* Do the same with SR/SDES */
-		if(now-audio_rtcp_last_sr >= 5*G_USEC_PER_SEC) {
+		timers->audio_rtcp_last_sr = now;
+	}
+	if(now-timers->video_rtcp_last_sr >= 5*G_USEC_PER_SEC) {
+		janus_ice_stream *stream = janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_BUNDLE) ? (handle->audio_stream ? handle->audio_stream : handle->video_stream) : (handle->video_stream);
+		if(stream && stream->rtp_component && stream->rtp_component->out_stats.video_packets > 0) {
+			/* Create a SR/SDES compound */
+			int srlen = 28;
+			int sdeslen = 20;
+			char rtcpbuf[srlen+sdeslen];
+			memset(rtcpbuf, 0, sizeof(rtcpbuf));
+			rtcp_sr *sr = (rtcp_sr *)&rtcpbuf;
+			sr->header.version = 2;
+			sr->header.type = RTCP_SR;
+			sr->header.rc = 0;
+			sr->header.length = htons((srlen/4)-1);
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			uint32_t s = tv.tv_sec + 2208988800u;
+			uint32_t u = tv.tv_usec;
+			uint32_t f = (u << 12) + (u << 8) - ((u * 3650) >> 6);
+			sr->si.ntp_ts_msw = htonl(s);
+			sr->si.ntp_ts_lsw = htonl(f);
+			/* Compute an RTP timestamp coherent with the NTP one */
+			rtcp_context *rtcp_ctx = stream->video_rtcp_ctx;
+			if(rtcp_ctx == NULL) {
+				sr->si.rtp_ts = htonl(stream->video_last_ts);	/* FIXME */
+			} else {
+				int64_t ntp = tv.tv_sec*G_USEC_PER_SEC + tv.tv_usec;
+				uint32_t rtp_ts = ((ntp-stream->video_first_ntp_ts)/1000)*(rtcp_ctx->tb/1000) + stream->video_first_rtp_ts;
+				sr->si.rtp_ts = htonl(rtp_ts);
+			}
+			sr->si.s_packets = htonl(stream->rtp_component->out_stats.video_packets);
+			sr->si.s_octets = htonl(stream->rtp_component->out_stats.video_bytes);
+			rtcp_sdes *sdes = (rtcp_sdes *)&rtcpbuf[28];
+			janus_rtcp_sdes((char *)sdes, sdeslen, "janusvideo", 10);
+			/* Enqueue it, we'll send it later */
+			janus_ice_relay_rtcp_internal(handle, 1, rtcpbuf, srlen+sdeslen, FALSE);
+		}
+		timers->video_rtcp_last_sr = now;
+	}
+	/* We tell event handlers once per second about RTCP-related stuff
+	 * FIXME Should we really do this here? Would this slow down this thread and add delay? */
+	if(janus_ice_event_stats_period > 0 && now-timers->audio_last_event >= (gint64)janus_ice_event_stats_period*G_USEC_PER_SEC) {
+		if(janus_events_is_enabled() && janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_HAS_AUDIO)) {
 			janus_ice_stream *stream = handle->audio_stream;
-			if(stream && stream->rtp_component && stream->rtp_component->out_stats.audio_packets > 0) {
-				/* Create a SR/SDES compound */
-				int srlen = 28;
-				int sdeslen = 20;
-				char rtcpbuf[srlen+sdeslen];
-				memset(rtcpbuf, 0, sizeof(rtcpbuf));
-				rtcp_sr *sr = (rtcp_sr *)&rtcpbuf;
-				sr->header.version = 2;
-				sr->header.type = RTCP_SR;
-				sr->header.rc = 0;
-				sr->header.length = htons((srlen/4)-1);
-				struct timeval tv;
-				gettimeofday(&tv, NULL);
-				uint32_t s = tv.tv_sec + 2208988800u;
-				uint32_t u = tv.tv_usec;
-				uint32_t f = (u << 12) + (u << 8) - ((u * 3650) >> 6);
-				sr->si.ntp_ts_msw = htonl(s);
-				sr->si.ntp_ts_lsw = htonl(f);
-				/* Compute an RTP timestamp coherent with the NTP one */
-				rtcp_context *rtcp_ctx = stream->audio_rtcp_ctx;
-				if(rtcp_ctx == NULL) {
-					sr->si.rtp_ts = htonl(stream->audio_last_ts);	/* FIXME */
-				} else {
-					int64_t ntp = tv.tv_sec*G_USEC_PER_SEC + tv.tv_usec;
-					uint32_t rtp_ts = ((ntp-stream->audio_first_ntp_ts)/1000)*(rtcp_ctx->tb/1000) + stream->audio_first_rtp_ts;
-					sr->si.rtp_ts = htonl(rtp_ts);
+			if(stream && stream->audio_rtcp_ctx) {
+				json_t *info = json_object();
+				json_object_set_new(info, "media", json_string("audio"));
+				json_object_set_new(info, "base", json_integer(stream->audio_rtcp_ctx->tb));
+				json_object_set_new(info, "lsr", json_integer(janus_rtcp_context_get_lsr(stream->audio_rtcp_ctx)));
+				json_object_set_new(info, "lost", json_integer(janus_rtcp_context_get_lost_all(stream->audio_rtcp_ctx, FALSE)));
+				json_object_set_new(info, "lost-by-remote", json_integer(janus_rtcp_context_get_lost_all(stream->audio_rtcp_ctx, TRUE)));
+				json_object_set_new(info, "jitter-local", json_integer(janus_rtcp_context_get_jitter(stream->audio_rtcp_ctx, FALSE)));
+				json_object_set_new(info, "jitter-remote", json_integer(janus_rtcp_context_get_jitter(stream->audio_rtcp_ctx, TRUE)));
+				if(stream->rtp_component) {
+					json_object_set_new(info, "packets-received", json_integer(stream->rtp_component->in_stats.audio_packets));
+					json_object_set_new(info, "packets-sent", json_integer(stream->rtp_component->out_stats.audio_packets));
+					json_object_set_new(info, "bytes-received", json_integer(stream->rtp_component->in_stats.audio_bytes));
+					json_object_set_new(info, "bytes-sent", json_integer(stream->rtp_component->out_stats.audio_bytes));
+					json_object_set_new(info, "nacks-received", json_integer(stream->rtp_component->in_stats.audio_nacks));
+					json_object_set_new(info, "nacks-sent", json_integer(stream->rtp_component->out_stats.audio_nacks));
 				}
-				sr->si.s_packets = htonl(stream->rtp_component->out_stats.audio_packets);
-				sr->si.s_octets = htonl(stream->rtp_component->out_stats.audio_bytes);
-				rtcp_sdes *sdes = (rtcp_sdes *)&rtcpbuf[28];
-				janus_rtcp_sdes((char *)sdes, sdeslen, "janusaudio", 10);
-				/* Enqueue it, we'll send it later */
-				janus_ice_relay_rtcp_internal(handle, 0, rtcpbuf, srlen+sdeslen, FALSE);
+				janus_events_notify_handlers(JANUS_EVENT_TYPE_MEDIA, session->session_id, handle->handle_id, info);
 			}
-			audio_rtcp_last_sr = now;
 		}
-		if(now-video_rtcp_last_sr >= 5*G_USEC_PER_SEC) {
+		timers->audio_last_event = now;
+	}
+	if(janus_ice_event_stats_period > 0 && now-timers->video_last_event >= (gint64)janus_ice_event_stats_period*G_USEC_PER_SEC) {
+		if(janus_events_is_enabled() && janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_HAS_VIDEO)) {
 			janus_ice_stream *stream = janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_BUNDLE) ? (handle->audio_stream ? handle->audio_stream : handle->video_stream) : (handle->video_stream);
-			if(stream && stream->rtp_component && stream->rtp_component->out_stats.video_packets > 0) {
-				/* Create a SR/SDES compound */
-				int srlen = 28;
-				int sdeslen = 20;
-				char rtcpbuf[srlen+sdeslen];
-				memset(rtcpbuf, 0, sizeof(rtcpbuf));
-				rtcp_sr *sr = (rtcp_sr *)&rtcpbuf;
-				sr->header.version = 2;
-				sr->header.type = RTCP_SR;
-				sr->header.rc = 0;
-				sr->header.length = htons((srlen/4)-1);
-				struct timeval tv;
-				gettimeofday(&tv, NULL);
-				uint32_t s = tv.tv_sec + 2208988800u;
-				uint32_t u = tv.tv_usec;
-				uint32_t f = (u << 12) + (u << 8) - ((u * 3650) >> 6);
-				sr->si.ntp_ts_msw = htonl(s);
-				sr->si.ntp_ts_lsw = htonl(f);
-				/* Compute an RTP timestamp coherent with the NTP one */
-				rtcp_context *rtcp_ctx = stream->video_rtcp_ctx;
-				if(rtcp_ctx == NULL) {
-					sr->si.rtp_ts = htonl(stream->video_last_ts);	/* FIXME */
-				} else {
-					int64_t ntp = tv.tv_sec*G_USEC_PER_SEC + tv.tv_usec;
-					uint32_t rtp_ts = ((ntp-stream->video_first_ntp_ts)/1000)*(rtcp_ctx->tb/1000) + stream->video_first_rtp_ts;
-					sr->si.rtp_ts = htonl(rtp_ts);
+			if(stream && stream->video_rtcp_ctx) {
+				json_t *info = json_object();
+				json_object_set_new(info, "media", json_string("video"));
+				json_object_set_new(info, "base", json_integer(stream->video_rtcp_ctx->tb));
+				json_object_set_new(info, "lsr", json_integer(janus_rtcp_context_get_lsr(stream->video_rtcp_ctx)));
+				json_object_set_new(info, "lost", json_integer(janus_rtcp_context_get_lost_all(stream->video_rtcp_ctx, FALSE)));
+				json_object_set_new(info, "lost-by-remote", json_integer(janus_rtcp_context_get_lost_all(stream->video_rtcp_ctx, TRUE)));
+				json_object_set_new(info, "jitter-local", json_integer(janus_rtcp_context_get_jitter(stream->video_rtcp_ctx, FALSE)));
+				json_object_set_new(info, "jitter-remote", json_integer(janus_rtcp_context_get_jitter(stream->video_rtcp_ctx, TRUE)));
+				if(stream->rtp_component) {
+					json_object_set_new(info, "packets-received", json_integer(stream->rtp_component->in_stats.video_packets));
+					json_object_set_new(info, "packets-sent", json_integer(stream->rtp_component->out_stats.video_packets));
+					json_object_set_new(info, "bytes-received", json_integer(stream->rtp_component->in_stats.video_bytes));
+					json_object_set_new(info, "bytes-sent", json_integer(stream->rtp_component->out_stats.video_bytes));
+					json_object_set_new(info, "nacks-received", json_integer(stream->rtp_component->in_stats.video_nacks));
+					json_object_set_new(info, "nacks-sent", json_integer(stream->rtp_component->out_stats.video_nacks));
 				}
-				sr->si.s_packets = htonl(stream->rtp_component->out_stats.video_packets);
-				sr->si.s_octets = htonl(stream->rtp_component->out_stats.video_bytes);
-				rtcp_sdes *sdes = (rtcp_sdes *)&rtcpbuf[28];
-				janus_rtcp_sdes((char *)sdes, sdeslen, "janusvideo", 10);
-				/* Enqueue it, we'll send it later */
-				janus_ice_relay_rtcp_internal(handle, 1, rtcpbuf, srlen+sdeslen, FALSE);
+				janus_events_notify_handlers(JANUS_EVENT_TYPE_MEDIA, session->session_id, handle->handle_id, info);
 			}
-			video_rtcp_last_sr = now;
 		}
-		/* We tell event handlers once per second about RTCP-related stuff
-		 * FIXME Should we really do this here? Would this slow down this thread and add delay? */
-		if(janus_ice_event_stats_period > 0 && now-audio_last_event >= (gint64)janus_ice_event_stats_period*G_USEC_PER_SEC) {
-			if(janus_events_is_enabled() && janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_HAS_AUDIO)) {
-				janus_ice_stream *stream = handle->audio_stream;
-				if(stream && stream->audio_rtcp_ctx) {
-					json_t *info = json_object();
-					json_object_set_new(info, "media", json_string("audio"));
-					json_object_set_new(info, "base", json_integer(stream->audio_rtcp_ctx->tb));
-					json_object_set_new(info, "lsr", json_integer(janus_rtcp_context_get_lsr(stream->audio_rtcp_ctx)));
-					json_object_set_new(info, "lost", json_integer(janus_rtcp_context_get_lost_all(stream->audio_rtcp_ctx, FALSE)));
-					json_object_set_new(info, "lost-by-remote", json_integer(janus_rtcp_context_get_lost_all(stream->audio_rtcp_ctx, TRUE)));
-					json_object_set_new(info, "jitter-local", json_integer(janus_rtcp_context_get_jitter(stream->audio_rtcp_ctx, FALSE)));
-					json_object_set_new(info, "jitter-remote", json_integer(janus_rtcp_context_get_jitter(stream->audio_rtcp_ctx, TRUE)));
-					if(stream->rtp_component) {
-						json_object_set_new(info, "packets-received", json_integer(stream->rtp_component->in_stats.audio_packets));
-						json_object_set_new(info, "packets-sent", json_integer(stream->rtp_component->out_stats.audio_packets));
-						json_object_set_new(info, "bytes-received", json_integer(stream->rtp_component->in_stats.audio_bytes));
-						json_object_set_new(info, "bytes-sent", json_integer(stream->rtp_component->out_stats.audio_bytes));
-						json_object_set_new(info, "nacks-received", json_integer(stream->rtp_component->in_stats.audio_nacks));
-						json_object_set_new(info, "nacks-sent", json_integer(stream->rtp_component->out_stats.audio_nacks));
-					}
-					janus_events_notify_handlers(JANUS_EVENT_TYPE_MEDIA, session->session_id, handle->handle_id, info);
-				}
+		timers->video_last_event = now;
+	}
+	/* Should we clean up old NACK buffers? (we check each 1/4 of the max_nack_queue time) */
+	if(max_nack_queue > 0 && (now-timers->last_nack_cleanup >= (max_nack_queue*250))) {
+		/* Check if we do for both streams */
+		janus_cleanup_nack_buffer(now, handle->audio_stream);
+		janus_cleanup_nack_buffer(now, handle->video_stream);
+		timers->last_nack_cleanup = now;
+	}
+	/* Check if we should also print a summary of SRTP-related errors */
+	if(now-timers->last_srtp_summary >= (2*G_USEC_PER_SEC)) {
+		if(handle->srtp_errors_count > 0) {
+			JANUS_LOG(LOG_ERR, "[%"SCNu64"] Got %d SRTP/SRTCP errors in the last few seconds (last error: %s)\n",
+				handle->handle_id, handle->srtp_errors_count, janus_srtp_error_str(handle->last_srtp_error));
+			handle->srtp_errors_count = 0;
+			handle->last_srtp_error = 0;
+		}
+		timers->last_srtp_summary = now;
+	}
+}
+
+/* The session is over, send an alert on all streams and components */
+static void janus_ice_send_alerts(janus_ice_handle *handle) {
+	if(handle->streams == NULL)
+		return;
+	if(handle->audio_stream) {
+		janus_ice_stream *stream = handle->audio_stream;
+		if(stream->rtp_component)
+			janus_dtls_srtp_send_alert(stream->rtp_component->dtls);
+		if(stream->rtcp_component)
+			janus_dtls_srtp_send_alert(stream->rtcp_component->dtls);
+	}
+	if(handle->video_stream) {
+		janus_ice_stream *stream = handle->video_stream;
+		if(stream->rtp_component)
+			janus_dtls_srtp_send_alert(stream->rtp_component->dtls);
+		if(stream->rtcp_component)
+			janus_dtls_srtp_send_alert(stream->rtcp_component->dtls);
+	}
+	if(handle->data_stream) {
+		janus_ice_stream *stream = handle->data_stream;
+		if(stream->rtp_component)
+			janus_dtls_srtp_send_alert(stream->rtp_component->dtls);
+		if(stream->rtcp_component)
+			janus_dtls_srtp_send_alert(stream->rtcp_component->dtls);
+	}
+}
+
+/* When batched sending is enabled, packets popped from the queue in the same
+ * round are protected into a batch and handed to libnice all at once (which
+ * uses sendmmsg where available), rather than with a send call each */
+static gboolean batched_send = FALSE;
+gboolean janus_ice_set_batched_send(gboolean enabled) {
+#ifndef HAVE_LIBNICE_SENDMSGS
+	if(enabled) {
+		JANUS_LOG(LOG_WARN, "Batched sending not supported by this libnice version, ignoring\n");
+		return FALSE;
+	}
+#endif
+	batched_send = enabled;
+	JANUS_LOG(LOG_VERB, "Batched sending %s\n", batched_send ? "enabled" : "disabled");
+	return TRUE;
+}
+gboolean janus_ice_is_batched_send_enabled(void) {
+	return batched_send;
+}
+/* Room for a MTU-sized packet, a prepended RR and the SRTP/SRTCP trailer: larger packets are sent right away */
+#define JANUS_ICE_BATCH_BUFSIZE		2048
+struct janus_ice_send_batch {
+	janus_ice_handle *handle;
+	guint stream_id, component_id;
+	guint count;
+	gint lengths[JANUS_ICE_QUEUE_BATCH];
+	char buffers[JANUS_ICE_QUEUE_BATCH][JANUS_ICE_BATCH_BUFSIZE];
+};
+static janus_ice_send_batch *janus_ice_send_batch_new(janus_ice_handle *handle) {
+	if(!batched_send)
+		return NULL;
+	janus_ice_send_batch *batch = g_malloc(sizeof(janus_ice_send_batch));
+	batch->handle = handle;
+	batch->stream_id = 0;
+	batch->component_id = 0;
+	batch->count = 0;
+	return batch;
+}
+static void janus_ice_send_batch_flush(janus_ice_send_batch *batch) {
+	if(batch == NULL || batch->count == 0)
+		return;
+	janus_ice_handle *handle = batch->handle;
+	gint sent = 0;
+#ifdef HAVE_LIBNICE_SENDMSGS
+	GOutputVector vectors[JANUS_ICE_QUEUE_BATCH];
+	NiceOutputMessage messages[JANUS_ICE_QUEUE_BATCH];
+	guint i = 0;
+	for(i=0; i<batch->count; i++) {
+		vectors[i].buffer = batch->buffers[i];
+		vectors[i].size = batch->lengths[i];
+		messages[i].buffers = &vectors[i];
+		messages[i].n_buffers = 1;
+	}
+	GError *error = NULL;
+	sent = nice_agent_send_messages_nonblocking(handle->agent, batch->stream_id, batch->component_id,
+		messages, batch->count, NULL, &error);
+	if(sent < 0) {
+		JANUS_LOG(LOG_ERR, "[%"SCNu64"] ... error sending batch of %u packets: %s\n",
+			handle->handle_id, batch->count, error ? error->message : "??");
+		if(error)
+			g_error_free(error);
+		sent = 0;
+	}
+#else
+	/* Can't happen (batched sending is refused at startup), but just in case */
+	guint i = 0;
+	for(i=0; i<batch->count; i++) {
+		if(nice_agent_send(handle->agent, batch->stream_id, batch->component_id, batch->lengths[i], batch->buffers[i]) > 0)
+			sent++;
+	}
+#endif
+	if(sent < (gint)batch->count) {
+		JANUS_LOG(LOG_ERR, "[%"SCNu64"] ... only sent %d packets? (was %u)\n", handle->handle_id, sent, batch->count);
+	}
+	/* Update the histogram of batch sizes (powers of two) */
+	guint bucket = 0, size = batch->count;
+	while(size > 1 && bucket < JANUS_ICE_SEND_BATCH_HISTOGRAM-1) {
+		size >>= 1;
+		bucket++;
+	}
+	handle->send_batches[bucket]++;
+	batch->count = 0;
+}
+static void janus_ice_send_batch_destroy(janus_ice_send_batch *batch) {
+	/* Batches are always flushed after each round, so there's nothing left to send here */
+	g_free(batch);
+}
+/* A static loop shares its batch among all the handles it serves: make sure
+ * nothing batched for the previous handle is left, before using it for another */
+static void janus_ice_send_batch_bind(janus_ice_send_batch *batch, janus_ice_handle *handle) {
+	if(batch == NULL || batch->handle == handle)
+		return;
+	janus_ice_send_batch_flush(batch);
+	batch->handle = handle;
+}
+/* Get the buffer for the next packet in the batch (flushing it first, if needed), or
+ * NULL if this packet can't be batched: in that case, the caller provides its own buffer */
+static char *janus_ice_send_batch_buffer(janus_ice_send_batch *batch, guint stream_id, guint component_id, int len) {
+	if(batch == NULL)
+		return NULL;
+	if(batch->count > 0 && (batch->count == JANUS_ICE_QUEUE_BATCH ||
+			batch->stream_id != stream_id || batch->component_id != component_id))
+		janus_ice_send_batch_flush(batch);
+	if(len + JANUS_ICE_SRTP_TRAILER > JANUS_ICE_BATCH_BUFSIZE) {
+		/* Too large, flush what we have, so that we don't change the order of packets */
+		janus_ice_send_batch_flush(batch);
+		return NULL;
+	}
+	batch->stream_id = stream_id;
+	batch->component_id = component_id;
+	return batch->buffers[batch->count];
+}
+/* Send a packet, or add it to the batch if it was written in the buffer the batch provided */
+static int janus_ice_send_output(janus_ice_handle *handle, janus_ice_send_batch *batch,
+		guint stream_id, guint component_id, char *buf, int len) {
+	if(batch != NULL && batch->count < JANUS_ICE_QUEUE_BATCH && buf == batch->buffers[batch->count]) {
+		batch->lengths[batch->count] = len;
+		batch->count++;
+		return len;
+	}
+	/* Make sure what we batched so far goes out first */
+	janus_ice_send_batch_flush(batch);
+	return nice_agent_send(handle->agent, stream_id, component_id, len, buf);
+}
+
+/* Encrypt and send a single queued packet: takes ownership of the packet */
+static void janus_ice_send_packet(janus_ice_handle *handle, janus_ice_send_batch *batch, janus_ice_queued_packet *pkt) {
+	if(pkt->data == NULL) {
+		janus_ice_queued_packet_free(pkt);
+		return;
+	}
+	if(pkt->control) {
+		/* RTCP */
+		int video = (pkt->type == JANUS_ICE_PACKET_VIDEO);
+		janus_ice_stream *stream = janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_BUNDLE) ? (handle->audio_stream ? handle->audio_stream : handle->video_stream) : (video ? handle->video_stream : handle->audio_stream);
+		if(!stream) {
+			janus_ice_queued_packet_free(pkt);
+			return;
+		}
+		janus_ice_component *component = janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX) ? stream->rtp_component : stream->rtcp_component;
+		if(!component) {
+			janus_ice_queued_packet_free(pkt);
+			return;
+		}
+		if(!stream->cdone) {
+			if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT) && !stream->noerrorlog) {
+				JANUS_LOG(LOG_ERR, "[%"SCNu64"]     %s candidates not gathered yet for stream??\n", handle->handle_id, video ? "video" : "audio");
+				stream->noerrorlog = TRUE;	/* Don't flood with the same error all over again */
 			}
-			audio_last_event = now;
+			janus_ice_queued_packet_free(pkt);
+			return;
 		}
-		if(janus_ice_event_stats_period > 0 && now-video_last_event >= (gint64)janus_ice_event_stats_period*G_USEC_PER_SEC) {
-			if(janus_events_is_enabled() && janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_HAS_VIDEO)) {
+		stream->noerrorlog = FALSE;
+		if(!component->dtls || !component->dtls->srtp_valid || !component->dtls->srtp_out) {
+			if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT) && !component->noerrorlog) {
+				JANUS_LOG(LOG_WARN, "[%"SCNu64"]     %s stream (#%u) component has no valid SRTP session (yet?)\n", handle->handle_id, video ? "video" : "audio", stream->stream_id);
+				component->noerrorlog = TRUE;	/* Don't flood with the same error all over again */
+			}
+			janus_ice_queued_packet_free(pkt);
+			return;
+		}
+		component->noerrorlog = FALSE;
+		if(pkt->encrypted) {
+			/* Already SRTCP */
+			char *sbuf = janus_ice_send_batch_buffer(batch, stream->stream_id, component->component_id, pkt->length);
+			if(sbuf != NULL)
+				memcpy(sbuf, pkt->data, pkt->length);
+			int sent = janus_ice_send_output(handle, batch, stream->stream_id, component->component_id,
+				sbuf ? sbuf : pkt->data, pkt->length);
+			if(sent < pkt->length) {
+				JANUS_LOG(LOG_ERR, "[%"SCNu64"] ... only sent %d bytes? (was %d)\n", handle->handle_id, sent, pkt->length);
+			}
+		} else {
+			/* FIXME Copy in a buffer and fix SSRC */
+			if(pkt->length + 32 + JANUS_ICE_SRTP_TRAILER > JANUS_BUFSIZE) {
+				/* There wouldn't be room for a RR (and the SRTCP trailer) in the buffer */
+				JANUS_LOG(LOG_WARN, "[%"SCNu64"] RTCP packet too large (%d bytes), dropping it\n", handle->handle_id, pkt->length);
+				janus_ice_queued_packet_free(pkt);
+				return;
+			}
+			char lbuf[JANUS_BUFSIZE];
+			char *sbuf = janus_ice_send_batch_buffer(batch, stream->stream_id, component->component_id, pkt->length+32);
+			if(sbuf == NULL)
+				sbuf = lbuf;
+			int length = pkt->length;
+			/* Check if there's anything we need to do before sending */
+			uint32_t bitrate = janus_rtcp_get_remb(pkt->data, pkt->length);
+			if(bitrate > 0) {
+				/* There's a REMB, prepend a RR as it won't work otherwise */
+				int rrlen = 32;
+				memset(sbuf, 0, rrlen);
+				rtcp_rr *rr = (rtcp_rr *)sbuf;
+				rr->header.version = 2;
+				rr->header.type = RTCP_RR;
+				rr->header.rc = 0;
+				rr->header.length = htons((rrlen/4)-1);
 				janus_ice_stream *stream = janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_BUNDLE) ? (handle->audio_stream ? handle->audio_stream : handle->video_stream) : (handle->video_stream);
-				if(stream && stream->video_rtcp_ctx) {
-					json_t *info = json_object();
-					json_object_set_new(info, "media", json_string("video"));
-					json_object_set_new(info, "base", json_integer(stream->video_rtcp_ctx->tb));
-					json_object_set_new(info, "lsr", json_integer(janus_rtcp_context_get_lsr(stream->video_rtcp_ctx)));
-					json_object_set_new(info, "lost", json_integer(janus_rtcp_context_get_lost_all(stream->video_rtcp_ctx, FALSE)));
-					json_object_set_new(info, "lost-by-remote", json_integer(janus_rtcp_context_get_lost_all(stream->video_rtcp_ctx, TRUE)));
-					json_object_set_new(info, "jitter-local", json_integer(janus_rtcp_context_get_jitter(stream->video_rtcp_ctx, FALSE)));
-					json_object_set_new(info, "jitter-remote", json_integer(janus_rtcp_context_get_jitter(stream->video_rtcp_ctx, TRUE)));
-					if(stream->rtp_component) {
-						json_object_set_new(info, "packets-received", json_integer(stream->rtp_component->in_stats.video_packets));
-						json_object_set_new(info, "packets-sent", json_integer(stream->rtp_component->out_stats.video_packets));
-						json_object_set_new(info, "bytes-received", json_integer(stream->rtp_component->in_stats.video_bytes));
-						json_object_set_new(info, "bytes-sent", json_integer(stream->rtp_component->out_stats.video_bytes));
-						json_object_set_new(info, "nacks-received", json_integer(stream->rtp_component->in_stats.video_nacks));
-						json_object_set_new(info, "nacks-sent", json_integer(stream->rtp_component->out_stats.video_nacks));
+				if(stream && stream->video_rtcp_ctx && stream->video_rtcp_ctx->rtp_recvd) {
+					rr->header.rc = 1;
+					janus_rtcp_report_block(stream->video_rtcp_ctx, &rr->rb[0]);
+				}
+				/* Append REMB */
+				memcpy(sbuf+rrlen, pkt->data, pkt->length);
+				/* If we're simulcasting, set the extra SSRCs (the first one will be set by janus_rtcp_fix_ssrc) */
+				if(stream->video_ssrc_peer_sim_1 && pkt->length >= 28) {
+					rtcp_fb *rtcpfb = (rtcp_fb *)(sbuf+rrlen);
+					rtcp_remb *remb = (rtcp_remb *)rtcpfb->fci;
+					remb->ssrc[1] = htonl(stream->video_ssrc_peer_sim_1);
+					if(stream->video_ssrc_peer_sim_2 && pkt->length >= 32) {
+						remb->ssrc[2] = htonl(stream->video_ssrc_peer_sim_2);
 					}
-					janus_events_notify_handlers(JANUS_EVENT_TYPE_MEDIA, session->session_id, handle->handle_id, info);
 				}
+				length = rrlen+pkt->length;
+			} else {
+				memcpy(sbuf, pkt->data, pkt->length);
 			}
-			video_last_event = now;
-		}
-		/* Should we clean up old NACK buffers? (we check each 1/4 of the max_nack_queue time) */
-		if(max_nack_queue > 0 && (now-last_nack_cleanup >= (max_nack_queue*250))) {
-			/* Check if we do for both streams */
-			janus_cleanup_nack_buffer(now, handle->audio_stream);
-			janus_cleanup_nack_buffer(now, handle->video_stream);
-			last_nack_cleanup = now;
-		}
-		/* Check if we should also print a summary of SRTP-related errors */
-		if(now-last_srtp_summary >= (2*G_USEC_PER_SEC)) {
-			if(handle->srtp_errors_count > 0) {
-				JANUS_LOG(LOG_ERR, "[%"SCNu64"] Got %d SRTP/SRTCP errors in the last few seconds (last error: %s)\n",
-					handle->handle_id, handle->srtp_errors_count, janus_srtp_error_str(handle->last_srtp_error));
-				handle->srtp_errors_count = 0;
-				handle->last_srtp_error = 0;
+			/* Fix all SSRCs! */
+			if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_PLAN_B)) {
+				JANUS_LOG(LOG_HUGE, "[%"SCNu64"] Fixing SSRCs (local %u, peer %u)\n", handle->handle_id,
+					video ? stream->video_ssrc : stream->audio_ssrc,
+					video ? stream->video_ssrc_peer : stream->audio_ssrc_peer);
+				janus_rtcp_fix_ssrc(NULL, sbuf, length, 1,
+					video ? stream->video_ssrc : stream->audio_ssrc,
+					video ? stream->video_ssrc_peer : stream->audio_ssrc_peer);
+			} else {
+				/* Plan B involved, we trust the plugin to set the right 'local' SSRC and we don't mess with it */
+				JANUS_LOG(LOG_HUGE, "[%"SCNu64"] Fixing peer SSRC (Plan B, peer %u)\n", handle->handle_id,
+					video ? stream->video_ssrc_peer : stream->audio_ssrc_peer);
+				janus_rtcp_fix_ssrc(NULL, sbuf, length, 1, 0,
+					video ? stream->video_ssrc_peer : stream->audio_ssrc_peer);
 			}
-			last_srtp_summary = now;
-		}
 
-		/* Now let's get on with the packets */
-		if(pkt == NULL) {
-			continue;
-		}
-		if(pkt->data == NULL) {
-			g_free(pkt);
-			pkt = NULL;
-			continue;
+			int protected = length;
+			int res = 0;
+			if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_PLAN_B)) {
+				res = srtp_protect_rtcp(component->dtls->srtp_out, sbuf, &protected);
+			} else {
+				/* We need to make sure different sources don't use the SRTP context at the same time */
+				janus_mutex_lock(&component->dtls->srtp_mutex);
+				res = srtp_protect_rtcp(component->dtls->srtp_out, sbuf, &protected);
+				janus_mutex_unlock(&component->dtls->srtp_mutex);
+			}
+			if(res != srtp_err_status_ok) {
+				/* We don't spam the logs for every SRTP error: just take note of this, and print a summary later */
+				handle->srtp_errors_count++;
+				handle->last_srtp_error = res;
+				/* If we're debugging, though, print every occurrence */
+				JANUS_LOG(LOG_DBG, "[%"SCNu64"] ... SRTCP protect error... %s (len=%d-->%d)...\n", handle->handle_id, janus_srtp_error_str(res), length, protected);
+			} else {
+				/* Shoot! */
+				int sent = janus_ice_send_output(handle, batch, stream->stream_id, component->component_id, sbuf, protected);
+				if(sent < protected) {
+					JANUS_LOG(LOG_ERR, "[%"SCNu64"] ... only sent %d bytes? (was %d)\n", handle->handle_id, sent, protected);
+				}
+			}
 		}
-		if(pkt->control) {
-			/* RTCP */
+		janus_ice_queued_packet_free(pkt);
+		return;
+	} else {
+		/* RTP or data */
+		if(pkt->type == JANUS_ICE_PACKET_AUDIO || pkt->type == JANUS_ICE_PACKET_VIDEO) {
+			/* RTP */
 			int video = (pkt->type == JANUS_ICE_PACKET_VIDEO);
 			janus_ice_stream *stream = janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_BUNDLE) ? (handle->audio_stream ? handle->audio_stream : handle->video_stream) : (video ? handle->video_stream : handle->audio_stream);
 			if(!stream) {
-				g_free(pkt->data);
-				pkt->data = NULL;
-				g_free(pkt);
-				pkt = NULL;
-				continue;
+				janus_ice_queued_packet_free(pkt);
+				return;
 			}
-			janus_ice_component *component = janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX) ? stream->rtp_component : stream->rtcp_component;
+			janus_ice_component *component = stream->rtp_component;
 			if(!component) {
-				g_free(pkt->data);
-				pkt->data = NULL;
-				g_free(pkt);
-				pkt = NULL;
-				continue;
+				janus_ice_queued_packet_free(pkt);
+				return;
 			}
 			if(!stream->cdone) {
 				if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT) && !stream->noerrorlog) {
 					JANUS_LOG(LOG_ERR, "[%"SCNu64"]     %s candidates not gathered yet for stream??\n", handle->handle_id, video ? "video" : "audio");
 					stream->noerrorlog = TRUE;	/* Don't flood with the same error all over again */
 				}
-				g_free(pkt->data);
-				pkt->data = NULL;
-				g_free(pkt);
-				pkt = NULL;
-				continue;
+				janus_ice_queued_packet_free(pkt);
+				return;
 			}
 			stream->noerrorlog = FALSE;
 			if(!component->dtls || !component->dtls->srtp_valid || !component->dtls->srtp_out) {
 				if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT) && !component->noerrorlog) {
-					JANUS_LOG(LOG_WARN, "[%"SCNu64"]     %s stream (#%u) component has no valid SRTP session (yet?)\n", handle->handle_id, video ? "video" : "audio", stream->stream_id);
+					JANUS_LOG(LOG_WARN, "[%"SCNu64"]     %s stream component has no valid SRTP session (yet?)\n", handle->handle_id, video ? "video" : "audio");
 					component->noerrorlog = TRUE;	/* Don't flood with the same error all over again */
 				}
-				g_free(pkt->data);
-				pkt->data = NULL;
-				g_free(pkt);
-				pkt = NULL;
-				continue;
+				janus_ice_queued_packet_free(pkt);
+				return;
 			}
 			component->noerrorlog = FALSE;
 			if(pkt->encrypted) {
-				/* Already SRTCP */
-				int sent = nice_agent_send(handle->agent, stream->stream_id, component->component_id, pkt->length, (const gchar *)pkt->data);
+				/* Already RTP (probably a retransmission?) */
+				rtp_header *header = (rtp_header *)pkt->data;
+				JANUS_LOG(LOG_HUGE, "[%"SCNu64"] ... Retransmitting seq.nr %"SCNu16"\n\n", handle->handle_id, ntohs(header->seq_number));
+				char *sbuf = janus_ice_send_batch_buffer(batch, stream->stream_id, component->component_id, pkt->length);
+				if(sbuf != NULL)
+					memcpy(sbuf, pkt->data, pkt->length);
+				int sent = janus_ice_send_output(handle, batch, stream->stream_id, component->component_id,
+					sbuf ? sbuf : pkt->data, pkt->length);
 				if(sent < pkt->length) {
 					JANUS_LOG(LOG_ERR, "[%"SCNu64"] ... only sent %d bytes? (was %d)\n", handle->handle_id, sent, pkt->length);
 				}
 			} else {
-				/* Check if there's anything we need to do before sending */
-				uint32_t bitrate = janus_rtcp_get_remb(pkt->data, pkt->length);
-				if(bitrate > 0) {
-					/* There's a REMB, prepend a RR as it won't work otherwise */
-					int rrlen = 32;
-					char *rtcpbuf = g_malloc0(rrlen+pkt->length);
-					memset(rtcpbuf, 0, rrlen+pkt->length);
-					rtcp_rr *rr = (rtcp_rr *)rtcpbuf;
-					rr->header.version = 2;
-					rr->header.type = RTCP_RR;
-					rr->header.rc = 0;
-					rr->header.length = htons((rrlen/4)-1);
-					janus_ice_stream *stream = janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_BUNDLE) ? (handle->audio_stream ? handle->audio_stream : handle->video_stream) : (handle->video_stream);
-					if(stream && stream->video_rtcp_ctx && stream->video_rtcp_ctx->rtp_recvd) {
-						rr->header.rc = 1;
-						janus_rtcp_report_block(stream->video_rtcp_ctx, &rr->rb[0]);
-					}
-					/* Append REMB */
-					memcpy(rtcpbuf+rrlen, pkt->data, pkt->length);
-					/* If we're simulcasting, set the extra SSRCs (the first one will be set by janus_rtcp_fix_ssrc) */
-					if(stream->video_ssrc_peer_sim_1 && pkt->length >= 28) {
-						rtcp_fb *rtcpfb = (rtcp_fb *)(rtcpbuf+rrlen);
-						rtcp_remb *remb = (rtcp_remb *)rtcpfb->fci;
-						remb->ssrc[1] = htonl(stream->video_ssrc_peer_sim_1);
-						if(stream->video_ssrc_peer_sim_2 && pkt->length >= 32) {
-							remb->ssrc[2] = htonl(stream->video_ssrc_peer_sim_2);
-						}
-					}
-					/* Free old packet and update */
-					char *prev_data = pkt->data;
-					pkt->data = rtcpbuf;
-					pkt->length = rrlen+pkt->length;
-					g_clear_pointer(&prev_data, g_free);
-				}
 				/* FIXME Copy in a buffer and fix SSRC */
-				char sbuf[JANUS_BUFSIZE];
+				if(pkt->length + JANUS_ICE_SRTP_TRAILER > JANUS_BUFSIZE) {
+					JANUS_LOG(LOG_WARN, "[%"SCNu64"] RTP packet too large (%d bytes), dropping it\n", handle->handle_id, pkt->length);
+					janus_ice_queued_packet_free(pkt);
+					return;
+				}
+				char lbuf[JANUS_BUFSIZE];
+				char *sbuf = janus_ice_send_batch_buffer(batch, stream->stream_id, component->component_id, pkt->length);
+				if(sbuf == NULL)
+					sbuf = lbuf;
 				memcpy(sbuf, pkt->data, pkt->length);
-				/* Fix all SSRCs! */
-				if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_PLAN_B)) {
-					JANUS_LOG(LOG_HUGE, "[%"SCNu64"] Fixing SSRCs (local %u, peer %u)\n", handle->handle_id,
-						video ? stream->video_ssrc : stream->audio_ssrc,
-						video ? stream->video_ssrc_peer : stream->audio_ssrc_peer);
-					janus_rtcp_fix_ssrc(NULL, sbuf, pkt->length, 1,
-						video ? stream->video_ssrc : stream->audio_ssrc,
-						video ? stream->video_ssrc_peer : stream->audio_ssrc_peer);
-				} else {
-					/* Plan B involved, we trust the plugin to set the right 'local' SSRC and we don't mess with it */
-					JANUS_LOG(LOG_HUGE, "[%"SCNu64"] Fixing peer SSRC (Plan B, peer %u)\n", handle->handle_id,
-						video ? stream->video_ssrc_peer : stream->audio_ssrc_peer);
-					janus_rtcp_fix_ssrc(NULL, sbuf, pkt->length, 1, 0,
-						video ? stream->video_ssrc_peer : stream->audio_ssrc_peer);
+				if(pkt->shared != NULL) {
+					/* Shared packet, apply the header changes for this peer */
+					rtp_header *header = (rtp_header *)sbuf;
+					if(pkt->overlay.ssrc != 0)
+						header->ssrc = htonl(pkt->overlay.ssrc);
+					header->timestamp = htonl(pkt->overlay.timestamp);
+					header->seq_number = htons(pkt->overlay.seq_number);
+					if(pkt->overlay.markerbit >= 0)
+						header->markerbit = pkt->overlay.markerbit ? 1 : 0;
 				}
-
-				int protected = pkt->length;
-				int res = 0;
 				if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_PLAN_B)) {
-					res = srtp_protect_rtcp(component->dtls->srtp_out, sbuf, &protected);
-				} else {
-					/* We need to make sure different sources don't use the SRTP context at the same time */
-					janus_mutex_lock(&component->dtls->srtp_mutex);
-					res = srtp_protect_rtcp(component->dtls->srtp_out, sbuf, &protected);
-					janus_mutex_unlock(&component->dtls->srtp_mutex);
+					/* Overwrite SSRC */
+					rtp_header *header = (rtp_header *)sbuf;
+					header->ssrc = htonl(video ? stream->video_ssrc : stream->audio_ssrc);
 				}
+				int protected = pkt->length;
+				int res = srtp_protect(component->dtls->srtp_out, sbuf, &protected);
 				if(res != srtp_err_status_ok) {
 					/* We don't spam the logs for every SRTP error: just take note of this, and print a summary later */
 					handle->srtp_errors_count++;
 					handle->last_srtp_error = res;
 					/* If we're debugging, though, print every occurrence */
-					JANUS_LOG(LOG_DBG, "[%"SCNu64"] ... SRTCP protect error... %s (len=%d-->%d)...\n", handle->handle_id, janus_srtp_error_str(res), pkt->length, protected);
+					rtp_header *header = (rtp_header *)sbuf;
+					guint32 timestamp = ntohl(header->timestamp);
+					guint16 seq = ntohs(header->seq_number);
+					JANUS_LOG(LOG_DBG, "[%"SCNu64"] ... SRTP protect error... %s (len=%d-->%d, ts=%"SCNu32", seq=%"SCNu16")...\n", handle->handle_id, janus_srtp_error_str(res), pkt->length, protected, timestamp, seq);
 				} else {
 					/* Shoot! */
-					int sent = nice_agent_send(handle->agent, stream->stream_id, component->component_id, protected, sbuf);
+					int sent = janus_ice_send_output(handle, batch, stream->stream_id, component->component_id, sbuf, protected);
 					if(sent < protected) {
 						JANUS_LOG(LOG_ERR, "[%"SCNu64"] ... only sent %d bytes? (was %d)\n", handle->handle_id, sent, protected);
 					}
-				}
-			}
-			g_free(pkt->data);
-			g_free(pkt);
-			continue;
-		} else {
-			/* RTP or data */
-			if(pkt->type == JANUS_ICE_PACKET_AUDIO || pkt->type == JANUS_ICE_PACKET_VIDEO) {
-				/* RTP */
-				int video = (pkt->type == JANUS_ICE_PACKET_VIDEO);
-				janus_ice_stream *stream = janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_BUNDLE) ? (handle->audio_stream ? handle->audio_stream : handle->video_stream) : (video ? handle->video_stream : handle->audio_stream);
-				if(!stream) {
-					g_free(pkt->data);
-					pkt->data = NULL;
-					g_free(pkt);
-					pkt = NULL;
-					continue;
-				}
-				janus_ice_component *component = stream->rtp_component;
-				if(!component) {
-					g_free(pkt->data);
-					pkt->data = NULL;
-					g_free(pkt);
-					pkt = NULL;
-					continue;
-				}
-				if(!stream->cdone) {
-					if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT) && !stream->noerrorlog) {
-						JANUS_LOG(LOG_ERR, "[%"SCNu64"]     %s candidates not gathered yet for stream??\n", handle->handle_id, video ? "video" : "audio");
-						stream->noerrorlog = TRUE;	/* Don't flood with the same error all over again */
-					}
-					g_free(pkt->data);
-					pkt->data = NULL;
-					g_free(pkt);
-					pkt = NULL;
-					continue;
-				}
-				stream->noerrorlog = FALSE;
-				if(!component->dtls || !component->dtls->srtp_valid || !component->dtls->srtp_out) {
-					if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT) && !component->noerrorlog) {
-						JANUS_LOG(LOG_WARN, "[%"SCNu64"]     %s stream component has no valid SRTP session (yet?)\n", handle->handle_id, video ? "video" : "audio");
-						component->noerrorlog = TRUE;	/* Don't flood with the same error all over again */
-					}
-					g_free(pkt->data);
-					pkt->data = NULL;
-					g_free(pkt);
-					pkt = NULL;
-					continue;
-				}
-				component->noerrorlog = FALSE;
-				if(pkt->encrypted) {
-					/* Already RTP (probably a retransmission?) */
-					rtp_header *header = (rtp_header *)pkt->data;
-					JANUS_LOG(LOG_HUGE, "[%"SCNu64"] ... Retransmitting seq.nr %"SCNu16"\n\n", handle->handle_id, ntohs(header->seq_number));
-					int sent = nice_agent_send(handle->agent, stream->stream_id, component->component_id, pkt->length, (const gchar *)pkt->data);
-					if(sent < pkt->length) {
-						JANUS_LOG(LOG_ERR, "[%"SCNu64"] ... only sent %d bytes? (was %d)\n", handle->handle_id, sent, pkt->length);
-					}
-				} else {
-					/* FIXME Copy in a buffer and fix SSRC */
-					char sbuf[JANUS_BUFSIZE];
-					memcpy(sbuf, pkt->data, pkt->length);
-					if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_PLAN_B)) {
-						/* Overwrite SSRC */
-						rtp_header *header = (rtp_header *)sbuf;
-						header->ssrc = htonl(video ? stream->video_ssrc : stream->audio_ssrc);
-					}
-					int protected = pkt->length;
-					int res = srtp_protect(component->dtls->srtp_out, sbuf, &protected);
-					if(res != srtp_err_status_ok) {
-						/* We don't spam the logs for every SRTP error: just take note of this, and print a summary later */
-						handle->srtp_errors_count++;
-						handle->last_srtp_error = res;
-						/* If we're debugging, though, print every occurrence */
+					/* Update stats */
+					if(sent > 0) {
+						/* Update the RTCP context as well */
 						rtp_header *header = (rtp_header *)sbuf;
 						guint32 timestamp = ntohl(header->timestamp);
-						guint16 seq = ntohs(header->seq_number);
-						JANUS_LOG(LOG_DBG, "[%"SCNu64"] ... SRTP protect error... %s (len=%d-->%d, ts=%"SCNu32", seq=%"SCNu16")...\n", handle->handle_id, janus_srtp_error_str(res), pkt->length, protected, timestamp, seq);
-					} else {
-						/* Shoot! */
-						int sent = nice_agent_send(handle->agent, stream->stream_id, component->component_id, protected, sbuf);
-						if(sent < protected) {
-							JANUS_LOG(LOG_ERR, "[%"SCNu64"] ... only sent %d bytes? (was %d)\n", handle->handle_id, sent, protected);
-						}
-						/* Update stats */
-						if(sent > 0) {
-							/* Update the RTCP context as well */
-							rtp_header *header = (rtp_header *)sbuf;
-							guint32 timestamp = ntohl(header->timestamp);
-							if(pkt->type == JANUS_ICE_PACKET_AUDIO) {
-								component->out_stats.audio_packets++;
-								component->out_stats.audio_bytes += sent;
-								stream->audio_last_ts = timestamp;
-								if(stream->audio_first_ntp_ts == 0) {
-									struct timeval tv;
-									gettimeofday(&tv, NULL);
-									stream->audio_first_ntp_ts = (gint64)tv.tv_sec*G_USEC_PER_SEC + tv.tv_usec;
-									stream->audio_first_rtp_ts = timestamp;
-								}
-								/* Let's check if this was G.711: in case we may need to change the timestamp base */
-								rtcp_context *rtcp_ctx = video ? stream->video_rtcp_ctx : stream->audio_rtcp_ctx;
-								int pt = header->type;
-								if((pt == 0 || pt == 8) && (rtcp_ctx->tb == 48000))
-									rtcp_ctx->tb = 8000;
-							} else if(pkt->type == JANUS_ICE_PACKET_VIDEO) {
-								component->out_stats.video_packets++;
-								component->out_stats.video_bytes += sent;
-								stream->video_last_ts = timestamp;
-								if(stream->video_first_ntp_ts == 0) {
-									struct timeval tv;
-									gettimeofday(&tv, NULL);
-									stream->video_first_ntp_ts = (gint64)tv.tv_sec*G_USEC_PER_SEC + tv.tv_usec;
-									stream->video_first_rtp_ts = timestamp;
-								}
+						if(pkt->type == JANUS_ICE_PACKET_AUDIO) {
+							component->out_stats.audio_packets++;
+							component->out_stats.audio_bytes += sent;
+							stream->audio_last_ts = timestamp;
+							if(stream->audio_first_ntp_ts == 0) {
+								struct timeval tv;
+								gettimeofday(&tv, NULL);
+								stream->audio_first_ntp_ts = (gint64)tv.tv_sec*G_USEC_PER_SEC + tv.tv_usec;
+								stream->audio_first_rtp_ts = timestamp;
 							}
-						}
-						if(max_nack_queue > 0) {
-							/* Save the packet for retransmissions that may be needed later */
-							if((pkt->type == JANUS_ICE_PACKET_AUDIO && !component->do_audio_nacks) ||
-									(pkt->type == JANUS_ICE_PACKET_VIDEO && !component->do_video_nacks)) {
-								/* ... unless NACKs are disabled for this medium */
-								g_free(pkt->data);
-								pkt->data = NULL;
-								g_free(pkt);
-								pkt = NULL;
-								continue;
+							/* Let's check if this was G.711: in case we may need to change the timestamp base */
+							rtcp_context *rtcp_ctx = video ? stream->video_rtcp_ctx : stream->audio_rtcp_ctx;
+							int pt = header->type;
+							if((pt == 0 || pt == 8) && (rtcp_ctx->tb == 48000))
+								rtcp_ctx->tb = 8000;
+						} else if(pkt->type == JANUS_ICE_PACKET_VIDEO) {
+							component->out_stats.video_packets++;
+							component->out_stats.video_bytes += sent;
+							stream->video_last_ts = timestamp;
+							if(stream->video_first_ntp_ts == 0) {
+								struct timeval tv;
+								gettimeofday(&tv, NULL);
+								stream->video_first_ntp_ts = (gint64)tv.tv_sec*G_USEC_PER_SEC + tv.tv_usec;
+								stream->video_first_rtp_ts = timestamp;
 							}
-							janus_rtp_packet *p = (janus_rtp_packet *)g_malloc0(sizeof(janus_rtp_packet));
-							p->data = (char *)g_malloc0(protected);
-							memcpy(p->data, sbuf, protected);
-							p->length = protected;
-							p->created = janus_get_monotonic_time();
-							p->last_retransmit = 0;
-							janus_mutex_lock(&component->mutex);
-							component->retransmit_buffer = g_list_append(component->retransmit_buffer, p);
-							janus_mutex_unlock(&component->mutex);
 						}
 					}
+					if(max_nack_queue > 0) {
+						/* Save the packet for retransmissions that may be needed later */
+						if((pkt->type == JANUS_ICE_PACKET_AUDIO && !component->do_audio_nacks) ||
+								(pkt->type == JANUS_ICE_PACKET_VIDEO && !component->do_video_nacks)) {
+							/* ... unless NACKs are disabled for this medium */
+							janus_ice_queued_packet_free(pkt);
+							return;
+						}
+						rtp_header *header = (rtp_header *)sbuf;
+						janus_mutex_lock(&component->mutex);
+						janus_ice_nack_ring **ring = video ? &component->video_retransmit_buffer : &component->audio_retransmit_buffer;
+						if(*ring == NULL)
+							*ring = janus_ice_nack_ring_new();
+						janus_ice_nack_ring_store(*ring, ntohs(header->seq_number), sbuf, protected, janus_get_monotonic_time());
+						janus_mutex_unlock(&component->mutex);
+					}
 				}
-			} else {
-				/* Data */
-				if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_DATA_CHANNELS)) {
-					g_free(pkt->data);
-					pkt->data = NULL;
-					g_free(pkt);
-					pkt = NULL;
-					continue;
-				}
+			}
+		} else {
+			/* Data */
+			if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_DATA_CHANNELS)) {
+				janus_ice_queued_packet_free(pkt);
+				return;
+			}
 #ifdef HAVE_SCTP
-				janus_ice_stream *stream = handle->data_stream ? handle->data_stream : (handle->audio_stream ? handle->audio_stream : handle->video_stream);
-				if(!stream) {
-					g_free(pkt->data);
-					pkt->data = NULL;
-					g_free(pkt);
-					pkt = NULL;
-					continue;
-				}
-				janus_ice_component *component = stream->rtp_component;
-				if(!component) {
-					g_free(pkt->data);
-					pkt->data = NULL;
-					g_free(pkt);
-					pkt = NULL;
-					continue;
-				}
-				if(!stream->cdone) {
-					if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT) && !stream->noerrorlog) {
-						JANUS_LOG(LOG_ERR, "[%"SCNu64"]     SCTP candidates not gathered yet for stream??\n", handle->handle_id);
-						stream->noerrorlog = TRUE;	/* Don't flood with the same error all over again */
-					}
-					g_free(pkt->data);
-					pkt->data = NULL;
-					g_free(pkt);
-					pkt = NULL;
-					continue;
+			janus_ice_stream *stream = handle->data_stream ? handle->data_stream : (handle->audio_stream ? handle->audio_stream : handle->video_stream);
+			if(!stream) {
+				janus_ice_queued_packet_free(pkt);
+				return;
+			}
+			janus_ice_component *component = stream->rtp_component;
+			if(!component) {
+				janus_ice_queued_packet_free(pkt);
+				return;
+			}
+			if(!stream->cdone) {
+				if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT) && !stream->noerrorlog) {
+					JANUS_LOG(LOG_ERR, "[%"SCNu64"]     SCTP candidates not gathered yet for stream??\n", handle->handle_id);
+					stream->noerrorlog = TRUE;	/* Don't flood with the same error all over again */
 				}
-				stream->noerrorlog = FALSE;
-				if(!component->dtls) {
-					if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT) && !component->noerrorlog) {
-						JANUS_LOG(LOG_WARN, "[%"SCNu64"]     SCTP stream component has no valid DTLS session (yet?)\n", handle->handle_id);
-						component->noerrorlog = TRUE;	/* Don't flood with the same error all over again */
-					}
-					g_free(pkt->data);
-					pkt->data = NULL;
-					g_free(pkt);
-					pkt = NULL;
-					continue;
+				janus_ice_queued_packet_free(pkt);
+				return;
+			}
+			stream->noerrorlog = FALSE;
+			if(!component->dtls) {
+				if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT) && !component->noerrorlog) {
+					JANUS_LOG(LOG_WARN, "[%"SCNu64"]     SCTP stream component has no valid DTLS session (yet?)\n", handle->handle_id);
+					component->noerrorlog = TRUE;	/* Don't flood with the same error all over again */
 				}
-				component->noerrorlog = FALSE;
-				janus_dtls_wrap_sctp_data(component->dtls, pkt->data, pkt->length);
+				janus_ice_queued_packet_free(pkt);
+				return;
+			}
+			component->noerrorlog = FALSE;
+			janus_dtls_wrap_sctp_data(component->dtls, pkt->data, pkt->length);
 #endif
+		}
+		janus_ice_queued_packet_free(pkt);
+	}
+}
+
+void *janus_ice_send_thread(void *data) {
+	janus_ice_handle *handle = (janus_ice_handle *)data;
+	JANUS_LOG(LOG_VERB, "[%"SCNu64"] ICE send thread started...\n", handle->handle_id);
+	janus_ice_queued_packet *pkts[JANUS_ICE_QUEUE_BATCH];
+	guint count = 0, i = 0;
+	janus_ice_send_timers timers;
+	janus_ice_send_timers_init(&timers);
+	/* The batch is only allocated when there's something to send */
+	janus_ice_send_batch *batch = NULL;
+	while(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_STOP)) {
+		count = 0;
+		if(handle->queued_packets != NULL) {
+			janus_ice_packet_queue_wait(handle->queued_packets, 500000);
+		} else {
+			g_usleep(100000);
+		}
+		if(handle->queued_packets != NULL && janus_ice_packet_queue_take_alert(handle->queued_packets)) {
+			/* The session is over, send an alert on all streams and components */
+			janus_ice_send_alerts(handle);
+			janus_ice_flush_queue(handle);
+			if(handle->iceloop) {
+				g_main_loop_quit(handle->iceloop);
+				handle->iceloop = NULL;
+				g_main_context_wakeup(handle->icectx);
+				handle->icectx = NULL;
 			}
-			g_free(pkt->data);
-			pkt->data = NULL;
-			g_free(pkt);
-			pkt = NULL;
 			continue;
 		}
+		if(handle->queued_packets != NULL)
+			count = janus_ice_packet_queue_pop_batch(handle->queued_packets, pkts, JANUS_ICE_QUEUE_BATCH);
+		if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_READY)) {
+			for(i=0; i<count; i++)
+				janus_ice_queued_packet_free(pkts[i]);
+			continue;
+		}
+		/* First of all, let's take care of the periodic tasks */
+		janus_ice_send_periodic(handle, &timers, janus_get_monotonic_time());
+		/* Now let's get on with the packets */
+		if(batch == NULL && count > 0)
+			batch = janus_ice_send_batch_new(handle);
+		for(i=0; i<count; i++)
+			janus_ice_send_packet(handle, batch, pkts[i]);
+		janus_ice_send_batch_flush(batch);
 	}
+	janus_ice_send_batch_destroy(batch);
 	JANUS_LOG(LOG_VERB, "[%"SCNu64"] ICE send thread leaving...\n", handle->handle_id);
 	g_thread_unref(g_thread_self());
 	return NULL;
 }
 
+/* When using static event loops there's no send thread: a custom source
+ * attached to the loop takes care of the outgoing queue instead */
+typedef struct janus_ice_outgoing_traffic {
+	GSource parent;
+	janus_ice_handle *handle;
+	janus_ice_send_timers timers;
+	gint64 last_check;
+} janus_ice_outgoing_traffic;
+/* How often (ms) the periodic tasks are checked when there's no traffic */
+#define JANUS_ICE_OUTGOING_CHECK	250
+
+static gboolean janus_ice_outgoing_traffic_prepare(GSource *source, gint *timeout) {
+	janus_ice_outgoing_traffic *t = (janus_ice_outgoing_traffic *)source;
+	janus_ice_handle *handle = t->handle;
+	if(handle->queued_packets != NULL && (janus_ice_packet_queue_length(handle->queued_packets) > 0 ||
+			g_atomic_int_get(&handle->queued_packets->alert)))
+		return TRUE;
+	gint64 elapsed = (janus_get_monotonic_time() - t->last_check)/1000;
+	if(elapsed >= JANUS_ICE_OUTGOING_CHECK)
+		return TRUE;
+	*timeout = JANUS_ICE_OUTGOING_CHECK - elapsed;
+	return FALSE;
+}
+
+static gboolean janus_ice_outgoing_traffic_check(GSource *source) {
+	janus_ice_outgoing_traffic *t = (janus_ice_outgoing_traffic *)source;
+	janus_ice_handle *handle = t->handle;
+	if(handle->queued_packets != NULL && (janus_ice_packet_queue_length(handle->queued_packets) > 0 ||
+			g_atomic_int_get(&handle->queued_packets->alert)))
+		return TRUE;
+	return (janus_get_monotonic_time() - t->last_check) >= JANUS_ICE_OUTGOING_CHECK*1000;
+}
+
+static gboolean janus_ice_outgoing_traffic_dispatch(GSource *source, GSourceFunc callback, gpointer user_data) {
+	janus_ice_outgoing_traffic *t = (janus_ice_outgoing_traffic *)source;
+	janus_ice_handle *handle = t->handle;
+	if(handle->queued_packets == NULL)
+		return G_SOURCE_REMOVE;
+	/* Check the alert before the stop flag, as a detach sets both */
+	if(janus_ice_packet_queue_take_alert(handle->queued_packets)) {
+		/* The session is over, send an alert on all streams and components */
+		janus_ice_send_alerts(handle);
+		janus_ice_flush_queue(handle);
+		janus_ice_static_event_loop_wrapup(handle);
+		return G_SOURCE_REMOVE;
+	}
+	if(janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_STOP))
+		return G_SOURCE_REMOVE;
+	/* All the handles of the loop share the same batch, as they're served by the same thread */
+	janus_ice_static_event_loop *loop = (janus_ice_static_event_loop *)handle->static_event_loop;
+	if(loop != NULL && loop->batch == NULL)
+		loop->batch = janus_ice_send_batch_new(handle);
+	janus_ice_send_batch *batch = loop ? loop->batch : NULL;
+	janus_ice_send_batch_bind(batch, handle);
+	/* Only handle what was queued so far, so that other handles in the same loop get their turn */
+	janus_ice_queued_packet *pkts[JANUS_ICE_QUEUE_BATCH];
+	guint budget = janus_ice_packet_queue_length(handle->queued_packets), count = 0, i = 0;
+	while(budget > 0) {
+		count = janus_ice_packet_queue_pop_batch(handle->queued_packets, pkts, MIN(budget, JANUS_ICE_QUEUE_BATCH));
+		if(count == 0)
+			break;
+		budget -= count;
+		for(i=0; i<count; i++) {
+			if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_READY)) {
+				janus_ice_queued_packet_free(pkts[i]);
+				continue;
+			}
+			janus_ice_send_packet(handle, batch, pkts[i]);
+		}
+		janus_ice_send_batch_flush(batch);
+	}
+	gint64 now = janus_get_monotonic_time();
+	if(now - t->last_check >= JANUS_ICE_OUTGOING_CHECK*1000) {
+		if(janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_READY))
+			janus_ice_send_periodic(handle, &t->timers, now);
+		t->last_check = now;
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+static void janus_ice_outgoing_traffic_finalize(GSource *source) {
+	/* Nothing to do: the batch belongs to the loop */
+}
+
+static GSourceFuncs janus_ice_outgoing_traffic_funcs = {
+	janus_ice_outgoing_traffic_prepare,
+	janus_ice_outgoing_traffic_check,
+	janus_ice_outgoing_traffic_dispatch,
+	janus_ice_outgoing_traffic_finalize,
+	NULL, NULL
+};
+
+static GSource *janus_ice_outgoing_traffic_create(janus_ice_handle *handle) {
+	GSource *source = g_source_new(&janus_ice_outgoing_traffic_funcs, sizeof(janus_ice_outgoing_traffic));
+	janus_ice_outgoing_traffic *t = (janus_ice_outgoing_traffic *)source;
+	char name[255];
+	g_snprintf(name, sizeof(name), "outgoing-%"SCNu64, handle->handle_id);
+	g_source_set_name(source, name);
+	g_source_set_priority(source, G_PRIORITY_DEFAULT);
+	t->handle = handle;
+	janus_ice_send_timers_init(&t->timers);
+	t->last_check = janus_get_monotonic_time();
+	return source;
+}
+
+/* Same as what janus_ice_thread does when a dedicated loop ends, but without touching the shared loop */
+static gboolean janus_ice_static_event_loop_cleanup(gpointer user_data) {
+	janus_ice_handle *handle = (janus_ice_handle *)user_data;
+	if(!janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_STOP))
+		janus_ice_webrtc_free(handle);
+	/* Release the reference we took when scheduling this */
+	g_atomic_int_dec_and_test(&handle->loop_refs);
+	return G_SOURCE_REMOVE;
+}
+
+static void janus_ice_static_event_loop_wrapup(janus_ice_handle *handle) {
+	janus_ice_static_event_loop *loop = (janus_ice_static_event_loop *)handle->static_event_loop;
+	if(loop == NULL)
+		return;
+	janus_flags_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_CLEANING);
+	if(handle->cdone == 0)
+		handle->cdone = -1;
+	janus_ice_detach_recv(handle);
+	JANUS_LOG(LOG_VERB, "[%"SCNu64"] PeerConnection over, freeing resources in a second (loop #%d)\n", handle->handle_id, loop->id);
+	/* This handle has been destroyed, wait a bit and then free all the resources: the
+	 * timeout holds a reference, so that the handle isn't freed in the meanwhile */
+	g_atomic_int_inc(&handle->loop_refs);
+	GSource *timeout = g_timeout_source_new_seconds(1);
+	g_source_set_callback(timeout, janus_ice_static_event_loop_cleanup, handle, NULL);
+	g_source_attach(timeout, loop->mainctx);
+	g_source_unref(timeout);
+}
+
 void janus_ice_relay_rtp(janus_ice_handle *handle, int video, char *buf, int len) {
 	if(!handle || buf == NULL || len < 1)
 		return;
@@ -3990,15 +5128,39 @@ void janus_ice_relay_rtp(janus_ice_handle *handle, int video, char *buf, int len
 			|| (video && !janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_HAS_VIDEO)))
 		return;
 	/* Queue this packet */
-	janus_ice_queued_packet *pkt = (janus_ice_queued_packet *)g_malloc0(sizeof(janus_ice_queued_packet));
-	pkt->data = g_malloc0(len);
-	memcpy(pkt->data, buf, len);
-	pkt->length = len;
+	janus_ice_queued_packet *pkt = janus_ice_queued_packet_new(handle, buf, len);
+	pkt->type = video ? JANUS_ICE_PACKET_VIDEO : JANUS_ICE_PACKET_AUDIO;
+	pkt->control = FALSE;
+	pkt->encrypted = FALSE;
+	janus_ice_queue_packet(handle, pkt);
+}
+
+void janus_ice_relay_rtp_shared(janus_ice_handle *handle, int video, janus_plugin_rtp_shared *packet, janus_plugin_rtp_overlay *overlay) {
+	if(!handle || packet == NULL || packet->length < 12)
+		return;
+	if((!video && !janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_HAS_AUDIO))
+			|| (video && !janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_HAS_VIDEO)))
+		return;
+	/* Queue a reference to the packet, rather than a copy */
+	janus_ice_queued_packet *pkt = janus_ice_queued_packet_get(handle, FALSE);
+	janus_plugin_rtp_shared_ref(packet);
+	pkt->shared = packet;
+	pkt->data = packet->buffer;
+	pkt->length = packet->length;
+	if(overlay != NULL) {
+		pkt->overlay = *overlay;
+	} else {
+		/* Nothing to change, just use what's in the header already */
+		rtp_header *header = (rtp_header *)packet->buffer;
+		pkt->overlay.ssrc = 0;
+		pkt->overlay.timestamp = ntohl(header->timestamp);
+		pkt->overlay.seq_number = ntohs(header->seq_number);
+		pkt->overlay.markerbit = -1;
+	}
 	pkt->type = video ? JANUS_ICE_PACKET_VIDEO : JANUS_ICE_PACKET_AUDIO;
 	pkt->control = FALSE;
 	pkt->encrypted = FALSE;
-	if(handle->queued_packets != NULL)
-		g_async_queue_push(handle->queued_packets, pkt);
+	janus_ice_queue_packet(handle, pkt);
 }
 
 void janus_ice_relay_rtcp_internal(janus_ice_handle *handle, int video, char *buf, int len, gboolean filter_rtcp) {
@@ -4018,15 +5180,11 @@ void janus_ice_relay_rtcp_internal(janus_ice_handle *handle, int video, char *bu
 	if(rtcp_len < 1)
 		return;
 	/* Queue this packet */
-	janus_ice_queued_packet *pkt = (janus_ice_queued_packet *)g_malloc0(sizeof(janus_ice_queued_packet));
-	pkt->data = g_malloc0(len);
-	memcpy(pkt->data, rtcp_buf, rtcp_len);
-	pkt->length = rtcp_len;
+	janus_ice_queued_packet *pkt = janus_ice_queued_packet_new(handle, rtcp_buf, rtcp_len);
 	pkt->type = video ? JANUS_ICE_PACKET_VIDEO : JANUS_ICE_PACKET_AUDIO;
 	pkt->control = TRUE;
 	pkt->encrypted = FALSE;
-	if(handle->queued_packets != NULL)
-		g_async_queue_push(handle->queued_packets, pkt);
+	janus_ice_queue_packet(handle, pkt);
 	if(rtcp_buf != buf) {
 		/* We filtered the original packet, deallocate it */
 		g_free(rtcp_buf);
@@ -4042,15 +5200,11 @@ void janus_ice_relay_data(janus_ice_handle *handle, char *buf, int len) {
 	if(!handle || buf == NULL || len < 1)
 		return;
 	/* Queue this packet */
-	janus_ice_queued_packet *pkt = (janus_ice_queued_packet *)g_malloc0(sizeof(janus_ice_queued_packet));
-	pkt->data = g_malloc0(len);
-	memcpy(pkt->data, buf, len);
-	pkt->length = len;
+	janus_ice_queued_packet *pkt = janus_ice_queued_packet_new(handle, buf, len);
 	pkt->type = JANUS_ICE_PACKET_DATA;
 	pkt->control = FALSE;
 	pkt->encrypted = FALSE;
-	if(handle->queued_packets != NULL)
-		g_async_queue_push(handle->queued_packets, pkt);
+	janus_ice_queue_packet(handle, pkt);
 }
 #endif
 
@@ -4098,14 +5252,7 @@ void janus_ice_dtls_handshake_done(janus_ice_handle *handle, janus_ice_component
 		}
 	}
 	/* Clear the queue before we wake the send thread */
-	janus_ice_queued_packet *pkt = NULL;
-	while(g_async_queue_length(handle->queued_packets) > 0) {
-		pkt = g_async_queue_try_pop(handle->queued_packets);
-		if(pkt != NULL && pkt != &janus_ice_dtls_alert) {
-			g_free(pkt->data);
-			g_free(pkt);
-		}
-	}
+	janus_ice_flush_queue(handle);
 	if(janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_READY)) {
 		/* Already notified */
 		janus_mutex_unlock(&handle->mutex);
@@ -134,6 +134,57 @@ void janus_set_no_media_timer(uint timer);
 /*! \brief Method to get the current no-media event timer (see above)
  * @returns The current no-media event timer */
 uint janus_get_no_media_timer(void);
+/*! \brief Method to configure the number of static event loops to share among handles
+ * \note By default (0) each handle gets its own dedicated thread for the libnice loop and one
+ * for outgoing media: when a number of static loops is specified instead, handles are assigned
+ * to one of them in a round robin fashion, and outgoing traffic is served by the same loop
+ * @param[in] loops The number of static event loops to spawn (0 to keep the dedicated threads) */
+void janus_ice_set_static_event_loops(int loops);
+/*! \brief Method to get the number of static event loops, if enabled
+ * @returns The number of static event loops, or 0 if each handle has its own loop */
+int janus_ice_get_static_event_loops(void);
+/*! \brief Method to stop all the static event loops, if enabled */
+void janus_ice_stop_static_event_loops(void);
+/*! \brief Method to modify the size of the outgoing queue of each handle (i.e., how many packets can wait to be sent)
+ * \note The value is rounded up to the next power of two: when a queue is full, video packets
+ * replace the oldest queued packet, while any other packet is dropped
+ * @param[in] size The new outgoing queue size, in packets */
+void janus_ice_set_outgoing_queue_size(uint size);
+/*! \brief Method to get the current outgoing queue size (see above)
+ * @returns The current outgoing queue size, in packets */
+uint janus_ice_get_outgoing_queue_size(void);
+/*! \brief Method to modify the size of the sliding window used to compute bitrates
+ * \note The value is rounded to a multiple of the bucket duration (100ms), and capped to 10s
+ * @param[in] window The new window size, in milliseconds */
+void janus_ice_set_stats_window(uint window);
+/*! \brief Method to get the current size of the sliding window used to compute bitrates (see above)
+ * @returns The current window size, in milliseconds */
+uint janus_ice_get_stats_window(void);
+/*! \brief Method to enable or disable batched sending, where the packets to send are
+ * protected in batches and handed to libnice in a single call (sendmmsg)
+ * \note Only available if libnice supports nice_agent_send_messages_nonblocking
+ * @param[in] enabled Whether batched sending should be enabled or not
+ * @returns TRUE if the setting was applied, FALSE if batched sending isn't supported */
+gboolean janus_ice_set_batched_send(gboolean enabled);
+/*! \brief Method to check whether batched sending is enabled
+ * @returns TRUE if batched sending is enabled, FALSE otherwise */
+gboolean janus_ice_is_batched_send_enabled(void);
+/*! \brief Method to enable or disable batched receiving, where the incoming RTP packets of
+ * a PeerConnection received in the same loop iteration are passed to the plugin all at once
+ * \note Only plugins implementing the incoming_rtp_batch callback are affected
+ * @param[in] enabled Whether batched receiving should be enabled or not */
+void janus_ice_set_batched_receive(gboolean enabled);
+/*! \brief Method to check whether batched receiving is enabled
+ * @returns TRUE if batched receiving is enabled, FALSE otherwise */
+gboolean janus_ice_is_batched_receive_enabled(void);
+/*! \brief Method to get a summary of how the pools of outgoing packets are performing
+ * \note Packets up to MTU size are recycled rather than allocated each time: a hit means
+ * a packet could be taken from a pool, a miss that a new one had to be allocated instead
+ * @param[out] hits Number of packets that were taken from a pool
+ * @param[out] misses Number of packets that had to be allocated
+ * @param[out] oversized Number of packets whose payload was too large for the pool buffers
+ * @param[out] available Number of packets currently available in the pools */
+void janus_ice_get_packet_pool_stats(guint64 *hits, guint64 *misses, guint64 *oversized, guint *available);
 /*! \brief Method to modify the event handler statistics period (i.e., the number of seconds that should pass before Janus notifies event handlers about media statistics for a PeerConnection)
  * @param[in] timer The new timer value, in seconds */
 void janus_ice_set_event_stats_period(int period);
@@ -163,7 +214,51 @@ typedef struct janus_ice_stream janus_ice_stream;
 typedef struct janus_ice_component janus_ice_component;
 /*! \brief Helper to handle pending trickle candidates (e.g., when we're still waiting for an offer) */
 typedef struct janus_ice_trickle janus_ice_trickle;
-
+/*! \brief Bounded lock-free queue of outgoing packets (opaque, internal to the ICE stack) */
+typedef struct janus_ice_packet_queue janus_ice_packet_queue;
+/*! \brief Store of sent RTP packets for retransmissions (opaque, internal to the ICE stack) */
+typedef struct janus_ice_nack_ring janus_ice_nack_ring;
+
+/*! \brief What a peer SSRC is used for */
+typedef enum janus_ice_ssrc_type {
+	/*! \brief Audio */
+	JANUS_ICE_SSRC_AUDIO = 1,
+	/*! \brief Video (main or only stream) */
+	JANUS_ICE_SSRC_VIDEO,
+	/*! \brief Video retransmissions */
+	JANUS_ICE_SSRC_VIDEO_RTX,
+	/*! \brief Video simulcast layer (other than the first one) */
+	JANUS_ICE_SSRC_VIDEO_SIM
+} janus_ice_ssrc_type;
+
+/*! \brief Entry in a table of peer SSRCs */
+typedef struct janus_ice_ssrc_entry {
+	/*! \brief The SSRC (0 means the slot is empty) */
+	guint32 ssrc;
+	/*! \brief What the SSRC is used for (janus_ice_ssrc_type) */
+	guint8 type;
+	/*! \brief Simulcast layer, for JANUS_ICE_SSRC_VIDEO_SIM */
+	guint8 layer;
+	/*! \brief Whether this SSRC was added explicitly, rather than taken from the stream fields */
+	guint8 extra;
+} janus_ice_ssrc_entry;
+
+/*! \brief Open addressing table of peer SSRCs, so that packets can be classified with a single probe
+ * \note The table grows as needed, so any number of simulcast/RTX SSRCs can be added */
+typedef struct janus_ice_ssrc_table {
+	/*! \brief Slots (size is always a power of two) */
+	janus_ice_ssrc_entry *entries;
+	/*! \brief Number of slots */
+	guint size;
+	/*! \brief Number of slots in use */
+	guint count;
+} janus_ice_ssrc_table;
+
+
+/*! \brief Maximum number of incoming RTP packets delivered to a plugin in a single batch */
+#define JANUS_ICE_RECV_BATCH_MAX	32
+/*! \brief Number of buckets in the histogram of sizes of the batches sent (powers of two) */
+#define JANUS_ICE_SEND_BATCH_HISTOGRAM	6
 
 #define JANUS_ICE_HANDLE_WEBRTC_PROCESSING_OFFER	(1 << 0)
 #define JANUS_ICE_HANDLE_WEBRTC_START				(1 << 1)
@@ -185,6 +280,25 @@ typedef struct janus_ice_trickle janus_ice_trickle;
 #define JANUS_ICE_HANDLE_WEBRTC_HAS_AGENT			(1 << 17)
 
 
+/*! \brief Duration of each bucket of the sliding window used for bitrate stats, in microseconds */
+#define JANUS_ICE_STATS_BUCKET_DURATION	100000
+/*! \brief Maximum number of buckets in a sliding window (i.e., the window can't be larger than 10s) */
+#define JANUS_ICE_STATS_MAX_BUCKETS	100
+
+/*! \brief Janus media statistics: sliding window of received packets
+ * \note The window is a ring of fixed-duration buckets, so updating it doesn't allocate anything:
+ * it is only updated by the thread receiving media, while other threads just read it */
+typedef struct janus_ice_stats_window {
+	/*! \brief Which period (monotonic time divided by the bucket duration) each bucket refers to */
+	gint64 period[JANUS_ICE_STATS_MAX_BUCKETS];
+	/*! \brief Bytes received in each bucket */
+	guint64 bytes[JANUS_ICE_STATS_MAX_BUCKETS];
+	/*! \brief Packets received in each bucket */
+	guint32 packets[JANUS_ICE_STATS_MAX_BUCKETS];
+	/*! \brief Time at which we last received something */
+	gint64 last_update;
+} janus_ice_stats_window;
+
 /*! \brief Janus media statistics
  * \note To improve with more stuff */
 typedef struct janus_ice_stats {
@@ -192,8 +306,8 @@ typedef struct janus_ice_stats {
 	guint32 audio_packets;
 	/*! \brief Audio bytes sent or received */
 	guint64 audio_bytes;
-	/*! \brief Audio bytes sent or received in the last second */
-	GList *audio_bytes_lastsec;
+	/*! \brief Sliding window of audio bytes sent or received recently */
+	janus_ice_stats_window audio_bytes_lastsec;
 	/*! \brief Whether or not we notified about audio lastsec issues already */
 	gboolean audio_notified_lastsec;
 	/*! \brief Number of audio NACKs sent or received */
@@ -202,8 +316,8 @@ typedef struct janus_ice_stats {
 	guint32 video_packets;
 	/*! \brief Video bytes sent or received */
 	guint64 video_bytes;
-	/*! \brief Video bytes sent or received in the last second */
-	GList *video_bytes_lastsec;
+	/*! \brief Sliding window of video bytes sent or received recently */
+	janus_ice_stats_window video_bytes_lastsec;
 	/*! \brief Whether or not we notified about video lastsec issues already */
 	gboolean video_notified_lastsec;
 	/*! \brief Number of video NACKs sent or received */
@@ -220,19 +334,46 @@ typedef struct janus_ice_stats {
 	guint sl_nack_recent_cnt;
 } janus_ice_stats;
 
-/*! \brief Janus media statistics: received packet info
- * \note To improve with more stuff */
-typedef struct janus_ice_stats_item {
-	/*! \brief Bytes sent or received */
-	guint64 bytes;
-	/*! \brief Time at which this happened */
-	gint64 when;
-} janus_ice_stats_item;
-
 /*! \brief Quick helper method to reset stats
  * @param stats The janus_ice_stats instance to reset */
 void janus_ice_stats_reset(janus_ice_stats *stats);
 
+/*! \brief Quick helper method to account for a new packet in a sliding window
+ * @param window The janus_ice_stats_window instance to update
+ * @param now The current monotonic time
+ * @param bytes The size of the packet */
+void janus_ice_stats_window_update(janus_ice_stats_window *window, gint64 now, guint32 bytes);
+
+/*! \brief Quick helper method to get the bitrate (in bytes per second) of a sliding window
+ * \note The bytes are summed over the configured stats window, and normalized to a second
+ * @param window The janus_ice_stats_window instance to inspect
+ * @param now The current monotonic time
+ * @returns The bytes received per second, on average, in the window */
+guint64 janus_ice_stats_window_get_bytes(janus_ice_stats_window *window, gint64 now);
+
+/*! \brief Helper method to add a peer SSRC to the table of a stream, in addition to those in the stream fields
+ * @param[in] stream The janus_ice_stream instance to update
+ * @param[in] ssrc The SSRC to add
+ * @param[in] type What the SSRC is used for
+ * @param[in] layer The simulcast layer, if this is a JANUS_ICE_SSRC_VIDEO_SIM SSRC */
+void janus_ice_stream_add_peer_ssrc(janus_ice_stream *stream, guint32 ssrc, janus_ice_ssrc_type type, int layer);
+
+/*! \brief Helper method to add the SSRCs that were added explicitly to a stream to another one (e.g., when bundling)
+ * @param[in] stream The janus_ice_stream instance to update
+ * @param[in] from The janus_ice_stream instance to copy the SSRCs from */
+void janus_ice_stream_copy_peer_ssrcs(janus_ice_stream *stream, janus_ice_stream *from);
+
+/*! \brief Helper method to update the table of peer SSRCs of a stream after the SSRC fields have changed
+ * \note SSRCs added with janus_ice_stream_add_peer_ssrc are preserved
+ * @param[in] stream The janus_ice_stream instance to update */
+void janus_ice_stream_update_peer_ssrcs(janus_ice_stream *stream);
+
+/*! \brief Helper method to set the payload types we can expect on a stream, replacing the previous ones
+ * @param[in] stream The janus_ice_stream instance to update
+ * @param[in] video Whether these are video or audio payload types
+ * @param[in] ptypes The list of payload types (as GINT_TO_POINTER) */
+void janus_ice_stream_set_payload_types(janus_ice_stream *stream, int video, GList *ptypes);
+
 /*! \brief Quick helper method to notify a WebRTC hangup through the Janus API
  * @param handle The janus_ice_handle instance this event refers to
  * @param reason A description of why this happened */
@@ -289,6 +430,10 @@ struct janus_ice_handle {
 	GMainLoop *iceloop;
 	/*! \brief GLib thread for libnice */
 	GThread *icethread;
+	/*! \brief Static event loop this handle was assigned to, if any (NULL if it has its own loop) */
+	void *static_event_loop;
+	/*! \brief References held by sources scheduled on the static event loop (the handle isn't freed until they're released) */
+	volatile gint loop_refs;
 	/*! \brief libnice ICE agent */
 	NiceAgent *agent;
 	/*! \brief Monotonic time of when the ICE agent has been created */
@@ -325,12 +470,20 @@ struct janus_ice_handle {
 	gchar *remote_sdp;
 	/*! \brief List of pending trickle candidates (those we received before getting the JSEP offer) */
 	GList *pending_trickles;
-	/*! \brief Queue of outgoing packets to send */
-	GAsyncQueue *queued_packets;
+	/*! \brief Queue of outgoing packets to send (bounded and lock-free) */
+	janus_ice_packet_queue *queued_packets;
 	/*! \brief GLib thread for sending outgoing packets */
 	GThread *send_thread;
-	/*! \brief Atomic flag to make sure we only create the thread once */
+	/*! \brief Atomic flag to make sure we only create the thread (or source) once */
 	volatile gint send_thread_created;
+	/*! \brief GLib source for sending outgoing packets, when a static event loop is used instead of the send thread */
+	GSource *outgoing_source;
+	/*! \brief GLib source delivering batches of incoming RTP packets to the plugin, when batched receiving is enabled */
+	GSource *incoming_batch;
+	/*! \brief Histogram of the sizes of the batches of RTP packets delivered to the plugin (index is size-1) */
+	guint64 recv_batches[JANUS_ICE_RECV_BATCH_MAX];
+	/*! \brief Histogram of the sizes of the batches sent, when batched sending is enabled (1, 2-3, 4-7, ...) */
+	guint64 send_batches[JANUS_ICE_SEND_BATCH_HISTOGRAM];
 	/*! \brief Count of the recent SRTP replay errors, in order to avoid spamming the logs */
 	guint srtp_errors_count;
 	/*! \brief Count of the recent SRTP replay errors, in order to avoid spamming the logs */
@@ -365,10 +518,14 @@ struct janus_ice_stream {
 	guint32 video_ssrc_peer_sim_2;
 	/*! \brief Array of RTP Stream IDs (for Firefox simulcasting, if enabled) */
 	char *rid[3];
-	/*! \brief List of payload types we can expect for audio */
-	GList *audio_payload_types;
-	/*! \brief List of payload types we can expect for video */
-	GList *video_payload_types;
+	/*! \brief Table to map the SSRCs of the peer to what they're used for (including the ones above) */
+	janus_ice_ssrc_table *peer_ssrcs;
+	/*! \brief Tables replaced when the loop of the handle was already gone, freed with the stream */
+	GSList *retired_ssrcs;
+	/*! \brief Bitmap of payload types we can expect for audio (words are accessed atomically) */
+	volatile gint audio_payload_types[4];
+	/*! \brief Bitmap of payload types we can expect for video (words are accessed atomically) */
+	volatile gint video_payload_types[4];
 	/*! \brief RTP payload type of this stream */
 	gint payload_type;
 	/*! \brief RTCP context for the audio stream (may be bundled) */
@@ -405,7 +562,7 @@ struct janus_ice_stream {
 	janus_ice_component *rtcp_component;
 	/*! \brief Helper flag to avoid flooding the console with the same error all over again */
 	gboolean noerrorlog;
-	/*! \brief Mutex to lock/unlock this stream */
+	/*! \brief Mutex to lock/unlock this stream (also protects the table of peer SSRCs and the payload types bitmaps) */
 	janus_mutex mutex;
 };
 
@@ -444,8 +601,10 @@ struct janus_ice_component {
 	gboolean do_audio_nacks;
 	/*! \brief Whether we should do NACKs (in or out) for video */
 	gboolean do_video_nacks;
-	/*! \brief List of previously sent janus_rtp_packet RTP packets, in case we receive NACKs */
-	GList *retransmit_buffer;
+	/*! \brief Ring of previously sent audio RTP packets, indexed by sequence number, in case we receive NACKs */
+	janus_ice_nack_ring *audio_retransmit_buffer;
+	/*! \brief Ring of previously sent video RTP packets, indexed by sequence number, in case we receive NACKs */
+	janus_ice_nack_ring *video_retransmit_buffer;
 	/*! \brief Last time a log message about sending retransmits was printed */
 	gint64 retransmit_log_ts;
 	/*! \brief Number of retransmitted packets since last log message */
@@ -529,6 +688,12 @@ gint janus_ice_handle_destroy(void *gateway_session, guint64 handle_id);
 /*! \brief Method to actually free the resources allocated by a Janus ICE handle
  * @param[in] handle The Janus ICE handle instance to free */
 void janus_ice_free(janus_ice_handle *handle);
+/*! \brief Method to get the state of the outgoing queue of a handle
+ * @param[in] handle The Janus ICE handle instance
+ * @param[out] queued Number of packets currently waiting to be sent
+ * @param[out] dropped_oldest Number of queued packets dropped to make room for new video packets
+ * @param[out] dropped_newest Number of packets dropped because the queue was full */
+void janus_ice_handle_get_queue_stats(janus_ice_handle *handle, guint *queued, guint *dropped_oldest, guint *dropped_newest);
 /*! \brief Method to only hangup (e.g., DTLS alert) the WebRTC PeerConnection allocated by a Janus ICE handle
  * @param[in] handle The Janus ICE handle instance managing the WebRTC PeerConnection to hangup
  * @param[in] reason A description of why this happened */
@@ -556,6 +721,14 @@ void janus_ice_component_free(GHashTable *container, janus_ice_component *compon
  * @param[in] buf The packet data (buffer)
  * @param[in] len The buffer lenght */
 void janus_ice_relay_rtp(janus_ice_handle *handle, int video, char *buf, int len);
+/*! \brief Gateway RTP callback, called when a plugin has a shared RTP packet to send to a peer
+ * \note The payload is not copied: the packet is referenced until it has been sent,
+ * and the overlay is applied to the header right before encrypting it
+ * @param[in] handle The Janus ICE handle associated with the peer
+ * @param[in] video Whether this is an audio or a video frame
+ * @param[in] packet The shared packet to send
+ * @param[in] overlay The header changes to apply for this peer, if any */
+void janus_ice_relay_rtp_shared(janus_ice_handle *handle, int video, janus_plugin_rtp_shared *packet, janus_plugin_rtp_overlay *overlay);
 /*! \brief Gateway RTCP callback, called when a plugin has an RTCP message to send to a peer
  * @param[in] handle The Janus ICE handle associated with the peer
  * @param[in] video Whether this is related to an audio or a video stream
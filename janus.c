@@ -36,6 +36,7 @@
 #include "rtcp.h"
 #include "auth.h"
 #include "record.h"
+#include "pacer.h"
 #include "events.h"
 
 
@@ -376,6 +377,7 @@ void janus_transport_task(gpointer data, gpointer user_data);
 int janus_plugin_push_event(janus_plugin_session *plugin_session, janus_plugin *plugin, const char *transaction, json_t *message, json_t *jsep);
 json_t *janus_plugin_handle_sdp(janus_plugin_session *plugin_session, janus_plugin *plugin, const char *sdp_type, const char *sdp);
 void janus_plugin_relay_rtp(janus_plugin_session *plugin_session, int video, char *buf, int len);
+void janus_plugin_relay_rtp_shared(janus_plugin_session *plugin_session, int video, janus_plugin_rtp_shared *packet, janus_plugin_rtp_overlay *overlay);
 void janus_plugin_relay_rtcp(janus_plugin_session *plugin_session, int video, char *buf, int len);
 void janus_plugin_relay_data(janus_plugin_session *plugin_session, char *buf, int len);
 void janus_plugin_close_pc(janus_plugin_session *plugin_session);
@@ -391,6 +393,10 @@ static janus_callbacks janus_handler_plugin =
 		.end_session = janus_plugin_end_session,
 		.events_is_enabled = janus_events_is_enabled,
 		.notify_event = janus_plugin_notify_event,
+		.rtp_shared_new = janus_plugin_rtp_shared_new,
+		.rtp_shared_ref = janus_plugin_rtp_shared_ref,
+		.rtp_shared_unref = janus_plugin_rtp_shared_unref,
+		.relay_rtp_shared = janus_plugin_relay_rtp_shared,
 	}; 
 ///@}
 
@@ -1137,16 +1143,19 @@ int janus_process_incoming_request(janus_request *request) {
 								handle->audio_stream->video_ssrc_peer_rtx = handle->video_stream->video_ssrc_peer_rtx;
 								handle->audio_stream->video_ssrc_peer_sim_1 = handle->video_stream->video_ssrc_peer_sim_1;
 								handle->audio_stream->video_ssrc_peer_sim_2 = handle->video_stream->video_ssrc_peer_sim_2;
-								nice_agent_attach_recv(handle->agent, handle->video_stream->stream_id, 1, g_main_loop_get_context (handle->iceloop), NULL, NULL);
+								/* Any additional video SSRC we may have been told about is now on the audio stream too */
+								janus_ice_stream_copy_peer_ssrcs(handle->audio_stream, handle->video_stream);
+								janus_ice_stream_update_peer_ssrcs(handle->audio_stream);
+								nice_agent_attach_recv(handle->agent, handle->video_stream->stream_id, 1, handle->icectx, NULL, NULL);
 								if(!handle->force_rtcp_mux && !janus_ice_is_rtcpmux_forced())
-									nice_agent_attach_recv(handle->agent, handle->video_stream->stream_id, 2, g_main_loop_get_context (handle->iceloop), NULL, NULL);
+									nice_agent_attach_recv(handle->agent, handle->video_stream->stream_id, 2, handle->icectx, NULL, NULL);
 								nice_agent_remove_stream(handle->agent, handle->video_stream->stream_id);
 								janus_ice_stream_free(handle->streams, handle->video_stream);
 							}
 							handle->video_stream = NULL;
 							handle->video_id = 0;
 							if(handle->streams && handle->data_stream) {
-								nice_agent_attach_recv(handle->agent, handle->data_stream->stream_id, 1, g_main_loop_get_context (handle->iceloop), NULL, NULL);
+								nice_agent_attach_recv(handle->agent, handle->data_stream->stream_id, 1, handle->icectx, NULL, NULL);
 								nice_agent_remove_stream(handle->agent, handle->data_stream->stream_id);
 								janus_ice_stream_free(handle->streams, handle->data_stream);
 							}
@@ -1155,13 +1164,14 @@ int janus_process_incoming_request(janus_request *request) {
 							if(!video) {
 								handle->audio_stream->video_ssrc = 0;
 								handle->audio_stream->video_ssrc_peer = 0;
+								janus_ice_stream_update_peer_ssrcs(handle->audio_stream);
 								g_free(handle->audio_stream->video_rtcp_ctx);
 								handle->audio_stream->video_rtcp_ctx = NULL;
 							}
 						} else if(video) {
 							/* Get rid of data, if present */
 							if(handle->streams && handle->data_stream) {
-								nice_agent_attach_recv(handle->agent, handle->data_stream->stream_id, 1, g_main_loop_get_context (handle->iceloop), NULL, NULL);
+								nice_agent_attach_recv(handle->agent, handle->data_stream->stream_id, 1, handle->icectx, NULL, NULL);
 								nice_agent_remove_stream(handle->agent, handle->data_stream->stream_id);
 								janus_ice_stream_free(handle->streams, handle->data_stream);
 							}
@@ -1172,7 +1182,7 @@ int janus_process_incoming_request(janus_request *request) {
 					if(janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX) && !handle->force_rtcp_mux && !janus_ice_is_rtcpmux_forced()) {
 						JANUS_LOG(LOG_HUGE, "[%"SCNu64"]   -- rtcp-mux is supported by the browser, getting rid of RTCP components, if any...\n", handle->handle_id);
 						if(handle->audio_stream && handle->audio_stream->components != NULL) {
-							nice_agent_attach_recv(handle->agent, handle->audio_id, 2, g_main_loop_get_context (handle->iceloop), NULL, NULL);
+							nice_agent_attach_recv(handle->agent, handle->audio_id, 2, handle->icectx, NULL, NULL);
 							/* Free the component */
 							janus_ice_component_free(handle->audio_stream->components, handle->audio_stream->rtcp_component);
 							handle->audio_stream->rtcp_component = NULL;
@@ -1195,7 +1205,7 @@ int janus_process_incoming_request(janus_request *request) {
 							}
 						}
 						if(handle->video_stream && handle->video_stream->components != NULL) {
-							nice_agent_attach_recv(handle->agent, handle->video_id, 2, g_main_loop_get_context (handle->iceloop), NULL, NULL);
+							nice_agent_attach_recv(handle->agent, handle->video_id, 2, handle->icectx, NULL, NULL);
 							/* Free the component */
 							janus_ice_component_free(handle->video_stream->components, handle->video_stream->rtcp_component);
 							handle->video_stream->rtcp_component = NULL;
@@ -1607,6 +1617,20 @@ int janus_process_incoming_admin_request(janus_request *request) {
 			json_object_set_new(status, "libnice_debug", janus_ice_is_ice_debugging_enabled() ? json_true() : json_false());
 			json_object_set_new(status, "max_nack_queue", json_integer(janus_get_max_nack_queue()));
 			json_object_set_new(status, "no_media_timer", json_integer(janus_get_no_media_timer()));
+			json_object_set_new(status, "outgoing_queue_size", json_integer(janus_ice_get_outgoing_queue_size()));
+			json_object_set_new(status, "batched_send", janus_ice_is_batched_send_enabled() ? json_true() : json_false());
+			json_object_set_new(status, "batched_receive", janus_ice_is_batched_receive_enabled() ? json_true() : json_false());
+			json_object_set_new(status, "stats_window", json_integer(janus_ice_get_stats_window()));
+			json_object_set_new(status, "static_event_loops", json_integer(janus_ice_get_static_event_loops()));
+			guint64 pool_hits = 0, pool_misses = 0, pool_oversized = 0;
+			guint pool_available = 0;
+			janus_ice_get_packet_pool_stats(&pool_hits, &pool_misses, &pool_oversized, &pool_available);
+			json_t *pool = json_object();
+			json_object_set_new(pool, "hits", json_integer(pool_hits));
+			json_object_set_new(pool, "misses", json_integer(pool_misses));
+			json_object_set_new(pool, "oversized", json_integer(pool_oversized));
+			json_object_set_new(pool, "available", json_integer(pool_available));
+			json_object_set_new(status, "packet_pool", pool);
 			json_object_set_new(reply, "status", status);
 			/* Send the success reply */
 			ret = janus_process_success(request, reply);
@@ -2281,8 +2305,41 @@ int janus_process_incoming_admin_request(janus_request *request) {
 		json_object_set_new(info, "sdps", sdps);
 		if(handle->pending_trickles)
 			json_object_set_new(info, "pending-trickles", json_integer(g_list_length(handle->pending_trickles)));
-		if(handle->queued_packets)
-			json_object_set_new(info, "queued-packets", json_integer(g_async_queue_length(handle->queued_packets)));
+		if(handle->queued_packets) {
+			guint queued = 0, dropped_oldest = 0, dropped_newest = 0;
+			janus_ice_handle_get_queue_stats(handle, &queued, &dropped_oldest, &dropped_newest);
+			json_object_set_new(info, "queued-packets", json_integer(queued));
+			json_object_set_new(info, "queue-dropped-oldest", json_integer(dropped_oldest));
+			json_object_set_new(info, "queue-dropped-newest", json_integer(dropped_newest));
+		}
+		if(handle->incoming_batch != NULL) {
+			/* How many RTP packets the plugin got at a time so far */
+			json_t *batches = json_object();
+			int i = 0;
+			for(i=0; i<JANUS_ICE_RECV_BATCH_MAX; i++) {
+				if(handle->recv_batches[i] == 0)
+					continue;
+				char label[20];
+				g_snprintf(label, sizeof(label), "%d", i+1);
+				json_object_set_new(batches, label, json_integer(handle->recv_batches[i]));
+			}
+			json_object_set_new(info, "recv-batches", batches);
+		}
+		if(janus_ice_is_batched_send_enabled()) {
+			/* Histogram of the sizes of the batches we sent so far */
+			json_t *batches = json_object();
+			int i = 0;
+			for(i=0; i<JANUS_ICE_SEND_BATCH_HISTOGRAM; i++) {
+				char label[20];
+				int from = 1 << i, to = (1 << (i+1)) - 1;
+				if(from == to || i == JANUS_ICE_SEND_BATCH_HISTOGRAM-1)
+					g_snprintf(label, sizeof(label), "%d", from);
+				else
+					g_snprintf(label, sizeof(label), "%d-%d", from, to);
+				json_object_set_new(batches, label, json_integer(handle->send_batches[i]));
+			}
+			json_object_set_new(info, "send-batches", batches);
+		}
 		json_t *streams = json_array();
 		if(handle->audio_stream) {
 			json_t *s = janus_admin_stream_summary(handle->audio_stream);
@@ -2500,17 +2557,7 @@ json_t *janus_admin_component_summary(janus_ice_component *component) {
 			json_object_set_new(in_stats, "audio_bytes", json_integer(component->in_stats.audio_bytes));
 			json_object_set_new(in_stats, "audio_nacks", json_integer(component->in_stats.audio_nacks));
 			/* Compute the last second stuff too */
-			gint64 now = janus_get_monotonic_time();
-			guint64 bytes = 0;
-			if(component->in_stats.audio_bytes_lastsec) {
-				GList *lastsec = component->in_stats.audio_bytes_lastsec;
-				while(lastsec) {
-					janus_ice_stats_item *s = (janus_ice_stats_item *)lastsec->data;
-					if(s && now-s->when < G_USEC_PER_SEC)
-						bytes += s->bytes;
-					lastsec = lastsec->next;
-				}
-			}
+			guint64 bytes = janus_ice_stats_window_get_bytes(&component->in_stats.audio_bytes_lastsec, janus_get_monotonic_time());
 			json_object_set_new(in_stats, "audio_bytes_lastsec", json_integer(bytes));
 		}
 		if(handle && janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_HAS_VIDEO)) {
@@ -2518,17 +2565,7 @@ json_t *janus_admin_component_summary(janus_ice_component *component) {
 			json_object_set_new(in_stats, "video_bytes", json_integer(component->in_stats.video_bytes));
 			json_object_set_new(in_stats, "video_nacks", json_integer(component->in_stats.video_nacks));
 			/* Compute the last second stuff too */
-			gint64 now = janus_get_monotonic_time();
-			guint64 bytes = 0;
-			if(component->in_stats.video_bytes_lastsec) {
-				GList *lastsec = component->in_stats.video_bytes_lastsec;
-				while(lastsec) {
-					janus_ice_stats_item *s = (janus_ice_stats_item *)lastsec->data;
-					if(s && now-s->when < G_USEC_PER_SEC)
-						bytes += s->bytes;
-					lastsec = lastsec->next;
-				}
-			}
+			guint64 bytes = janus_ice_stats_window_get_bytes(&component->in_stats.video_bytes_lastsec, janus_get_monotonic_time());
 			json_object_set_new(in_stats, "video_bytes_lastsec", json_integer(bytes));
 		}
 		json_object_set_new(in_stats, "data_packets", json_integer(component->in_stats.data_packets));
@@ -2937,16 +2974,19 @@ json_t *janus_plugin_handle_sdp(janus_plugin_session *plugin_session, janus_plug
 						ice_handle->audio_stream->video_ssrc_peer_rtx = ice_handle->video_stream->video_ssrc_peer_rtx;
 						ice_handle->audio_stream->video_ssrc_peer_sim_1 = ice_handle->video_stream->video_ssrc_peer_sim_1;
 						ice_handle->audio_stream->video_ssrc_peer_sim_2 = ice_handle->video_stream->video_ssrc_peer_sim_2;
-						nice_agent_attach_recv(ice_handle->agent, ice_handle->video_stream->stream_id, 1, g_main_loop_get_context (ice_handle->iceloop), NULL, NULL);
+						/* Any additional video SSRC we may have been told about is now on the audio stream too */
+						janus_ice_stream_copy_peer_ssrcs(ice_handle->audio_stream, ice_handle->video_stream);
+						janus_ice_stream_update_peer_ssrcs(ice_handle->audio_stream);
+						nice_agent_attach_recv(ice_handle->agent, ice_handle->video_stream->stream_id, 1, ice_handle->icectx, NULL, NULL);
 						if(!ice_handle->force_rtcp_mux && !janus_ice_is_rtcpmux_forced())
-							nice_agent_attach_recv(ice_handle->agent, ice_handle->video_stream->stream_id, 2, g_main_loop_get_context (ice_handle->iceloop), NULL, NULL);
+							nice_agent_attach_recv(ice_handle->agent, ice_handle->video_stream->stream_id, 2, ice_handle->icectx, NULL, NULL);
 						nice_agent_remove_stream(ice_handle->agent, ice_handle->video_stream->stream_id);
 						janus_ice_stream_free(ice_handle->streams, ice_handle->video_stream);
 					}
 					ice_handle->video_stream = NULL;
 					ice_handle->video_id = 0;
 					if(ice_handle->streams && ice_handle->data_stream) {
-						nice_agent_attach_recv(ice_handle->agent, ice_handle->data_stream->stream_id, 1, g_main_loop_get_context (ice_handle->iceloop), NULL, NULL);
+						nice_agent_attach_recv(ice_handle->agent, ice_handle->data_stream->stream_id, 1, ice_handle->icectx, NULL, NULL);
 						nice_agent_remove_stream(ice_handle->agent, ice_handle->data_stream->stream_id);
 						janus_ice_stream_free(ice_handle->streams, ice_handle->data_stream);
 					}
@@ -2955,13 +2995,14 @@ json_t *janus_plugin_handle_sdp(janus_plugin_session *plugin_session, janus_plug
 					if(!video) {
 						ice_handle->audio_stream->video_ssrc = 0;
 						ice_handle->audio_stream->video_ssrc_peer = 0;
+						janus_ice_stream_update_peer_ssrcs(ice_handle->audio_stream);
 						g_free(ice_handle->audio_stream->video_rtcp_ctx);
 						ice_handle->audio_stream->video_rtcp_ctx = NULL;
 					}
 				} else if(video) {
 					/* Get rid of data, if present */
 					if(ice_handle->streams && ice_handle->data_stream) {
-						nice_agent_attach_recv(ice_handle->agent, ice_handle->data_stream->stream_id, 1, g_main_loop_get_context (ice_handle->iceloop), NULL, NULL);
+						nice_agent_attach_recv(ice_handle->agent, ice_handle->data_stream->stream_id, 1, ice_handle->icectx, NULL, NULL);
 						nice_agent_remove_stream(ice_handle->agent, ice_handle->data_stream->stream_id);
 						janus_ice_stream_free(ice_handle->streams, ice_handle->data_stream);
 					}
@@ -2972,7 +3013,7 @@ json_t *janus_plugin_handle_sdp(janus_plugin_session *plugin_session, janus_plug
 			if(janus_flags_is_set(&ice_handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_RTCPMUX) && !ice_handle->force_rtcp_mux && !janus_ice_is_rtcpmux_forced()) {
 				JANUS_LOG(LOG_VERB, "[%"SCNu64"]   -- rtcp-mux is supported by the browser, getting rid of RTCP components, if any...\n", ice_handle->handle_id);
 				if(ice_handle->audio_stream && ice_handle->audio_stream->rtcp_component && ice_handle->audio_stream->components != NULL) {
-					nice_agent_attach_recv(ice_handle->agent, ice_handle->audio_id, 2, g_main_loop_get_context (ice_handle->iceloop), NULL, NULL);
+					nice_agent_attach_recv(ice_handle->agent, ice_handle->audio_id, 2, ice_handle->icectx, NULL, NULL);
 					/* Free the component */
 					janus_ice_component_free(ice_handle->audio_stream->components, ice_handle->audio_stream->rtcp_component);
 					ice_handle->audio_stream->rtcp_component = NULL;
@@ -2995,7 +3036,7 @@ json_t *janus_plugin_handle_sdp(janus_plugin_session *plugin_session, janus_plug
 					}
 				}
 				if(ice_handle->video_stream && ice_handle->video_stream->rtcp_component && ice_handle->video_stream->components != NULL) {
-					nice_agent_attach_recv(ice_handle->agent, ice_handle->video_id, 2, g_main_loop_get_context (ice_handle->iceloop), NULL, NULL);
+					nice_agent_attach_recv(ice_handle->agent, ice_handle->video_id, 2, ice_handle->icectx, NULL, NULL);
 					/* Free the component */
 					janus_ice_component_free(ice_handle->video_stream->components, ice_handle->video_stream->rtcp_component);
 					ice_handle->video_stream->rtcp_component = NULL;
@@ -3110,6 +3151,16 @@ void janus_plugin_relay_rtp(janus_plugin_session *plugin_session, int video, cha
 	janus_ice_relay_rtp(handle, video, buf, len);
 }
 
+void janus_plugin_relay_rtp_shared(janus_plugin_session *plugin_session, int video, janus_plugin_rtp_shared *packet, janus_plugin_rtp_overlay *overlay) {
+	if((plugin_session < (janus_plugin_session *)0x1000) || plugin_session->stopped || packet == NULL || packet->length < 1)
+		return;
+	janus_ice_handle *handle = (janus_ice_handle *)plugin_session->gateway_handle;
+	if(!handle || janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_STOP)
+			|| janus_flags_is_set(&handle->webrtc_flags, JANUS_ICE_HANDLE_WEBRTC_ALERT))
+		return;
+	janus_ice_relay_rtp_shared(handle, video, packet, overlay);
+}
+
 void janus_plugin_relay_rtcp(janus_plugin_session *plugin_session, int video, char *buf, int len) {
 	if((plugin_session < (janus_plugin_session *)0x1000) || plugin_session->stopped || buf == NULL || len < 1)
 		return;
@@ -3625,6 +3676,37 @@ gint main(int argc, char *argv[])
 	janus_auth_init(item && item->value && janus_is_true(item->value));
 
 	/* Initialize the recorder code */
+	int rec_threads = 0;
+	item = janus_config_get_item_drilldown(config, "general", "recordings_io_threads");
+	if(item && item->value) {
+		rec_threads = atoi(item->value);
+		if(rec_threads < 1) {
+			JANUS_LOG(LOG_WARN, "Ignoring recordings_io_threads value as it's not a positive integer\n");
+			rec_threads = 0;
+		}
+	}
+	size_t rec_budget = 0;
+	item = janus_config_get_item_drilldown(config, "general", "recordings_buffer");
+	if(item && item->value) {
+		int mb = atoi(item->value);
+		if(mb < 1) {
+			JANUS_LOG(LOG_WARN, "Ignoring recordings_buffer value as it's not a positive integer\n");
+		} else {
+			rec_budget = (size_t)mb*1024*1024;
+		}
+	}
+	janus_recorder_overflow rec_overflow = JANUS_RECORDER_OVERFLOW_DROP;
+	item = janus_config_get_item_drilldown(config, "general", "recordings_overflow");
+	if(item && item->value) {
+		if(!strcasecmp(item->value, "wait")) {
+			rec_overflow = JANUS_RECORDER_OVERFLOW_WAIT;
+		} else if(strcasecmp(item->value, "drop")) {
+			JANUS_LOG(LOG_WARN, "Unsupported recordings_overflow value '%s', dropping frames when needed\n", item->value);
+		}
+	}
+	janus_recorder_set_io(rec_threads, rec_budget, rec_overflow);
+	item = janus_config_get_item_drilldown(config, "general", "recordings_index");
+	janus_recorder_set_index(item && item->value && janus_is_true(item->value));
 	item = janus_config_get_item_drilldown(config, "general", "recordings_tmp_ext");
 	if(item && item->value) {
 		janus_recorder_init(TRUE, item->value);
@@ -3632,6 +3714,21 @@ gint main(int argc, char *argv[])
 		janus_recorder_init(FALSE, NULL);
 	}
 
+	/* Start the pacing engine plugins can use to send pre-recorded media */
+	int pacer_threads = 0;
+	item = janus_config_get_item_drilldown(config, "general", "pacer_threads");
+	if(item && item->value) {
+		pacer_threads = atoi(item->value);
+		if(pacer_threads < 1) {
+			JANUS_LOG(LOG_WARN, "Ignoring pacer_threads value as it's not a positive integer\n");
+			pacer_threads = 0;
+		}
+	}
+	if(janus_pacer_init(pacer_threads) < 0) {
+		JANUS_LOG(LOG_FATAL, "Error initializing the pacing engine\n");
+		exit(1);
+	}
+
 	/* Setup ICE stuff (e.g., checking if the provided STUN server is correct) */
 	char *stun_server = NULL, *turn_server = NULL;
 	uint16_t stun_port = 0, turn_port = 0;
@@ -3721,6 +3818,16 @@ gint main(int argc, char *argv[])
 #endif
 	/* Initialize the ICE stack now */
 	janus_ice_init(ice_lite, ice_tcp, ipv6, rtp_min_port, rtp_max_port);
+	/* Check if we should use static event loops rather than a thread per handle */
+	item = janus_config_get_item_drilldown(config, "general", "event_loops");
+	if(item && item->value) {
+		int loops = atoi(item->value);
+		if(loops < 0) {
+			JANUS_LOG(LOG_WARN, "Ignoring event_loops value as it's not a positive integer\n");
+		} else {
+			janus_ice_set_static_event_loops(loops);
+		}
+	}
 	if(janus_ice_set_stun_server(stun_server, stun_port) < 0) {
 		JANUS_LOG(LOG_FATAL, "Invalid STUN address %s:%u\n", stun_server, stun_port);
 		exit(1);
@@ -3782,6 +3889,14 @@ gint main(int argc, char *argv[])
 	item = janus_config_get_item_drilldown(config, "media", "force-rtcp-mux");
 	force_rtcpmux = (item && item->value) ? janus_is_true(item->value) : FALSE;
 	janus_ice_force_rtcpmux(force_rtcpmux);
+	/* Batched sending */
+	item = janus_config_get_item_drilldown(config, "media", "batched_send");
+	if(item && item->value && janus_is_true(item->value))
+		janus_ice_set_batched_send(TRUE);
+	/* Batched receiving */
+	item = janus_config_get_item_drilldown(config, "media", "batched_receive");
+	if(item && item->value && janus_is_true(item->value))
+		janus_ice_set_batched_receive(TRUE);
 	/* NACK related stuff */
 	item = janus_config_get_item_drilldown(config, "media", "max_nack_queue");
 	if(item && item->value) {
@@ -3794,6 +3909,26 @@ gint main(int argc, char *argv[])
 			janus_set_max_nack_queue(mnq);
 		}
 	}
+	/* Size of the outgoing queue of each handle */
+	item = janus_config_get_item_drilldown(config, "media", "outgoing_queue_size");
+	if(item && item->value) {
+		int oqs = atoi(item->value);
+		if(oqs <= 0) {
+			JANUS_LOG(LOG_WARN, "Ignoring outgoing_queue_size value as it's not a positive integer\n");
+		} else {
+			janus_ice_set_outgoing_queue_size(oqs);
+		}
+	}
+	/* Size of the window used to compute bitrates */
+	item = janus_config_get_item_drilldown(config, "media", "stats_window");
+	if(item && item->value) {
+		int sw = atoi(item->value);
+		if(sw <= 0) {
+			JANUS_LOG(LOG_WARN, "Ignoring stats_window value as it's not a positive integer\n");
+		} else {
+			janus_ice_set_stats_window(sw);
+		}
+	}
 	/* no-media timer */
 	item = janus_config_get_item_drilldown(config, "media", "no_media_timer");
 	if(item && item->value) {
@@ -4345,6 +4480,7 @@ gint main(int argc, char *argv[])
 		g_hash_table_destroy(eventhandlers_so);
 	}
 
+	janus_pacer_deinit();
 	janus_recorder_deinit();
 	g_free(local_ip);
 
@@ -0,0 +1,320 @@
+/*! \file    jitter.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU General Public License v3
+ * \brief    Audio jitter buffer
+ * \details  Implementation of a jitter buffer for decoded audio that
+ * plugins can make use of when they need to play out frames received via
+ * RTP at a steady pace (e.g., to mix them). Frames are stored in a
+ * fixed-size ring indexed by RTP sequence number, whose PCM slots are
+ * preallocated, so that decoders can write directly into them and no
+ * memory is allocated per frame. The buffer tracks the interarrival
+ * jitter (RFC 3550) and adapts how many frames it keeps queued to it,
+ * within configurable bounds. Gaps are filled by a codec-specific
+ * concealment callback, invoked only when a missing frame is due, which
+ * can either recover it from a later packet (e.g., via Opus in-band FEC)
+ * or conceal it (e.g., Opus PLC): the janus_jitter_buffer_missing()
+ * helper can be used to find out if an incoming packet may be needed
+ * to recover a lost frame before the frame is due.
+ * \note The jitter buffer does no locking of its own: if it's fed and
+ * read by different threads, access must be protected by the caller.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <string.h>
+
+#include "jitter.h"
+#include "utils.h"
+
+/* Sequence number jumps that make us treat packets as a new stream */
+#define JANUS_JITTER_BUFFER_RESYNC		1000
+/* Frames we conceal when the buffer runs empty, before buffering again */
+#define JANUS_JITTER_BUFFER_MAX_CONCEAL	3
+/* Frames we need to receive before trusting the jitter estimation */
+#define JANUS_JITTER_BUFFER_WARMUP		50
+/* Frames that must be played with too many frames queued before we drop one */
+#define JANUS_JITTER_BUFFER_SHRINK		50
+
+struct janus_jitter_buffer {
+	int slots;						/* Number of frames in the ring */
+	int max_samples;				/* Maximum number of samples in a frame */
+	int clock_rate;					/* RTP clock rate */
+	int ptime;						/* Duration of a frame (us) */
+	int min_depth, max_depth;		/* Bounds of the target depth */
+	int target;						/* Frames we try to keep queued */
+	janus_jitter_buffer_frame *ring;	/* Ring of frames, indexed by sequence number */
+	int16_t *pcm;					/* Preallocated samples for the ring */
+	janus_jitter_buffer_frame out;	/* Frame returned to the application */
+	gboolean started;				/* Whether we received any frame yet */
+	gboolean buffering;				/* Whether we're waiting for enough frames to be queued */
+	uint16_t next_seq;				/* Sequence number of the next frame to play */
+	uint16_t last_seq;				/* Highest sequence number received so far */
+	int last_count;					/* Number of samples in the last frame received */
+	gint64 last_arrival;			/* When the last (in order) frame was received */
+	uint32_t last_ts;				/* RTP timestamp of the last (in order) frame */
+	gint64 jitter;					/* Interarrival jitter, in 1/16 microseconds */
+	int estimates;					/* Frames used for the jitter estimation so far */
+	int conceal_row;				/* Frames concealed in a row since the buffer ran empty */
+	int shrink_count;				/* Frames played in a row with too many frames queued */
+	janus_jitter_buffer_stats stats;	/* Counters */
+};
+
+
+static int janus_jitter_buffer_depth(janus_jitter_buffer *jb) {
+	if(!jb->started)
+		return 0;
+	int depth = (int16_t)(jb->last_seq - jb->next_seq) + 1;
+	return depth > 0 ? depth : 0;
+}
+
+static gboolean janus_jitter_buffer_has(janus_jitter_buffer *jb, uint16_t seq) {
+	janus_jitter_buffer_frame *frame = &jb->ring[seq % jb->slots];
+	return frame->count > 0 && frame->seq == seq;
+}
+
+/* Whether we ran empty and are buffering again, in which case we can resume from any frame */
+static gboolean janus_jitter_buffer_restartable(janus_jitter_buffer *jb) {
+	return jb->buffering && janus_jitter_buffer_depth(jb) == 0;
+}
+
+/* Skip the next frame to play, whether we have it or not */
+static void janus_jitter_buffer_skip(janus_jitter_buffer *jb) {
+	janus_jitter_buffer_frame *frame = &jb->ring[jb->next_seq % jb->slots];
+	if(frame->count > 0 && frame->seq == jb->next_seq) {
+		frame->count = 0;
+		jb->stats.dropped++;
+	}
+	jb->next_seq++;
+}
+
+janus_jitter_buffer *janus_jitter_buffer_create(int slots, int max_samples, int clock_rate, int ptime, int min_depth, int max_depth) {
+	/* The number of slots must be a power of two, or the ring index would break when sequence numbers wrap */
+	if(slots < 2 || (slots & (slots-1)) != 0 || max_samples < 1 || clock_rate < 1 || ptime < 1 ||
+			min_depth < 1 || max_depth < min_depth || max_depth >= slots)
+		return NULL;
+	janus_jitter_buffer *jb = g_malloc0(sizeof(janus_jitter_buffer));
+	jb->slots = slots;
+	jb->max_samples = max_samples;
+	jb->clock_rate = clock_rate;
+	jb->ptime = ptime*1000;
+	jb->min_depth = min_depth;
+	jb->max_depth = max_depth;
+	jb->ring = g_malloc0(slots * sizeof(janus_jitter_buffer_frame));
+	jb->pcm = g_malloc0((slots+1) * max_samples * sizeof(int16_t));
+	int i = 0;
+	for(i=0; i<slots; i++)
+		jb->ring[i].samples = jb->pcm + i*max_samples;
+	jb->out.samples = jb->pcm + slots*max_samples;
+	janus_jitter_buffer_reset(jb);
+	return jb;
+}
+
+void janus_jitter_buffer_destroy(janus_jitter_buffer *jb) {
+	if(!jb)
+		return;
+	g_free(jb->ring);
+	g_free(jb->pcm);
+	g_free(jb);
+}
+
+void janus_jitter_buffer_reset(janus_jitter_buffer *jb) {
+	if(!jb)
+		return;
+	int i = 0;
+	for(i=0; i<jb->slots; i++)
+		jb->ring[i].count = 0;
+	jb->started = FALSE;
+	jb->buffering = TRUE;
+	/* Until we know better, aim for somewhere in the middle */
+	jb->target = jb->min_depth + (jb->max_depth - jb->min_depth)/2;
+	jb->next_seq = 0;
+	jb->last_seq = 0;
+	jb->last_count = 0;
+	jb->last_arrival = 0;
+	jb->last_ts = 0;
+	jb->jitter = 0;
+	jb->estimates = 0;
+	jb->conceal_row = 0;
+	jb->shrink_count = 0;
+}
+
+int16_t *janus_jitter_buffer_slot(janus_jitter_buffer *jb, uint16_t seq) {
+	if(!jb)
+		return NULL;
+	janus_jitter_buffer_frame *frame = &jb->ring[seq % jb->slots];
+	if(jb->started) {
+		int16_t diff = seq - jb->next_seq;
+		if(diff < 0 && diff > -JANUS_JITTER_BUFFER_RESYNC && !janus_jitter_buffer_restartable(jb)) {
+			/* Too late, we already played (or concealed) this one */
+			jb->stats.late++;
+			return NULL;
+		}
+		if(frame->count > 0 && frame->seq == seq) {
+			/* Duplicate */
+			return NULL;
+		}
+		if(frame->count > 0) {
+			/* This slot still contains an older frame, which is going to be overwritten */
+			frame->count = 0;
+			jb->stats.dropped++;
+		}
+	}
+	return frame->samples;
+}
+
+void janus_jitter_buffer_commit(janus_jitter_buffer *jb, uint16_t seq, uint32_t timestamp, int count, int level, gboolean recovered) {
+	if(!jb || count < 1)
+		return;
+	if(count > jb->max_samples)
+		count = jb->max_samples;
+	gint64 now = janus_get_monotonic_time();
+	int16_t diff = seq - jb->next_seq;
+	if(!jb->started || diff >= JANUS_JITTER_BUFFER_RESYNC || diff <= -JANUS_JITTER_BUFFER_RESYNC) {
+		/* First frame, or a new stream: start from here */
+		if(jb->started)
+			janus_jitter_buffer_reset(jb);
+		jb->started = TRUE;
+		jb->next_seq = seq;
+		jb->last_seq = seq;
+	} else if(diff < 0) {
+		if(!janus_jitter_buffer_restartable(jb)) {
+			jb->stats.late++;
+			return;
+		}
+		/* We ran empty and concealed frames we're getting only now: resume from here */
+		jb->next_seq = seq;
+		jb->last_seq = seq;
+	}
+	/* If the ring is not large enough for this frame, drop the older ones */
+	while((int16_t)(seq - jb->next_seq) >= jb->slots)
+		janus_jitter_buffer_skip(jb);
+	janus_jitter_buffer_frame *frame = &jb->ring[seq % jb->slots];
+	frame->seq = seq;
+	frame->timestamp = timestamp;
+	frame->count = count;
+	frame->level = level;
+	frame->concealed = FALSE;
+	jb->last_count = count;
+	if(recovered)
+		jb->stats.recovered++;
+	else
+		jb->stats.received++;
+	if((int16_t)(seq - jb->last_seq) > 0)
+		jb->last_seq = seq;
+	if(!recovered) {
+		/* Update the interarrival jitter (RFC 3550, 6.4.1) using the frames we receive in order */
+		if(jb->last_arrival > 0 && (int32_t)(timestamp - jb->last_ts) > 0) {
+			gint64 d = (now - jb->last_arrival) - (gint64)((int32_t)(timestamp - jb->last_ts))*G_USEC_PER_SEC/jb->clock_rate;
+			if(d < 0)
+				d = -d;
+			jb->jitter += d - ((jb->jitter + 8) >> 4);
+			jb->estimates++;
+		}
+		if(jb->last_arrival == 0 || (int32_t)(timestamp - jb->last_ts) > 0) {
+			jb->last_arrival = now;
+			jb->last_ts = timestamp;
+		}
+	}
+	if(jb->estimates >= JANUS_JITTER_BUFFER_WARMUP) {
+		/* Try to keep enough frames queued to absorb about three times the jitter */
+		gint64 jitter = jb->jitter >> 4;
+		int target = 1 + (int)((3*jitter + jb->ptime - 1) / jb->ptime);
+		if(target < jb->min_depth)
+			target = jb->min_depth;
+		else if(target > jb->max_depth)
+			target = jb->max_depth;
+		jb->target = target;
+	}
+	/* Never keep more than the maximum depth queued */
+	while(janus_jitter_buffer_depth(jb) > jb->max_depth)
+		janus_jitter_buffer_skip(jb);
+}
+
+gboolean janus_jitter_buffer_missing(janus_jitter_buffer *jb, uint16_t seq) {
+	if(!jb || !jb->started)
+		return FALSE;
+	int16_t diff = seq - jb->next_seq;
+	if(diff < 0 || diff >= jb->slots)
+		return FALSE;
+	return !janus_jitter_buffer_has(jb, seq);
+}
+
+const janus_jitter_buffer_frame *janus_jitter_buffer_get(janus_jitter_buffer *jb, janus_jitter_buffer_conceal_cb conceal, void *user_data) {
+	if(!jb || !jb->started)
+		return NULL;
+	int depth = janus_jitter_buffer_depth(jb);
+	if(jb->buffering) {
+		if(depth < jb->target)
+			return NULL;
+		jb->buffering = FALSE;
+		jb->conceal_row = 0;
+		jb->shrink_count = 0;
+	}
+	if(depth == 0) {
+		/* We ran out of frames: conceal a few, and if nothing comes, buffer again */
+		if(conceal == NULL || jb->last_count == 0 || jb->conceal_row >= JANUS_JITTER_BUFFER_MAX_CONCEAL) {
+			jb->buffering = TRUE;
+			jb->stats.underruns++;
+			return NULL;
+		}
+		jb->conceal_row++;
+	} else {
+		jb->conceal_row = 0;
+		if(depth > jb->target + 1) {
+			/* Too many frames queued for the current jitter: drop one every now and then */
+			jb->shrink_count++;
+			if(jb->shrink_count >= JANUS_JITTER_BUFFER_SHRINK) {
+				jb->shrink_count = 0;
+				janus_jitter_buffer_skip(jb);
+			}
+		} else {
+			jb->shrink_count = 0;
+		}
+	}
+	uint16_t seq = jb->next_seq;
+	janus_jitter_buffer_frame *frame = &jb->ring[seq % jb->slots];
+	if(frame->count > 0 && frame->seq == seq) {
+		memcpy(jb->out.samples, frame->samples, frame->count*sizeof(int16_t));
+		jb->out.count = frame->count;
+		jb->out.seq = seq;
+		jb->out.timestamp = frame->timestamp;
+		jb->out.level = frame->level;
+		jb->out.concealed = FALSE;
+		frame->count = 0;
+		jb->next_seq++;
+		jb->stats.played++;
+		return &jb->out;
+	}
+	/* We don't have this frame: try to recover or conceal it (we keep the level of the previous one) */
+	jb->next_seq++;
+	gboolean recovered = FALSE;
+	int count = (conceal && jb->last_count > 0) ? conceal(user_data, seq, jb->out.samples, jb->last_count, &recovered) : -1;
+	if(count < 1)
+		return NULL;
+	if(count > jb->max_samples)
+		count = jb->max_samples;
+	jb->out.count = count;
+	jb->out.seq = seq;
+	jb->out.timestamp += (uint32_t)((gint64)jb->clock_rate * jb->ptime / G_USEC_PER_SEC);
+	jb->out.concealed = !recovered;
+	if(recovered)
+		jb->stats.recovered++;
+	else
+		jb->stats.concealed++;
+	return &jb->out;
+}
+
+gboolean janus_jitter_buffer_is_buffering(janus_jitter_buffer *jb) {
+	return jb ? jb->buffering : TRUE;
+}
+
+void janus_jitter_buffer_get_stats(janus_jitter_buffer *jb, janus_jitter_buffer_stats *stats) {
+	if(!jb || !stats)
+		return;
+	*stats = jb->stats;
+	stats->depth = janus_jitter_buffer_depth(jb);
+	stats->target = jb->target;
+	stats->buffering = jb->buffering;
+	stats->jitter = jb->jitter >> 4;
+}
@@ -0,0 +1,148 @@
+/*! \file    jitter.h
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU General Public License v3
+ * \brief    Audio jitter buffer (headers)
+ * \details  Implementation of a jitter buffer for decoded audio that
+ * plugins can make use of when they need to play out frames received via
+ * RTP at a steady pace (e.g., to mix them). Frames are stored in a
+ * fixed-size ring indexed by RTP sequence number, whose PCM slots are
+ * preallocated, so that decoders can write directly into them and no
+ * memory is allocated per frame. The buffer tracks the interarrival
+ * jitter (RFC 3550) and adapts how many frames it keeps queued to it,
+ * within configurable bounds. Gaps are filled by a codec-specific
+ * concealment callback, invoked only when a missing frame is due, which
+ * can either recover it from a later packet (e.g., via Opus in-band FEC)
+ * or conceal it (e.g., Opus PLC): the janus_jitter_buffer_missing()
+ * helper can be used to find out if an incoming packet may be needed
+ * to recover a lost frame before the frame is due.
+ * \note The jitter buffer does no locking of its own: if it's fed and
+ * read by different threads, access must be protected by the caller.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#ifndef _JANUS_JITTER_H
+#define _JANUS_JITTER_H
+
+#include <inttypes.h>
+
+#include <glib.h>
+
+
+/*! \brief Frame as returned by the jitter buffer */
+typedef struct janus_jitter_buffer_frame {
+	/*! \brief Decoded samples */
+	int16_t *samples;
+	/*! \brief Number of samples (0 if this slot is empty) */
+	int count;
+	/*! \brief RTP sequence number of the frame */
+	uint16_t seq;
+	/*! \brief RTP timestamp of the frame */
+	uint32_t timestamp;
+	/*! \brief Application-defined value associated to the frame (e.g., an audio level) */
+	int level;
+	/*! \brief Whether this frame was concealed, rather than received */
+	gboolean concealed;
+} janus_jitter_buffer_frame;
+
+/*! \brief Callback to generate a frame for a packet that was lost, invoked when the frame is due
+ * @param[in] user_data Opaque pointer passed to janus_jitter_buffer_get()
+ * @param[in] seq The RTP sequence number of the missing frame
+ * @param[out] samples Where to write the samples
+ * @param[in] count Number of samples to generate (the size of the last frame received)
+ * @param[out] recovered Set to TRUE if the frame was recovered from a different packet (e.g., via FEC), rather than concealed
+ * @returns The number of samples written, or a negative value if the frame couldn't be concealed */
+typedef int (*janus_jitter_buffer_conceal_cb)(void *user_data, uint16_t seq, int16_t *samples, int count, gboolean *recovered);
+
+/*! \brief Jitter buffer statistics */
+typedef struct janus_jitter_buffer_stats {
+	/*! \brief Frames currently queued */
+	int depth;
+	/*! \brief Frames we currently try to keep queued */
+	int target;
+	/*! \brief Whether we're (re)buffering, and so not playing out frames */
+	gboolean buffering;
+	/*! \brief Current interarrival jitter, in microseconds */
+	gint64 jitter;
+	/*! \brief Frames received */
+	guint64 received;
+	/*! \brief Frames recovered by the application (e.g., via FEC) */
+	guint64 recovered;
+	/*! \brief Frames played out */
+	guint64 played;
+	/*! \brief Frames concealed */
+	guint64 concealed;
+	/*! \brief Frames that arrived too late to be played */
+	guint64 late;
+	/*! \brief Frames dropped because too many were queued */
+	guint64 dropped;
+	/*! \brief Times the buffer ran empty */
+	guint64 underruns;
+} janus_jitter_buffer_stats;
+
+/*! \brief Jitter buffer instance */
+typedef struct janus_jitter_buffer janus_jitter_buffer;
+
+
+/*! \brief Create a new jitter buffer
+ * @param[in] slots Number of frames the buffer can hold (must be a power of two, e.g., 32)
+ * @param[in] max_samples Maximum number of samples in a frame (e.g., 960 for 20ms at 48kHz)
+ * @param[in] clock_rate RTP clock rate of the stream (e.g., 48000 for Opus)
+ * @param[in] ptime Duration of a frame, in milliseconds (e.g., 20)
+ * @param[in] min_depth Minimum number of frames to keep queued
+ * @param[in] max_depth Maximum number of frames to keep queued (must be lower than slots)
+ * @returns A new janus_jitter_buffer instance, or NULL in case of errors */
+janus_jitter_buffer *janus_jitter_buffer_create(int slots, int max_samples, int clock_rate, int ptime, int min_depth, int max_depth);
+
+/*! \brief Destroy a jitter buffer
+ * @param[in] jb The janus_jitter_buffer instance to destroy */
+void janus_jitter_buffer_destroy(janus_jitter_buffer *jb);
+
+/*! \brief Get rid of all the queued frames, and start buffering again
+ * @note This also resets the jitter estimation, but not the statistics
+ * @param[in] jb The janus_jitter_buffer instance to reset */
+void janus_jitter_buffer_reset(janus_jitter_buffer *jb);
+
+/*! \brief Get the slot a frame should be written to
+ * @note The frame is only added to the buffer when janus_jitter_buffer_commit() is called
+ * @param[in] jb The janus_jitter_buffer instance
+ * @param[in] seq The RTP sequence number of the frame
+ * @returns A pointer to where to write the samples (at least max_samples), or NULL if the frame is late or a duplicate */
+int16_t *janus_jitter_buffer_slot(janus_jitter_buffer *jb, uint16_t seq);
+
+/*! \brief Add a frame written to the slot returned by janus_jitter_buffer_slot() to the buffer
+ * @param[in] jb The janus_jitter_buffer instance
+ * @param[in] seq The RTP sequence number of the frame
+ * @param[in] timestamp The RTP timestamp of the frame
+ * @param[in] count Number of samples written to the slot
+ * @param[in] level Application-defined value to associate to the frame
+ * @param[in] recovered Whether the frame was recovered from a different packet (e.g., via FEC) */
+void janus_jitter_buffer_commit(janus_jitter_buffer *jb, uint16_t seq, uint32_t timestamp, int count, int level, gboolean recovered);
+
+/*! \brief Check whether a frame was not received, but could still be played if recovered
+ * @param[in] jb The janus_jitter_buffer instance
+ * @param[in] seq The RTP sequence number of the frame
+ * @returns TRUE if the frame is missing and not due yet, FALSE otherwise */
+gboolean janus_jitter_buffer_missing(janus_jitter_buffer *jb, uint16_t seq);
+
+/*! \brief Get the next frame to play out, if any
+ * @note The frame that is returned is only valid until the next call to
+ * this function, but it won't be modified by the other methods
+ * @param[in] jb The janus_jitter_buffer instance
+ * @param[in] conceal Callback to invoke to conceal a missing frame (NULL to skip it)
+ * @param[in] user_data Opaque pointer to pass to the callback
+ * @returns A pointer to the frame to play, or NULL if there's nothing to play (e.g., still buffering) */
+const janus_jitter_buffer_frame *janus_jitter_buffer_get(janus_jitter_buffer *jb, janus_jitter_buffer_conceal_cb conceal, void *user_data);
+
+/*! \brief Check whether the buffer is (re)buffering, and so not playing out frames
+ * @param[in] jb The janus_jitter_buffer instance
+ * @returns TRUE if buffering, FALSE otherwise */
+gboolean janus_jitter_buffer_is_buffering(janus_jitter_buffer *jb);
+
+/*! \brief Get the statistics of a jitter buffer
+ * @param[in] jb The janus_jitter_buffer instance
+ * @param[out] stats Where to write the statistics */
+void janus_jitter_buffer_get_stats(janus_jitter_buffer *jb, janus_jitter_buffer_stats *stats);
+
+#endif
@@ -0,0 +1,514 @@
+/*! \file    pacer.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU General Public License v3
+ * \brief    Shared pacing engine
+ * \details  Implementation of an engine plugins can use to send
+ * pre-recorded media at the right pace, without having to spawn a thread
+ * for each viewer. Each pacing thread has a hashed timing wheel, with a
+ * slot per millisecond: tasks are put in the slot of the millisecond
+ * their next packet is due in (possibly several rounds ahead), and the
+ * thread only wakes up once per millisecond when it has tasks to take
+ * care of. When processing a slot, the tasks that are due are sorted by
+ * their actual deadline, and the thread sleeps until each of them is due
+ * before waking it up, so that the accuracy is not limited to the size
+ * of a slot.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pacer.h"
+#include "debug.h"
+#include "mutex.h"
+
+/* Size of a slot in the timing wheels, in microseconds */
+#define JANUS_PACER_TICK	1000
+/* Number of slots in the timing wheels (about half a second) */
+#define JANUS_PACER_SLOTS	512
+/* Maximum number of pacing threads */
+#define JANUS_PACER_MAX_THREADS	64
+
+/* Pacing thread, and its timing wheel */
+typedef struct janus_pacer_thread {
+	int id;
+	GThread *thread;
+	janus_mutex mutex;
+	janus_condition cond;
+	/* Slots of the wheel, and the next tick to process */
+	GQueue slots[JANUS_PACER_SLOTS];
+	gint64 tick;
+	/* How many tasks are in the wheel right now */
+	guint scheduled;
+	/* How many tasks are assigned to this thread, to balance the load */
+	volatile gint tasks;
+	janus_pacer_stats stats;
+	gboolean stopping;
+} janus_pacer_thread;
+
+struct janus_pacer_task {
+	janus_pacer_callbacks callbacks;
+	void *data;
+	/* Thread the task was assigned to, when started */
+	janus_pacer_thread *thread;
+	/* Serializes the callbacks and any change to the state of the task */
+	janus_mutex mutex;
+	/* Monotonic time position 0 of the media corresponds to */
+	gint64 base;
+	/* When the task is due next */
+	gint64 deadline;
+	/* Where the task was paused */
+	gint64 paused_position;
+	gboolean started, paused, stopping, finished;
+	/* Wheel state (protected by the mutex of the thread) */
+	GList link;
+	gboolean scheduled;
+	guint slot, rounds;
+	janus_pacer_stats stats;
+	volatile gint ref;
+};
+
+static janus_pacer_thread **pacer_threads = NULL;
+static int pacer_threads_count = 0;
+static volatile gint pacer_running = 0;
+static void *janus_pacer_thread_loop(void *data);
+
+
+/* The pacing engine uses its own clock, as it needs to sleep on it */
+static gint64 janus_pacer_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec*G_USEC_PER_SEC + ts.tv_nsec/1000;
+}
+
+static void janus_pacer_sleep_until(gint64 when) {
+	struct timespec ts;
+	ts.tv_sec = when / G_USEC_PER_SEC;
+	ts.tv_nsec = (when % G_USEC_PER_SEC) * 1000;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void janus_pacer_stats_update(janus_pacer_stats *stats, gint64 late) {
+	stats->wakeups++;
+	stats->late_last = late;
+	if(late > stats->late_max)
+		stats->late_max = late;
+	stats->late_total += late;
+	if(late >= 500)
+		stats->late_500us++;
+	if(late >= 1000)
+		stats->late_1ms++;
+	if(late >= 5000)
+		stats->late_5ms++;
+}
+
+static void janus_pacer_stats_add(janus_pacer_stats *stats, janus_pacer_stats *other) {
+	stats->wakeups += other->wakeups;
+	stats->late_last = other->late_last;
+	if(other->late_max > stats->late_max)
+		stats->late_max = other->late_max;
+	stats->late_total += other->late_total;
+	stats->late_500us += other->late_500us;
+	stats->late_1ms += other->late_1ms;
+	stats->late_5ms += other->late_5ms;
+	stats->late_avg = stats->wakeups ? (gint64)(stats->late_total/stats->wakeups) : 0;
+}
+
+
+int janus_pacer_init(int threads) {
+	if(threads < 1) {
+		/* One thread per core, but only a few are needed anyway */
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? MIN(cores, 4) : 1;
+	}
+	if(threads > JANUS_PACER_MAX_THREADS)
+		threads = JANUS_PACER_MAX_THREADS;
+	JANUS_LOG(LOG_INFO, "Initializing pacing engine (%d threads)\n", threads);
+	pacer_threads = g_malloc0(threads * sizeof(janus_pacer_thread *));
+	g_atomic_int_set(&pacer_running, 1);
+	int i = 0;
+	for(i=0; i<threads; i++) {
+		janus_pacer_thread *thread = g_malloc0(sizeof(janus_pacer_thread));
+		thread->id = i;
+		janus_mutex_init(&thread->mutex);
+		janus_condition_init(&thread->cond);
+		int j = 0;
+		for(j=0; j<JANUS_PACER_SLOTS; j++)
+			g_queue_init(&thread->slots[j]);
+		thread->tick = janus_pacer_now() / JANUS_PACER_TICK;
+		GError *error = NULL;
+		char tname[16];
+		g_snprintf(tname, sizeof(tname), "pacer %d", i);
+		thread->thread = g_thread_try_new(tname, &janus_pacer_thread_loop, thread, &error);
+		if(error != NULL) {
+			/* We can live with fewer threads, as long as there's at least one */
+			JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the pacing thread...\n", error->code, error->message ? error->message : "??");
+			g_error_free(error);
+			janus_mutex_destroy(&thread->mutex);
+			janus_condition_destroy(&thread->cond);
+			g_free(thread);
+			break;
+		}
+		pacer_threads[i] = thread;
+	}
+	pacer_threads_count = i;
+	if(i == 0) {
+		JANUS_LOG(LOG_FATAL, "No pacing thread could be started\n");
+		g_atomic_int_set(&pacer_running, 0);
+		g_free(pacer_threads);
+		pacer_threads = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void janus_pacer_deinit(void) {
+	if(!g_atomic_int_compare_and_exchange(&pacer_running, 1, 0))
+		return;
+	janus_pacer_stats stats = { 0 };
+	int i = 0;
+	for(i=0; i<pacer_threads_count; i++) {
+		janus_pacer_thread *thread = pacer_threads[i];
+		janus_mutex_lock(&thread->mutex);
+		thread->stopping = TRUE;
+		janus_condition_signal(&thread->cond);
+		janus_mutex_unlock(&thread->mutex);
+		g_thread_join(thread->thread);
+		janus_pacer_stats_add(&stats, &thread->stats);
+		janus_mutex_destroy(&thread->mutex);
+		janus_condition_destroy(&thread->cond);
+		g_free(thread);
+	}
+	JANUS_LOG(LOG_INFO, "Pacing engine: %"SCNu64" wake-ups, %"SCNi64"us late on average (max %"SCNi64"us), %"SCNu64" more than 1ms late\n",
+		stats.wakeups, stats.late_avg, stats.late_max, stats.late_1ms);
+	g_free(pacer_threads);
+	pacer_threads = NULL;
+	pacer_threads_count = 0;
+}
+
+void janus_pacer_get_stats(janus_pacer_stats *stats) {
+	if(stats == NULL)
+		return;
+	memset(stats, 0, sizeof(janus_pacer_stats));
+	if(!g_atomic_int_get(&pacer_running))
+		return;
+	int i = 0;
+	for(i=0; i<pacer_threads_count; i++) {
+		janus_pacer_thread *thread = pacer_threads[i];
+		janus_mutex_lock(&thread->mutex);
+		janus_pacer_stats_add(stats, &thread->stats);
+		janus_mutex_unlock(&thread->mutex);
+	}
+}
+
+
+/* Wheel management: the mutex of the task must be locked when calling these */
+static void janus_pacer_unschedule(janus_pacer_task *task) {
+	janus_pacer_thread *thread = task->thread;
+	if(thread == NULL || !g_atomic_int_get(&pacer_running))
+		return;
+	janus_mutex_lock(&thread->mutex);
+	if(task->scheduled) {
+		g_queue_unlink(&thread->slots[task->slot], &task->link);
+		task->scheduled = FALSE;
+		thread->scheduled--;
+	}
+	janus_mutex_unlock(&thread->mutex);
+}
+
+static void janus_pacer_schedule(janus_pacer_task *task, gint64 when) {
+	janus_pacer_thread *thread = task->thread;
+	if(thread == NULL || !g_atomic_int_get(&pacer_running))
+		return;
+	janus_mutex_lock(&thread->mutex);
+	if(task->scheduled) {
+		g_queue_unlink(&thread->slots[task->slot], &task->link);
+		thread->scheduled--;
+	}
+	if(thread->scheduled == 0) {
+		/* The wheel was idle, so it may be behind */
+		thread->tick = janus_pacer_now() / JANUS_PACER_TICK;
+	}
+	task->deadline = when;
+	/* If it's already late, it goes in the next slot the thread will process */
+	gint64 tick = MAX(when / JANUS_PACER_TICK, thread->tick);
+	task->slot = tick % JANUS_PACER_SLOTS;
+	task->rounds = (tick - thread->tick) / JANUS_PACER_SLOTS;
+	task->link.data = task;
+	g_queue_push_tail_link(&thread->slots[task->slot], &task->link);
+	task->scheduled = TRUE;
+	thread->scheduled++;
+	if(thread->scheduled == 1)
+		janus_condition_signal(&thread->cond);
+	janus_mutex_unlock(&thread->mutex);
+}
+
+
+janus_pacer_task *janus_pacer_task_create(const janus_pacer_callbacks *callbacks, void *data) {
+	if(callbacks == NULL || callbacks->send == NULL || callbacks->done == NULL)
+		return NULL;
+	janus_pacer_task *task = g_malloc0(sizeof(janus_pacer_task));
+	task->callbacks = *callbacks;
+	task->data = data;
+	janus_mutex_init(&task->mutex);
+	g_atomic_int_set(&task->ref, 1);
+	return task;
+}
+
+int janus_pacer_task_start(janus_pacer_task *task, gint64 position) {
+	if(task == NULL)
+		return -1;
+	if(!g_atomic_int_get(&pacer_running)) {
+		JANUS_LOG(LOG_ERR, "Pacing engine not running, can't start task\n");
+		return -2;
+	}
+	janus_mutex_lock(&task->mutex);
+	if(task->started) {
+		janus_mutex_unlock(&task->mutex);
+		return -3;
+	}
+	/* Pick the thread with the fewest tasks */
+	janus_pacer_thread *thread = NULL;
+	int i = 0;
+	for(i=0; i<pacer_threads_count; i++) {
+		if(thread == NULL || g_atomic_int_get(&pacer_threads[i]->tasks) < g_atomic_int_get(&thread->tasks))
+			thread = pacer_threads[i];
+	}
+	g_atomic_int_inc(&thread->tasks);
+	task->thread = thread;
+	task->started = TRUE;
+	/* The engine holds a reference until the task is done */
+	g_atomic_int_inc(&task->ref);
+	gint64 now = janus_pacer_now();
+	task->base = now - MAX(position, 0);
+	janus_pacer_schedule(task, now);
+	janus_mutex_unlock(&task->mutex);
+	return 0;
+}
+
+void janus_pacer_task_pause(janus_pacer_task *task) {
+	if(task == NULL)
+		return;
+	janus_mutex_lock(&task->mutex);
+	if(task->started && !task->paused && !task->stopping && !task->finished) {
+		task->paused_position = janus_pacer_now() - task->base;
+		task->paused = TRUE;
+		janus_pacer_unschedule(task);
+	}
+	janus_mutex_unlock(&task->mutex);
+}
+
+void janus_pacer_task_resume(janus_pacer_task *task) {
+	if(task == NULL)
+		return;
+	janus_mutex_lock(&task->mutex);
+	if(task->paused && !task->stopping && !task->finished) {
+		gint64 now = janus_pacer_now();
+		task->base = now - task->paused_position;
+		task->paused = FALSE;
+		janus_pacer_schedule(task, now);
+	}
+	janus_mutex_unlock(&task->mutex);
+}
+
+gint64 janus_pacer_task_seek(janus_pacer_task *task, gint64 position) {
+	if(task == NULL || task->callbacks.seek == NULL)
+		return -1;
+	janus_mutex_lock(&task->mutex);
+	if(!task->started || task->stopping || task->finished) {
+		janus_mutex_unlock(&task->mutex);
+		return -2;
+	}
+	gint64 actual = task->callbacks.seek(task->data, MAX(position, 0));
+	if(actual >= 0) {
+		gint64 now = janus_pacer_now();
+		if(task->paused) {
+			task->paused_position = actual;
+		} else {
+			task->base = now - actual;
+			janus_pacer_schedule(task, now);
+		}
+	}
+	janus_mutex_unlock(&task->mutex);
+	return actual;
+}
+
+void janus_pacer_task_stop(janus_pacer_task *task) {
+	if(task == NULL)
+		return;
+	janus_mutex_lock(&task->mutex);
+	if(task->stopping || task->finished) {
+		janus_mutex_unlock(&task->mutex);
+		return;
+	}
+	task->stopping = TRUE;
+	if(!task->started) {
+		/* There's no pacing thread involved yet, we're done already */
+		task->finished = TRUE;
+		janus_mutex_unlock(&task->mutex);
+		task->callbacks.done(task->data);
+		return;
+	}
+	/* Let the pacing thread wrap this up as soon as possible */
+	task->paused = FALSE;
+	janus_pacer_schedule(task, janus_pacer_now());
+	janus_mutex_unlock(&task->mutex);
+}
+
+gboolean janus_pacer_task_is_paused(janus_pacer_task *task) {
+	if(task == NULL)
+		return FALSE;
+	janus_mutex_lock(&task->mutex);
+	gboolean paused = task->paused;
+	janus_mutex_unlock(&task->mutex);
+	return paused;
+}
+
+gint64 janus_pacer_task_get_position(janus_pacer_task *task) {
+	if(task == NULL)
+		return 0;
+	gint64 position = 0;
+	janus_mutex_lock(&task->mutex);
+	if(task->paused)
+		position = task->paused_position;
+	else if(task->started)
+		position = janus_pacer_now() - task->base;
+	janus_mutex_unlock(&task->mutex);
+	return position;
+}
+
+void janus_pacer_task_get_stats(janus_pacer_task *task, janus_pacer_stats *stats) {
+	if(stats == NULL)
+		return;
+	memset(stats, 0, sizeof(janus_pacer_stats));
+	if(task == NULL)
+		return;
+	janus_mutex_lock(&task->mutex);
+	janus_pacer_stats_add(stats, &task->stats);
+	janus_mutex_unlock(&task->mutex);
+}
+
+void janus_pacer_task_unref(janus_pacer_task *task) {
+	if(task == NULL)
+		return;
+	if(g_atomic_int_dec_and_test(&task->ref)) {
+		janus_mutex_destroy(&task->mutex);
+		g_free(task);
+	}
+}
+
+
+/* Wake a task up, and reschedule it */
+static void janus_pacer_fire(janus_pacer_thread *thread, janus_pacer_task *task) {
+	gboolean done = FALSE;
+	janus_mutex_lock(&task->mutex);
+	if(task->finished || task->scheduled) {
+		/* Either over, or rescheduled after we took it from the wheel */
+		janus_mutex_unlock(&task->mutex);
+		return;
+	}
+	if(task->stopping) {
+		done = TRUE;
+	} else if(!task->paused) {
+		gint64 now = janus_pacer_now();
+		gint64 late = now - task->deadline;
+		janus_pacer_stats_update(&task->stats, late);
+		janus_mutex_lock(&thread->mutex);
+		janus_pacer_stats_update(&thread->stats, late);
+		janus_mutex_unlock(&thread->mutex);
+		gint64 next = task->callbacks.send(task->data, now - task->base);
+		if(next < 0) {
+			done = TRUE;
+		} else {
+			janus_pacer_schedule(task, task->base + next);
+		}
+	}
+	if(done) {
+		task->finished = TRUE;
+		janus_pacer_unschedule(task);
+	}
+	janus_mutex_unlock(&task->mutex);
+	if(done) {
+		task->callbacks.done(task->data);
+		g_atomic_int_add(&thread->tasks, -1);
+		/* Release the reference the engine was holding */
+		janus_pacer_task_unref(task);
+	}
+}
+
+/* Task that is due in the slot being processed: as the deadline of the task can be
+ * changed by other threads as soon as we release the lock (e.g., a seek), we use
+ * the copy we took with the lock held to sort the tasks and to sleep */
+typedef struct janus_pacer_due {
+	janus_pacer_task *task;
+	gint64 deadline;
+} janus_pacer_due;
+
+static gint janus_pacer_due_compare(gconstpointer a, gconstpointer b) {
+	const janus_pacer_due *first = (const janus_pacer_due *)a, *second = (const janus_pacer_due *)b;
+	if(first->deadline == second->deadline)
+		return 0;
+	return first->deadline < second->deadline ? -1 : 1;
+}
+
+static void *janus_pacer_thread_loop(void *data) {
+	janus_pacer_thread *thread = (janus_pacer_thread *)data;
+	JANUS_LOG(LOG_VERB, "Joining pacing thread #%d\n", thread->id);
+	GArray *due = g_array_new(FALSE, FALSE, sizeof(janus_pacer_due));
+	janus_mutex_lock(&thread->mutex);
+	while(!thread->stopping) {
+		if(thread->scheduled == 0) {
+			/* Nothing to do, wait for a task to be scheduled */
+			janus_condition_wait(&thread->cond, &thread->mutex);
+			continue;
+		}
+		gint64 tick_time = thread->tick * JANUS_PACER_TICK;
+		if(janus_pacer_now() < tick_time) {
+			janus_mutex_unlock(&thread->mutex);
+			janus_pacer_sleep_until(tick_time);
+			janus_mutex_lock(&thread->mutex);
+			continue;
+		}
+		/* Take the tasks that are due in this slot: the others are for later rounds */
+		GQueue *slot = &thread->slots[thread->tick % JANUS_PACER_SLOTS];
+		GList *l = slot->head;
+		while(l) {
+			GList *next = l->next;
+			janus_pacer_task *task = (janus_pacer_task *)l->data;
+			if(task->rounds > 0) {
+				task->rounds--;
+			} else {
+				g_queue_unlink(slot, l);
+				task->scheduled = FALSE;
+				thread->scheduled--;
+				g_atomic_int_inc(&task->ref);
+				janus_pacer_due item = { task, task->deadline };
+				g_array_append_val(due, item);
+			}
+			l = next;
+		}
+		thread->tick++;
+		janus_mutex_unlock(&thread->mutex);
+		/* Wake the tasks up in order, each at its exact deadline */
+		if(due->len > 1)
+			g_array_sort(due, janus_pacer_due_compare);
+		guint i = 0;
+		for(i=0; i<due->len; i++) {
+			janus_pacer_due *item = &g_array_index(due, janus_pacer_due, i);
+			if(item->deadline > janus_pacer_now())
+				janus_pacer_sleep_until(item->deadline);
+			janus_pacer_fire(thread, item->task);
+			janus_pacer_task_unref(item->task);
+		}
+		g_array_set_size(due, 0);
+		janus_mutex_lock(&thread->mutex);
+	}
+	janus_mutex_unlock(&thread->mutex);
+	g_array_free(due, TRUE);
+	JANUS_LOG(LOG_VERB, "Leaving pacing thread #%d\n", thread->id);
+	return NULL;
+}
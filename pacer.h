@@ -0,0 +1,131 @@
+/*! \file    pacer.h
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU General Public License v3
+ * \brief    Shared pacing engine (headers)
+ * \details  Implementation of an engine plugins can use to send
+ * pre-recorded media (e.g., recordings or files) at the right pace,
+ * without having to spawn a thread for each viewer. A few pacing threads
+ * are started when Janus starts, each with its own timing wheel: plugins
+ * create a task for each playout, and the engine wakes it up when the
+ * next packet of the playout is due, according to its media clock.
+ *
+ * Tasks only deal with positions, i.e., how far (in microseconds) into
+ * the media they are: the \c send callback of a task is passed the
+ * current position, is expected to send everything that's due by then,
+ * and returns the position of the next packet. This is what allows the
+ * engine to take care of pausing and seeking transparently, as it only
+ * needs to update the reference time of the media clock. The engine
+ * also keeps track of how late tasks were woken up with respect to
+ * their schedule, with microsecond resolution.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#ifndef _JANUS_PACER_H
+#define _JANUS_PACER_H
+
+#include <inttypes.h>
+
+#include <glib.h>
+
+
+/*! \brief Callbacks a pacing task is made of */
+typedef struct janus_pacer_callbacks {
+	/*! \brief Send everything that's due at the current position
+	 * @param[in] data Opaque pointer that was passed when creating the task
+	 * @param[in] position Current position in the media, in microseconds
+	 * @returns The position of the next packet to send, or a negative value if the playout is over */
+	gint64 (*send)(void *data, gint64 position);
+	/*! \brief Move to a different position in the media (optional)
+	 * @param[in] data Opaque pointer that was passed when creating the task
+	 * @param[in] position The position to move to, in microseconds
+	 * @returns The actual position the playout will resume from (e.g., a keyframe), or a negative value if seeking is not possible */
+	gint64 (*seek)(void *data, gint64 position);
+	/*! \brief The task is over, either because \c send said so or because it was stopped
+	 * \note This is called exactly once, from one of the pacing threads,
+	 * and no other callback will be invoked after it
+	 * @param[in] data Opaque pointer that was passed when creating the task */
+	void (*done)(void *data);
+} janus_pacer_callbacks;
+
+/*! \brief Pacing statistics (all times in microseconds) */
+typedef struct janus_pacer_stats {
+	/*! \brief How many times tasks were woken up */
+	guint64 wakeups;
+	/*! \brief How late the last wake-up was */
+	gint64 late_last;
+	/*! \brief How late the latest wake-up ever was */
+	gint64 late_max;
+	/*! \brief How late wake-ups were, on average */
+	gint64 late_avg;
+	/*! \brief Sum of the delays of all the wake-ups (used to compute the average) */
+	guint64 late_total;
+	/*! \brief How many wake-ups were at least half a millisecond late */
+	guint64 late_500us;
+	/*! \brief How many wake-ups were at least a millisecond late */
+	guint64 late_1ms;
+	/*! \brief How many wake-ups were at least five milliseconds late */
+	guint64 late_5ms;
+} janus_pacer_stats;
+
+/*! \brief Pacing task, i.e., a playout the engine takes care of */
+typedef struct janus_pacer_task janus_pacer_task;
+
+
+/*! \brief Start the pacing threads
+ * @param[in] threads How many pacing threads to start (0 to pick a default based on the number of cores)
+ * @returns 0 in case of success, a negative integer otherwise */
+int janus_pacer_init(int threads);
+/*! \brief Stop the pacing threads
+ * \note Tasks that are still running are not notified */
+void janus_pacer_deinit(void);
+/*! \brief Get the statistics of all the pacing threads
+ * @param[out] stats Where to write the statistics */
+void janus_pacer_get_stats(janus_pacer_stats *stats);
+
+/*! \brief Create a new pacing task
+ * @param[in] callbacks The callbacks to invoke (copied, \c send and \c done are mandatory)
+ * @param[in] data Opaque pointer to pass to the callbacks
+ * @returns A new janus_pacer_task instance, with a reference the caller must release with janus_pacer_task_unref(), or NULL in case of errors */
+janus_pacer_task *janus_pacer_task_create(const janus_pacer_callbacks *callbacks, void *data);
+/*! \brief Start a pacing task
+ * @param[in] task The janus_pacer_task instance
+ * @param[in] position The position to start from, in microseconds
+ * @returns 0 in case of success, a negative integer otherwise */
+int janus_pacer_task_start(janus_pacer_task *task, gint64 position);
+/*! \brief Pause a pacing task: the media clock is frozen until it's resumed
+ * @param[in] task The janus_pacer_task instance */
+void janus_pacer_task_pause(janus_pacer_task *task);
+/*! \brief Resume a paused pacing task from where it was paused
+ * @param[in] task The janus_pacer_task instance */
+void janus_pacer_task_resume(janus_pacer_task *task);
+/*! \brief Move a pacing task to a different position
+ * \note This needs the task to have a \c seek callback. If the task is
+ * paused, it stays paused, and will resume from the new position
+ * @param[in] task The janus_pacer_task instance
+ * @param[in] position The position to move to, in microseconds
+ * @returns The actual new position in case of success, a negative integer otherwise */
+gint64 janus_pacer_task_seek(janus_pacer_task *task, gint64 position);
+/*! \brief Stop a pacing task
+ * \note This doesn't wait for the task to be over: its \c done callback
+ * will be invoked from one of the pacing threads as soon as possible
+ * @param[in] task The janus_pacer_task instance */
+void janus_pacer_task_stop(janus_pacer_task *task);
+/*! \brief Check whether a pacing task is paused
+ * @param[in] task The janus_pacer_task instance
+ * @returns TRUE if the task is paused, FALSE otherwise */
+gboolean janus_pacer_task_is_paused(janus_pacer_task *task);
+/*! \brief Get the current position of a pacing task
+ * @param[in] task The janus_pacer_task instance
+ * @returns The current position, in microseconds */
+gint64 janus_pacer_task_get_position(janus_pacer_task *task);
+/*! \brief Get the statistics of a pacing task
+ * @param[in] task The janus_pacer_task instance
+ * @param[out] stats Where to write the statistics */
+void janus_pacer_task_get_stats(janus_pacer_task *task, janus_pacer_stats *stats);
+/*! \brief Release a reference to a pacing task
+ * @param[in] task The janus_pacer_task instance */
+void janus_pacer_task_unref(janus_pacer_task *task);
+
+#endif
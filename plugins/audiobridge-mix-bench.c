@@ -0,0 +1,100 @@
+/*! \file    audiobridge-mix-bench.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU General Public License v3
+ * \brief    Micro-benchmark for the AudioBridge mixing kernels
+ * \details  Small standalone tool (not installed) that runs all the mixing
+ * routines the CPU supports on the same random input, checks they produce
+ * the same output as the plain C version, and prints how long each of them
+ * takes to mix a room. Usage:
+ *
+\verbatim
+./audiobridge-mix-bench [participants [iterations]]
+\endverbatim
+ *
+ * \ingroup plugins
+ * \ref plugins
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audiobridge-mix.h"
+
+/* 20ms at 48kHz, the largest frame the AudioBridge mixes */
+#define BENCH_SAMPLES	960
+#define BENCH_MAX_OPS	8
+
+static double bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/* Mix a room once, as the AudioBridge does: accumulate all the participants,
+ * then remove each participant's own contribution to get what they hear */
+static void bench_mix(const janus_audiobridge_mix_ops *ops, int participants,
+		int16_t *in, int *gains, int32_t *mix, int16_t *out) {
+	int i = 0;
+	memset(mix, 0, BENCH_SAMPLES*sizeof(int32_t));
+	for(i=0; i<participants; i++)
+		ops->accumulate(mix, in + i*BENCH_SAMPLES, BENCH_SAMPLES, gains[i]);
+	for(i=0; i<participants; i++)
+		ops->subtract(out + i*BENCH_SAMPLES, mix, in + i*BENCH_SAMPLES, BENCH_SAMPLES, gains[i]);
+}
+
+int main(int argc, char *argv[]) {
+	int participants = argc > 1 ? atoi(argv[1]) : 32;
+	int iterations = argc > 2 ? atoi(argv[2]) : 10000;
+	if(participants < 1 || iterations < 1) {
+		printf("Usage: %s [participants [iterations]]\n", argv[0]);
+		return 1;
+	}
+	int16_t *in = malloc(participants*BENCH_SAMPLES*sizeof(int16_t));
+	int16_t *ref = malloc(participants*BENCH_SAMPLES*sizeof(int16_t));
+	int16_t *out = malloc(participants*BENCH_SAMPLES*sizeof(int16_t));
+	int32_t *mix = malloc(BENCH_SAMPLES*sizeof(int32_t));
+	int *gains = malloc(participants*sizeof(int));
+	if(in == NULL || ref == NULL || out == NULL || mix == NULL || gains == NULL) {
+		printf("Out of memory\n");
+		return 1;
+	}
+	/* Loud random samples and volumes, so that saturation gets exercised too */
+	srand(42);
+	int i = 0;
+	for(i=0; i<participants*BENCH_SAMPLES; i++)
+		in[i] = (int16_t)((rand() % 65536) - 32768);
+	for(i=0; i<participants; i++)
+		gains[i] = janus_audiobridge_mix_gain(i == 0 ? 100 : (rand() % 400));
+
+	const janus_audiobridge_mix_ops *list[BENCH_MAX_OPS];
+	int count = janus_audiobridge_mix_ops_list(list, BENCH_MAX_OPS);
+	printf("Mixing %d participants, %d samples, %d iterations (default: %s)\n",
+		participants, BENCH_SAMPLES, iterations, janus_audiobridge_mix_ops_get()->name);
+	int ret = 0;
+	double baseline = 0;
+	for(i=0; i<count; i++) {
+		const janus_audiobridge_mix_ops *ops = list[i];
+		bench_mix(ops, participants, in, gains, mix, i == 0 ? ref : out);
+		if(i > 0 && memcmp(ref, out, participants*BENCH_SAMPLES*sizeof(int16_t)) != 0) {
+			printf("  %-6s output differs from the plain C version!\n", ops->name);
+			ret = 1;
+		}
+		double start = bench_now();
+		int n = 0;
+		for(n=0; n<iterations; n++)
+			bench_mix(ops, participants, in, gains, mix, out);
+		double elapsed = bench_now() - start;
+		if(i == 0)
+			baseline = elapsed;
+		printf("  %-6s %8.2f us per mix (%.2fx)\n", ops->name,
+			elapsed*1e6/iterations, elapsed > 0 ? baseline/elapsed : 0);
+	}
+	free(in);
+	free(ref);
+	free(out);
+	free(mix);
+	free(gains);
+	return ret;
+}
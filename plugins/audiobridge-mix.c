@@ -0,0 +1,221 @@
+/*! \file    audiobridge-mix.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU General Public License v3
+ * \brief    Audio mixing kernels for the AudioBridge plugin
+ * \details  Implementation of the AudioBridge mixing routines: a plain C
+ * version, plus SSE2/AVX2 (x86) and NEON (ARM) versions that are only
+ * built when the compiler supports them, and selected at runtime.
+ *
+ * \ingroup plugins
+ * \ref plugins
+ */
+
+#include <stddef.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JANUS_AUDIOBRIDGE_MIX_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define JANUS_AUDIOBRIDGE_MIX_NEON
+#include <arm_neon.h>
+#endif
+
+#include "audiobridge-mix.h"
+
+int janus_audiobridge_mix_gain(int volume) {
+	if(volume < 0)
+		volume = 0;
+	else if(volume > JANUS_AUDIOBRIDGE_MIX_MAX_VOLUME)
+		volume = JANUS_AUDIOBRIDGE_MIX_MAX_VOLUME;
+	/* The result always fits in a signed 16-bit integer */
+	return (volume*1024 + 50)/100;
+}
+
+static inline int16_t janus_audiobridge_mix_saturate(int32_t sample) {
+	if(sample > 32767)
+		return 32767;
+	if(sample < -32768)
+		return -32768;
+	return (int16_t)sample;
+}
+
+
+/* Plain C version, also used for the samples that don't fill a whole vector */
+static void janus_audiobridge_mix_accumulate_c(int32_t *mix, const int16_t *in, int samples, int gain) {
+	int i = 0;
+	for(i=0; i<samples; i++)
+		mix[i] += ((int32_t)in[i]*gain) >> 10;
+}
+
+static void janus_audiobridge_mix_subtract_c(int16_t *out, const int32_t *mix, const int16_t *in, int samples, int gain) {
+	int i = 0;
+	if(in == NULL) {
+		for(i=0; i<samples; i++)
+			out[i] = janus_audiobridge_mix_saturate(mix[i]);
+		return;
+	}
+	for(i=0; i<samples; i++)
+		out[i] = janus_audiobridge_mix_saturate(mix[i] - (((int32_t)in[i]*gain) >> 10));
+}
+
+static const janus_audiobridge_mix_ops janus_audiobridge_mix_c = {
+	.name = "c",
+	.accumulate = janus_audiobridge_mix_accumulate_c,
+	.subtract = janus_audiobridge_mix_subtract_c,
+};
+
+
+#ifdef JANUS_AUDIOBRIDGE_MIX_X86
+/* SSE2: 8 samples at a time, the 16x16 bit products are rebuilt from their low and high halves */
+__attribute__((target("sse2")))
+static void janus_audiobridge_mix_accumulate_sse2(int32_t *mix, const int16_t *in, int samples, int gain) {
+	const __m128i g = _mm_set1_epi16((short)gain);
+	int i = 0;
+	for(i=0; i+8<=samples; i+=8) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(in+i));
+		__m128i pl = _mm_mullo_epi16(s, g), ph = _mm_mulhi_epi16(s, g);
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(pl, ph), 10);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(pl, ph), 10);
+		_mm_storeu_si128((__m128i *)(mix+i), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(mix+i)), lo));
+		_mm_storeu_si128((__m128i *)(mix+i+4), _mm_add_epi32(_mm_loadu_si128((const __m128i *)(mix+i+4)), hi));
+	}
+	janus_audiobridge_mix_accumulate_c(mix+i, in+i, samples-i, gain);
+}
+
+__attribute__((target("sse2")))
+static void janus_audiobridge_mix_subtract_sse2(int16_t *out, const int32_t *mix, const int16_t *in, int samples, int gain) {
+	const __m128i g = _mm_set1_epi16((short)gain);
+	int i = 0;
+	for(i=0; i+8<=samples; i+=8) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(mix+i));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(mix+i+4));
+		if(in != NULL) {
+			__m128i s = _mm_loadu_si128((const __m128i *)(in+i));
+			__m128i pl = _mm_mullo_epi16(s, g), ph = _mm_mulhi_epi16(s, g);
+			lo = _mm_sub_epi32(lo, _mm_srai_epi32(_mm_unpacklo_epi16(pl, ph), 10));
+			hi = _mm_sub_epi32(hi, _mm_srai_epi32(_mm_unpackhi_epi16(pl, ph), 10));
+		}
+		_mm_storeu_si128((__m128i *)(out+i), _mm_packs_epi32(lo, hi));
+	}
+	janus_audiobridge_mix_subtract_c(out+i, mix+i, in ? in+i : NULL, samples-i, gain);
+}
+
+static const janus_audiobridge_mix_ops janus_audiobridge_mix_sse2 = {
+	.name = "sse2",
+	.accumulate = janus_audiobridge_mix_accumulate_sse2,
+	.subtract = janus_audiobridge_mix_subtract_sse2,
+};
+
+/* AVX2: 16 samples at a time */
+__attribute__((target("avx2")))
+static void janus_audiobridge_mix_accumulate_avx2(int32_t *mix, const int16_t *in, int samples, int gain) {
+	const __m256i g = _mm256_set1_epi32(gain);
+	int i = 0;
+	for(i=0; i+16<=samples; i+=16) {
+		__m256i lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in+i)));
+		__m256i hi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in+i+8)));
+		lo = _mm256_srai_epi32(_mm256_mullo_epi32(lo, g), 10);
+		hi = _mm256_srai_epi32(_mm256_mullo_epi32(hi, g), 10);
+		_mm256_storeu_si256((__m256i *)(mix+i), _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(mix+i)), lo));
+		_mm256_storeu_si256((__m256i *)(mix+i+8), _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(mix+i+8)), hi));
+	}
+	janus_audiobridge_mix_accumulate_c(mix+i, in+i, samples-i, gain);
+}
+
+__attribute__((target("avx2")))
+static void janus_audiobridge_mix_subtract_avx2(int16_t *out, const int32_t *mix, const int16_t *in, int samples, int gain) {
+	const __m256i g = _mm256_set1_epi32(gain);
+	int i = 0;
+	for(i=0; i+16<=samples; i+=16) {
+		__m256i lo = _mm256_loadu_si256((const __m256i *)(mix+i));
+		__m256i hi = _mm256_loadu_si256((const __m256i *)(mix+i+8));
+		if(in != NULL) {
+			__m256i slo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in+i)));
+			__m256i shi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in+i+8)));
+			lo = _mm256_sub_epi32(lo, _mm256_srai_epi32(_mm256_mullo_epi32(slo, g), 10));
+			hi = _mm256_sub_epi32(hi, _mm256_srai_epi32(_mm256_mullo_epi32(shi, g), 10));
+		}
+		/* The pack works on 128-bit lanes, so we need to fix the order afterwards */
+		__m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+		_mm256_storeu_si256((__m256i *)(out+i), packed);
+	}
+	janus_audiobridge_mix_subtract_c(out+i, mix+i, in ? in+i : NULL, samples-i, gain);
+}
+
+static const janus_audiobridge_mix_ops janus_audiobridge_mix_avx2 = {
+	.name = "avx2",
+	.accumulate = janus_audiobridge_mix_accumulate_avx2,
+	.subtract = janus_audiobridge_mix_subtract_avx2,
+};
+#endif
+
+
+#ifdef JANUS_AUDIOBRIDGE_MIX_NEON
+/* NEON: 8 samples at a time */
+static void janus_audiobridge_mix_accumulate_neon(int32_t *mix, const int16_t *in, int samples, int gain) {
+	int i = 0;
+	for(i=0; i+8<=samples; i+=8) {
+		int16x8_t s = vld1q_s16(in+i);
+		int32x4_t lo = vshrq_n_s32(vmull_n_s16(vget_low_s16(s), (int16_t)gain), 10);
+		int32x4_t hi = vshrq_n_s32(vmull_n_s16(vget_high_s16(s), (int16_t)gain), 10);
+		vst1q_s32(mix+i, vaddq_s32(vld1q_s32(mix+i), lo));
+		vst1q_s32(mix+i+4, vaddq_s32(vld1q_s32(mix+i+4), hi));
+	}
+	janus_audiobridge_mix_accumulate_c(mix+i, in+i, samples-i, gain);
+}
+
+static void janus_audiobridge_mix_subtract_neon(int16_t *out, const int32_t *mix, const int16_t *in, int samples, int gain) {
+	int i = 0;
+	for(i=0; i+8<=samples; i+=8) {
+		int32x4_t lo = vld1q_s32(mix+i);
+		int32x4_t hi = vld1q_s32(mix+i+4);
+		if(in != NULL) {
+			int16x8_t s = vld1q_s16(in+i);
+			lo = vsubq_s32(lo, vshrq_n_s32(vmull_n_s16(vget_low_s16(s), (int16_t)gain), 10));
+			hi = vsubq_s32(hi, vshrq_n_s32(vmull_n_s16(vget_high_s16(s), (int16_t)gain), 10));
+		}
+		vst1q_s16(out+i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+	}
+	janus_audiobridge_mix_subtract_c(out+i, mix+i, in ? in+i : NULL, samples-i, gain);
+}
+
+static const janus_audiobridge_mix_ops janus_audiobridge_mix_neon = {
+	.name = "neon",
+	.accumulate = janus_audiobridge_mix_accumulate_neon,
+	.subtract = janus_audiobridge_mix_subtract_neon,
+};
+#endif
+
+
+int janus_audiobridge_mix_ops_list(const janus_audiobridge_mix_ops **list, int max) {
+	int count = 0;
+	if(list == NULL || max < 1)
+		return 0;
+	list[count++] = &janus_audiobridge_mix_c;
+#ifdef JANUS_AUDIOBRIDGE_MIX_X86
+	__builtin_cpu_init();
+	if(count < max && __builtin_cpu_supports("sse2"))
+		list[count++] = &janus_audiobridge_mix_sse2;
+	if(count < max && __builtin_cpu_supports("avx2"))
+		list[count++] = &janus_audiobridge_mix_avx2;
+#endif
+#ifdef JANUS_AUDIOBRIDGE_MIX_NEON
+	if(count < max)
+		list[count++] = &janus_audiobridge_mix_neon;
+#endif
+	return count;
+}
+
+const janus_audiobridge_mix_ops *janus_audiobridge_mix_ops_get(void) {
+#ifdef JANUS_AUDIOBRIDGE_MIX_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+		return &janus_audiobridge_mix_avx2;
+	if(__builtin_cpu_supports("sse2"))
+		return &janus_audiobridge_mix_sse2;
+#endif
+#ifdef JANUS_AUDIOBRIDGE_MIX_NEON
+	return &janus_audiobridge_mix_neon;
+#endif
+	return &janus_audiobridge_mix_c;
+}
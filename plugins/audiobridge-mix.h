@@ -0,0 +1,62 @@
+/*! \file    audiobridge-mix.h
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU General Public License v3
+ * \brief    Audio mixing kernels for the AudioBridge plugin (headers)
+ * \details  Provides the routines the AudioBridge mixer uses to sum the
+ * contributions of all participants, remove the contribution of a
+ * participant from the mix, and convert the mix back to 16-bit samples
+ * with saturation. Vectorized versions (SSE2/AVX2 on x86, NEON on ARM)
+ * are available, and the best one supported by the CPU is chosen at
+ * runtime, with a plain C fallback for everything else. All the versions
+ * produce exactly the same output.
+ *
+ * Gains are passed as Q10 fixed point factors (1024 means unity gain),
+ * as returned by janus_audiobridge_mix_gain().
+ *
+ * \ingroup plugins
+ * \ref plugins
+ */
+
+#ifndef _JANUS_AUDIOBRIDGE_MIX_H
+#define _JANUS_AUDIOBRIDGE_MIX_H
+
+#include <stdint.h>
+
+/*! \brief Maximum volume (percentage) a participant can be given */
+#define JANUS_AUDIOBRIDGE_MIX_MAX_VOLUME	3199
+
+/*! \brief Set of mixing routines */
+typedef struct janus_audiobridge_mix_ops {
+	/*! \brief Name of the implementation (e.g., "avx2") */
+	const char *name;
+	/*! \brief Add a participant's contribution to the mix
+	 * @param[in,out] mix The mix buffer
+	 * @param[in] in The participant's samples
+	 * @param[in] samples Number of samples
+	 * @param[in] gain The gain to apply, as a Q10 factor */
+	void (*accumulate)(int32_t *mix, const int16_t *in, int samples, int gain);
+	/*! \brief Remove a participant's contribution from the mix, and convert it to 16-bit samples with saturation
+	 * @param[out] out Where to write the samples
+	 * @param[in] mix The mix buffer
+	 * @param[in] in The participant's samples, if any (NULL to just convert the mix)
+	 * @param[in] samples Number of samples
+	 * @param[in] gain The gain that was applied to the participant's contribution, as a Q10 factor */
+	void (*subtract)(int16_t *out, const int32_t *mix, const int16_t *in, int samples, int gain);
+} janus_audiobridge_mix_ops;
+
+/*! \brief Get the best set of mixing routines this CPU supports
+ * @returns A pointer to a janus_audiobridge_mix_ops instance (never NULL) */
+const janus_audiobridge_mix_ops *janus_audiobridge_mix_ops_get(void);
+
+/*! \brief Get all the sets of mixing routines this CPU supports (e.g., to compare them)
+ * @param[out] list Array to fill with pointers to janus_audiobridge_mix_ops instances
+ * @param[in] max Size of the array
+ * @returns The number of sets written in the array (the plain C version always comes first) */
+int janus_audiobridge_mix_ops_list(const janus_audiobridge_mix_ops **list, int max);
+
+/*! \brief Convert a volume percentage to the Q10 gain factor the mixing routines expect
+ * @param[in] volume The volume, as a percentage (100 means unchanged)
+ * @returns The Q10 gain factor (clamped to a safe range) */
+int janus_audiobridge_mix_gain(int volume);
+
+#endif
@@ -0,0 +1,549 @@
+/*! \file    audiobridge-rec.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU General Public License v3
+ * \brief    Asynchronous recorder for the AudioBridge plugin
+ * \details  Implementation of the AudioBridge recorder: the mixer fills
+ * preallocated buffers, and a thread per recording writes them to disk
+ * (encoding them to Opus first, if needed). Buffers are recycled, so
+ * nothing is allocated while recording, unless the writer falls behind.
+ *
+ * \ingroup plugins
+ * \ref plugins
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <opus/opus.h>
+#ifdef HAVE_LIBOGG
+#include <ogg/ogg.h>
+#endif
+
+#include "audiobridge-rec.h"
+#include "../debug.h"
+#include "../mutex.h"
+#include "../utils.h"
+
+/* Size of the buffers (enough for more than a second of audio at 48kHz), and their alignment */
+#define REC_BUFFER_SIZE		131072
+#define REC_BUFFER_ALIGN	4096
+/* Maximum number of buffers per recording, before we start discarding audio (about a minute at 48kHz) */
+#define REC_MAX_BUFFERS		48
+/* Maximum size of an encoded Opus frame */
+#define REC_MAX_OPUS_FRAME	1500
+
+/* Buffer of samples, filled by the mixer and written by the writer thread */
+typedef struct janus_audiobridge_rec_buffer {
+	int16_t *samples;
+	int count;
+} janus_audiobridge_rec_buffer;
+
+/* Helper struct to generate WAVE headers */
+typedef struct janus_audiobridge_rec_wav_header {
+	char riff[4];
+	uint32_t len;
+	char wave[4];
+	char fmt[4];
+	uint32_t formatsize;
+	uint16_t format;
+	uint16_t channels;
+	uint32_t samplerate;
+	uint32_t avgbyterate;
+	uint16_t samplebytes;
+	uint16_t channelbits;
+	char data[4];
+	uint32_t blocksize;
+} janus_audiobridge_rec_wav_header;
+
+struct janus_audiobridge_rec {
+	char *filename;						/* Path of the recording */
+	janus_audiobridge_rec_format format;	/* Format of the recording */
+	int fd;								/* File descriptor of the recording */
+	int sampling_rate;					/* Sampling rate of the mix */
+	gint64 flush_interval;				/* How often we write to disk, at the very least (us) */
+	GThread *thread;					/* Writer thread */
+	GAsyncQueue *queue;					/* Buffers to write */
+	GAsyncQueue *pool;					/* Buffers that can be reused */
+	int buffers;						/* Number of buffers allocated so far */
+	/* Mixer side */
+	janus_audiobridge_rec_buffer *current;	/* Buffer the mixer is filling */
+	gint64 current_started;				/* When the mixer started filling it */
+	guint64 discarded;					/* Samples discarded because the writer was too slow */
+	/* Writer side */
+	guint64 written;					/* Bytes written so far */
+	gint64 last_flush;					/* When we last flushed to disk */
+	gboolean failed;					/* Whether writing failed, in which case we just discard buffers */
+	unsigned char *out;					/* Aligned buffer for the encoded data */
+	int out_len;						/* Bytes in the encoded data buffer */
+	OpusEncoder *encoder;				/* Opus encoder */
+	int16_t *frame;						/* Samples of the Opus frame being prepared */
+	int frame_count;					/* Samples in the Opus frame being prepared */
+	int frame_size;						/* Samples in an Opus frame (20ms) */
+	unsigned char *payload;				/* Encoded Opus frame */
+	unsigned char *pending;				/* Last encoded Opus frame, held back so that we can mark the end of stream */
+	int pending_len;					/* Size of the held back Opus frame */
+#ifdef HAVE_LIBOGG
+	ogg_stream_state ogg;				/* Ogg stream */
+	gboolean ogg_started;				/* Whether the Ogg stream was initialized */
+	ogg_int64_t granulepos;				/* Position in the Ogg stream (at 48kHz) */
+	ogg_int64_t packetno;				/* Ogg packet counter */
+	ogg_int64_t samples;				/* Samples we got from the mixer, at 48kHz */
+	int preskip;						/* Encoder lookahead, at 48kHz */
+#endif
+};
+
+/* Sentinel we queue to tell a writer thread the recording is over */
+static janus_audiobridge_rec_buffer rec_exit;
+
+/* Writers that are still finalizing their recording */
+static janus_mutex writers_mutex = JANUS_MUTEX_INITIALIZER;
+static janus_condition writers_cond = PTHREAD_COND_INITIALIZER;
+static int writers = 0;
+
+
+int janus_audiobridge_rec_format_parse(const char *name, janus_audiobridge_rec_format *format) {
+	if(name == NULL || format == NULL)
+		return -1;
+	if(!strcasecmp(name, "wav")) {
+		*format = JANUS_AUDIOBRIDGE_REC_WAV;
+		return 0;
+	}
+#ifdef HAVE_LIBOGG
+	if(!strcasecmp(name, "opus")) {
+		*format = JANUS_AUDIOBRIDGE_REC_OPUS;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+const char *janus_audiobridge_rec_format_name(janus_audiobridge_rec_format format) {
+	return format == JANUS_AUDIOBRIDGE_REC_OPUS ? "opus" : "wav";
+}
+
+const char *janus_audiobridge_rec_format_extension(janus_audiobridge_rec_format format) {
+	return format == JANUS_AUDIOBRIDGE_REC_OPUS ? "opus" : "wav";
+}
+
+
+static janus_audiobridge_rec_buffer *janus_audiobridge_rec_buffer_new(void) {
+	janus_audiobridge_rec_buffer *buffer = g_malloc0(sizeof(janus_audiobridge_rec_buffer));
+	if(posix_memalign((void **)&buffer->samples, REC_BUFFER_ALIGN, REC_BUFFER_SIZE) != 0) {
+		g_free(buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
+static void janus_audiobridge_rec_buffer_free(janus_audiobridge_rec_buffer *buffer) {
+	if(buffer == NULL || buffer == &rec_exit)
+		return;
+	free(buffer->samples);
+	g_free(buffer);
+}
+
+/* Write all the data, whatever it takes */
+static int janus_audiobridge_rec_write(janus_audiobridge_rec *rec, const void *data, size_t len) {
+	const char *p = (const char *)data;
+	while(len > 0) {
+		ssize_t res = write(rec->fd, p, len);
+		if(res < 0) {
+			if(errno == EINTR)
+				continue;
+			JANUS_LOG(LOG_ERR, "Error writing to recording %s: %d (%s)\n", rec->filename, errno, strerror(errno));
+			rec->failed = TRUE;
+			return -1;
+		}
+		p += res;
+		len -= res;
+		rec->written += res;
+	}
+	return 0;
+}
+
+/* Update the lengths in the WAV header */
+static void janus_audiobridge_rec_wav_update(janus_audiobridge_rec *rec) {
+	uint32_t size = rec->written - 8;
+	if(pwrite(rec->fd, &size, sizeof(uint32_t), 4) < 0)
+		return;
+	size = rec->written - sizeof(janus_audiobridge_rec_wav_header);
+	if(pwrite(rec->fd, &size, sizeof(uint32_t), 40) < 0)
+		return;
+}
+
+#ifdef HAVE_LIBOGG
+/* Write the encoded data we have, if any */
+static void janus_audiobridge_rec_out_write(janus_audiobridge_rec *rec) {
+	if(rec->out_len > 0)
+		janus_audiobridge_rec_write(rec, rec->out, rec->out_len);
+	rec->out_len = 0;
+}
+
+/* Move the Ogg pages that are ready (or all of them, if flushing) to the output buffer */
+static void janus_audiobridge_rec_ogg_pages(janus_audiobridge_rec *rec, gboolean flush) {
+	ogg_page page;
+	while(flush ? ogg_stream_flush(&rec->ogg, &page) : ogg_stream_pageout(&rec->ogg, &page)) {
+		if(rec->out_len + page.header_len + page.body_len > REC_BUFFER_SIZE)
+			janus_audiobridge_rec_out_write(rec);
+		memcpy(rec->out + rec->out_len, page.header, page.header_len);
+		rec->out_len += page.header_len;
+		memcpy(rec->out + rec->out_len, page.body, page.body_len);
+		rec->out_len += page.body_len;
+	}
+}
+
+static void janus_audiobridge_rec_ogg_packet(janus_audiobridge_rec *rec, unsigned char *data, int len, gboolean bos, gboolean eos) {
+	ogg_packet op;
+	memset(&op, 0, sizeof(op));
+	op.packet = data;
+	op.bytes = len;
+	op.b_o_s = bos;
+	op.e_o_s = eos;
+	op.granulepos = rec->granulepos;
+	op.packetno = rec->packetno++;
+	ogg_stream_packetin(&rec->ogg, &op);
+}
+
+/* Prepare the Opus encoder, and write the OpusHead and OpusTags packets */
+static int janus_audiobridge_rec_ogg_start(janus_audiobridge_rec *rec) {
+	int error = 0;
+	rec->encoder = opus_encoder_create(rec->sampling_rate, 1, OPUS_APPLICATION_VOIP, &error);
+	if(error != OPUS_OK) {
+		JANUS_LOG(LOG_ERR, "Error creating Opus encoder for recording %s: %d (%s)\n", rec->filename, error, opus_strerror(error));
+		rec->encoder = NULL;
+		return -1;
+	}
+	opus_encoder_ctl(rec->encoder, OPUS_SET_BITRATE(rec->sampling_rate >= 48000 ? 32000 : 24000));
+	opus_encoder_ctl(rec->encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+	opus_int32 lookahead = 0;
+	opus_encoder_ctl(rec->encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+	rec->frame_size = rec->sampling_rate/50;
+	rec->frame = g_malloc0(rec->frame_size * sizeof(int16_t));
+	rec->payload = g_malloc0(REC_MAX_OPUS_FRAME);
+	rec->pending = g_malloc0(REC_MAX_OPUS_FRAME);
+	if(ogg_stream_init(&rec->ogg, g_random_int()) < 0) {
+		JANUS_LOG(LOG_ERR, "Couldn't initialize Ogg stream for recording %s\n", rec->filename);
+		return -1;
+	}
+	rec->ogg_started = TRUE;
+	/* OpusHead: the pre-skip is always expressed at 48kHz */
+	unsigned char head[19];
+	memcpy(head, "OpusHead", 8);
+	head[8] = 1;
+	head[9] = 1;
+	uint16_t preskip = lookahead * (48000/rec->sampling_rate);
+	rec->preskip = preskip;
+	head[10] = preskip & 0xff;
+	head[11] = (preskip >> 8) & 0xff;
+	head[12] = rec->sampling_rate & 0xff;
+	head[13] = (rec->sampling_rate >> 8) & 0xff;
+	head[14] = (rec->sampling_rate >> 16) & 0xff;
+	head[15] = (rec->sampling_rate >> 24) & 0xff;
+	head[16] = 0;
+	head[17] = 0;
+	head[18] = 0;
+	janus_audiobridge_rec_ogg_packet(rec, head, sizeof(head), TRUE, FALSE);
+	/* OpusTags */
+	const char *vendor = "Janus AudioBridge plugin";
+	int vlen = strlen(vendor);
+	unsigned char tags[64];
+	memcpy(tags, "OpusTags", 8);
+	tags[8] = vlen & 0xff;
+	tags[9] = tags[10] = tags[11] = 0;
+	memcpy(tags+12, vendor, vlen);
+	memset(tags+12+vlen, 0, 4);
+	janus_audiobridge_rec_ogg_packet(rec, tags, 12+vlen+4, FALSE, FALSE);
+	/* The headers must be in pages of their own */
+	janus_audiobridge_rec_ogg_pages(rec, TRUE);
+	janus_audiobridge_rec_out_write(rec);
+	return 0;
+}
+
+/* Encode the Opus frame we prepared: the previous one is queued now, while this
+ * one is held back, as we'll only know it's the last one when we're closing */
+static void janus_audiobridge_rec_ogg_frame(janus_audiobridge_rec *rec) {
+	rec->frame_count = 0;
+	opus_int32 len = opus_encode(rec->encoder, rec->frame, rec->frame_size, rec->payload, REC_MAX_OPUS_FRAME);
+	if(len < 0) {
+		JANUS_LOG(LOG_ERR, "Error encoding Opus frame for recording %s: %d (%s)\n", rec->filename, len, opus_strerror(len));
+		return;
+	}
+	if(rec->pending_len > 0) {
+		rec->granulepos += 960;
+		janus_audiobridge_rec_ogg_packet(rec, rec->pending, rec->pending_len, FALSE, FALSE);
+		janus_audiobridge_rec_ogg_pages(rec, FALSE);
+	}
+	unsigned char *payload = rec->pending;
+	rec->pending = rec->payload;
+	rec->pending_len = len;
+	rec->payload = payload;
+}
+
+/* Encode the samples in a buffer, and queue the resulting Ogg pages */
+static void janus_audiobridge_rec_ogg_encode(janus_audiobridge_rec *rec, const int16_t *samples, int count) {
+	rec->samples += (ogg_int64_t)count * (48000/rec->sampling_rate);
+	while(count > 0) {
+		int num = rec->frame_size - rec->frame_count;
+		if(num > count)
+			num = count;
+		memcpy(rec->frame + rec->frame_count, samples, num * sizeof(int16_t));
+		rec->frame_count += num;
+		samples += num;
+		count -= num;
+		if(rec->frame_count < rec->frame_size)
+			break;
+		janus_audiobridge_rec_ogg_frame(rec);
+	}
+}
+
+/* Pad and encode the last partial frame, if any, and close the Ogg stream: the
+ * granule position of the last packet tells players where the audio really ends */
+static void janus_audiobridge_rec_ogg_finish(janus_audiobridge_rec *rec) {
+	if(rec->frame_count > 0 || rec->pending_len == 0) {
+		memset(rec->frame + rec->frame_count, 0, (rec->frame_size - rec->frame_count) * sizeof(int16_t));
+		janus_audiobridge_rec_ogg_frame(rec);
+	}
+	if(rec->pending_len > 0) {
+		ogg_int64_t end = rec->samples + rec->preskip;
+		rec->granulepos += 960;
+		if(end > rec->granulepos - 960 && end < rec->granulepos)
+			rec->granulepos = end;
+		janus_audiobridge_rec_ogg_packet(rec, rec->pending, rec->pending_len, FALSE, TRUE);
+		rec->pending_len = 0;
+	}
+	janus_audiobridge_rec_ogg_pages(rec, TRUE);
+	janus_audiobridge_rec_out_write(rec);
+}
+#endif
+
+/* Get rid of a recording instance (the file must have been closed already) */
+static void janus_audiobridge_rec_free(janus_audiobridge_rec *rec) {
+	janus_audiobridge_rec_buffer *buffer = NULL;
+	if(rec->pool != NULL) {
+		while((buffer = g_async_queue_try_pop(rec->pool)) != NULL)
+			janus_audiobridge_rec_buffer_free(buffer);
+		g_async_queue_unref(rec->pool);
+	}
+	if(rec->queue != NULL)
+		g_async_queue_unref(rec->queue);
+#ifdef HAVE_LIBOGG
+	if(rec->ogg_started)
+		ogg_stream_clear(&rec->ogg);
+#endif
+	if(rec->encoder != NULL)
+		opus_encoder_destroy(rec->encoder);
+	g_free(rec->frame);
+	g_free(rec->payload);
+	g_free(rec->pending);
+	free(rec->out);
+	g_free(rec->filename);
+	g_free(rec);
+}
+
+/* Thread writing the buffers of a recording to disk */
+static void *janus_audiobridge_rec_thread(void *data) {
+	janus_audiobridge_rec *rec = (janus_audiobridge_rec *)data;
+	JANUS_LOG(LOG_VERB, "Recording thread for %s starting...\n", rec->filename);
+	janus_audiobridge_rec_buffer *buffer = NULL;
+	while((buffer = g_async_queue_pop(rec->queue)) != &rec_exit) {
+		if(!rec->failed) {
+			if(rec->format == JANUS_AUDIOBRIDGE_REC_WAV) {
+				janus_audiobridge_rec_write(rec, buffer->samples, buffer->count * sizeof(int16_t));
+#ifdef HAVE_LIBOGG
+			} else {
+				janus_audiobridge_rec_ogg_encode(rec, buffer->samples, buffer->count);
+				if(rec->out_len > REC_BUFFER_SIZE/2)
+					janus_audiobridge_rec_out_write(rec);
+#endif
+			}
+		}
+		buffer->count = 0;
+		g_async_queue_push(rec->pool, buffer);
+		/* Make sure what we have so far is on disk, and usable, every now and then */
+		gint64 now = janus_get_monotonic_time();
+		if(!rec->failed && now - rec->last_flush >= rec->flush_interval) {
+			rec->last_flush = now;
+			if(rec->format == JANUS_AUDIOBRIDGE_REC_WAV) {
+				janus_audiobridge_rec_wav_update(rec);
+#ifdef HAVE_LIBOGG
+			} else {
+				janus_audiobridge_rec_ogg_pages(rec, TRUE);
+				janus_audiobridge_rec_out_write(rec);
+#endif
+			}
+		}
+	}
+	/* We're done: finalize the recording */
+	if(!rec->failed) {
+		if(rec->format == JANUS_AUDIOBRIDGE_REC_WAV) {
+			janus_audiobridge_rec_wav_update(rec);
+#ifdef HAVE_LIBOGG
+		} else {
+			janus_audiobridge_rec_ogg_finish(rec);
+#endif
+		}
+	}
+	close(rec->fd);
+	if(rec->discarded > 0) {
+		JANUS_LOG(LOG_WARN, "Recording %s: the disk couldn't keep up, %"SCNu64" samples were discarded\n",
+			rec->filename, rec->discarded);
+	}
+	JANUS_LOG(LOG_INFO, "Closed recording %s (%"SCNu64" bytes)\n", rec->filename, rec->written);
+	janus_audiobridge_rec_free(rec);
+	janus_mutex_lock(&writers_mutex);
+	writers--;
+	janus_condition_broadcast(&writers_cond);
+	janus_mutex_unlock(&writers_mutex);
+	return NULL;
+}
+
+janus_audiobridge_rec *janus_audiobridge_rec_create(const char *filename, janus_audiobridge_rec_format format,
+		int sampling_rate, gint64 flush_interval) {
+	if(filename == NULL || sampling_rate < 8000)
+		return NULL;
+#ifndef HAVE_LIBOGG
+	if(format == JANUS_AUDIOBRIDGE_REC_OPUS) {
+		JANUS_LOG(LOG_ERR, "Can't record %s as Opus, libogg support is not available\n", filename);
+		return NULL;
+	}
+#endif
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(fd < 0) {
+		JANUS_LOG(LOG_ERR, "Couldn't open recording %s: %d (%s)\n", filename, errno, strerror(errno));
+		return NULL;
+	}
+	janus_audiobridge_rec *rec = g_malloc0(sizeof(janus_audiobridge_rec));
+	rec->filename = g_strdup(filename);
+	rec->format = format;
+	rec->fd = fd;
+	rec->sampling_rate = sampling_rate;
+	rec->flush_interval = flush_interval;
+	rec->last_flush = janus_get_monotonic_time();
+	if(format == JANUS_AUDIOBRIDGE_REC_WAV) {
+		janus_audiobridge_rec_wav_header header = {
+			{'R', 'I', 'F', 'F'},
+			0,
+			{'W', 'A', 'V', 'E'},
+			{'f', 'm', 't', ' '},
+			16,
+			1,
+			1,
+			sampling_rate,
+			sampling_rate * 2,
+			2,
+			16,
+			{'d', 'a', 't', 'a'},
+			0
+		};
+		janus_audiobridge_rec_write(rec, &header, sizeof(header));
+#ifdef HAVE_LIBOGG
+	} else {
+		if(posix_memalign((void **)&rec->out, REC_BUFFER_ALIGN, REC_BUFFER_SIZE) != 0)
+			rec->out = NULL;
+		if(rec->out == NULL || janus_audiobridge_rec_ogg_start(rec) < 0)
+			rec->failed = TRUE;
+#endif
+	}
+	if(rec->failed) {
+		close(fd);
+		janus_audiobridge_rec_free(rec);
+		return NULL;
+	}
+	rec->queue = g_async_queue_new();
+	rec->pool = g_async_queue_new();
+	/* Preallocate a couple of buffers */
+	int i = 0;
+	for(i=0; i<2; i++) {
+		janus_audiobridge_rec_buffer *buffer = janus_audiobridge_rec_buffer_new();
+		if(buffer == NULL)
+			break;
+		rec->buffers++;
+		g_async_queue_push(rec->pool, buffer);
+	}
+	janus_mutex_lock(&writers_mutex);
+	writers++;
+	janus_mutex_unlock(&writers_mutex);
+	GError *error = NULL;
+	rec->thread = g_thread_try_new("abrecorder", &janus_audiobridge_rec_thread, rec, &error);
+	if(error != NULL) {
+		JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the recording thread...\n", error->code, error->message ? error->message : "??");
+		g_error_free(error);
+		janus_mutex_lock(&writers_mutex);
+		writers--;
+		janus_mutex_unlock(&writers_mutex);
+		close(fd);
+		janus_audiobridge_rec_free(rec);
+		return NULL;
+	}
+	return rec;
+}
+
+int janus_audiobridge_rec_save(janus_audiobridge_rec *rec, const int16_t *samples, int count) {
+	if(rec == NULL || samples == NULL || count < 1)
+		return -1;
+	const int capacity = REC_BUFFER_SIZE/sizeof(int16_t);
+	gint64 now = janus_get_monotonic_time();
+	while(count > 0) {
+		if(rec->current == NULL) {
+			/* Get a buffer to fill: reuse one, or allocate a new one if the writer is lagging behind */
+			rec->current = g_async_queue_try_pop(rec->pool);
+			if(rec->current == NULL && rec->buffers < REC_MAX_BUFFERS) {
+				rec->current = janus_audiobridge_rec_buffer_new();
+				if(rec->current != NULL)
+					rec->buffers++;
+			}
+			if(rec->current == NULL) {
+				/* Too much audio buffered already, we can't keep up with the disk */
+				if(rec->discarded == 0)
+					JANUS_LOG(LOG_WARN, "Recording %s: the disk can't keep up, discarding audio\n", rec->filename);
+				rec->discarded += count;
+				return -1;
+			}
+			rec->current_started = now;
+		}
+		janus_audiobridge_rec_buffer *buffer = rec->current;
+		int num = capacity - buffer->count;
+		if(num > count)
+			num = count;
+		memcpy(buffer->samples + buffer->count, samples, num * sizeof(int16_t));
+		buffer->count += num;
+		samples += num;
+		count -= num;
+		/* Hand the buffer to the writer when it's full, or when it's time to flush */
+		if(buffer->count == capacity || now - rec->current_started >= rec->flush_interval) {
+			g_async_queue_push(rec->queue, buffer);
+			rec->current = NULL;
+		}
+	}
+	return 0;
+}
+
+void janus_audiobridge_rec_close(janus_audiobridge_rec *rec) {
+	if(rec == NULL)
+		return;
+	/* Hand whatever we have left to the writer thread, which will take care of the rest */
+	if(rec->current != NULL) {
+		if(rec->current->count > 0) {
+			g_async_queue_push(rec->queue, rec->current);
+		} else {
+			g_async_queue_push(rec->pool, rec->current);
+		}
+		rec->current = NULL;
+	}
+	GThread *thread = rec->thread;
+	g_async_queue_push(rec->queue, &rec_exit);
+	g_thread_unref(thread);
+}
+
+void janus_audiobridge_rec_wait_all(void) {
+	janus_mutex_lock(&writers_mutex);
+	while(writers > 0) {
+		janus_condition_wait(&writers_cond, &writers_mutex);
+	}
+	janus_mutex_unlock(&writers_mutex);
+}
@@ -0,0 +1,79 @@
+/*! \file    audiobridge-rec.h
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU General Public License v3
+ * \brief    Asynchronous recorder for the AudioBridge plugin (headers)
+ * \details  Provides the writer the AudioBridge uses to record the mix of
+ * a room. The mixer only copies its frames into large preallocated and
+ * aligned buffers, which are handed to a dedicated thread when they're
+ * full or when the configured flush interval expires: this thread is the
+ * only one touching the disk, so that a slow or stalled disk never delays
+ * the mix. Recordings can be saved either as plain WAV files, or as Opus
+ * in an Ogg container (when libogg is available), in which case frames
+ * are encoded by the writer thread as well.
+ *
+ * \ingroup plugins
+ * \ref plugins
+ */
+
+#ifndef _JANUS_AUDIOBRIDGE_REC_H
+#define _JANUS_AUDIOBRIDGE_REC_H
+
+#include <stdint.h>
+
+#include <glib.h>
+
+/*! \brief Recording formats */
+typedef enum janus_audiobridge_rec_format {
+	/*! \brief Uncompressed 16-bit PCM, in a WAV file */
+	JANUS_AUDIOBRIDGE_REC_WAV = 0,
+	/*! \brief Opus, in an Ogg container */
+	JANUS_AUDIOBRIDGE_REC_OPUS,
+} janus_audiobridge_rec_format;
+
+/*! \brief Recorder instance */
+typedef struct janus_audiobridge_rec janus_audiobridge_rec;
+
+/*! \brief Parse the name of a recording format
+ * @param[in] name The name of the format ("wav" or "opus")
+ * @param[out] format Where to write the format
+ * @returns 0 if the format is known and supported, -1 otherwise */
+int janus_audiobridge_rec_format_parse(const char *name, janus_audiobridge_rec_format *format);
+
+/*! \brief Get the name of a recording format
+ * @param[in] format The recording format
+ * @returns The name of the format */
+const char *janus_audiobridge_rec_format_name(janus_audiobridge_rec_format format);
+
+/*! \brief Get the file extension to use for a recording format
+ * @param[in] format The recording format
+ * @returns The extension, without the dot */
+const char *janus_audiobridge_rec_format_extension(janus_audiobridge_rec_format format);
+
+/*! \brief Open a file for recording, and start the thread that will write to it
+ * @param[in] filename Path of the file to create
+ * @param[in] format Format to save the recording in
+ * @param[in] sampling_rate Sampling rate of the mix
+ * @param[in] flush_interval How often buffered audio should be written to disk, at the very least, in microseconds
+ * @returns A new janus_audiobridge_rec instance, or NULL in case of errors */
+janus_audiobridge_rec *janus_audiobridge_rec_create(const char *filename, janus_audiobridge_rec_format format,
+	int sampling_rate, gint64 flush_interval);
+
+/*! \brief Add samples to a recording
+ * @note This never blocks on the disk: if the writer can't keep up and too
+ * much audio is buffered already, samples are discarded instead
+ * @param[in] rec The janus_audiobridge_rec instance
+ * @param[in] samples The samples to add
+ * @param[in] count Number of samples
+ * @returns 0 in case of success, -1 if (some of) the samples were discarded */
+int janus_audiobridge_rec_save(janus_audiobridge_rec *rec, const int16_t *samples, int count);
+
+/*! \brief Close a recording
+ * @note This doesn't wait for the buffered audio to be written: the writer
+ * thread finalizes the file and gets rid of the instance in the background
+ * @param[in] rec The janus_audiobridge_rec instance to close */
+void janus_audiobridge_rec_close(janus_audiobridge_rec *rec);
+
+/*! \brief Wait for all the recordings that were closed to be finalized */
+void janus_audiobridge_rec_wait_all(void);
+
+#endif
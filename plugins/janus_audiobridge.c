@@ -30,6 +30,8 @@ audiolevel_ext = yes|no (whether the ssrc-audio-level RTP extension must be
 	negotiated/used or not for new joins, default=yes)
 record = true|false (whether this room should be recorded, default=false)
 record_file =	/path/to/recording.wav (where to save the recording)
+record_format = wav|opus (whether to save the recording as WAV or as Opus in
+	an Ogg container, which needs much less space; default=wav)
 \endverbatim
  *
  * \section bridgeapi Audio Bridge API
@@ -40,7 +42,7 @@ record_file =	/path/to/recording.wav (where to save the recording)
  * synchronous error response even for asynchronous requests. 
  * 
  * \c create , \c edit , \c destroy , \c exists, \c allowed, \c kick, \c list,
- * \c listparticipants and \c resetdecoder are synchronous requests,
+ * \c listparticipants , \c resetdecoder and \c mixers are synchronous requests,
  * which means you'll get a response directly within the context of the
  * transaction. \c create allows you to create a new audio conference bridge
  * dynamically, as an alternative to using the configuration file; \c edit
@@ -53,7 +55,8 @@ record_file =	/path/to/recording.wav (where to save the recording)
  * the participants of a specific room and their details; finally,
  * \c resetdecoder marks the Opus decoder for the participant as invalid,
  * and forces it to be recreated (which might be needed if the audio
- * for generated by the participant becomes garbled). 
+ * for generated by the participant becomes garbled); \c mixers returns
+ * statistics on the threads mixing the rooms. 
  * 
  * The \c join , \c configure , \c changeroom and \c leave requests
  * instead are all asynchronous, which means you'll get a notification
@@ -90,8 +93,10 @@ record_file =	/path/to/recording.wav (where to save the recording)
 	"audiolevel_event" : yes|no (whether to emit event to other users or not),
 	"audio_active_packets" : 100 (number of packets with audio level, default=100, 2 seconds),
 	"audio_level_average" : 25 (average value of audio level, 127=muted, 0='too loud', default=25),
+	"max_speakers" : <only mix the N loudest participants in each frame, optional, 0 (mix everyone) by default>,
 	"record" : <true|false, whether to record the room or not, default false>,
 	"record_file" : "</path/to/the/recording.wav, optional>",
+	"record_format" : "<wav|opus, format of the recording, optional, wav by default>",
 }
 \endverbatim
  *
@@ -276,6 +281,65 @@ record_file =	/path/to/recording.wav (where to save the recording)
 	]
 }
 \endverbatim
+ *
+ * Rooms are not mixed by a dedicated thread each: a small pool of mixer
+ * threads (one per core, up to 8, by default; see the \c mixer_threads
+ * property in the \c general section of the configuration file) wakes
+ * up every 20ms and mixes all the rooms it has been assigned. To check
+ * how well they're keeping up, you can use the \c mixers request, which
+ * has to be formatted as follows (\c admin_key only needs to be provided
+ * if one has been configured):
+ * 
+\verbatim
+{
+	"request" : "mixers",
+	"admin_key" : "<plugin administrator key, if configured>"
+}
+\endverbatim
+ *
+ * A successful request will produce a list of mixer threads in a
+ * \c success response:
+ * 
+\verbatim
+{
+	"audiobridge" : "success",
+	"period" : <mixing period, in microseconds>,
+	"mixers" : [		// Array of mixer thread objects
+		{	// Mixer thread #1
+			"id" : <index of the mixer thread>,
+			"rooms" : <number of rooms this thread is mixing>,
+			"ticks" : <mixing rounds done so far>,
+			"overruns" : <rounds that were not completed within the mixing period>,
+			"skipped" : <rounds that were skipped because the thread was too late>,
+			"jitter_avg" : <average delay of the wake ups, in microseconds>,
+			"jitter_max" : <maximum delay of the wake ups, in microseconds>,
+			"load_avg" : <average time spent mixing in each round, in microseconds>,
+			"load_max" : <maximum time spent mixing in a round, in microseconds>
+		},
+		// Other mixer threads
+	],
+	"encoders" : [		// Array of encoder thread objects
+		{	// Encoder thread #1
+			"id" : <index of the encoder thread>,
+			"queue" : <frames waiting to be encoded and sent>,
+			"frames" : <frames sent so far>,
+			"encode_avg" : <average time spent encoding a frame, in microseconds>,
+			"encode_max" : <maximum time spent encoding a frame, in microseconds>,
+			"latency_avg" : <average time from the mixing round to the frame being sent, in microseconds>,
+			"latency_max" : <maximum time from the mixing round to the frame being sent, in microseconds>
+		},
+		// Other encoder threads
+	]
+}
+\endverbatim
+ *
+ * Mixed frames are encoded and sent to participants by a separate pool
+ * of encoder threads (again one per core, up to 16, by default; see the
+ * \c encoder_threads property), each always serving the same subset of
+ * participants, which is what the \c encoders part above refers to.
+ * The same information, for the mixer thread a participant's room is
+ * assigned to and the encoder thread serving the participant, is also
+ * available in the Admin API.
  *
  * To get a list of the participants in a specific room, instead, you
  * can make use of the \c listparticipants request, which has to be
@@ -566,10 +630,14 @@ record_file =	/path/to/recording.wav (where to save the recording)
  */
 
 #include "plugin.h"
+#include "audiobridge-mix.h"
+#include "audiobridge-rec.h"
 
 #include <jansson.h>
 #include <opus/opus.h>
 #include <sys/time.h>
+#include <time.h>
+#include <math.h>
 
 #include "../debug.h"
 #include "../apierror.h"
@@ -580,6 +648,7 @@ record_file =	/path/to/recording.wav (where to save the recording)
 #include "../record.h"
 #include "../sdp-utils.h"
 #include "../utils.h"
+#include "../jitter.h"
 
 
 /* Plugin information */
@@ -656,11 +725,13 @@ static struct janus_json_parameter create_parameters[] = {
 	{"sampling", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
 	{"record", JANUS_JSON_BOOL, 0},
 	{"record_file", JSON_STRING, 0},
+	{"record_format", JSON_STRING, 0},
 	{"permanent", JANUS_JSON_BOOL, 0},
 	{"audiolevel_ext", JANUS_JSON_BOOL, 0},
 	{"audiolevel_event", JANUS_JSON_BOOL, 0},
 	{"audio_active_packets", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
 	{"audio_level_average", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
+	{"max_speakers", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE},
 	{"room", JSON_INTEGER, JANUS_JSON_PARAM_POSITIVE}
 };
 static struct janus_json_parameter edit_parameters[] = {
@@ -729,12 +800,12 @@ static janus_mutex config_mutex = JANUS_MUTEX_INITIALIZER;
 static volatile gint initialized = 0, stopping = 0;
 static gboolean notify_events = TRUE;
 static janus_callbacks *gateway = NULL;
+static const janus_audiobridge_mix_ops *mix_ops = NULL;
 static GThread *handler_thread;
 static GThread *watchdog;
 static void *janus_audiobridge_handler(void *data);
 static void janus_audiobridge_relay_rtp_packet(gpointer data, gpointer user_data);
-static void *janus_audiobridge_mixer_thread(void *data);
-static void *janus_audiobridge_participant_thread(void *data);
+static void *janus_audiobridge_scheduler_thread(void *data);
 
 typedef struct janus_audiobridge_message {
 	janus_plugin_session *handle;
@@ -775,15 +846,18 @@ typedef struct janus_audiobridge_room {
 	gboolean audiolevel_event;	/* Whether to emit event to other users about audiolevel */
 	int audio_active_packets;	/* amount of packets with audio level for checkup */
 	int audio_level_average;	/* average audio level */
+	int max_speakers;			/* If set, maximum number of participants to mix in each frame (the loudest ones) */
 	gboolean record;			/* Whether this room has to be recorded or not */
 	gchar *record_file;			/* Path of the recording file */
-	FILE *recording;			/* File to record the room into */
-	gint64 record_lastupdate;	/* Time when we last updated the wav header */
+	janus_audiobridge_rec_format record_format;	/* Format of the recording */
+	janus_audiobridge_rec *recording;	/* Recording of the room, written by its own thread */
 	gboolean destroy;			/* Value to flag the room for destruction */
 	GHashTable *participants;	/* Map of participants */
 	gboolean check_tokens;		/* Whether to check tokens when participants join (see below) */
 	GHashTable *allowed;		/* Map of participants (as tokens) allowed to join */
-	GThread *thread;			/* Mixer thread for this room */
+	struct janus_audiobridge_mixer *mixer;			/* Mixing state for this room */
+	struct janus_audiobridge_scheduler *scheduler;	/* Scheduler thread mixing this room */
+	volatile gint mixer_stopped;	/* Whether the scheduler is done mixing this room */
 	gint64 destroyed;			/* When this room has been destroyed */
 	janus_mutex mutex;			/* Mutex to lock this room instance */
 	/* RTP forwarders for this room's mix */
@@ -797,6 +871,73 @@ static janus_mutex rooms_mutex = JANUS_MUTEX_INITIALIZER;
 static GList *old_rooms;
 static char *admin_key = NULL;
 
+/* Mixing state of a room, updated by the scheduler thread every 20ms */
+typedef struct janus_audiobridge_mixer {
+	int samples;				/* Number of samples in each frame */
+	opus_int32 buffer[960];		/* Mix of all the contributions (assuming 48kHz, although we'll likely use less than that) */
+	opus_int16 outBuffer[960];	/* Frame to send, or record */
+	OpusEncoder *mix_encoder;	/* Encoder for the full mix, shared by all participants not contributing to it */
+	unsigned char *mixpayload;	/* Buffer for the encoded full mix */
+	GPtrArray *speakers;		/* Participants that may be mixed, if the room limits the number of speakers */
+	unsigned char *rtpbuffer;	/* Base RTP packet, in case there are forwarders involved */
+	gint16 seq;					/* RTP sequence number of the mix */
+	gint32 ts;					/* RTP timestamp of the mix */
+	int prev_count;				/* Number of participants and forwarders in the previous frame */
+} janus_audiobridge_mixer;
+
+/* Mixer scheduler: rather than having a thread per room, a small pool of
+ * threads wakes up every 20ms (sleeping until an absolute deadline) and
+ * mixes all the rooms it has been assigned in a row */
+#define MIXER_PERIOD		20000	/* us */
+#define MIXER_MAX_LATE		5		/* Rounds we can catch up with before skipping ahead */
+#define MAX_MIXER_THREADS	64
+typedef struct janus_audiobridge_scheduler {
+	guint id;					/* Index of this scheduler */
+	GThread *thread;			/* Thread mixing the rooms */
+	GList *rooms;				/* Rooms this thread is mixing */
+	volatile gint rooms_num;	/* Number of rooms this thread is mixing */
+	janus_mutex mutex;			/* Mutex to lock the list of rooms */
+	janus_condition cond;		/* Condition to wait for a room to be stopped */
+	/* Statistics */
+	guint64 ticks;				/* Mixing rounds done so far */
+	guint64 overruns;			/* Rounds that took longer than the mixing period */
+	guint64 skipped;			/* Rounds we skipped because we were too late */
+	gint64 jitter_avg;			/* Average delay of the wake ups with respect to the deadline (us) */
+	gint64 jitter_max;			/* Maximum delay of the wake ups with respect to the deadline (us) */
+	gint64 load_avg;			/* Average time spent mixing in each round (us) */
+	gint64 load_max;			/* Maximum time spent mixing in a round (us) */
+} janus_audiobridge_scheduler;
+static janus_audiobridge_scheduler *schedulers = NULL;
+static guint schedulers_num = 0;
+static int janus_audiobridge_scheduler_add(janus_audiobridge_room *audiobridge);
+static void janus_audiobridge_scheduler_wait(janus_audiobridge_room *audiobridge);
+
+/* Encoder pool: rather than having a thread per participant, mixed frames
+ * are encoded and sent by a small pool of threads. Each participant is
+ * always served by the same thread, so that its frames are encoded in order
+ * and its encoder is never used by two threads at the same time */
+#define MAX_ENCODER_THREADS	64
+typedef struct janus_audiobridge_encoder_worker {
+	guint id;					/* Index of this worker */
+	GThread *thread;			/* Thread encoding the frames */
+	GAsyncQueue *queue;			/* Participants that have a new frame to encode and send */
+	/* Statistics */
+	guint64 frames;				/* Frames sent so far */
+	gint64 encode_avg;			/* Average time spent encoding a frame (us) */
+	gint64 encode_max;			/* Maximum time spent encoding a frame (us) */
+	gint64 latency_avg;			/* Average time from the mixing round to the frame being sent (us) */
+	gint64 latency_max;			/* Maximum time from the mixing round to the frame being sent (us) */
+} janus_audiobridge_encoder_worker;
+static janus_audiobridge_encoder_worker *encoders = NULL;
+static guint encoders_num = 0;
+static volatile gint encoders_next = 0;
+static janus_audiobridge_encoder_worker encoder_exit;	/* Pushed to a worker's queue to have it stop */
+static void *janus_audiobridge_encoder_thread(void *data);
+
+/* How often recordings of the mix are written to disk, at the very least */
+#define DEFAULT_RECORD_FLUSH_INTERVAL	5
+static gint64 record_flush_interval = DEFAULT_RECORD_FLUSH_INTERVAL*G_USEC_PER_SEC;
+
 typedef struct janus_audiobridge_session {
 	janus_plugin_session *handle;
 	gpointer participant;
@@ -814,16 +955,18 @@ typedef struct janus_audiobridge_participant {
 	janus_audiobridge_room *room;	/* Room */
 	guint64 user_id;		/* Unique ID in the room */
 	gchar *display;			/* Display name (opaque value, only meaningful to application) */
-	gboolean prebuffering;	/* Whether this participant needs pre-buffering of a few packets (just joined) */
 	gboolean active;		/* Whether this participant can receive media at all */
-	gboolean working;		/* Whether this participant is currently encoding/decoding */
+	volatile gint working;	/* Whether this participant is currently encoding/sending (set with qmutex locked) */
 	gboolean muted;			/* Whether this participant is muted */
 	int volume_gain;		/* Gain to apply to the input audio (in percentage) */
 	int opus_complexity;	/* Complexity to use in the encoder (by default, DEFAULT_COMPLEXITY) */
 	/* RTP stuff */
-	GList *inbuf;			/* Incoming audio from this participant, as an ordered list of packets */
+	janus_jitter_buffer *jitter;	/* Incoming audio from this participant, decoded */
+	unsigned char *fec_payload;	/* Last packet with in-band FEC (LBRR) data for a frame we're missing, if any */
+	int fec_len;			/* Size of the packet in fec_payload (0 if there's none) */
+	uint16_t fec_seq;		/* Sequence number of the missing frame the packet in fec_payload can recover */
+	const janus_jitter_buffer_frame *playout;	/* Frame this participant contributes to the current mixing round, if any */
 	GAsyncQueue *outbuf;	/* Mixed audio for this participant */
-	gint64 last_drop;		/* When we last dropped a packet because the imcoming queue was full */
 	janus_mutex qmutex;		/* Incoming queue mutex */
 	int opus_pt;			/* Opus payload type */
 	int extmap_id;			/* Audio level RTP extension id, if any */
@@ -831,17 +974,41 @@ typedef struct janus_audiobridge_participant {
 	int audio_active_packets;	/* Participant's number of audio packets to accumulate */
 	int audio_dBov_sum;	    /* Participant's accumulated dBov value for audio level */
 	gboolean talking;		/* Whether this participant is currently talking (uses audio levels extension) */
+	int mix_level;			/* Smoothed audio level (dBov), used to pick the speakers when the room limits them */
+	int mix_score;			/* Score of this participant in the current mixing round (lower is louder) */
+	gboolean in_mix;		/* Whether this participant is currently one of the speakers being mixed */
+	int silent_frames;		/* How many mixing rounds in a row this participant didn't contribute to */
+	gboolean shared_mix;	/* Whether this participant is currently getting the mix encoded by the shared encoder */
 	janus_rtp_switching_context context;	/* Needed in case the participant changes room */
 	/* Opus stuff */
 	OpusEncoder *encoder;		/* Opus encoder instance */
 	OpusDecoder *decoder;		/* Opus decoder instance */
 	gboolean reset;				/* Whether or not the Opus context must be reset, without re-joining the room */
-	GThread *thread;			/* Encoding thread for this participant */
+	janus_audiobridge_encoder_worker *encoder_worker;	/* Thread encoding and sending the mix for this participant */
 	janus_recorder *arc;		/* The Janus recorder instance for this user's audio, if enabled */
 	janus_mutex rec_mutex;		/* Mutex to protect the recorder from race conditions */
 	gint64 destroyed;			/* When this participant has been destroyed */
 } janus_audiobridge_participant;
 
+/* Opus frame the mixer encoded once for all the participants that get the full mix */
+typedef struct janus_audiobridge_encoded_frame {
+	unsigned char *data;
+	gint length;
+	volatile gint ref;
+} janus_audiobridge_encoded_frame;
+static janus_audiobridge_encoded_frame *janus_audiobridge_encoded_frame_new(const unsigned char *data, int length) {
+	janus_audiobridge_encoded_frame *frame = g_malloc(sizeof(janus_audiobridge_encoded_frame) + length);
+	frame->data = (unsigned char *)(frame + 1);
+	memcpy(frame->data, data, length);
+	frame->length = length;
+	g_atomic_int_set(&frame->ref, 1);
+	return frame;
+}
+static void janus_audiobridge_encoded_frame_unref(janus_audiobridge_encoded_frame *frame) {
+	if(frame && g_atomic_int_dec_and_test(&frame->ref))
+		g_free(frame);
+}
+
 /* Packets we get from gstreamer and relay */
 typedef struct janus_audiobridge_rtp_relay_packet {
 	rtp_header *data;
@@ -849,7 +1016,9 @@ typedef struct janus_audiobridge_rtp_relay_packet {
 	uint32_t ssrc;
 	uint32_t timestamp;
 	uint16_t seq_number;
-	gboolean silence;
+	janus_audiobridge_encoded_frame *encoded;	/* Already encoded frame, for mixed packets that don't need encoding */
+	gboolean reset_encoder;	/* Whether the participant's encoder must be reset before encoding this frame */
+	gint64 mixed;	/* When the mixer prepared this frame, to measure how long it took to send it */
 } janus_audiobridge_rtp_relay_packet;
 
 /* RTP forwarder instance: address to send to, and current RTP header info */
@@ -888,52 +1057,80 @@ static guint32 janus_audiobridge_rtp_forwarder_add_helper(janus_audiobridge_room
 }
 
 
-/* Helper to sort incoming RTP packets by sequence numbers */
-static gint janus_audiobridge_rtp_sort(gconstpointer a, gconstpointer b) {
-	janus_audiobridge_rtp_relay_packet *pkt1 = (janus_audiobridge_rtp_relay_packet *)a;
-	janus_audiobridge_rtp_relay_packet *pkt2 = (janus_audiobridge_rtp_relay_packet *)b;
-	if(pkt1->seq_number < 100 && pkt2->seq_number > 65000) {
-		/* Sequence number was probably reset, pkt2 is older */
-		return 1;
-	} else if(pkt2->seq_number < 100 && pkt1->seq_number > 65000) {
-		/* Sequence number was probably reset, pkt1 is older */
-		return -1;
+/* Helper to estimate the audio level (in dBov, as in the audio level extension) of a decoded frame */
+static int janus_audiobridge_samples_level(opus_int16 *samples, int count) {
+	if(samples == NULL || count < 1)
+		return 127;
+	double energy = 0;
+	int i = 0;
+	for(i=0; i<count; i++)
+		energy += (double)samples[i]*samples[i];
+	double rms = sqrt(energy/count);
+	if(rms < 1.0)
+		return 127;
+	int level = (int)(-20.0*log10(rms/32768.0));
+	return level < 0 ? 0 : (level > 127 ? 127 : level);
+}
+
+/* Helper to pick the participants to mix, when a room limits the number of speakers:
+ * participants are ranked by their smoothed audio level, and the ones that are mixed
+ * already get a bonus, so that speakers with similar levels don't keep on flapping */
+#define SPEAKERS_HYSTERESIS	6	/* dB */
+static gint janus_audiobridge_speakers_sort(gconstpointer a, gconstpointer b) {
+	janus_audiobridge_participant *p1 = *(janus_audiobridge_participant **)a;
+	janus_audiobridge_participant *p2 = *(janus_audiobridge_participant **)b;
+	return p1->mix_score - p2->mix_score;
+}
+static void janus_audiobridge_select_speakers(janus_audiobridge_room *audiobridge, GList *participants, GPtrArray *candidates) {
+	g_ptr_array_set_size(candidates, 0);
+	GList *ps = participants;
+	while(ps) {
+		janus_audiobridge_participant *p = (janus_audiobridge_participant *)ps->data;
+		gboolean candidate = FALSE;
+		int level = 127;
+		if(p->playout != NULL && p->playout->level != 127) {
+			candidate = TRUE;
+			if(p->playout->level >= 0)
+				level = p->playout->level;
+		}
+		/* Smooth the level, so that short pauses or peaks don't change the ranking */
+		p->mix_level = (3*p->mix_level + level)/4;
+		if(candidate) {
+			p->mix_score = p->mix_level - (p->in_mix ? SPEAKERS_HYSTERESIS : 0);
+			g_ptr_array_add(candidates, p);
+		} else {
+			p->in_mix = FALSE;
+		}
+		ps = ps->next;
+	}
+	if(candidates->len > (guint)audiobridge->max_speakers)
+		g_ptr_array_sort(candidates, janus_audiobridge_speakers_sort);
+	guint i = 0;
+	for(i=0; i<candidates->len; i++) {
+		janus_audiobridge_participant *p = (janus_audiobridge_participant *)g_ptr_array_index(candidates, i);
+		p->in_mix = (i < (guint)audiobridge->max_speakers);
 	}
-	/* Simply compare timestamps */
-	if(pkt1->seq_number < pkt2->seq_number)
-		return -1;
-	else if(pkt1->seq_number > pkt2->seq_number)
-		return 1;
-	return 0;
 }
 
-/* Helper struct to generate and parse WAVE headers */
-typedef struct wav_header {
-	char riff[4];
-	uint32_t len;
-	char wave[4];
-	char fmt[4];
-	uint32_t formatsize;
-	uint16_t format;
-	uint16_t channels;
-	uint32_t samplerate;
-	uint32_t avgbyterate;
-	uint16_t samplebytes;
-	uint16_t channelbits;
-	char data[4];
-	uint32_t blocksize;
-} wav_header;
 
 
 /* Mixer settings */
 #define DEFAULT_PREBUFFERING	6
+/* Jitter buffer: at most 20ms at 48kHz per frame, and between 2 and 12 frames queued depending on the jitter */
+#define JITTER_BUFFER_SLOTS		32
+#define JITTER_BUFFER_SAMPLES	960
+#define JITTER_BUFFER_MIN		2
+#define JITTER_BUFFER_MAX		DEFAULT_PREBUFFERING*2
 
 
 /* Opus settings */		
 #define	BUFFER_SAMPLES	8000
 #define	OPUS_SAMPLES	160
+#define	FEC_PAYLOAD_MAX	1500
 #define USE_FEC			0
 #define DEFAULT_COMPLEXITY	4
+/* Mixing rounds (20ms each) a participant must be out of the mix before getting the shared encoded mix */
+#define JANUS_AUDIOBRIDGE_SHARED_MIX_HOLDOFF	50
 
 
 /* Error codes */
@@ -1059,6 +1256,109 @@ int janus_audiobridge_init(janus_callbacks *callback, const char *config_path) {
 	/* This is the callback we'll need to invoke to contact the gateway */
 	gateway = callback;
 
+	/* Pick the fastest mixing routines this CPU supports: this must be done
+	 * before any mixer thread is started, as they use them right away */
+	mix_ops = janus_audiobridge_mix_ops_get();
+	JANUS_LOG(LOG_VERB, "Using %s audio mixing routines\n", mix_ops->name);
+
+	/* Start the threads that will take care of mixing the rooms: by default
+	 * we use one per core (up to 8), as each can mix several rooms */
+	long int cores = sysconf(_SC_NPROCESSORS_ONLN);
+	schedulers_num = cores > 0 ? (cores < 8 ? cores : 8) : 1;
+	if(config != NULL) {
+		janus_config_item *threads = janus_config_get_item_drilldown(config, "general", "mixer_threads");
+		if(threads != NULL && threads->value != NULL) {
+			int num = atoi(threads->value);
+			if(num < 1 || num > MAX_MIXER_THREADS) {
+				JANUS_LOG(LOG_WARN, "Invalid number of mixer threads (%d), using %u\n", num, schedulers_num);
+			} else {
+				schedulers_num = num;
+			}
+		}
+	}
+	schedulers = g_malloc0(schedulers_num * sizeof(janus_audiobridge_scheduler));
+	guint i = 0;
+	for(i=0; i<schedulers_num; i++) {
+		janus_audiobridge_scheduler *scheduler = &schedulers[i];
+		scheduler->id = i;
+		janus_mutex_init(&scheduler->mutex);
+		janus_condition_init(&scheduler->cond);
+		GError *error = NULL;
+		char tname[16];
+		g_snprintf(tname, sizeof(tname), "mixer %u", i);
+		scheduler->thread = g_thread_try_new(tname, &janus_audiobridge_scheduler_thread, scheduler, &error);
+		if(error != NULL) {
+			JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the mixer thread...\n", error->code, error->message ? error->message : "??");
+			g_error_free(error);
+			break;
+		}
+	}
+	if(i < schedulers_num) {
+		/* Only use the threads we managed to start */
+		schedulers_num = i;
+		if(schedulers_num == 0) {
+			g_free(schedulers);
+			schedulers = NULL;
+			janus_config_destroy(config);
+			return -1;
+		}
+	}
+	JANUS_LOG(LOG_VERB, "Using %u mixer threads\n", schedulers_num);
+	/* Start the threads that will encode and send the mix to participants:
+	 * as for mixer threads, by default we use one per core (up to 16) */
+	encoders_num = cores > 0 ? (cores < 16 ? cores : 16) : 1;
+	if(config != NULL) {
+		janus_config_item *threads = janus_config_get_item_drilldown(config, "general", "encoder_threads");
+		if(threads != NULL && threads->value != NULL) {
+			int num = atoi(threads->value);
+			if(num < 1 || num > MAX_ENCODER_THREADS) {
+				JANUS_LOG(LOG_WARN, "Invalid number of encoder threads (%d), using %u\n", num, encoders_num);
+			} else {
+				encoders_num = num;
+			}
+		}
+	}
+	encoders = g_malloc0(encoders_num * sizeof(janus_audiobridge_encoder_worker));
+	for(i=0; i<encoders_num; i++) {
+		janus_audiobridge_encoder_worker *worker = &encoders[i];
+		worker->id = i;
+		worker->queue = g_async_queue_new();
+		GError *error = NULL;
+		char tname[16];
+		g_snprintf(tname, sizeof(tname), "abencoder %u", i);
+		worker->thread = g_thread_try_new(tname, &janus_audiobridge_encoder_thread, worker, &error);
+		if(error != NULL) {
+			JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the encoder thread...\n", error->code, error->message ? error->message : "??");
+			g_error_free(error);
+			g_async_queue_unref(worker->queue);
+			worker->queue = NULL;
+			break;
+		}
+	}
+	if(i < encoders_num) {
+		/* Only use the threads we managed to start */
+		encoders_num = i;
+		if(encoders_num == 0) {
+			g_free(encoders);
+			encoders = NULL;
+			janus_config_destroy(config);
+			return -1;
+		}
+	}
+	JANUS_LOG(LOG_VERB, "Using %u encoder threads\n", encoders_num);
+	/* How often should room recordings be written to disk? */
+	if(config != NULL) {
+		janus_config_item *flush = janus_config_get_item_drilldown(config, "general", "record_flush_interval");
+		if(flush != NULL && flush->value != NULL) {
+			int interval = atoi(flush->value);
+			if(interval < 1) {
+				JANUS_LOG(LOG_WARN, "Invalid recording flush interval (%d), using %d seconds\n", interval, DEFAULT_RECORD_FLUSH_INTERVAL);
+			} else {
+				record_flush_interval = (gint64)interval*G_USEC_PER_SEC;
+			}
+		}
+	}
+
 	/* Parse configuration to populate the rooms list */
 	if(config != NULL) {
 		/* Any admin key to limit who can "create"? */
@@ -1087,10 +1387,12 @@ int janus_audiobridge_init(janus_callbacks *callback, const char *config_path) {
 			janus_config_item *audiolevel_event = janus_config_get_item(cat, "audiolevel_event");
 			janus_config_item *audio_active_packets = janus_config_get_item(cat, "audio_active_packets");
 			janus_config_item *audio_level_average = janus_config_get_item(cat, "audio_level_average");
+			janus_config_item *max_speakers = janus_config_get_item(cat, "max_speakers");
 			janus_config_item *secret = janus_config_get_item(cat, "secret");
 			janus_config_item *pin = janus_config_get_item(cat, "pin");
 			janus_config_item *record = janus_config_get_item(cat, "record");
 			janus_config_item *recfile = janus_config_get_item(cat, "record_file");
+			janus_config_item *recformat = janus_config_get_item(cat, "record_format");
 			if(sampling == NULL || sampling->value == NULL) {
 				JANUS_LOG(LOG_ERR, "Can't add the audio room, missing mandatory information...\n");
 				cl = cl->next;
@@ -1144,6 +1446,14 @@ int janus_audiobridge_init(janus_callbacks *callback, const char *config_path) {
 					}
 				}
 			}
+			audiobridge->max_speakers = 0;
+			if(max_speakers != NULL && max_speakers->value != NULL) {
+				if(atoi(max_speakers->value) >= 0) {
+					audiobridge->max_speakers = atoi(max_speakers->value);
+				} else {
+					JANUS_LOG(LOG_WARN, "Invalid max_speakers value provided, mixing everyone\n");
+				}
+			}
 
 			if(secret != NULL && secret->value != NULL) {
 				audiobridge->room_secret = g_strdup(secret->value);
@@ -1156,6 +1466,11 @@ int janus_audiobridge_init(janus_callbacks *callback, const char *config_path) {
 				audiobridge->record = TRUE;
 			if(recfile && recfile->value)
 				audiobridge->record_file = g_strdup(recfile->value);
+			audiobridge->record_format = JANUS_AUDIOBRIDGE_REC_WAV;
+			if(recformat && recformat->value &&
+					janus_audiobridge_rec_format_parse(recformat->value, &audiobridge->record_format) < 0) {
+				JANUS_LOG(LOG_WARN, "Unsupported record_format value '%s', recording as WAV\n", recformat->value);
+			}
 			audiobridge->recording = NULL;
 			audiobridge->destroy = 0;
 			audiobridge->participants = g_hash_table_new_full(g_int64_hash, g_int64_equal, (GDestroyNotify)g_free, NULL);
@@ -1172,14 +1487,10 @@ int janus_audiobridge_init(janus_callbacks *callback, const char *config_path) {
 				audiobridge->is_private ? "private" : "public",
 				audiobridge->room_secret ? audiobridge->room_secret : "no secret",
 				audiobridge->room_pin ? audiobridge->room_pin : "no pin");
-			/* We need a thread for the mix */
-			GError *error = NULL;
-			char tname[16];
-			g_snprintf(tname, sizeof(tname), "mixer %"SCNu64, audiobridge->room_id);
-			audiobridge->thread = g_thread_try_new(tname, &janus_audiobridge_mixer_thread, audiobridge, &error);
-			if(error != NULL) {
+			/* Have one of the mixer threads take care of the mix */
+			if(janus_audiobridge_scheduler_add(audiobridge) < 0) {
 				/* FIXME We should clear some resources... */
-				JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the mixer thread...\n", error->code, error->message ? error->message : "??");
+				JANUS_LOG(LOG_ERR, "No mixer thread available for room %"SCNu64"...\n", audiobridge->room_id);
 			} else {
 				janus_mutex_lock(&rooms_mutex);
 				g_hash_table_insert(rooms, janus_uint64_dup(audiobridge->room_id), audiobridge);
@@ -1235,6 +1546,30 @@ void janus_audiobridge_destroy(void) {
 		g_thread_join(handler_thread);
 		handler_thread = NULL;
 	}
+	/* Wait for the mixer threads to be done with the rooms */
+	guint i = 0;
+	for(i=0; i<schedulers_num; i++) {
+		if(schedulers[i].thread != NULL)
+			g_thread_join(schedulers[i].thread);
+		janus_mutex_destroy(&schedulers[i].mutex);
+		janus_condition_destroy(&schedulers[i].cond);
+	}
+	g_free(schedulers);
+	schedulers = NULL;
+	schedulers_num = 0;
+	/* Now that nothing is being mixed anymore, stop the encoder threads too */
+	for(i=0; i<encoders_num; i++) {
+		if(encoders[i].thread != NULL) {
+			g_async_queue_push(encoders[i].queue, &encoder_exit);
+			g_thread_join(encoders[i].thread);
+		}
+		g_async_queue_unref(encoders[i].queue);
+	}
+	g_free(encoders);
+	encoders = NULL;
+	encoders_num = 0;
+	/* Wait for the recordings of the rooms to be finalized */
+	janus_audiobridge_rec_wait_all();
 	if(watchdog != NULL) {
 		g_thread_join(watchdog);
 		watchdog = NULL;
@@ -1362,24 +1697,50 @@ json_t *janus_audiobridge_query_session(janus_plugin_session *handle) {
 	if(participant) {
 		janus_mutex_lock(&rooms_mutex);
 		janus_audiobridge_room *room = participant->room;
-		if(room != NULL)
+		if(room != NULL) {
 			json_object_set_new(info, "room", json_integer(room->room_id));
+			if(room->scheduler != NULL) {
+				json_t *mixer = json_object();
+				json_object_set_new(mixer, "id", json_integer(room->scheduler->id));
+				json_object_set_new(mixer, "overruns", json_integer(room->scheduler->overruns));
+				json_object_set_new(mixer, "jitter_avg", json_integer(room->scheduler->jitter_avg));
+				json_object_set_new(mixer, "load_avg", json_integer(room->scheduler->load_avg));
+				json_object_set_new(info, "mixer", mixer);
+			}
+		}
 		janus_mutex_unlock(&rooms_mutex);
 		json_object_set_new(info, "id", json_integer(participant->user_id));
 		if(participant->display)
 			json_object_set_new(info, "display", json_string(participant->display));
 		json_object_set_new(info, "muted", participant->muted ? json_true() : json_false());
 		json_object_set_new(info, "active", participant->active ? json_true() : json_false());
-		json_object_set_new(info, "pre-buffering", participant->prebuffering ? json_true() : json_false());
-		if(participant->inbuf) {
+		if(participant->jitter) {
+			janus_jitter_buffer_stats stats;
 			janus_mutex_lock(&participant->qmutex);
-			json_object_set_new(info, "queue-in", json_integer(g_list_length(participant->inbuf)));
+			janus_jitter_buffer_get_stats(participant->jitter, &stats);
 			janus_mutex_unlock(&participant->qmutex);
+			json_object_set_new(info, "pre-buffering", stats.buffering ? json_true() : json_false());
+			json_object_set_new(info, "queue-in", json_integer(stats.depth));
+			json_t *jb = json_object();
+			json_object_set_new(jb, "target", json_integer(stats.target));
+			json_object_set_new(jb, "jitter", json_integer(stats.jitter));
+			json_object_set_new(jb, "received", json_integer(stats.received));
+			json_object_set_new(jb, "recovered", json_integer(stats.recovered));
+			json_object_set_new(jb, "concealed", json_integer(stats.concealed));
+			json_object_set_new(jb, "late", json_integer(stats.late));
+			json_object_set_new(jb, "dropped", json_integer(stats.dropped));
+			json_object_set_new(jb, "underruns", json_integer(stats.underruns));
+			json_object_set_new(info, "jitter-buffer", jb);
 		}
 		if(participant->outbuf)
 			json_object_set_new(info, "queue-out", json_integer(g_async_queue_length(participant->outbuf)));
-		if(participant->last_drop > 0)
-			json_object_set_new(info, "last-drop", json_integer(participant->last_drop));
+		if(participant->encoder_worker) {
+			json_t *encoder = json_object();
+			json_object_set_new(encoder, "id", json_integer(participant->encoder_worker->id));
+			json_object_set_new(encoder, "encode_avg", json_integer(participant->encoder_worker->encode_avg));
+			json_object_set_new(encoder, "latency_avg", json_integer(participant->encoder_worker->latency_avg));
+			json_object_set_new(info, "encoder", encoder);
+		}
 		if(participant->arc && participant->arc->filename)
 			json_object_set_new(info, "audio-recording", json_string(participant->arc->filename));
 		if(participant->extmap_id > 0) {
@@ -1467,9 +1828,18 @@ struct janus_plugin_result *janus_audiobridge_handle_message(janus_plugin_sessio
 		json_t *audiolevel_event = json_object_get(root, "audiolevel_event");
 		json_t *audio_active_packets = json_object_get(root, "audio_active_packets");
 		json_t *audio_level_average = json_object_get(root, "audio_level_average");
+		json_t *max_speakers = json_object_get(root, "max_speakers");
 		json_t *record = json_object_get(root, "record");
 		json_t *recfile = json_object_get(root, "record_file");
+		json_t *recformat = json_object_get(root, "record_format");
 		json_t *permanent = json_object_get(root, "permanent");
+		janus_audiobridge_rec_format record_format = JANUS_AUDIOBRIDGE_REC_WAV;
+		if(recformat && janus_audiobridge_rec_format_parse(json_string_value(recformat), &record_format) < 0) {
+			JANUS_LOG(LOG_ERR, "Unsupported record_format value (%s)\n", json_string_value(recformat));
+			error_code = JANUS_AUDIOBRIDGE_ERROR_INVALID_ELEMENT;
+			g_snprintf(error_cause, 512, "Unsupported record_format value (%s)", json_string_value(recformat));
+			goto plugin_response;
+		}
 		if(allowed) {
 			/* Make sure the "allowed" array only contains strings */
 			gboolean ok = TRUE;
@@ -1562,6 +1932,7 @@ struct janus_plugin_result *janus_audiobridge_handle_message(janus_plugin_sessio
 				JANUS_LOG(LOG_WARN, "Invalid audio_level_average value provided, using default: %d\n", audiobridge->audio_level_average);
 			}
 		}
+		audiobridge->max_speakers = max_speakers ? json_integer_value(max_speakers) : 0;
 		switch(audiobridge->sampling_rate) {
 			case 8000:
 			case 12000:
@@ -1582,6 +1953,7 @@ struct janus_plugin_result *janus_audiobridge_handle_message(janus_plugin_sessio
 			audiobridge->record = TRUE;
 		if(recfile)
 			audiobridge->record_file = g_strdup(json_string_value(recfile));
+		audiobridge->record_format = record_format;
 		audiobridge->recording = NULL;
 		audiobridge->destroy = 0;
 		audiobridge->participants = g_hash_table_new_full(g_int64_hash, g_int64_equal, (GDestroyNotify)g_free, NULL);
@@ -1610,16 +1982,13 @@ struct janus_plugin_result *janus_audiobridge_handle_message(janus_plugin_sessio
 			audiobridge->is_private ? "private" : "public",
 			audiobridge->room_secret ? audiobridge->room_secret : "no secret",
 			audiobridge->room_pin ? audiobridge->room_pin : "no pin");
-		/* We need a thread for the mix */
-		GError *error = NULL;
-		char tname[16];
-		g_snprintf(tname, sizeof(tname), "mixer %"SCNu64, audiobridge->room_id);
-		audiobridge->thread = g_thread_try_new(tname, &janus_audiobridge_mixer_thread, audiobridge, &error);
-		if(error != NULL) {
+		/* Have one of the mixer threads take care of the mix */
+		if(janus_audiobridge_scheduler_add(audiobridge) < 0) {
+			g_hash_table_remove(rooms, &audiobridge->room_id);
 			janus_mutex_unlock(&rooms_mutex);
-			JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the mixer thread...\n", error->code, error->message ? error->message : "??");
+			JANUS_LOG(LOG_ERR, "No mixer thread available for room %"SCNu64"...\n", audiobridge->room_id);
 			error_code = JANUS_AUDIOBRIDGE_ERROR_UNKNOWN_ERROR;
-			g_snprintf(error_cause, 512, "Got error %d (%s) trying to launch the mixer thread", error->code, error->message ? error->message : "??");
+			g_snprintf(error_cause, 512, "No mixer thread available");
 			g_free(audiobridge->room_name);
 			g_free(audiobridge->room_secret);
 			g_free(audiobridge->record_file);
@@ -1649,10 +2018,16 @@ struct janus_plugin_result *janus_audiobridge_handle_message(janus_plugin_sessio
 				janus_config_add_item(config, cat, "secret", audiobridge->room_secret);
 			if(audiobridge->room_pin)
 				janus_config_add_item(config, cat, "pin", audiobridge->room_pin);
+			if(audiobridge->max_speakers > 0) {
+				g_snprintf(value, BUFSIZ, "%d", audiobridge->max_speakers);
+				janus_config_add_item(config, cat, "max_speakers", value);
+			}
 			if(audiobridge->record_file) {
 				janus_config_add_item(config, cat, "record", "yes");
 				janus_config_add_item(config, cat, "record_file", audiobridge->record_file);
 			}
+			if(audiobridge->record_format != JANUS_AUDIOBRIDGE_REC_WAV)
+				janus_config_add_item(config, cat, "record_format", janus_audiobridge_rec_format_name(audiobridge->record_format));
 			/* Save modified configuration */
 			if(janus_config_save(config, config_folder, JANUS_AUDIOBRIDGE_PACKAGE) < 0)
 				save = FALSE;	/* This will notify the user the room is not permanent */
@@ -1754,10 +2129,16 @@ struct janus_plugin_result *janus_audiobridge_handle_message(janus_plugin_sessio
 				janus_config_add_item(config, cat, "secret", audiobridge->room_secret);
 			if(audiobridge->room_pin)
 				janus_config_add_item(config, cat, "pin", audiobridge->room_pin);
+			if(audiobridge->max_speakers > 0) {
+				g_snprintf(value, BUFSIZ, "%d", audiobridge->max_speakers);
+				janus_config_add_item(config, cat, "max_speakers", value);
+			}
 			if(audiobridge->record_file) {
 				janus_config_add_item(config, cat, "record", "yes");
 				janus_config_add_item(config, cat, "record_file", audiobridge->record_file);
 			}
+			if(audiobridge->record_format != JANUS_AUDIOBRIDGE_REC_WAV)
+				janus_config_add_item(config, cat, "record_format", janus_audiobridge_rec_format_name(audiobridge->record_format));
 			/* Save modified configuration */
 			if(janus_config_save(config, config_folder, JANUS_AUDIOBRIDGE_PACKAGE) < 0)
 				save = FALSE;	/* This will notify the user the room changes are not permanent */
@@ -1849,19 +2230,7 @@ struct janus_plugin_result *janus_audiobridge_handle_message(janus_plugin_sessio
 				/* Get rid of queued packets */
 				janus_mutex_lock(&p->qmutex);
 				p->active = FALSE;
-				while(p->inbuf) {
-					GList *first = g_list_first(p->inbuf);
-					janus_audiobridge_rtp_relay_packet *pkt = (janus_audiobridge_rtp_relay_packet *)first->data;
-					p->inbuf = g_list_remove_link(p->inbuf, first);
-					first = NULL;
-					if(pkt == NULL)
-						continue;
-					if(pkt->data)
-						g_free(pkt->data);
-					pkt->data = NULL;
-					g_free(pkt);
-					pkt = NULL;
-				}
+				janus_jitter_buffer_reset(p->jitter);
 				janus_mutex_unlock(&p->qmutex);
 			}
 		}
@@ -1873,11 +2242,11 @@ struct janus_plugin_result *janus_audiobridge_handle_message(janus_plugin_sessio
 			json_object_set_new(info, "room", json_integer(room_id));
 			gateway->notify_event(&janus_audiobridge_plugin, session->handle, info);
 		}
-		JANUS_LOG(LOG_VERB, "Waiting for the mixer thread to complete...\n");
+		JANUS_LOG(LOG_VERB, "Waiting for the mixer thread to be done with the room...\n");
 		audiobridge->destroyed = janus_get_monotonic_time();
 		janus_mutex_unlock(&audiobridge->mutex);
 		janus_mutex_unlock(&rooms_mutex);
-		g_thread_join(audiobridge->thread);
+		janus_audiobridge_scheduler_wait(audiobridge);
 		/* Done */
 		response = json_object();
 		json_object_set_new(response, "audiobridge", json_string("destroyed"));
@@ -1908,6 +2277,8 @@ struct janus_plugin_result *janus_audiobridge_handle_message(janus_plugin_sessio
 			json_object_set_new(rl, "room", json_integer(room->room_id));
 			json_object_set_new(rl, "description", json_string(room->room_name));
 			json_object_set_new(rl, "sampling_rate", json_integer(room->sampling_rate));
+			if(room->max_speakers > 0)
+				json_object_set_new(rl, "max_speakers", json_integer(room->max_speakers));
 			json_object_set_new(rl, "pin_required", room->room_pin ? json_true() : json_false());
 			json_object_set_new(rl, "record", room->record ? json_true() : json_false());
 			/* TODO: Possibly list participant details... or make it a separate API call for a specific room */
@@ -1920,6 +2291,55 @@ struct janus_plugin_result *janus_audiobridge_handle_message(janus_plugin_sessio
 		json_object_set_new(response, "audiobridge", json_string("success"));
 		json_object_set_new(response, "list", list);
 		goto plugin_response;
+	} else if(!strcasecmp(request_text, "mixers")) {
+		/* Return statistics on the mixer threads */
+		if(admin_key != NULL) {
+			/* An admin key was specified: make sure it was provided, and that it's valid */
+			JANUS_VALIDATE_JSON_OBJECT(root, adminkey_parameters,
+				error_code, error_cause, TRUE,
+				JANUS_AUDIOBRIDGE_ERROR_MISSING_ELEMENT, JANUS_AUDIOBRIDGE_ERROR_INVALID_ELEMENT);
+			if(error_code != 0)
+				goto plugin_response;
+			JANUS_CHECK_SECRET(admin_key, root, "admin_key", error_code, error_cause,
+				JANUS_AUDIOBRIDGE_ERROR_MISSING_ELEMENT, JANUS_AUDIOBRIDGE_ERROR_INVALID_ELEMENT, JANUS_AUDIOBRIDGE_ERROR_UNAUTHORIZED);
+			if(error_code != 0)
+				goto plugin_response;
+		}
+		json_t *list = json_array();
+		guint i = 0;
+		for(i=0; i<schedulers_num; i++) {
+			janus_audiobridge_scheduler *scheduler = &schedulers[i];
+			json_t *ml = json_object();
+			json_object_set_new(ml, "id", json_integer(scheduler->id));
+			json_object_set_new(ml, "rooms", json_integer(g_atomic_int_get(&scheduler->rooms_num)));
+			json_object_set_new(ml, "ticks", json_integer(scheduler->ticks));
+			json_object_set_new(ml, "overruns", json_integer(scheduler->overruns));
+			json_object_set_new(ml, "skipped", json_integer(scheduler->skipped));
+			json_object_set_new(ml, "jitter_avg", json_integer(scheduler->jitter_avg));
+			json_object_set_new(ml, "jitter_max", json_integer(scheduler->jitter_max));
+			json_object_set_new(ml, "load_avg", json_integer(scheduler->load_avg));
+			json_object_set_new(ml, "load_max", json_integer(scheduler->load_max));
+			json_array_append_new(list, ml);
+		}
+		json_t *elist = json_array();
+		for(i=0; i<encoders_num; i++) {
+			janus_audiobridge_encoder_worker *worker = &encoders[i];
+			json_t *el = json_object();
+			json_object_set_new(el, "id", json_integer(worker->id));
+			json_object_set_new(el, "queue", json_integer(g_async_queue_length(worker->queue)));
+			json_object_set_new(el, "frames", json_integer(worker->frames));
+			json_object_set_new(el, "encode_avg", json_integer(worker->encode_avg));
+			json_object_set_new(el, "encode_max", json_integer(worker->encode_max));
+			json_object_set_new(el, "latency_avg", json_integer(worker->latency_avg));
+			json_object_set_new(el, "latency_max", json_integer(worker->latency_max));
+			json_array_append_new(elist, el);
+		}
+		response = json_object();
+		json_object_set_new(response, "audiobridge", json_string("success"));
+		json_object_set_new(response, "period", json_integer(MIXER_PERIOD));
+		json_object_set_new(response, "mixers", list);
+		json_object_set_new(response, "encoders", elist);
+		goto plugin_response;
 	} else if(!strcasecmp(request_text, "exists")) {
 		/* Check whether a given room exists or not, returns true/false */	
 		JANUS_VALIDATE_JSON_OBJECT(root, room_parameters,
@@ -2421,37 +2841,15 @@ void janus_audiobridge_incoming_rtp(janus_plugin_session *handle, int video, cha
 	/* Save the frame if we're recording this leg */
 	janus_recorder_save_frame(participant->arc, buf, len);
 	if(participant->active && participant->decoder) {
-		/* First of all, check if a reset on the decoder is due */
-		if(participant->reset) {
-			/* Create a new decoder and get rid of the old one */
-			int error = 0;
-			OpusDecoder *decoder = opus_decoder_create(participant->room->sampling_rate, 1, &error);
-			if(error != OPUS_OK) {
-				JANUS_LOG(LOG_ERR, "Error resetting Opus decoder...\n");
-			} else {
-				if(participant->decoder)
-					opus_decoder_destroy(participant->decoder);
-				participant->decoder = decoder;
-				JANUS_LOG(LOG_VERB, "Opus decoder reset\n");
-			}
-			participant->reset = FALSE;
-		}
-		/* Decode frame (Opus -> slinear) */
 		rtp_header *rtp = (rtp_header *)buf;
-		janus_audiobridge_rtp_relay_packet *pkt = g_malloc0(sizeof(janus_audiobridge_rtp_relay_packet));
-		pkt->data = g_malloc0(BUFFER_SAMPLES*sizeof(opus_int16));
-		pkt->ssrc = 0;
-		pkt->timestamp = ntohl(rtp->timestamp);
-		pkt->seq_number = ntohs(rtp->seq_number);
+		uint16_t seq_number = ntohs(rtp->seq_number);
+		uint32_t timestamp = ntohl(rtp->timestamp);
 		/* We might check the audio level extension to see if this is silence */
-		pkt->silence = FALSE;
+		int level = -1;
 
 		if(participant->extmap_id > 0) {
 			/* Check the audio levels, in case we need to notify participants about who's talking */
-			int level = 0;
 			if(janus_rtp_header_extension_parse_audio_level(buf, len, participant->extmap_id, &level) == 0) {
-				/* Is this silence? */
-				pkt->silence = (level == 127);
 				if(participant->room->audiolevel_event) {
 					/* We also need to detect who's talking: update our monitoring stuff */
 					participant->audio_dBov_sum += level;
@@ -2494,66 +2892,96 @@ void janus_audiobridge_incoming_rtp(janus_plugin_session *handle, int video, cha
 						}
 					}
 				}
+			} else {
+				level = -1;
 			}
 		}
-		participant->working = TRUE;
 		int plen = 0;
 		const unsigned char *payload = (const unsigned char *)janus_rtp_payload(buf, len, &plen);
 		if(!payload) {
 			JANUS_LOG(LOG_ERR, "[Opus] Ops! got an error accessing the RTP payload\n");
-			g_free(pkt->data);
-			g_free(pkt);
-			return;
-		}
-		pkt->length = opus_decode(participant->decoder, payload, plen, (opus_int16 *)pkt->data, BUFFER_SAMPLES, USE_FEC);
-		participant->working = FALSE;
-		if(pkt->length < 0) {
-			JANUS_LOG(LOG_ERR, "[Opus] Ops! got an error decoding the Opus frame: %d (%s)\n", pkt->length, opus_strerror(pkt->length));
-			g_free(pkt->data);
-			g_free(pkt);
 			return;
 		}
-		/* Enqueue the decoded frame */
+		/* We decode directly in the jitter buffer, and as the mixer may need the
+		 * decoder too (to conceal lost packets), we do that holding the lock */
 		janus_mutex_lock(&participant->qmutex);
-		/* Insert packets sorting by sequence number */
-		participant->inbuf = g_list_insert_sorted(participant->inbuf, pkt, &janus_audiobridge_rtp_sort);
-		if(participant->prebuffering) {
-			/* Still pre-buffering: do we have enough packets now? */
-			if(g_list_length(participant->inbuf) == DEFAULT_PREBUFFERING) {
-				participant->prebuffering = FALSE;
-				JANUS_LOG(LOG_VERB, "Prebuffering done! Finally adding the user to the mix\n");
+		/* First of all, check if a reset on the decoder is due */
+		if(participant->reset) {
+			/* Create a new decoder and get rid of the old one */
+			int error = 0;
+			OpusDecoder *decoder = opus_decoder_create(participant->room->sampling_rate, 1, &error);
+			if(error != OPUS_OK) {
+				JANUS_LOG(LOG_ERR, "Error resetting Opus decoder...\n");
 			} else {
-				JANUS_LOG(LOG_VERB, "Still prebuffering (got %d packets), not adding the user to the mix yet\n", g_list_length(participant->inbuf));
-			}
-		} else {
-			/* Make sure we're not queueing too many packets: if so, get rid of the older ones */
-			if(g_list_length(participant->inbuf) >= DEFAULT_PREBUFFERING*2) {
-				gint64 now = janus_get_monotonic_time();
-				if(now - participant->last_drop > 5*G_USEC_PER_SEC) {
-					JANUS_LOG(LOG_VERB, "Too many packets in queue (%d > %d), removing older ones\n",
-						g_list_length(participant->inbuf), DEFAULT_PREBUFFERING*2);
-					participant->last_drop = now;
-				}
-				while(g_list_length(participant->inbuf) > DEFAULT_PREBUFFERING*2) {
-					/* Remove this packet: it's too old */
-					GList *first = g_list_first(participant->inbuf);
-					janus_audiobridge_rtp_relay_packet *pkt = (janus_audiobridge_rtp_relay_packet *)first->data;
-					participant->inbuf = g_list_remove_link(participant->inbuf, first);
-					first = NULL;
-					if(pkt == NULL)
-						continue;
-					if(pkt->data)
-						g_free(pkt->data);
-					pkt->data = NULL;
-					g_free(pkt);
-					pkt = NULL;
-				}
+				if(participant->decoder)
+					opus_decoder_destroy(participant->decoder);
+				participant->decoder = decoder;
+				JANUS_LOG(LOG_VERB, "Opus decoder reset\n");
 			}
+			participant->reset = FALSE;
+		}
+		janus_audiobridge_room *audiobridge = participant->room;
+		if(participant->decoder == NULL || audiobridge == NULL) {
+			janus_mutex_unlock(&participant->qmutex);
+			return;
+		}
+		/* If we're missing the previous packet and this one carries in-band FEC data for it, keep it
+		 * around: if the previous packet doesn't arrive in time (it may just be reordered), we'll
+		 * try to recover it from this one when it's due, rather than concealing it */
+		uint16_t prev_seq = seq_number-1;
+		if(plen <= FEC_PAYLOAD_MAX && janus_jitter_buffer_missing(participant->jitter, prev_seq) &&
+				opus_packet_has_lbrr(payload, plen) == 1) {
+			if(participant->fec_payload == NULL)
+				participant->fec_payload = g_malloc(FEC_PAYLOAD_MAX);
+			memcpy(participant->fec_payload, payload, plen);
+			participant->fec_len = plen;
+			participant->fec_seq = prev_seq;
+		}
+		/* Decode frame (Opus -> slinear) */
+		opus_int16 *slot = (opus_int16 *)janus_jitter_buffer_slot(participant->jitter, seq_number);
+		if(slot == NULL) {
+			/* Too late (we already played or concealed it) or a duplicate */
+			janus_mutex_unlock(&participant->qmutex);
+			return;
+		}
+		int count = opus_decode(participant->decoder, payload, plen, slot, JITTER_BUFFER_SAMPLES, 0);
+		if(count < 0) {
+			janus_mutex_unlock(&participant->qmutex);
+			JANUS_LOG(LOG_ERR, "[Opus] Ops! got an error decoding the Opus frame: %d (%s)\n", count, opus_strerror(count));
+			return;
+		}
+		if(level < 0 && audiobridge->max_speakers > 0) {
+			/* No audio level extension, but we need to rank speakers: estimate it ourselves */
+			level = janus_audiobridge_samples_level(slot, count);
 		}
+		/* Enqueue the decoded frame */
+		janus_jitter_buffer_commit(participant->jitter, seq_number, timestamp, count, level, FALSE);
 		janus_mutex_unlock(&participant->qmutex);
 	}
 }
 
+/* Recover a packet a participant lost using the in-band FEC data of the next one, if we got it,
+ * or conceal it using the Opus PLC: called by the jitter buffer when the frame is due, with the
+ * participant's lock held */
+static int janus_audiobridge_conceal(void *user_data, uint16_t seq, int16_t *samples, int count, gboolean *recovered) {
+	janus_audiobridge_participant *participant = (janus_audiobridge_participant *)user_data;
+	if(participant == NULL || participant->decoder == NULL)
+		return -1;
+	if(participant->fec_len > 0 && participant->fec_seq == seq) {
+		int fec_len = participant->fec_len;
+		participant->fec_len = 0;
+		int fec = opus_decode(participant->decoder, participant->fec_payload, fec_len, samples, count, 1);
+		if(fec > 0) {
+			*recovered = TRUE;
+			return fec;
+		}
+	} else if(participant->fec_len > 0 && (int16_t)(participant->fec_seq - seq) < 0) {
+		/* The frame this packet could recover is gone already */
+		participant->fec_len = 0;
+	}
+	return opus_decode(participant->decoder, NULL, 0, samples, count, 0);
+}
+
 void janus_audiobridge_incoming_rtcp(janus_plugin_session *handle, int video, char *buf, int len) {
 	if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
 		return;
@@ -2624,10 +3052,21 @@ void janus_audiobridge_hangup_media(janus_plugin_session *handle) {
 	if(participant->display)
 		g_free(participant->display);
 	participant->display = NULL;
-	participant->prebuffering = TRUE;
-	/* Make sure we're not using the encoder/decoder right now, we're going to destroy them */
-	while(participant->working)
+	/* Make sure we're not using the encoder/decoder right now, we're going to destroy them:
+	 * as the encoder thread only starts working with this lock held and the participant
+	 * active, nobody will touch the encoder or the session after this */
+	while(g_atomic_int_get(&participant->working))
 		g_usleep(5000);
+	/* Get rid of the mixed frames that haven't been encoded yet: the references the
+	 * encoder thread may still have in its queue will find nothing to do */
+	if(participant->outbuf != NULL) {
+		janus_audiobridge_rtp_relay_packet *pkt = NULL;
+		while((pkt = g_async_queue_try_pop(participant->outbuf)) != NULL) {
+			g_free(pkt->data);
+			janus_audiobridge_encoded_frame_unref(pkt->encoded);
+			g_free(pkt);
+		}
+	}
 	if(participant->encoder)
 		opus_encoder_destroy(participant->encoder);
 	participant->encoder = NULL;
@@ -2639,20 +3078,8 @@ void janus_audiobridge_hangup_media(janus_plugin_session *handle) {
 	participant->audio_dBov_sum = 0;
 	participant->talking = FALSE;
 	/* Get rid of queued packets */
-	while(participant->inbuf) {
-		GList *first = g_list_first(participant->inbuf);
-		janus_audiobridge_rtp_relay_packet *pkt = (janus_audiobridge_rtp_relay_packet *)first->data;
-		participant->inbuf = g_list_remove_link(participant->inbuf, first);
-		first = NULL;
-		if(pkt == NULL)
-			continue;
-		if(pkt->data)
-			g_free(pkt->data);
-		pkt->data = NULL;
-		g_free(pkt);
-		pkt = NULL;
-	}
-	participant->last_drop = 0;
+	janus_jitter_buffer_reset(participant->jitter);
+	participant->fec_len = 0;
 	janus_mutex_unlock(&participant->qmutex);
 	if(audiobridge != NULL) {
 		janus_mutex_unlock(&audiobridge->mutex);
@@ -2803,11 +3230,10 @@ static void *janus_audiobridge_handler(void *data) {
 			if(participant == NULL) {
 				participant = g_malloc0(sizeof(janus_audiobridge_participant));
 				participant->active = FALSE;
-				participant->prebuffering = TRUE;
 				participant->display = NULL;
-				participant->inbuf = NULL;
+				participant->jitter = janus_jitter_buffer_create(JITTER_BUFFER_SLOTS, JITTER_BUFFER_SAMPLES,
+					48000, 20, JITTER_BUFFER_MIN, JITTER_BUFFER_MAX);
 				participant->outbuf = NULL;
-				participant->last_drop = 0;
 				participant->encoder = NULL;
 				participant->decoder = NULL;
 				participant->reset = FALSE;
@@ -2817,6 +3243,10 @@ static void *janus_audiobridge_handler(void *data) {
 			}
 			participant->session = session;
 			participant->room = audiobridge;
+			participant->mix_level = 127;	/* Start as silent, for the speakers ranking */
+			participant->silent_frames = 0;
+			participant->shared_mix = FALSE;
+			participant->in_mix = FALSE;
 			participant->user_id = user_id;
 			g_free(participant->display);
 			participant->display = display_text ? g_strdup(display_text) : NULL;
@@ -2844,6 +3274,7 @@ static void *janus_audiobridge_handler(void *data) {
 					janus_mutex_unlock(&rooms_mutex);
 					if(participant->display)
 						g_free(participant->display);
+					janus_jitter_buffer_destroy(participant->jitter);
 					g_free(participant);
 					JANUS_LOG(LOG_ERR, "Error creating Opus encoder\n");
 					error_code = JANUS_AUDIOBRIDGE_ERROR_LIBOPUS_ERROR;
@@ -2884,6 +3315,7 @@ static void *janus_audiobridge_handler(void *data) {
 					if(participant->decoder)
 						opus_decoder_destroy(participant->decoder);
 					participant->decoder = NULL;
+					janus_jitter_buffer_destroy(participant->jitter);
 					g_free(participant);
 					JANUS_LOG(LOG_ERR, "Error creating Opus encoder\n");
 					error_code = JANUS_AUDIOBRIDGE_ERROR_LIBOPUS_ERROR;
@@ -2892,19 +3324,11 @@ static void *janus_audiobridge_handler(void *data) {
 				}
 			}
 			participant->reset = FALSE;
-			/* Finally, start the encoding thread if it hasn't already */
-			if(participant->thread == NULL) {
-				GError *error = NULL;
-				char roomtrunc[5], parttrunc[5];
-				g_snprintf(roomtrunc, sizeof(roomtrunc), "%"SCNu64, audiobridge->room_id);
-				g_snprintf(parttrunc, sizeof(parttrunc), "%"SCNu64, participant->user_id);
-				char tname[16];
-				g_snprintf(tname, sizeof(tname), "mixer %s %s", roomtrunc, parttrunc);
-				participant->thread = g_thread_try_new(tname, &janus_audiobridge_participant_thread, participant, &error);
-				if(error != NULL) {
-					/* FIXME We should fail here... */
-					JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the participant thread...\n", error->code, error->message ? error->message : "??");
-				}
+			/* Finally, pick the encoder thread for this participant if we haven't already */
+			if(participant->encoder_worker == NULL) {
+				guint index = (guint)g_atomic_int_add(&encoders_next, 1) % encoders_num;
+				participant->encoder_worker = &encoders[index];
+				JANUS_LOG(LOG_VERB, "Participant %"SCNu64" will be served by encoder thread #%u\n", participant->user_id, index);
 			}
 			
 			/* Done */
@@ -3011,19 +3435,7 @@ static void *janus_audiobridge_handler(void *data) {
 					if(participant->muted) {
 						/* Clear the queued packets waiting to be handled */
 						janus_mutex_lock(&participant->qmutex);
-						while(participant->inbuf) {
-							GList *first = g_list_first(participant->inbuf);
-							janus_audiobridge_rtp_relay_packet *pkt = (janus_audiobridge_rtp_relay_packet *)first->data;
-							participant->inbuf = g_list_remove_link(participant->inbuf, first);
-							first = NULL;
-							if(pkt == NULL)
-								continue;
-							if(pkt->data)
-								g_free(pkt->data);
-							pkt->data = NULL;
-							g_free(pkt);
-							pkt = NULL;
-						}
+						janus_jitter_buffer_reset(participant->jitter);
 						janus_mutex_unlock(&participant->qmutex);
 					}
 				}
@@ -3222,7 +3634,9 @@ static void *janus_audiobridge_handler(void *data) {
 				}
 			}
 			JANUS_LOG(LOG_VERB, "  -- Participant ID in new room %"SCNu64": %"SCNu64"\n", room_id, user_id);
-			participant->prebuffering = TRUE;
+			janus_mutex_lock(&participant->qmutex);
+			janus_jitter_buffer_reset(participant->jitter);
+			janus_mutex_unlock(&participant->qmutex);
 			participant->audio_active_packets = 0;
 			participant->audio_dBov_sum = 0;
 			participant->talking = FALSE;
@@ -3288,13 +3702,19 @@ static void *janus_audiobridge_handler(void *data) {
 					goto error;
 				}
 				participant->reset = FALSE;
-				/* Destroy the previous encoder/decoder and update the references */
+				/* Destroy the previous encoder/decoder and update the references: as for
+				 * the hangup, wait for the encoder thread to be done with the old one */
+				janus_mutex_lock(&participant->qmutex);
+				while(g_atomic_int_get(&participant->working))
+					g_usleep(5000);
 				if(participant->encoder)
 					opus_encoder_destroy(participant->encoder);
 				participant->encoder = new_encoder;
 				if(participant->decoder)
 					opus_decoder_destroy(participant->decoder);
 				participant->decoder = new_decoder;
+				janus_jitter_buffer_reset(participant->jitter);
+				janus_mutex_unlock(&participant->qmutex);
 			}
 			/* Everything looks fine, start by telling the folks in the old room this participant is going away */
 			event = json_object();
@@ -3338,6 +3758,10 @@ static void *janus_audiobridge_handler(void *data) {
 			g_free(participant->display);
 			participant->display = display_text ? g_strdup(display_text) : NULL;
 			participant->room = audiobridge;
+			participant->mix_level = 127;	/* Start as silent, for the speakers ranking */
+			participant->silent_frames = 0;
+			participant->shared_mix = FALSE;
+			participant->in_mix = FALSE;
 			participant->muted = muted ? json_is_true(muted) : FALSE;	/* When switching to a new room, you're unmuted by default */
 			participant->audio_active_packets = 0;
 			participant->audio_dBov_sum = 0;
@@ -3444,20 +3868,7 @@ static void *janus_audiobridge_handler(void *data) {
 			/* Get rid of queued packets */
 			janus_mutex_lock(&participant->qmutex);
 			participant->active = FALSE;
-			participant->prebuffering = TRUE;
-			while(participant->inbuf) {
-				GList *first = g_list_first(participant->inbuf);
-				janus_audiobridge_rtp_relay_packet *pkt = (janus_audiobridge_rtp_relay_packet *)first->data;
-				participant->inbuf = g_list_remove_link(participant->inbuf, first);
-				first = NULL;
-				if(pkt == NULL)
-					continue;
-				if(pkt->data)
-					g_free(pkt->data);
-				pkt->data = NULL;
-				g_free(pkt);
-				pkt = NULL;
-			}
+			janus_jitter_buffer_reset(participant->jitter);
 			janus_mutex_unlock(&participant->qmutex);
 			/* Stop recording, if we were */
 			janus_mutex_lock(&participant->rec_mutex);
@@ -3655,308 +4066,422 @@ error:
 	return NULL;
 }
 
-/* Thread to mix the contributions from all participants */
-static void *janus_audiobridge_mixer_thread(void *data) {
-	JANUS_LOG(LOG_VERB, "Audio bridge thread starting...\n");
-	janus_audiobridge_room *audiobridge = (janus_audiobridge_room *)data;
-	if(!audiobridge) {
-		JANUS_LOG(LOG_ERR, "Invalid room!\n");
-		return NULL;
-	}
-	JANUS_LOG(LOG_VERB, "Thread is for mixing room %"SCNu64" (%s) at rate %"SCNu32"...\n", audiobridge->room_id, audiobridge->room_name, audiobridge->sampling_rate);
+/* Prepare the mixing state of a room (and start recording it, if needed) */
+static void janus_audiobridge_mixer_start(janus_audiobridge_room *audiobridge) {
+	JANUS_LOG(LOG_VERB, "Preparing mixer for room %"SCNu64" (%s) at rate %"SCNu32"...\n", audiobridge->room_id, audiobridge->room_name, audiobridge->sampling_rate);
 
-	/* Do we need to record the mix? */
+	/* Do we need to record the mix? The file is written by a thread of its own */
 	if(audiobridge->record) {
 		char filename[255];
 		if(audiobridge->record_file) {
 			g_snprintf(filename, 255, "%s", audiobridge->record_file);
 		} else {
-			g_snprintf(filename, 255, "janus-audioroom-%"SCNu64".wav", audiobridge->room_id);
+			g_snprintf(filename, 255, "janus-audioroom-%"SCNu64".%s", audiobridge->room_id,
+				janus_audiobridge_rec_format_extension(audiobridge->record_format));
 		}
-		audiobridge->recording = fopen(filename, "wb");
+		audiobridge->recording = janus_audiobridge_rec_create(filename, audiobridge->record_format,
+			audiobridge->sampling_rate, record_flush_interval);
 		if(audiobridge->recording == NULL) {
 			JANUS_LOG(LOG_WARN, "Recording requested, but could NOT open file %s for writing...\n", filename);
 		} else {
-			JANUS_LOG(LOG_VERB, "Recording requested, opened file %s for writing\n", filename);
-			/* Write WAV header */
-			wav_header header = {
-				{'R', 'I', 'F', 'F'},
-				0,
-				{'W', 'A', 'V', 'E'},
-				{'f', 'm', 't', ' '},
-				16,
-				1,
-				1,
-				audiobridge->sampling_rate,
-				audiobridge->sampling_rate * 2,
-				2,
-				16,
-				{'d', 'a', 't', 'a'},
-				0
-			};
-			if(fwrite(&header, 1, sizeof(header), audiobridge->recording) != sizeof(header)) {
-				JANUS_LOG(LOG_ERR, "Error writing WAV header...\n");
-			}
-			fflush(audiobridge->recording);
-			audiobridge->record_lastupdate = janus_get_monotonic_time();
+			JANUS_LOG(LOG_VERB, "Recording requested, opened file %s for writing (%s)\n", filename,
+				janus_audiobridge_rec_format_name(audiobridge->record_format));
+		}
+	}
+
+	janus_audiobridge_mixer *mixer = g_malloc0(sizeof(janus_audiobridge_mixer));
+	mixer->samples = audiobridge->sampling_rate/50;
+
+	/* Participants that are not contributing to the mix (e.g., muted or silent)
+	 * all get the same frame, the full mix: we encode it only once, then */
+	int error = 0;
+	mixer->mixpayload = g_malloc0(1500);
+	mixer->mix_encoder = opus_encoder_create(audiobridge->sampling_rate, 1, OPUS_APPLICATION_VOIP, &error);
+	if(error != OPUS_OK) {
+		JANUS_LOG(LOG_WARN, "Error creating Opus encoder for the full mix, each participant will encode its own\n");
+		mixer->mix_encoder = NULL;
+	} else {
+		if(audiobridge->sampling_rate == 8000) {
+			opus_encoder_ctl(mixer->mix_encoder, OPUS_SET_MAX_BANDWIDTH(OPUS_BANDWIDTH_NARROWBAND));
+		} else if(audiobridge->sampling_rate == 12000) {
+			opus_encoder_ctl(mixer->mix_encoder, OPUS_SET_MAX_BANDWIDTH(OPUS_BANDWIDTH_MEDIUMBAND));
+		} else if(audiobridge->sampling_rate == 16000) {
+			opus_encoder_ctl(mixer->mix_encoder, OPUS_SET_MAX_BANDWIDTH(OPUS_BANDWIDTH_WIDEBAND));
+		} else if(audiobridge->sampling_rate == 24000) {
+			opus_encoder_ctl(mixer->mix_encoder, OPUS_SET_MAX_BANDWIDTH(OPUS_BANDWIDTH_SUPERWIDEBAND));
+		} else if(audiobridge->sampling_rate == 48000) {
+			opus_encoder_ctl(mixer->mix_encoder, OPUS_SET_MAX_BANDWIDTH(OPUS_BANDWIDTH_FULLBAND));
+		} else {
+			opus_encoder_ctl(mixer->mix_encoder, OPUS_SET_MAX_BANDWIDTH(OPUS_BANDWIDTH_WIDEBAND));
 		}
+		opus_encoder_ctl(mixer->mix_encoder, OPUS_SET_INBAND_FEC(USE_FEC));
+		opus_encoder_ctl(mixer->mix_encoder, OPUS_SET_COMPLEXITY(DEFAULT_COMPLEXITY));
 	}
 
-	/* Buffer (we allocate assuming 48kHz, although we'll likely use less than that) */
-	int samples = audiobridge->sampling_rate/50;
-	opus_int32 buffer[960], sumBuffer[960];
-	opus_int16 outBuffer[960], *curBuffer = NULL;
-	memset(buffer, 0, 960*4);
-	memset(sumBuffer, 0, 960*4);
-	memset(outBuffer, 0, 960*2);
+	/* Participants that may be mixed, if the room limits the number of speakers */
+	mixer->speakers = g_ptr_array_new();
 
 	/* Base RTP packet, in case there are forwarders involved */
-	unsigned char *rtpbuffer = g_malloc0(1500);
-	rtp_header *rtph = (rtp_header *)rtpbuffer;
+	mixer->rtpbuffer = g_malloc0(1500);
+	rtp_header *rtph = (rtp_header *)mixer->rtpbuffer;
 	rtph->version = 2;
 
-	/* Timer */
-	struct timeval now, before;
-	gettimeofday(&before, NULL);
-	now.tv_sec = before.tv_sec;
-	now.tv_usec = before.tv_usec;
-	time_t passed, d_s, d_us;
-
-	/* RTP */
-	gint16 seq = 0;
-	gint32 ts = 0;
-
-	/* Loop */
-	int i=0;
-	int count = 0, rf_count = 0, prev_count = 0;
-	while(!g_atomic_int_get(&stopping) && audiobridge->destroyed == 0) {	/* FIXME We need a per-room watchdog as well */
-		/* See if it's time to prepare a frame */
-		gettimeofday(&now, NULL);
-		d_s = now.tv_sec - before.tv_sec;
-		d_us = now.tv_usec - before.tv_usec;
-		if(d_us < 0) {
-			d_us += 1000000;
-			--d_s;
-		}
-		passed = d_s*1000000 + d_us;
-		if(passed < 15000) {	/* Let's wait about 15ms at max */
-			usleep(1000);
-			continue;
+	audiobridge->mixer = mixer;
+}
+
+/* Queue a mixed frame for a participant, and wake up the thread that will encode and send it */
+static void janus_audiobridge_encoder_queue(janus_audiobridge_participant *participant, janus_audiobridge_rtp_relay_packet *pkt) {
+	if(participant->encoder_worker == NULL) {
+		g_free(pkt->data);
+		janus_audiobridge_encoded_frame_unref(pkt->encoded);
+		g_free(pkt);
+		return;
+	}
+	g_async_queue_push(participant->outbuf, pkt);
+	g_async_queue_push(participant->encoder_worker->queue, participant);
+}
+
+/* Mix the contributions from all participants in a room: invoked by its scheduler thread every 20ms */
+static void janus_audiobridge_mixer_tick(janus_audiobridge_room *audiobridge) {
+	janus_audiobridge_mixer *mixer = audiobridge->mixer;
+	if(mixer == NULL)
+		return;
+	int samples = mixer->samples;
+	opus_int32 *buffer = mixer->buffer;
+	opus_int16 *outBuffer = mixer->outBuffer, *curBuffer = NULL;
+	rtp_header *rtph = (rtp_header *)mixer->rtpbuffer;
+	janus_audiobridge_encoded_frame *mixframe = NULL;
+	int i = 0;
+	int count = 0, rf_count = 0;
+	gint64 mixed = janus_get_monotonic_time();
+	/* Do we need to mix at all? */
+	janus_mutex_lock_nodebug(&audiobridge->mutex);
+	count = g_hash_table_size(audiobridge->participants);
+	rf_count = g_hash_table_size(audiobridge->rtp_forwarders);
+	janus_mutex_unlock_nodebug(&audiobridge->mutex);
+	if((count+rf_count) == 0) {
+		/* No participant and RTP forwarders, do nothing */
+		if(mixer->prev_count > 0) {
+			JANUS_LOG(LOG_VERB, "Last user/forwarder just left room %"SCNu64", going idle...\n", audiobridge->room_id);
+			mixer->prev_count = 0;
 		}
-		/* Update the reference time */
-		before.tv_usec += 20000;
-		if(before.tv_usec > 1000000) {
-			before.tv_sec++;
-			before.tv_usec -= 1000000;
-		}
-		/* Do we need to mix at all? */
-		janus_mutex_lock_nodebug(&audiobridge->mutex);
-		count = g_hash_table_size(audiobridge->participants);
-		rf_count = g_hash_table_size(audiobridge->rtp_forwarders);
-		janus_mutex_unlock_nodebug(&audiobridge->mutex);
-		if((count+rf_count) == 0) {
-			/* No participant and RTP forwarders, do nothing */
-			if(prev_count > 0) {
-				JANUS_LOG(LOG_VERB, "Last user/forwarder just left room %"SCNu64", going idle...\n", audiobridge->room_id);
-				prev_count = 0;
-			}
-			continue;
+		return;
+	}
+	if(mixer->prev_count == 0) {
+		JANUS_LOG(LOG_VERB, "First user/forwarder just joined room %"SCNu64", waking it up...\n", audiobridge->room_id);
+	}
+	mixer->prev_count = count+rf_count;
+	/* Update RTP header information */
+	mixer->seq++;
+	mixer->ts += 960;
+	/* Mix all contributions */
+	janus_mutex_lock_nodebug(&audiobridge->mutex);
+	GList *participants_list = g_hash_table_get_values(audiobridge->participants);
+	janus_mutex_unlock_nodebug(&audiobridge->mutex);
+	for(i=0; i<samples; i++)
+		buffer[i] = 0;
+	/* Get the frame each participant contributes to this round from their jitter buffer, if any */
+	GList *ps = participants_list;
+	while(ps) {
+		janus_audiobridge_participant *p = (janus_audiobridge_participant *)ps->data;
+		janus_mutex_lock(&p->qmutex);
+		if(p->active && !p->muted) {
+			p->playout = janus_jitter_buffer_get(p->jitter, &janus_audiobridge_conceal, p);
+		} else {
+			p->playout = NULL;
 		}
-		if(prev_count == 0) {
-			JANUS_LOG(LOG_VERB, "First user/forwarder just joined room %"SCNu64", waking it up...\n", audiobridge->room_id);
-		}
-		prev_count = count+rf_count;
-		/* Update RTP header information */
-		seq++;
-		ts += 960;
-		/* Mix all contributions */
-		janus_mutex_lock_nodebug(&audiobridge->mutex);
-		GList *participants_list = g_hash_table_get_values(audiobridge->participants);
-		janus_mutex_unlock_nodebug(&audiobridge->mutex);
-		for(i=0; i<samples; i++)
-			buffer[i] = 0;
-		GList *ps = participants_list;
-		while(ps) {
-			janus_audiobridge_participant *p = (janus_audiobridge_participant *)ps->data;
-			janus_mutex_lock(&p->qmutex);
-			if(!p->active || p->muted || p->prebuffering || !p->inbuf) {
-				janus_mutex_unlock(&p->qmutex);
-				ps = ps->next;
-				continue;
-			}
-			GList *peek = g_list_first(p->inbuf);
-			janus_audiobridge_rtp_relay_packet *pkt = (janus_audiobridge_rtp_relay_packet *)(peek ? peek->data : NULL);
-			if(pkt != NULL && !pkt->silence) {
-				curBuffer = (opus_int16 *)pkt->data;
-				for(i=0; i<samples; i++) {
-					if(p->volume_gain == 100) {
-						buffer[i] += curBuffer[i];
-					} else {
-						buffer[i] += (curBuffer[i]*p->volume_gain)/100;
-					}
-				}
-			}
-			janus_mutex_unlock(&p->qmutex);
-			ps = ps->next;
+		janus_mutex_unlock(&p->qmutex);
+		ps = ps->next;
+	}
+	/* If there's a limit to how many participants we can mix, pick the loudest ones */
+	gboolean all_speakers = (audiobridge->max_speakers == 0);
+	if(!all_speakers)
+		janus_audiobridge_select_speakers(audiobridge, participants_list, mixer->speakers);
+	ps = participants_list;
+	while(ps) {
+		janus_audiobridge_participant *p = (janus_audiobridge_participant *)ps->data;
+		/* Frames the audio level extension marked as silence don't contribute to the mix */
+		if(p->playout != NULL && p->playout->level != 127 && (all_speakers || p->in_mix)) {
+			curBuffer = p->playout->samples;
+			mix_ops->accumulate(buffer, curBuffer, samples, janus_audiobridge_mix_gain(p->volume_gain));
+		}
+		ps = ps->next;
+	}
+	/* Are we recording the mix? (only do it if there's someone in, though...) */
+	if(audiobridge->recording != NULL && participants_list != NULL) {
+		/* FIXME Smoothen/Normalize instead of clipping? */
+		mix_ops->subtract(outBuffer, buffer, NULL, samples, 0);
+		/* This only copies the samples: the recording thread will write them */
+		janus_audiobridge_rec_save(audiobridge->recording, outBuffer, samples);
+	}
+	/* Send proper packet to each participant (remove own contribution) */
+	gboolean mixframe_done = FALSE, reset_encoder = FALSE;
+	ps = participants_list;
+	while(ps) {
+		janus_audiobridge_participant *p = (janus_audiobridge_participant *)ps->data;
+		curBuffer = (p->playout != NULL && p->playout->level != 127 && (all_speakers || p->in_mix)) ? p->playout->samples : NULL;
+		/* Switching encoder breaks the Opus prediction (and FEC) the participant's decoder relies on,
+		 * so we only move participants to the shared encoder after they've been out of the mix for
+		 * a while, and back to their own encoder (reset, as its state is stale) when they're in again */
+		reset_encoder = FALSE;
+		if(curBuffer != NULL) {
+			p->silent_frames = 0;
+		} else if(p->silent_frames < JANUS_AUDIOBRIDGE_SHARED_MIX_HOLDOFF) {
+			p->silent_frames++;
 		}
-		/* Are we recording the mix? (only do it if there's someone in, though...) */
-		if(audiobridge->recording != NULL && g_list_length(participants_list) > 0) {
-			for(i=0; i<samples; i++) {
-				/* FIXME Smoothen/Normalize instead of truncating? */
-				outBuffer[i] = buffer[i];
-			}
-			fwrite(outBuffer, sizeof(opus_int16), samples, audiobridge->recording);
-			/* Every 5 seconds we update the wav header */
-			gint64 now = janus_get_monotonic_time();
-			if(now - audiobridge->record_lastupdate >= 5*G_USEC_PER_SEC) {
-				audiobridge->record_lastupdate = now;
-				/* Update the length in the header */
-				fseek(audiobridge->recording, 0, SEEK_END);
-				long int size = ftell(audiobridge->recording);
-				if(size >= 8) {
-					size -= 8;
-					fseek(audiobridge->recording, 4, SEEK_SET);
-					fwrite(&size, sizeof(uint32_t), 1, audiobridge->recording);
-					size += 8;
-					fseek(audiobridge->recording, 40, SEEK_SET);
-					fwrite(&size, sizeof(uint32_t), 1, audiobridge->recording);
-					fflush(audiobridge->recording);
-					fseek(audiobridge->recording, 0, SEEK_END);
+		gboolean shared = (curBuffer == NULL && mixer->mix_encoder != NULL && p->opus_complexity == DEFAULT_COMPLEXITY &&
+			(p->shared_mix || p->silent_frames >= JANUS_AUDIOBRIDGE_SHARED_MIX_HOLDOFF));
+		if(!shared && p->shared_mix)
+			reset_encoder = TRUE;
+		p->shared_mix = shared;
+		if(shared) {
+			/* This participant gets the full mix: encode it, if we haven't already */
+			if(!mixframe_done) {
+				mixframe_done = TRUE;
+				/* FIXME Smoothen/Normalize instead of clipping? */
+				mix_ops->subtract(outBuffer, buffer, NULL, samples, 0);
+				opus_int32 length = opus_encode(mixer->mix_encoder, outBuffer, samples, mixer->mixpayload, 1500);
+				if(length < 0) {
+					JANUS_LOG(LOG_ERR, "[Opus] Ops! got an error encoding the Opus frame: %d (%s)\n", length, opus_strerror(length));
+				} else {
+					mixframe = janus_audiobridge_encoded_frame_new(mixer->mixpayload, length);
 				}
 			}
-		}
-		/* Send proper packet to each participant (remove own contribution) */
-		ps = participants_list;
-		while(ps) {
-			janus_audiobridge_participant *p = (janus_audiobridge_participant *)ps->data;
-			janus_audiobridge_rtp_relay_packet *pkt = NULL;
-			janus_mutex_lock(&p->qmutex);
-			if(p->active && !p->muted && !p->prebuffering && p->inbuf) {
-				GList *first = g_list_first(p->inbuf);
-				pkt = (janus_audiobridge_rtp_relay_packet *)(first ? first->data : NULL);
-				p->inbuf = g_list_delete_link(p->inbuf, first);
-			}
-			janus_mutex_unlock(&p->qmutex);
-			curBuffer = (opus_int16 *)((pkt && !pkt->silence) ? pkt->data : NULL);
-			for(i=0; i<samples; i++) {
-				if(p->volume_gain == 100)
-					sumBuffer[i] = buffer[i] - (curBuffer ? (curBuffer[i]) : 0);
-				else
-					sumBuffer[i] = buffer[i] - (curBuffer ? (curBuffer[i]*p->volume_gain)/100 : 0);
-			}
-			for(i=0; i<samples; i++)
-				/* FIXME Smoothen/Normalize instead of truncating? */
-				outBuffer[i] = sumBuffer[i];
-			/* Enqueue this mixed frame for encoding in the participant thread */
-			janus_audiobridge_rtp_relay_packet *mixedpkt = g_malloc0(sizeof(janus_audiobridge_rtp_relay_packet));
-			if(mixedpkt != NULL) {
-				mixedpkt->data = g_malloc0(samples*2);
-				memcpy(mixedpkt->data, outBuffer, samples*2);
-				mixedpkt->length = samples;	/* We set the number of samples here, not the data length */
-				mixedpkt->timestamp = ts;
-				mixedpkt->seq_number = seq;
+			if(mixframe != NULL) {
+				janus_audiobridge_rtp_relay_packet *mixedpkt = g_malloc0(sizeof(janus_audiobridge_rtp_relay_packet));
+				g_atomic_int_inc(&mixframe->ref);
+				mixedpkt->encoded = mixframe;
+				mixedpkt->length = samples;
+				mixedpkt->timestamp = mixer->ts;
+				mixedpkt->seq_number = mixer->seq;
 				mixedpkt->ssrc = audiobridge->room_id;
-				g_async_queue_push(p->outbuf, mixedpkt);
-			}
-			if(pkt) {
-				if(pkt->data)
-					g_free(pkt->data);
-				pkt->data = NULL;
-				g_free(pkt);
-				pkt = NULL;
+				mixedpkt->mixed = mixed;
+				janus_audiobridge_encoder_queue(p, mixedpkt);
 			}
 			ps = ps->next;
+			continue;
 		}
-		g_list_free(participants_list);
-		/* Forward the mixed packet as RTP to any RTP forwarder that may be listening */
-		janus_mutex_lock(&audiobridge->rtp_mutex);
-		if(g_hash_table_size(audiobridge->rtp_forwarders) > 0 && audiobridge->rtp_encoder) {
-			/* If the room is empty, check if there's any RTP forwarder with an "always on" option */
-			gboolean go_on = FALSE;
-			if(count == 0) {
+		/* FIXME Smoothen/Normalize instead of clipping? */
+		mix_ops->subtract(outBuffer, buffer, curBuffer, samples, janus_audiobridge_mix_gain(p->volume_gain));
+		/* Enqueue this mixed frame for encoding in the participant thread */
+		janus_audiobridge_rtp_relay_packet *mixedpkt = g_malloc0(sizeof(janus_audiobridge_rtp_relay_packet));
+		if(mixedpkt != NULL) {
+			mixedpkt->reset_encoder = reset_encoder;
+			mixedpkt->data = g_malloc0(samples*2);
+			memcpy(mixedpkt->data, outBuffer, samples*2);
+			mixedpkt->length = samples;	/* We set the number of samples here, not the data length */
+			mixedpkt->timestamp = mixer->ts;
+			mixedpkt->seq_number = mixer->seq;
+			mixedpkt->ssrc = audiobridge->room_id;
+			mixedpkt->mixed = mixed;
+			janus_audiobridge_encoder_queue(p, mixedpkt);
+		}
+		ps = ps->next;
+	}
+	g_list_free(participants_list);
+	/* The participants that got the full mix hold their own reference to it */
+	janus_audiobridge_encoded_frame_unref(mixframe);
+	mixframe = NULL;
+	/* Forward the mixed packet as RTP to any RTP forwarder that may be listening */
+	janus_mutex_lock(&audiobridge->rtp_mutex);
+	if(g_hash_table_size(audiobridge->rtp_forwarders) > 0 && audiobridge->rtp_encoder) {
+		/* If the room is empty, check if there's any RTP forwarder with an "always on" option */
+		gboolean go_on = FALSE;
+		if(count == 0) {
+			GHashTableIter iter;
+			gpointer value;
+			g_hash_table_iter_init(&iter, audiobridge->rtp_forwarders);
+			while(g_hash_table_iter_next(&iter, NULL, &value)) {
+				janus_audiobridge_rtp_forwarder* forwarder = (janus_audiobridge_rtp_forwarder *)value;
+				if(forwarder->always_on) {
+					go_on = TRUE;
+					break;
+				}
+			}
+		} else {
+			go_on = TRUE;
+		}
+		if(go_on) {
+			/* Encode the mixed frame first*/
+			mix_ops->subtract(outBuffer, buffer, NULL, samples, 0);
+			opus_int32 length = opus_encode(audiobridge->rtp_encoder, outBuffer, samples, mixer->rtpbuffer+12, 1500-12);
+			if(length < 0) {
+				JANUS_LOG(LOG_ERR, "[Opus] Ops! got an error encoding the Opus frame: %d (%s)\n", length, opus_strerror(length));
+			} else {
+				/* Then send it to everybody */
 				GHashTableIter iter;
-				gpointer value;
+				gpointer key, value;
 				g_hash_table_iter_init(&iter, audiobridge->rtp_forwarders);
-				while(g_hash_table_iter_next(&iter, NULL, &value)) {
+				while(audiobridge->rtp_udp_sock > 0 && g_hash_table_iter_next(&iter, &key, &value)) {
+					guint32 stream_id = GPOINTER_TO_UINT(key);
 					janus_audiobridge_rtp_forwarder* forwarder = (janus_audiobridge_rtp_forwarder *)value;
-					if(forwarder->always_on) {
-						go_on = TRUE;
-						break;
-					}
-				}
-			} else {
-				go_on = TRUE;
-			}
-			if(go_on) {
-				/* Encode the mixed frame first*/
-				for(i=0; i<samples; i++)
-					outBuffer[i] = buffer[i];
-				opus_int32 length = opus_encode(audiobridge->rtp_encoder, outBuffer, samples, rtpbuffer+12, 1500-12);
-				if(length < 0) {
-					JANUS_LOG(LOG_ERR, "[Opus] Ops! got an error encoding the Opus frame: %d (%s)\n", length, opus_strerror(length));
-				} else {
-					/* Then send it to everybody */
-					GHashTableIter iter;
-					gpointer key, value;
-					g_hash_table_iter_init(&iter, audiobridge->rtp_forwarders);
-					while(audiobridge->rtp_udp_sock > 0 && g_hash_table_iter_next(&iter, &key, &value)) {
-						guint32 stream_id = GPOINTER_TO_UINT(key);
-						janus_audiobridge_rtp_forwarder* forwarder = (janus_audiobridge_rtp_forwarder *)value;
-						if(count == 0 && !forwarder->always_on)
-							continue;
-						/* Update header */
-						rtph->type = forwarder->payload_type;
-						rtph->ssrc = htonl(forwarder->ssrc ? forwarder->ssrc : stream_id);
-						forwarder->seq_number++;
-						rtph->seq_number = htons(forwarder->seq_number);
-						forwarder->timestamp += 960;
-						rtph->timestamp = htonl(forwarder->timestamp);
-						/* Send RTP packet */
-						if(sendto(audiobridge->rtp_udp_sock, rtpbuffer, length+12, 0, (struct sockaddr*)&forwarder->serv_addr, sizeof(forwarder->serv_addr)) < 0) {
-							JANUS_LOG(LOG_HUGE, "Error forwarding mixed RTP packet for room %"SCNu64"... %s (len=%d)...\n",
-								audiobridge->room_id, strerror(errno), length+12);
-						}
+					if(count == 0 && !forwarder->always_on)
+						continue;
+					/* Update header */
+					rtph->type = forwarder->payload_type;
+					rtph->ssrc = htonl(forwarder->ssrc ? forwarder->ssrc : stream_id);
+					forwarder->seq_number++;
+					rtph->seq_number = htons(forwarder->seq_number);
+					forwarder->timestamp += 960;
+					rtph->timestamp = htonl(forwarder->timestamp);
+					/* Send RTP packet */
+					if(sendto(audiobridge->rtp_udp_sock, mixer->rtpbuffer, length+12, 0, (struct sockaddr*)&forwarder->serv_addr, sizeof(forwarder->serv_addr)) < 0) {
+						JANUS_LOG(LOG_HUGE, "Error forwarding mixed RTP packet for room %"SCNu64"... %s (len=%d)...\n",
+							audiobridge->room_id, strerror(errno), length+12);
 					}
 				}
 			}
 		}
-		janus_mutex_unlock(&audiobridge->rtp_mutex);
 	}
-	if(audiobridge->recording) {
-		/* Update the length in the header */
-		fseek(audiobridge->recording, 0, SEEK_END);
-		long int size = ftell(audiobridge->recording);
-		if(size >= 8) {
-			size -= 8;
-			fseek(audiobridge->recording, 4, SEEK_SET);
-			fwrite(&size, sizeof(uint32_t), 1, audiobridge->recording);
-			size += 8;
-			fseek(audiobridge->recording, 40, SEEK_SET);
-			fwrite(&size, sizeof(uint32_t), 1, audiobridge->recording);
-			fflush(audiobridge->recording);
-			fclose(audiobridge->recording);
-		}
+	janus_mutex_unlock(&audiobridge->rtp_mutex);
+}
+
+/* Get rid of the mixing state of a room (and close its recording, if any) */
+static void janus_audiobridge_mixer_stop(janus_audiobridge_room *audiobridge) {
+	/* The recording thread will finalize the file in the background */
+	janus_audiobridge_rec_close(audiobridge->recording);
+	audiobridge->recording = NULL;
+	janus_audiobridge_mixer *mixer = audiobridge->mixer;
+	audiobridge->mixer = NULL;
+	if(mixer != NULL) {
+		g_free(mixer->rtpbuffer);
+		g_free(mixer->mixpayload);
+		g_ptr_array_free(mixer->speakers, TRUE);
+		if(mixer->mix_encoder != NULL)
+			opus_encoder_destroy(mixer->mix_encoder);
+		g_free(mixer);
 	}
-	g_free(rtpbuffer);
-	JANUS_LOG(LOG_VERB, "Leaving mixer thread for room %"SCNu64" (%s)...\n", audiobridge->room_id, audiobridge->room_name);
+	JANUS_LOG(LOG_VERB, "Stopped mixing room %"SCNu64" (%s)...\n", audiobridge->room_id, audiobridge->room_name);
+}
 
+/* Assign a room to the least loaded scheduler thread, which will start mixing it */
+static int janus_audiobridge_scheduler_add(janus_audiobridge_room *audiobridge) {
+	if(schedulers == NULL || schedulers_num == 0)
+		return -1;
+	janus_audiobridge_scheduler *scheduler = NULL;
+	guint i = 0;
+	for(i=0; i<schedulers_num; i++) {
+		janus_audiobridge_scheduler *s = &schedulers[i];
+		if(scheduler == NULL || g_atomic_int_get(&s->rooms_num) < g_atomic_int_get(&scheduler->rooms_num))
+			scheduler = s;
+	}
+	janus_audiobridge_mixer_start(audiobridge);
+	g_atomic_int_set(&audiobridge->mixer_stopped, 0);
+	audiobridge->scheduler = scheduler;
+	janus_mutex_lock(&scheduler->mutex);
+	scheduler->rooms = g_list_append(scheduler->rooms, audiobridge);
+	g_atomic_int_inc(&scheduler->rooms_num);
+	janus_mutex_unlock(&scheduler->mutex);
+	JANUS_LOG(LOG_VERB, "Room %"SCNu64" will be mixed by mixer thread #%u\n", audiobridge->room_id, scheduler->id);
+	return 0;
+}
+
+/* Wait for the scheduler thread to be done with a room that has been destroyed */
+static void janus_audiobridge_scheduler_wait(janus_audiobridge_room *audiobridge) {
+	janus_audiobridge_scheduler *scheduler = audiobridge->scheduler;
+	if(scheduler == NULL)
+		return;
+	janus_mutex_lock(&scheduler->mutex);
+	while(!g_atomic_int_get(&audiobridge->mixer_stopped)) {
+		janus_condition_wait(&scheduler->cond, &scheduler->mutex);
+	}
+	janus_mutex_unlock(&scheduler->mutex);
+}
+
+/* Stop mixing a room, and hand it to the watchdog */
+static void janus_audiobridge_scheduler_remove(janus_audiobridge_scheduler *scheduler, janus_audiobridge_room *audiobridge) {
+	janus_audiobridge_mixer_stop(audiobridge);
 	/* We'll let the watchdog worry about free resources */
+	janus_mutex_lock(&rooms_mutex);
 	old_rooms = g_list_append(old_rooms, audiobridge);
+	janus_mutex_unlock(&rooms_mutex);
+	janus_mutex_lock(&scheduler->mutex);
+	scheduler->rooms = g_list_remove(scheduler->rooms, audiobridge);
+	g_atomic_int_add(&scheduler->rooms_num, -1);
+	g_atomic_int_set(&audiobridge->mixer_stopped, 1);
+	janus_condition_broadcast(&scheduler->cond);
+	janus_mutex_unlock(&scheduler->mutex);
+}
 
-	return NULL;
+static void janus_audiobridge_timespec_add(struct timespec *ts, gint64 us) {
+	ts->tv_sec += us / G_USEC_PER_SEC;
+	ts->tv_nsec += (us % G_USEC_PER_SEC) * 1000;
+	if(ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
 }
 
-/* Thread to encode a mixed frame and send it to a specific participant */
-static void *janus_audiobridge_participant_thread(void *data) {
-	JANUS_LOG(LOG_VERB, "AudioBridge Participant thread starting...\n");
-	janus_audiobridge_participant *participant = (janus_audiobridge_participant *)data;
-	if(!participant) {
-		JANUS_LOG(LOG_ERR, "Invalid participant!\n");
-		g_thread_unref(g_thread_self());
-		return NULL;
+/* Thread to mix, every 20ms, all the rooms it has been assigned */
+static void *janus_audiobridge_scheduler_thread(void *data) {
+	janus_audiobridge_scheduler *scheduler = (janus_audiobridge_scheduler *)data;
+	JANUS_LOG(LOG_VERB, "Mixer thread #%u starting...\n", scheduler->id);
+	/* Spread the rounds of the different threads over the mixing period */
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	janus_audiobridge_timespec_add(&deadline, (gint64)scheduler->id * MIXER_PERIOD / schedulers_num);
+	GList *list = NULL, *rl = NULL;
+	while(!g_atomic_int_get(&stopping)) {
+		/* Sleep until the next round is due */
+		janus_audiobridge_timespec_add(&deadline, MIXER_PERIOD);
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+		gint64 target = (gint64)deadline.tv_sec*G_USEC_PER_SEC + deadline.tv_nsec/1000;
+		gint64 start = janus_get_monotonic_time();
+		gint64 late = start - target;
+		if(late < 0)
+			late = 0;
+		if(late >= MIXER_MAX_LATE*MIXER_PERIOD) {
+			/* We're way too late (e.g., the machine was suspended): rather
+			 * than mixing all the frames we missed in a burst, skip ahead */
+			gint64 missed = late/MIXER_PERIOD;
+			JANUS_LOG(LOG_WARN, "Mixer thread #%u is %"SCNi64"ms late, skipping %"SCNi64" rounds\n",
+				scheduler->id, late/1000, missed);
+			scheduler->skipped += missed;
+			janus_audiobridge_timespec_add(&deadline, missed*MIXER_PERIOD);
+			late -= missed*MIXER_PERIOD;
+		}
+		/* Mix all the rooms we're responsible for */
+		janus_mutex_lock(&scheduler->mutex);
+		list = g_list_copy(scheduler->rooms);
+		janus_mutex_unlock(&scheduler->mutex);
+		rl = list;
+		while(rl) {
+			janus_audiobridge_room *audiobridge = (janus_audiobridge_room *)rl->data;
+			if(audiobridge->destroyed) {
+				janus_audiobridge_scheduler_remove(scheduler, audiobridge);
+			} else {
+				janus_audiobridge_mixer_tick(audiobridge);
+			}
+			rl = rl->next;
+		}
+		g_list_free(list);
+		/* Update the statistics */
+		gint64 load = janus_get_monotonic_time() - start;
+		scheduler->ticks++;
+		if(late + load > MIXER_PERIOD)
+			scheduler->overruns++;
+		scheduler->jitter_avg = scheduler->ticks == 1 ? late : (scheduler->jitter_avg*15 + late)/16;
+		if(late > scheduler->jitter_max)
+			scheduler->jitter_max = late;
+		scheduler->load_avg = scheduler->ticks == 1 ? load : (scheduler->load_avg*15 + load)/16;
+		if(load > scheduler->load_max)
+			scheduler->load_max = load;
 	}
-	JANUS_LOG(LOG_VERB, "Thread is for participant %"SCNu64" (%s)\n", participant->user_id, participant->display ? participant->display : "??");
-	janus_audiobridge_session *session = participant->session;
+	/* We're shutting down: stop mixing the rooms we're still responsible for */
+	janus_mutex_lock(&scheduler->mutex);
+	list = g_list_copy(scheduler->rooms);
+	janus_mutex_unlock(&scheduler->mutex);
+	for(rl = list; rl != NULL; rl = rl->next)
+		janus_audiobridge_scheduler_remove(scheduler, (janus_audiobridge_room *)rl->data);
+	g_list_free(list);
+	JANUS_LOG(LOG_VERB, "Leaving mixer thread #%u...\n", scheduler->id);
+	return NULL;
+}
+
+/* Thread to encode mixed frames and send them to the participants it has been assigned */
+static void *janus_audiobridge_encoder_thread(void *data) {
+	janus_audiobridge_encoder_worker *worker = (janus_audiobridge_encoder_worker *)data;
+	JANUS_LOG(LOG_VERB, "Encoder thread #%u starting...\n", worker->id);
 
 	/* Output buffer */
 	janus_audiobridge_rtp_relay_packet *outpkt = g_malloc0(sizeof(janus_audiobridge_rtp_relay_packet));
@@ -3967,69 +4492,83 @@ static void *janus_audiobridge_participant_thread(void *data) {
 	unsigned char *payload = (unsigned char *)outpkt->data;
 	memset(payload, 0, 1500);
 
+	janus_audiobridge_participant *participant = NULL;
 	janus_audiobridge_rtp_relay_packet *mixedpkt = NULL;
 
-	/* Start working: check the outgoing queue for packets, then encode and send them */
-	while(!g_atomic_int_get(&stopping) && session->destroyed == 0) {
-		if(!participant->active || !participant->encoder) {
-			/* Wait until the participant is in a room */
-			g_usleep(10000);
+	/* Start working: wait for participants with a new frame, then encode and send it */
+	while(!g_atomic_int_get(&stopping)) {
+		gpointer item = g_async_queue_pop(worker->queue);
+		if(item == NULL)
 			continue;
-		}
-		if(g_async_queue_length(participant->outbuf) == 0) {
-			/* Nothing to do */
-			g_usleep(5000);
+		if(item == &encoder_exit)
+			break;
+		participant = (janus_audiobridge_participant *)item;
+		mixedpkt = g_async_queue_try_pop(participant->outbuf);
+		if(mixedpkt == NULL)
 			continue;
+		/* Check if we can use the participant with the same lock the hangup uses: if it's
+		 * still active, the hangup will wait for us before getting rid of anything */
+		gboolean working = FALSE;
+		janus_mutex_lock(&participant->qmutex);
+		if(participant->active && participant->encoder && participant->session) {
+			g_atomic_int_set(&participant->working, 1);
+			working = TRUE;
 		}
-		mixedpkt = g_async_queue_pop(participant->outbuf);
-		if(mixedpkt != NULL && session->destroyed == 0) {
-			/* Encode raw frame to Opus */
-			if(participant->active && participant->encoder) {
-				participant->working = TRUE;
+		janus_mutex_unlock(&participant->qmutex);
+		/* Encode raw frame to Opus, unless the mixer did that for us already */
+		if(working) {
+			gint64 encode = 0;
+			if(mixedpkt->encoded != NULL) {
+				outpkt->length = mixedpkt->encoded->length;
+				memcpy(payload+12, mixedpkt->encoded->data, mixedpkt->encoded->length);
+			} else {
+				gint64 start = janus_get_monotonic_time();
 				opus_int16 *outBuffer = (opus_int16 *)mixedpkt->data;
+				if(mixedpkt->reset_encoder)
+					opus_encoder_ctl(participant->encoder, OPUS_RESET_STATE);
 				outpkt->length = opus_encode(participant->encoder, outBuffer, mixedpkt->length, payload+12, BUFFER_SAMPLES-12);
-				participant->working = FALSE;
-				if(outpkt->length < 0) {
-					JANUS_LOG(LOG_ERR, "[Opus] Ops! got an error encoding the Opus frame: %d (%s)\n", outpkt->length, opus_strerror(outpkt->length));
-				} else {
-					outpkt->length += 12;	/* Take the RTP header into consideration */
-					/* Update RTP header */
-					outpkt->data->version = 2;
-					outpkt->data->markerbit = 0;	/* FIXME Should be 1 for the first packet */
-					outpkt->data->seq_number = htons(mixedpkt->seq_number);
-					outpkt->data->timestamp = htonl(mixedpkt->timestamp);
-					outpkt->data->ssrc = htonl(mixedpkt->ssrc);	/* The gateway will fix this anyway */
-					/* Backup the actual timestamp and sequence number set by the audiobridge, in case a room is changed */
-					outpkt->ssrc = mixedpkt->ssrc;
-					outpkt->timestamp = mixedpkt->timestamp;
-					outpkt->seq_number = mixedpkt->seq_number;
-					janus_audiobridge_relay_rtp_packet(participant->session, outpkt);
-				}
+				encode = janus_get_monotonic_time() - start;
 			}
-			if(mixedpkt) {
-				if(mixedpkt->data)
-					g_free(mixedpkt->data);
-				mixedpkt->data = NULL;
-				g_free(mixedpkt);
-				mixedpkt = NULL;
+			if(outpkt->length < 0) {
+				JANUS_LOG(LOG_ERR, "[Opus] Ops! got an error encoding the Opus frame: %d (%s)\n", outpkt->length, opus_strerror(outpkt->length));
+			} else {
+				outpkt->length += 12;	/* Take the RTP header into consideration */
+				/* Update RTP header */
+				outpkt->data->version = 2;
+				outpkt->data->markerbit = 0;	/* FIXME Should be 1 for the first packet */
+				outpkt->data->seq_number = htons(mixedpkt->seq_number);
+				outpkt->data->timestamp = htonl(mixedpkt->timestamp);
+				outpkt->data->ssrc = htonl(mixedpkt->ssrc);	/* The gateway will fix this anyway */
+				/* Backup the actual timestamp and sequence number set by the audiobridge, in case a room is changed */
+				outpkt->ssrc = mixedpkt->ssrc;
+				outpkt->timestamp = mixedpkt->timestamp;
+				outpkt->seq_number = mixedpkt->seq_number;
+				janus_audiobridge_relay_rtp_packet(participant->session, outpkt);
+				/* Update the statistics */
+				gint64 latency = janus_get_monotonic_time() - mixedpkt->mixed;
+				worker->frames++;
+				if(mixedpkt->encoded == NULL) {
+					worker->encode_avg = (worker->encode_avg*15 + encode)/16;
+					if(encode > worker->encode_max)
+						worker->encode_max = encode;
+				}
+				worker->latency_avg = worker->frames == 1 ? latency : (worker->latency_avg*15 + latency)/16;
+				if(latency > worker->latency_max)
+					worker->latency_max = latency;
 			}
+			g_atomic_int_set(&participant->working, 0);
 		}
+		g_free(mixedpkt->data);
+		mixedpkt->data = NULL;
+		janus_audiobridge_encoded_frame_unref(mixedpkt->encoded);
+		mixedpkt->encoded = NULL;
+		g_free(mixedpkt);
+		mixedpkt = NULL;
 	}
 	/* We're done, get rid of the resources */
 	g_free(outpkt->data);
 	g_free(outpkt);
-	/* Empty the outgoing queue if there was something still in */
-	while(g_async_queue_length(participant->outbuf) > 0) {
-		janus_audiobridge_rtp_relay_packet *pkt = g_async_queue_pop(participant->outbuf);
-		if(pkt == NULL)
-			continue;
-		if(pkt->data)
-			g_free(pkt->data);
-		pkt->data = NULL;
-		g_free(pkt);
-		pkt = NULL;
-	}
-	JANUS_LOG(LOG_VERB, "AudioBridge Participant thread leaving...\n");
+	JANUS_LOG(LOG_VERB, "Leaving encoder thread #%u...\n", worker->id);
 	return NULL;
 }
 
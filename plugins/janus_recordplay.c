@@ -17,6 +17,18 @@
  * recordings should be saved. The same folder will also be used to list
  * the available recordings that can be replayed.
  * 
+ * Recordings being replayed are memory-mapped, and their frames are only
+ * parsed once: all the viewers watching the same recording at the same
+ * time share the same index of frames, and packets are copied from the
+ * mapped file rather than read from disk by each viewer.
+ *
+ * \note Since they're memory-mapped, recordings must never be truncated
+ * or rewritten in place while they're being played, as reading the part
+ * of a mapping that's not backed by the file anymore crashes the process
+ * (SIGBUS). If you need to update a recording, write the new version to
+ * a different file and rename it: viewers of the old version will keep
+ * on using it until they're done, while new ones will get the new one.
+ * 
  * \note The application creates a special file in INI format with
  * \c .nfo extension for each recording that is saved. This is necessary
  * to map a specific audio .mjr file to a different video .mjr one, as
@@ -45,13 +57,14 @@
  * to scan the folder of recordings again in case some were added manually
  * and not indexed in the meanwhile.
  * 
- * The \c record , \c play , \c start and \c stop requests instead are
- * all asynchronous, which means you'll get a notification about their
- * success or failure in an event. \c record asks the plugin to start
- * recording a session; \c play asks the plugin to prepare the playout
- * of one of the previously recorded sessions; \c start starts the
- * actual playout, and \c stop stops whatever the session was for, i.e.,
- * recording or replaying.
+ * The \c record , \c play , \c start , \c pause , \c resume , \c seek
+ * and \c stop requests instead are all asynchronous, which means you'll
+ * get a notification about their success or failure in an event.
+ * \c record asks the plugin to start recording a session; \c play asks
+ * the plugin to prepare the playout of one of the previously recorded
+ * sessions; \c start starts the actual playout, \c pause , \c resume
+ * and \c seek control it while it's in progress, and \c stop stops
+ * whatever the session was for, i.e., recording or replaying.
  * 
  * The \c list request has to be formatted as follows:
  *
@@ -207,6 +220,43 @@
 }
 \endverbatim
  * 
+ * Playouts are paced by the shared engine in the core, rather than by a
+ * thread per viewer. Once the playout has started, it can be paused and
+ * resumed with a \c pause and \c resume request respectively:
+ *
+\verbatim
+{
+	"request" : "pause"
+}
+\endverbatim
+ *
+ * Both result in a status notification that also tells where in the
+ * recording (in milliseconds) the playout is:
+ *
+\verbatim
+{
+	"recordplay" : "event",
+	"result": {
+		"status" : "<paused|playing>",
+		"position" : <position in milliseconds>
+	}
+}
+\endverbatim
+ *
+ * A \c seek request moves the playout somewhere else in the recording:
+ *
+\verbatim
+{
+	"request" : "seek",
+	"position" : <position in milliseconds>
+}
+\endverbatim
+ *
+ * Video can only be resumed from a keyframe, so the playout will
+ * actually move to the last keyframe before the requested position:
+ * this is the position the notification (same format as the one above)
+ * will contain. Seeking a paused playout doesn't resume it.
+ *
  * Just as before, a \c stop request can interrupt the playout process at
  * any time, and tear the associated PeerConnection down:
  * 
@@ -247,6 +297,9 @@
 
 #include <dirent.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <jansson.h>
@@ -256,6 +309,7 @@
 #include "../config.h"
 #include "../mutex.h"
 #include "../record.h"
+#include "../pacer.h"
 #include "../sdp-utils.h"
 #include "../rtp.h"
 #include "../rtcp.h"
@@ -339,6 +393,9 @@ static struct janus_json_parameter record_parameters[] = {
 static struct janus_json_parameter play_parameters[] = {
 	{"id", JSON_INTEGER, JANUS_JSON_PARAM_REQUIRED | JANUS_JSON_PARAM_POSITIVE}
 };
+static struct janus_json_parameter seek_parameters[] = {
+	{"position", JSON_INTEGER, JANUS_JSON_PARAM_REQUIRED | JANUS_JSON_PARAM_POSITIVE}
+};
 
 /* Useful stuff */
 static volatile gint initialized = 0, stopping = 0;
@@ -362,15 +419,23 @@ typedef struct janus_recordplay_rtp_header_extension {
 	uint16_t length;
 } janus_recordplay_rtp_header_extension;
 
-typedef struct janus_recordplay_frame_packet {
-	uint16_t seq;	/* RTP Sequence number */
-	uint64_t ts;	/* RTP Timestamp */
-	int len;		/* Length of the data */
-	long offset;	/* Offset of the data in the file */
-	struct janus_recordplay_frame_packet *next;
-	struct janus_recordplay_frame_packet *prev;
-} janus_recordplay_frame_packet;
-janus_recordplay_frame_packet *janus_recordplay_get_frames(const char *dir, const char *filename);
+janus_recorder_index *janus_recordplay_get_frames(const char *source, char *data, size_t size);
+
+/* Recordings are memory-mapped, and their frames only parsed once: viewers
+ * of the same recording share the same (refcounted) instance */
+typedef struct janus_recordplay_frames {
+	char *source;		/* Path of the .mjr file */
+	char *data;			/* Read-only mapping of the file */
+	size_t size;		/* Size of the file */
+	time_t mtime;		/* Last modification time of the file, to detect changes */
+	janus_recorder_index *index;	/* Frames in playout order, and where the keyframes are */
+	int ref;			/* Number of viewers using this instance (protected by frames_mutex) */
+} janus_recordplay_frames;
+static GHashTable *frames_cache = NULL;
+static janus_mutex frames_mutex = JANUS_MUTEX_INITIALIZER;
+static janus_recordplay_frames *janus_recordplay_frames_get(const char *dir, const char *filename);
+static void janus_recordplay_frames_unref(janus_recordplay_frames *frames);
+static int janus_recordplay_frames_copy(janus_recordplay_frames *frames, size_t frame, char *buffer, int size);
 
 typedef struct janus_recordplay_recording {
 	guint64 id;			/* Recording unique ID */
@@ -396,8 +461,9 @@ typedef struct janus_recordplay_session {
 	janus_recorder *arc;	/* Audio recorder */
 	janus_recorder *vrc;	/* Video recorder */
 	janus_mutex rec_mutex;	/* Mutex to protect the recorders from race conditions */
-	janus_recordplay_frame_packet *aframes;	/* Audio frames (for playout) */
-	janus_recordplay_frame_packet *vframes;	/* Video frames (for playout) */
+	janus_recordplay_frames *aframes;	/* Audio frames (for playout) */
+	janus_recordplay_frames *vframes;	/* Video frames (for playout) */
+	janus_pacer_task *playout;	/* Pacing task sending the frames (for playout) */
 	guint video_remb_startup;
 	gint64 video_remb_last;
 	guint32 video_bitrate;
@@ -415,7 +481,7 @@ static janus_mutex sessions_mutex = JANUS_MUTEX_INITIALIZER;
 
 static char *recordings_path = NULL;
 void janus_recordplay_update_recordings_list(void);
-static void *janus_recordplay_playout_thread(void *data);
+static int janus_recordplay_playout_start(janus_recordplay_session *session);
 
 /* Helper to send RTCP feedback back to recorders, if needed */
 void janus_recordplay_send_rtcp_feedback(janus_plugin_session *handle, int video, char *buf, int len);
@@ -507,6 +573,13 @@ static void *janus_recordplay_watchdog(void *data) {
 					old_sessions = g_list_delete_link(old_sessions, sl);
 					sl = rm;
 					session->handle = NULL;
+					janus_pacer_task_unref(session->playout);
+					session->playout = NULL;
+					/* If the playout never started, the frames may still be there */
+					janus_recordplay_frames_unref(session->aframes);
+					session->aframes = NULL;
+					janus_recordplay_frames_unref(session->vframes);
+					session->vframes = NULL;
 					g_free(session);
 					session = NULL;
 					continue;
@@ -573,6 +646,7 @@ int janus_recordplay_init(janus_callbacks *callback, const char *config_path) {
 	janus_recordplay_update_recordings_list();
 	
 	sessions = g_hash_table_new(NULL, NULL);
+	frames_cache = g_hash_table_new(g_str_hash, g_str_equal);
 	messages = g_async_queue_new_full((GDestroyNotify) janus_recordplay_message_free);
 	/* This is the callback we'll need to invoke to contact the gateway */
 	gateway = callback;
@@ -614,11 +688,39 @@ void janus_recordplay_destroy(void) {
 	}
 	/* FIXME We should destroy the sessions cleanly */
 	janus_mutex_lock(&sessions_mutex);
+	/* Sessions may still hold frames that never made it to a playout */
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, sessions);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		janus_recordplay_session *session = value;
+		janus_recordplay_frames_unref(session->aframes);
+		session->aframes = NULL;
+		janus_recordplay_frames_unref(session->vframes);
+		session->vframes = NULL;
+	}
+	GList *sl = old_sessions;
+	while(sl) {
+		janus_recordplay_session *session = (janus_recordplay_session *)sl->data;
+		if(session != NULL) {
+			janus_recordplay_frames_unref(session->aframes);
+			session->aframes = NULL;
+			janus_recordplay_frames_unref(session->vframes);
+			session->vframes = NULL;
+		}
+		sl = sl->next;
+	}
 	g_hash_table_destroy(sessions);
 	janus_mutex_unlock(&sessions_mutex);
 	g_async_queue_unref(messages);
 	messages = NULL;
 	sessions = NULL;
+	/* The cache doesn't own the frames: whatever is still in there is used by
+	 * playouts, which will free the frames when they're done with them */
+	janus_mutex_lock(&frames_mutex);
+	g_hash_table_destroy(frames_cache);
+	frames_cache = NULL;
+	janus_mutex_unlock(&frames_mutex);
 	g_atomic_int_set(&initialized, 0);
 	g_atomic_int_set(&stopping, 0);
 	JANUS_LOG(LOG_INFO, "%s destroyed!\n", JANUS_RECORDPLAY_NAME);
@@ -722,6 +824,20 @@ json_t *janus_recordplay_query_session(janus_plugin_session *handle) {
 		json_object_set_new(info, "recording_id", json_integer(session->recording->id));
 		json_object_set_new(info, "recording_name", json_string(session->recording->name));
 	}
+	if(session->playout) {
+		/* How accurately is the pacing engine sending this viewer the frames? */
+		janus_pacer_stats stats;
+		janus_pacer_task_get_stats(session->playout, &stats);
+		json_t *pacing = json_object();
+		json_object_set_new(pacing, "position", json_integer(janus_pacer_task_get_position(session->playout)/1000));
+		json_object_set_new(pacing, "paused", janus_pacer_task_is_paused(session->playout) ? json_true() : json_false());
+		json_object_set_new(pacing, "wakeups", json_integer(stats.wakeups));
+		json_object_set_new(pacing, "late-last-us", json_integer(stats.late_last));
+		json_object_set_new(pacing, "late-avg-us", json_integer(stats.late_avg));
+		json_object_set_new(pacing, "late-max-us", json_integer(stats.late_max));
+		json_object_set_new(pacing, "late-1ms", json_integer(stats.late_1ms));
+		json_object_set_new(info, "pacing", pacing);
+	}
 	json_object_set_new(info, "destroyed", json_integer(session->destroyed));
 	return info;
 }
@@ -830,7 +946,9 @@ struct janus_plugin_result *janus_recordplay_handle_message(janus_plugin_session
 		json_object_set_new(response, "settings", settings); 
 		goto plugin_response;
 	} else if(!strcasecmp(request_text, "record") || !strcasecmp(request_text, "play")
-			|| !strcasecmp(request_text, "start") || !strcasecmp(request_text, "stop")) {
+			|| !strcasecmp(request_text, "start") || !strcasecmp(request_text, "stop")
+			|| !strcasecmp(request_text, "pause") || !strcasecmp(request_text, "resume")
+			|| !strcasecmp(request_text, "seek")) {
 		/* These messages are handled asynchronously */
 		janus_recordplay_message *msg = g_malloc0(sizeof(janus_recordplay_message));
 		msg->handle = handle;
@@ -887,11 +1005,10 @@ void janus_recordplay_setup_media(janus_plugin_session *handle) {
 	/* Take note of the fact that the session is now active */
 	session->active = TRUE;
 	if(!session->recorder) {
-		GError *error = NULL;
-		g_thread_try_new("recordplay playout thread", &janus_recordplay_playout_thread, session, &error);
-		if(error != NULL) {
+		/* The pacing engine will take care of sending the frames */
+		if(janus_recordplay_playout_start(session) < 0) {
 			/* FIXME Should we notify this back to the user somehow? */
-			JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the Record&Play playout thread...\n", error->code, error->message ? error->message : "??");
+			JANUS_LOG(LOG_ERR, "Error starting the Record&Play playout...\n");
 		}
 	}
 }
@@ -1009,6 +1126,10 @@ void janus_recordplay_hangup_media(janus_plugin_session *handle) {
 		return;
 	}
 	session->active = FALSE;
+	if(!session->recorder) {
+		/* Stop the playout, if any: the pacing engine will do the rest */
+		janus_pacer_task_stop(session->playout);
+	}
 	if(session->destroyed || !session->recorder)
 		return;
 	if(g_atomic_int_add(&session->hangingup, 1))
@@ -1229,15 +1350,19 @@ static void *janus_recordplay_handler(void *data) {
 			}
 			/* Access the frames */
 			const char *warning = NULL;
+			janus_recordplay_frames_unref(session->aframes);
+			session->aframes = NULL;
+			janus_recordplay_frames_unref(session->vframes);
+			session->vframes = NULL;
 			if(rec->arc_file) {
-				session->aframes = janus_recordplay_get_frames(recordings_path, rec->arc_file);
+				session->aframes = janus_recordplay_frames_get(recordings_path, rec->arc_file);
 				if(session->aframes == NULL) {
 					JANUS_LOG(LOG_WARN, "Error opening audio recording, trying to go on anyway\n");
 					warning = "Broken audio file, playing video only";
 				}
 			}
 			if(rec->vrc_file) {
-				session->vframes = janus_recordplay_get_frames(recordings_path, rec->vrc_file);
+				session->vframes = janus_recordplay_frames_get(recordings_path, rec->vrc_file);
 				if(session->vframes == NULL) {
 					JANUS_LOG(LOG_WARN, "Error opening video recording, trying to go on anyway\n");
 					warning = "Broken video file, playing audio only";
@@ -1293,9 +1418,66 @@ static void *janus_recordplay_handler(void *data) {
 				json_object_set_new(info, "id", json_integer(session->recording->id));
 				gateway->notify_event(&janus_recordplay_plugin, session->handle, info);
 			}
+		} else if(!strcasecmp(request_text, "pause") || !strcasecmp(request_text, "resume")) {
+			if(session->playout == NULL) {
+				JANUS_LOG(LOG_ERR, "Not a playout session, can't %s\n", request_text);
+				error_code = JANUS_RECORDPLAY_ERROR_INVALID_STATE;
+				g_snprintf(error_cause, 512, "Not a playout session, can't %s", request_text);
+				goto error;
+			}
+			gboolean pause = !strcasecmp(request_text, "pause");
+			if(pause)
+				janus_pacer_task_pause(session->playout);
+			else
+				janus_pacer_task_resume(session->playout);
+			/* Done! */
+			result = json_object();
+			json_object_set_new(result, "status", json_string(pause ? "paused" : "playing"));
+			json_object_set_new(result, "position", json_integer(janus_pacer_task_get_position(session->playout)/1000));
+			/* Also notify event handlers */
+			if(notify_events && gateway->events_is_enabled()) {
+				json_t *info = json_object();
+				json_object_set_new(info, "event", json_string(pause ? "paused" : "playing"));
+				json_object_set_new(info, "id", json_integer(session->recording->id));
+				gateway->notify_event(&janus_recordplay_plugin, session->handle, info);
+			}
+		} else if(!strcasecmp(request_text, "seek")) {
+			JANUS_VALIDATE_JSON_OBJECT(root, seek_parameters,
+				error_code, error_cause, TRUE,
+				JANUS_RECORDPLAY_ERROR_MISSING_ELEMENT, JANUS_RECORDPLAY_ERROR_INVALID_ELEMENT);
+			if(error_code != 0)
+				goto error;
+			if(session->playout == NULL) {
+				JANUS_LOG(LOG_ERR, "Not a playout session, can't seek\n");
+				error_code = JANUS_RECORDPLAY_ERROR_INVALID_STATE;
+				g_snprintf(error_cause, 512, "Not a playout session, can't seek");
+				goto error;
+			}
+			json_t *position = json_object_get(root, "position");
+			gint64 actual = janus_pacer_task_seek(session->playout, json_integer_value(position)*1000);
+			if(actual < 0) {
+				JANUS_LOG(LOG_ERR, "Error seeking to %"SCNi64"ms\n", (gint64)json_integer_value(position));
+				error_code = JANUS_RECORDPLAY_ERROR_INVALID_STATE;
+				g_snprintf(error_cause, 512, "Error seeking to %"SCNi64"ms", (gint64)json_integer_value(position));
+				goto error;
+			}
+			/* Done! */
+			result = json_object();
+			json_object_set_new(result, "status", json_string(janus_pacer_task_is_paused(session->playout) ? "paused" : "playing"));
+			json_object_set_new(result, "position", json_integer(actual/1000));
+			/* Also notify event handlers */
+			if(notify_events && gateway->events_is_enabled()) {
+				json_t *info = json_object();
+				json_object_set_new(info, "event", json_string("seeked"));
+				json_object_set_new(info, "id", json_integer(session->recording->id));
+				json_object_set_new(info, "position", json_integer(actual/1000));
+				gateway->notify_event(&janus_recordplay_plugin, session->handle, info);
+			}
 		} else if(!strcasecmp(request_text, "stop")) {
 			/* Stop the recording/playout */
 			session->active = FALSE;
+			if(!session->recorder)
+				janus_pacer_task_stop(session->playout);
 			janus_mutex_lock(&session->rec_mutex);
 			if(session->arc) {
 				janus_recorder_close(session->arc);
@@ -1562,41 +1744,36 @@ void janus_recordplay_update_recordings_list(void) {
 	janus_mutex_unlock(&recordings_mutex);
 }
 
-janus_recordplay_frame_packet *janus_recordplay_get_frames(const char *dir, const char *filename) {
-	if(!dir || !filename)
+janus_recorder_index *janus_recordplay_get_frames(const char *source, char *data, size_t size) {
+	if(!source || !data || size == 0)
 		return NULL;
-	/* Open the file */
-	char source[1024];
-	if(strstr(filename, ".mjr"))
-		g_snprintf(source, 1024, "%s/%s", dir, filename);
-	else
-		g_snprintf(source, 1024, "%s/%s.mjr", dir, filename);
-	FILE *file = fopen(source, "rb");
+	/* Parse the mapped file as a stream: this doesn't involve any syscall */
+	FILE *file = fmemopen(data, size, "rb");
 	if(file == NULL) {
 		JANUS_LOG(LOG_ERR, "Could not open file %s\n", source);
 		return NULL;
 	}
-	fseek(file, 0L, SEEK_END);
-	long fsize = ftell(file);
-	fseek(file, 0L, SEEK_SET);
+	long fsize = size;
 	JANUS_LOG(LOG_VERB, "File is %zu bytes\n", fsize);
+	/* If the recording comes with an index, we don't need to scan all the frames */
+	janus_recorder_index *index = janus_recorder_index_load(source, fsize);
 
 	/* Pre-parse */
 	JANUS_LOG(LOG_VERB, "Pre-parsing file %s to generate ordered index...\n", source);
-	gboolean parsed_header = FALSE;
+	gboolean parsed_header = FALSE, video = FALSE;
 	int bytes = 0;
 	long offset = 0;
-	uint16_t len = 0, count = 0;
-	uint32_t first_ts = 0, last_ts = 0, reset = 0;	/* To handle whether there's a timestamp reset in the recording */
+	uint16_t len = 0;
 	char prebuffer[1500];
 	memset(prebuffer, 0, 1500);
-	/* Let's look for timestamp resets first */
-	while(offset < fsize) {
+	/* Let's check the header first */
+	while(offset < fsize && !parsed_header) {
 		/* Read frame header */
 		fseek(file, offset, SEEK_SET);
 		bytes = fread(prebuffer, sizeof(char), 8, file);
 		if(bytes != 8 || prebuffer[0] != 'M') {
 			JANUS_LOG(LOG_ERR, "Invalid header...\n");
+			janus_recorder_index_free(index);
 			fclose(file);
 			return NULL;
 		}
@@ -1613,10 +1790,12 @@ janus_recordplay_frame_packet *janus_recordplay_get_frames(const char *dir, cons
 				bytes = fread(prebuffer, sizeof(char), 5, file);
 				if(prebuffer[0] == 'v') {
 					JANUS_LOG(LOG_INFO, "This is a video recording, assuming VP8\n");
+					video = TRUE;
 				} else if(prebuffer[0] == 'a') {
 					JANUS_LOG(LOG_INFO, "This is an audio recording, assuming Opus\n");
 				} else {
 					JANUS_LOG(LOG_WARN, "Unsupported recording media type...\n");
+					janus_recorder_index_free(index);
 					fclose(file);
 					return NULL;
 				}
@@ -1640,6 +1819,7 @@ janus_recordplay_frame_packet *janus_recordplay_get_frames(const char *dir, cons
 				bytes = fread(prebuffer, sizeof(char), len, file);
 				if(bytes < 0) {
 					JANUS_LOG(LOG_ERR, "Error reading from file... %s\n", strerror(errno));
+					janus_recorder_index_free(index);
 					fclose(file);
 					return NULL;
 				}
@@ -1650,6 +1830,7 @@ janus_recordplay_frame_packet *janus_recordplay_get_frames(const char *dir, cons
 				if(!info) {
 					JANUS_LOG(LOG_ERR, "JSON error: on line %d: %s\n", error.line, error.text);
 					JANUS_LOG(LOG_WARN, "Error parsing info header...\n");
+					janus_recorder_index_free(index);
 					fclose(file);
 					return NULL;
 				}
@@ -1658,19 +1839,20 @@ janus_recordplay_frame_packet *janus_recordplay_get_frames(const char *dir, cons
 				if(!type || !json_is_string(type)) {
 					JANUS_LOG(LOG_WARN, "Missing/invalid recording type in info header...\n");
 					json_decref(info);
+					janus_recorder_index_free(index);
 					fclose(file);
 					return NULL;
 				}
 				const char *t = json_string_value(type);
-				int video = 0;
 				gint64 c_time = 0, w_time = 0;
 				if(!strcasecmp(t, "v")) {
-					video = 1;
+					video = TRUE;
 				} else if(!strcasecmp(t, "a")) {
-					video = 0;
+					video = FALSE;
 				} else {
 					JANUS_LOG(LOG_WARN, "Unsupported recording type '%s' in info header...\n", t);
 					json_decref(info);
+					janus_recorder_index_free(index);
 					fclose(file);
 					return NULL;
 				}
@@ -1679,6 +1861,7 @@ janus_recordplay_frame_packet *janus_recordplay_get_frames(const char *dir, cons
 				if(!codec || !json_is_string(codec)) {
 					JANUS_LOG(LOG_WARN, "Missing recording codec in info header...\n");
 					json_decref(info);
+					janus_recorder_index_free(index);
 					fclose(file);
 					return NULL;
 				}
@@ -1686,11 +1869,13 @@ janus_recordplay_frame_packet *janus_recordplay_get_frames(const char *dir, cons
 				if(video && strcasecmp(c, "vp8")) {
 					JANUS_LOG(LOG_WARN, "The Record&Play plugin only supports VP8 video for now (was '%s')...\n", c);
 					json_decref(info);
+					janus_recorder_index_free(index);
 					fclose(file);
 					return NULL;
 				} else if(!video && strcasecmp(c, "opus")) {
 					JANUS_LOG(LOG_WARN, "The Record&Play plugin only supports Opus audio for now (was '%s')...\n", c);
 					json_decref(info);
+					janus_recorder_index_free(index);
 					fclose(file);
 					return NULL;
 				}
@@ -1699,6 +1884,7 @@ janus_recordplay_frame_packet *janus_recordplay_get_frames(const char *dir, cons
 				if(!created || !json_is_integer(created)) {
 					JANUS_LOG(LOG_WARN, "Missing recording created time in info header...\n");
 					json_decref(info);
+					janus_recorder_index_free(index);
 					fclose(file);
 					return NULL;
 				}
@@ -1708,6 +1894,7 @@ janus_recordplay_frame_packet *janus_recordplay_get_frames(const char *dir, cons
 				if(!written || !json_is_integer(written)) {
 					JANUS_LOG(LOG_WARN, "Missing recording written time in info header...\n");
 					json_decref(info);
+					janus_recorder_index_free(index);
 					fclose(file);
 					return NULL;
 				}
@@ -1721,35 +1908,27 @@ janus_recordplay_frame_packet *janus_recordplay_get_frames(const char *dir, cons
 			}
 		} else {
 			JANUS_LOG(LOG_ERR, "Invalid header...\n");
+			janus_recorder_index_free(index);
 			fclose(file);
 			return NULL;
 		}
-		/* Only read RTP header */
-		bytes = fread(prebuffer, sizeof(char), 16, file);
-		rtp_header *rtp = (rtp_header *)prebuffer;
-		if(last_ts == 0) {
-			first_ts = ntohl(rtp->timestamp);
-			if(first_ts > 1000*1000)	/* Just used to check whether a packet is pre- or post-reset */
-				first_ts -= 1000*1000;
-		} else {
-			if(ntohl(rtp->timestamp) < last_ts) {
-				/* The new timestamp is smaller than the next one, is it a timestamp reset or simply out of order? */
-				if(last_ts-ntohl(rtp->timestamp) > 2*1000*1000*1000) {
-					reset = ntohl(rtp->timestamp);
-					JANUS_LOG(LOG_VERB, "Timestamp reset: %"SCNu32"\n", reset);
-				}
-			} else if(ntohl(rtp->timestamp) < reset) {
-				JANUS_LOG(LOG_VERB, "Updating timestamp reset: %"SCNu32" (was %"SCNu32")\n", ntohl(rtp->timestamp), reset);
-				reset = ntohl(rtp->timestamp);
-			}
-		}
-		last_ts = ntohl(rtp->timestamp);
 		/* Skip data for now */
 		offset += len;
 	}
-	/* Now let's parse the frames and order them */
+	/* Now let's parse the frames, unless the recording came with an index already */
+	if(index != NULL) {
+		/* The index is already in playout order, and knows where the keyframes are */
+		JANUS_LOG(LOG_VERB, "Using the index (%zu packets, %zu keyframes)\n", index->count, index->keyframes_count);
+		fclose(file);
+		if(index->count == 0) {
+			JANUS_LOG(LOG_WARN, "No RTP packets in %s\n", source);
+			janus_recorder_index_free(index);
+			return NULL;
+		}
+		return index;
+	}
 	offset = 0;
-	janus_recordplay_frame_packet *list = NULL, *last = NULL;
+	index = janus_recorder_index_create();
 	while(offset < fsize) {
 		/* Read frame header */
 		fseek(file, offset, SEEK_SET);
@@ -1767,345 +1946,294 @@ janus_recordplay_frame_packet *janus_recordplay_get_frames(const char *dir, cons
 			offset += len;
 			continue;
 		}
-		/* Only read RTP header */
-		bytes = fread(prebuffer, sizeof(char), 16, file);
-		if(bytes < 0) {
-			JANUS_LOG(LOG_WARN, "Error reading RTP header, stopping here...\n");
+		if(offset + len > fsize) {
+			JANUS_LOG(LOG_WARN, "Truncated packet, stopping here...\n");
 			break;
 		}
-		rtp_header *rtp = (rtp_header *)prebuffer;
+		/* The file is mapped, so we can look at the RTP packet in place */
+		rtp_header *rtp = (rtp_header *)(data + offset);
 		JANUS_LOG(LOG_HUGE, "  -- RTP packet (ssrc=%"SCNu32", pt=%"SCNu16", ext=%"SCNu16", seq=%"SCNu16", ts=%"SCNu32")\n",
 				ntohl(rtp->ssrc), rtp->type, rtp->extension, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-		/* Generate frame packet and insert in the ordered list */
-		janus_recordplay_frame_packet *p = g_malloc0(sizeof(janus_recordplay_frame_packet));
-		p->seq = ntohs(rtp->seq_number);
-		if(reset == 0) {
-			/* Simple enough... */
-			p->ts = ntohl(rtp->timestamp);
-		} else {
-			/* Is this packet pre- or post-reset? */
-			if(ntohl(rtp->timestamp) > first_ts) {
-				/* Pre-reset... */
-				p->ts = ntohl(rtp->timestamp);
-			} else {
-				/* Post-reset... */
-				uint64_t max32 = UINT32_MAX;
-				max32++;
-				p->ts = max32+ntohl(rtp->timestamp);
-			}
-		}
-		p->len = len;
-		p->offset = offset;
-		p->next = NULL;
-		p->prev = NULL;
-		if(list == NULL) {
-			/* First element becomes the list itself (and the last item), at least for now */
-			list = p;
-			last = p;
-		} else {
-			/* Check where we should insert this, starting from the end */
-			int added = 0;
-			janus_recordplay_frame_packet *tmp = last;
-			while(tmp) {
-				if(tmp->ts < p->ts) {
-					/* The new timestamp is greater than the last one we have, append */
-					added = 1;
-					if(tmp->next != NULL) {
-						/* We're inserting */
-						tmp->next->prev = p;
-						p->next = tmp->next;
-					} else {
-						/* Update the last packet */
-						last = p;
-					}
-					tmp->next = p;
-					p->prev = tmp;
-					break;
-				} else if(tmp->ts == p->ts) {
-					/* Same timestamp, check the sequence number */
-					if(tmp->seq < p->seq && (abs(tmp->seq - p->seq) < 10000)) {
-						/* The new sequence number is greater than the last one we have, append */
-						added = 1;
-						if(tmp->next != NULL) {
-							/* We're inserting */
-							tmp->next->prev = p;
-							p->next = tmp->next;
-						} else {
-							/* Update the last packet */
-							last = p;
-						}
-						tmp->next = p;
-						p->prev = tmp;
-						break;
-					} else if(tmp->seq > p->seq && (abs(tmp->seq - p->seq) > 10000)) {
-						/* The new sequence number (resetted) is greater than the last one we have, append */
-						added = 1;
-						if(tmp->next != NULL) {
-							/* We're inserting */
-							tmp->next->prev = p;
-							p->next = tmp->next;
-						} else {
-							/* Update the last packet */
-							last = p;
-						}
-						tmp->next = p;
-						p->prev = tmp;
-						break;
-					}
-				}
-				/* If either the timestamp ot the sequence number we just got is smaller, keep going back */
-				tmp = tmp->prev;
-			}
-			if(!added) {
-				/* We reached the start */
-				p->next = list;
-				list->prev = p;
-				list = p;
-			}
+		gboolean keyframe = FALSE;
+		if(video) {
+			int plen = 0;
+			char *payload = janus_rtp_payload(data + offset, len, &plen);
+			keyframe = payload != NULL && janus_vp8_is_keyframe(payload, plen);	/* FIXME We assume it's VP8 */
 		}
+		/* The index extends timestamps, which takes care of resets, and we sort it when we're done */
+		janus_recorder_index_add(index, offset, ntohl(rtp->timestamp), ntohs(rtp->seq_number), len, keyframe);
 		/* Skip data for now */
 		offset += len;
-		count++;
 	}
-	
-	JANUS_LOG(LOG_VERB, "Counted %"SCNu16" RTP packets\n", count);
-	janus_recordplay_frame_packet *tmp = list;
-	count = 0;
-	while(tmp) {
-		count++;
-		JANUS_LOG(LOG_HUGE, "[%10lu][%4d] seq=%"SCNu16", ts=%"SCNu64"\n", tmp->offset, tmp->len, tmp->seq, tmp->ts);
-		tmp = tmp->next;
-	}
-	JANUS_LOG(LOG_VERB, "Counted %"SCNu16" frame packets\n", count);
-	
-	/* Done! */
 	fclose(file);
-	return list;
+	if(index->count == 0) {
+		JANUS_LOG(LOG_WARN, "No RTP packets in %s\n", source);
+		janus_recorder_index_free(index);
+		return NULL;
+	}
+	janus_recorder_index_sort(index);
+	JANUS_LOG(LOG_VERB, "Counted %zu RTP packets (%zu keyframes)\n", index->count, index->keyframes_count);
+
+	/* Done! */
+	return index;
 }
 
-static void *janus_recordplay_playout_thread(void *data) {
-	janus_recordplay_session *session = (janus_recordplay_session *)data;
-	if(!session) {
-		JANUS_LOG(LOG_ERR, "Invalid session, can't start playout thread...\n");
-		g_thread_unref(g_thread_self());
+static janus_recordplay_frames *janus_recordplay_frames_get(const char *dir, const char *filename) {
+	if(!dir || !filename)
+		return NULL;
+	char source[1024];
+	if(strstr(filename, ".mjr"))
+		g_snprintf(source, 1024, "%s/%s", dir, filename);
+	else
+		g_snprintf(source, 1024, "%s/%s.mjr", dir, filename);
+	int fd = open(source, O_RDONLY);
+	if(fd < 0) {
+		JANUS_LOG(LOG_ERR, "Could not open file %s\n", source);
 		return NULL;
 	}
-	if(session->recorder) {
-		JANUS_LOG(LOG_ERR, "This is a recorder, can't start playout thread...\n");
-		g_thread_unref(g_thread_self());
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size == 0) {
+		JANUS_LOG(LOG_ERR, "Could not access file %s\n", source);
+		close(fd);
 		return NULL;
 	}
-	if(!session->aframes && !session->vframes) {
-		JANUS_LOG(LOG_ERR, "No audio and no video frames, can't start playout thread...\n");
-		g_thread_unref(g_thread_self());
+	/* Do we have this recording already, and is it still the same file? */
+	janus_recordplay_frames *frames = NULL;
+	janus_mutex_lock(&frames_mutex);
+	frames = frames_cache ? g_hash_table_lookup(frames_cache, source) : NULL;
+	if(frames != NULL && frames->size == (size_t)st.st_size && frames->mtime == st.st_mtime) {
+		frames->ref++;
+		JANUS_LOG(LOG_VERB, "Sharing the frames of %s (%d viewers)\n", source, frames->ref);
+		janus_mutex_unlock(&frames_mutex);
+		close(fd);
+		return frames;
+	}
+	janus_mutex_unlock(&frames_mutex);
+	/* Map the file and parse it: we don't hold the lock, as it may take a while. The
+	 * mapping stays valid after we close the file: we check the file is all there only
+	 * here, as recordings must not be truncated while they're being played */
+	char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(data == MAP_FAILED) {
+		JANUS_LOG(LOG_ERR, "Could not map file %s: %d (%s)\n", source, errno, strerror(errno));
+		close(fd);
 		return NULL;
 	}
-	JANUS_LOG(LOG_INFO, "Joining playout thread\n");
-	/* Open the files */
-	FILE *afile = NULL, *vfile = NULL;
-	if(session->aframes) {
-		char source[1024];
-		if(strstr(session->recording->arc_file, ".mjr"))
-			g_snprintf(source, 1024, "%s/%s", recordings_path, session->recording->arc_file);
-		else
-			g_snprintf(source, 1024, "%s/%s.mjr", recordings_path, session->recording->arc_file);
-		afile = fopen(source, "rb");
-		if(afile == NULL) {
-			JANUS_LOG(LOG_ERR, "Could not open audio file %s, can't start playout thread...\n", source);
-			g_thread_unref(g_thread_self());
-			return NULL;
-		}
+	close(fd);
+	janus_recorder_index *index = janus_recordplay_get_frames(source, data, st.st_size);
+	if(index == NULL) {
+		munmap(data, st.st_size);
+		return NULL;
+	}
+	frames = g_malloc0(sizeof(janus_recordplay_frames));
+	frames->source = g_strdup(source);
+	frames->data = data;
+	frames->size = st.st_size;
+	frames->mtime = st.st_mtime;
+	frames->index = index;
+	frames->ref = 1;
+	janus_mutex_lock(&frames_mutex);
+	janus_recordplay_frames *cached = frames_cache ? g_hash_table_lookup(frames_cache, source) : NULL;
+	if(cached != NULL && cached->size == frames->size && cached->mtime == frames->mtime) {
+		/* Another viewer got here first, use theirs */
+		cached->ref++;
+		janus_mutex_unlock(&frames_mutex);
+		frames->ref = 0;
+		janus_recordplay_frames_unref(frames);
+		return cached;
+	}
+	/* If there was a stale instance, whoever is still using it keeps it until they're done */
+	if(frames_cache != NULL)
+		g_hash_table_insert(frames_cache, frames->source, frames);
+	janus_mutex_unlock(&frames_mutex);
+	return frames;
+}
+
+static void janus_recordplay_frames_unref(janus_recordplay_frames *frames) {
+	if(!frames)
+		return;
+	janus_mutex_lock(&frames_mutex);
+	if(frames->ref > 0)
+		frames->ref--;
+	if(frames->ref > 0) {
+		janus_mutex_unlock(&frames_mutex);
+		return;
+	}
+	if(frames_cache != NULL && g_hash_table_lookup(frames_cache, frames->source) == frames)
+		g_hash_table_remove(frames_cache, frames->source);
+	janus_mutex_unlock(&frames_mutex);
+	/* Get rid of the index and of the mapping */
+	janus_recorder_index_free(frames->index);
+	munmap(frames->data, frames->size);
+	g_free(frames->source);
+	g_free(frames);
+}
+
+/* Helper to copy a packet from the mapping to a buffer we can update */
+static int janus_recordplay_frames_copy(janus_recordplay_frames *frames, size_t frame, char *buffer, int size) {
+	janus_recorder_index_entry *entry = &frames->index->entries[frame];
+	if(entry->length > size || entry->offset + entry->length > frames->size) {
+		JANUS_LOG(LOG_WARN, "Invalid packet (offset %"SCNu64", length %"SCNu16"), skipping...\n", entry->offset, entry->length);
+		return -1;
 	}
-	if(session->vframes) {
-		char source[1024];
-		if(strstr(session->recording->vrc_file, ".mjr"))
-			g_snprintf(source, 1024, "%s/%s", recordings_path, session->recording->vrc_file);
+	memcpy(buffer, frames->data + entry->offset, entry->length);
+	return entry->length;
+}
+
+/* Playouts are sent by the pacing engine: positions are relative to the first frame of each medium */
+typedef struct janus_recordplay_playout {
+	janus_recordplay_session *session;
+	janus_recordplay_frames *aframes, *vframes;	/* Frames being sent (the playout owns a reference) */
+	size_t anext, vnext;	/* Positions in the indexes of the next frames to send */
+} janus_recordplay_playout;
+static gint64 janus_recordplay_playout_send(void *data, gint64 position);
+static gint64 janus_recordplay_playout_seek(void *data, gint64 position);
+static void janus_recordplay_playout_done(void *data);
+static janus_pacer_callbacks janus_recordplay_playout_callbacks = {
+	.send = janus_recordplay_playout_send,
+	.seek = janus_recordplay_playout_seek,
+	.done = janus_recordplay_playout_done,
+};
+
+/* Whether there are frames left to send, starting from a position in the index */
+static gboolean janus_recordplay_frame_valid(janus_recordplay_frames *frames, size_t frame) {
+	return frames != NULL && frame < frames->index->count;
+}
+
+static gint64 janus_recordplay_frame_position(janus_recordplay_frames *frames, size_t frame, int khz) {
+	janus_recorder_index_entry *entries = frames->index->entries;
+	return (gint64)(entries[frame].timestamp - entries[0].timestamp)*1000/khz;
+}
+
+/* Convert a position in the media to an (extended) RTP timestamp in the index */
+static guint64 janus_recordplay_frame_timestamp(janus_recordplay_frames *frames, gint64 position, int khz) {
+	return frames->index->entries[0].timestamp + (guint64)(MAX(position, 0)*khz/1000);
+}
+
+/* Find the first frame that's not before a timestamp (binary search, as the index is in playout order) */
+static size_t janus_recordplay_frame_find(janus_recordplay_frames *frames, guint64 timestamp) {
+	janus_recorder_index_entry *entries = frames->index->entries;
+	size_t low = 0, high = frames->index->count;
+	while(low < high) {
+		size_t mid = low + (high - low)/2;
+		if(entries[mid].timestamp < timestamp)
+			low = mid + 1;
 		else
-			g_snprintf(source, 1024, "%s/%s.mjr", recordings_path, session->recording->vrc_file);
-		vfile = fopen(source, "rb");
-		if(vfile == NULL) {
-			JANUS_LOG(LOG_ERR, "Could not open video file %s, can't start playout thread...\n", source);
-			if(afile)
-				fclose(afile);
-			afile = NULL;
-			g_thread_unref(g_thread_self());
-			return NULL;
-		}
+			high = mid;
 	}
-	
-	/* Timer */
-	gboolean asent = FALSE, vsent = FALSE;
-	struct timeval now, abefore, vbefore;
-	time_t d_s, d_us;
-	gettimeofday(&now, NULL);
-	gettimeofday(&abefore, NULL);
-	gettimeofday(&vbefore, NULL);
-
-	janus_recordplay_frame_packet *audio = session->aframes, *video = session->vframes;
-	char *buffer = (char *)g_malloc0(1500);
-	memset(buffer, 0, 1500);
+	return low;
+}
+
+static int janus_recordplay_playout_start(janus_recordplay_session *session) {
+	if(!session) {
+		JANUS_LOG(LOG_ERR, "Invalid session, can't start playout...\n");
+		return -1;
+	}
+	if(session->recorder) {
+		JANUS_LOG(LOG_ERR, "This is a recorder, can't start playout...\n");
+		return -1;
+	}
+	if(!session->aframes && !session->vframes) {
+		JANUS_LOG(LOG_ERR, "No audio and no video frames, can't start playout...\n");
+		return -1;
+	}
+	JANUS_LOG(LOG_INFO, "Starting playout\n");
+	/* The recordings are already mapped, so there's no file to open here: the frames now belong to the playout */
+	janus_recordplay_playout *playout = g_malloc0(sizeof(janus_recordplay_playout));
+	playout->session = session;
+	playout->aframes = session->aframes;
+	playout->anext = 0;
+	session->aframes = NULL;
+	playout->vframes = session->vframes;
+	playout->vnext = 0;
+	session->vframes = NULL;
+	janus_pacer_task *task = janus_pacer_task_create(&janus_recordplay_playout_callbacks, playout);
+	if(task == NULL) {
+		janus_recordplay_playout_done(playout);
+		return -1;
+	}
+	janus_pacer_task_unref(session->playout);
+	session->playout = task;
+	if(janus_pacer_task_start(task, 0) < 0) {
+		/* This will get rid of the frames and of the PeerConnection */
+		janus_pacer_task_stop(task);
+		return -1;
+	}
+	return 0;
+}
+
+static gint64 janus_recordplay_playout_send(void *data, gint64 position) {
+	janus_recordplay_playout *playout = (janus_recordplay_playout *)data;
+	janus_recordplay_session *session = playout->session;
+	if(session->destroyed || !session->active || session->recording == NULL || session->recording->destroyed)
+		return -1;
+	janus_recordplay_frames *aframes = playout->aframes, *vframes = playout->vframes;
+	char buffer[1500];
 	int bytes = 0;
-	int64_t ts_diff = 0, passed = 0;
-	
-	while(!session->destroyed && session->active && !session->recording->destroyed && (audio || video)) {
-		if(!asent && !vsent) {
-			/* We skipped the last round, so sleep a bit (5ms) */
-			usleep(5000);
-		}
-		asent = FALSE;
-		vsent = FALSE;
-		if(audio) {
-			if(audio == session->aframes) {
-				/* First packet, send now */
-				fseek(afile, audio->offset, SEEK_SET);
-				bytes = fread(buffer, sizeof(char), audio->len, afile);
-				if(bytes != audio->len)
-					JANUS_LOG(LOG_WARN, "Didn't manage to read all the bytes we needed (%d < %d)...\n", bytes, audio->len);
-				/* Update payload type */
-				rtp_header *rtp = (rtp_header *)buffer;
-				rtp->type = OPUS_PT;	/* FIXME We assume it's Opus */
-				if(gateway != NULL)
-					gateway->relay_rtp(session->handle, 0, (char *)buffer, bytes);
-				gettimeofday(&now, NULL);
-				abefore.tv_sec = now.tv_sec;
-				abefore.tv_usec = now.tv_usec;
-				asent = TRUE;
-				audio = audio->next;
-			} else {
-				/* What's the timestamp skip from the previous packet? */
-				ts_diff = audio->ts - audio->prev->ts;
-				ts_diff = (ts_diff*1000)/48;	/* FIXME Again, we're assuming Opus and it's 48khz */
-				/* Check if it's time to send */
-				gettimeofday(&now, NULL);
-				d_s = now.tv_sec - abefore.tv_sec;
-				d_us = now.tv_usec - abefore.tv_usec;
-				if(d_us < 0) {
-					d_us += 1000000;
-					--d_s;
-				}
-				passed = d_s*1000000 + d_us;
-				if(passed < (ts_diff-5000)) {
-					asent = FALSE;
-				} else {
-					/* Update the reference time */
-					abefore.tv_usec += ts_diff%1000000;
-					if(abefore.tv_usec > 1000000) {
-						abefore.tv_sec++;
-						abefore.tv_usec -= 1000000;
-					}
-					if(ts_diff/1000000 > 0) {
-						abefore.tv_sec += ts_diff/1000000;
-						abefore.tv_usec -= ts_diff/1000000;
-					}
-					/* Send now */
-					fseek(afile, audio->offset, SEEK_SET);
-					bytes = fread(buffer, sizeof(char), audio->len, afile);
-					if(bytes != audio->len)
-						JANUS_LOG(LOG_WARN, "Didn't manage to read all the bytes we needed (%d < %d)...\n", bytes, audio->len);
-					/* Update payload type */
-					rtp_header *rtp = (rtp_header *)buffer;
-					rtp->type = OPUS_PT;	/* FIXME We assume it's Opus */
-					if(gateway != NULL)
-						gateway->relay_rtp(session->handle, 0, (char *)buffer, bytes);
-					asent = TRUE;
-					audio = audio->next;
-				}
-			}
+	/* Send all the audio packets that are due */
+	while(janus_recordplay_frame_valid(aframes, playout->anext) && janus_recordplay_frame_position(aframes, playout->anext, 48) <= position) {	/* FIXME Again, we're assuming Opus and it's 48khz */
+		bytes = janus_recordplay_frames_copy(aframes, playout->anext, buffer, sizeof(buffer));
+		if(bytes > 0) {
+			/* Update payload type */
+			rtp_header *rtp = (rtp_header *)buffer;
+			rtp->type = OPUS_PT;	/* FIXME We assume it's Opus */
+			if(gateway != NULL)
+				gateway->relay_rtp(session->handle, 0, (char *)buffer, bytes);
 		}
-		if(video) {
-			if(video == session->vframes) {
-				/* First packets: there may be many of them with the same timestamp, send them all */
-				uint64_t ts = video->ts;
-				while(video && video->ts == ts) {
-					fseek(vfile, video->offset, SEEK_SET);
-					bytes = fread(buffer, sizeof(char), video->len, vfile);
-					if(bytes != video->len)
-						JANUS_LOG(LOG_WARN, "Didn't manage to read all the bytes we needed (%d < %d)...\n", bytes, video->len);
-					/* Update payload type */
-					rtp_header *rtp = (rtp_header *)buffer;
-					rtp->type = VP8_PT;	/* FIXME We assume it's VP8 */
-					if(gateway != NULL)
-						gateway->relay_rtp(session->handle, 1, (char *)buffer, bytes);
-					video = video->next;
-				}
-				vsent = TRUE;
-				gettimeofday(&now, NULL);
-				vbefore.tv_sec = now.tv_sec;
-				vbefore.tv_usec = now.tv_usec;
-			} else {
-				/* What's the timestamp skip from the previous packet? */
-				ts_diff = video->ts - video->prev->ts;
-				ts_diff = (ts_diff*1000)/90;
-				/* Check if it's time to send */
-				gettimeofday(&now, NULL);
-				d_s = now.tv_sec - vbefore.tv_sec;
-				d_us = now.tv_usec - vbefore.tv_usec;
-				if(d_us < 0) {
-					d_us += 1000000;
-					--d_s;
-				}
-				passed = d_s*1000000 + d_us;
-				if(passed < (ts_diff-5000)) {
-					vsent = FALSE;
-				} else {
-					/* Update the reference time */
-					vbefore.tv_usec += ts_diff%1000000;
-					if(vbefore.tv_usec > 1000000) {
-						vbefore.tv_sec++;
-						vbefore.tv_usec -= 1000000;
-					}
-					if(ts_diff/1000000 > 0) {
-						vbefore.tv_sec += ts_diff/1000000;
-						vbefore.tv_usec -= ts_diff/1000000;
-					}
-					/* There may be multiple packets with the same timestamp, send them all */
-					uint64_t ts = video->ts;
-					while(video && video->ts == ts) {
-						/* Send now */
-						fseek(vfile, video->offset, SEEK_SET);
-						bytes = fread(buffer, sizeof(char), video->len, vfile);
-						if(bytes != video->len)
-							JANUS_LOG(LOG_WARN, "Didn't manage to read all the bytes we needed (%d < %d)...\n", bytes, video->len);
-						/* Update payload type */
-						rtp_header *rtp = (rtp_header *)buffer;
-						rtp->type = VP8_PT;	/* FIXME We assume it's VP8 */
-						if(gateway != NULL)
-							gateway->relay_rtp(session->handle, 1, (char *)buffer, bytes);
-						video = video->next;
-					}
-					vsent = TRUE;
-				}
-			}
+		playout->anext++;
+	}
+	/* Same for video: there may be many packets with the same timestamp, and they'll all be sent */
+	while(janus_recordplay_frame_valid(vframes, playout->vnext) && janus_recordplay_frame_position(vframes, playout->vnext, 90) <= position) {
+		bytes = janus_recordplay_frames_copy(vframes, playout->vnext, buffer, sizeof(buffer));
+		if(bytes > 0) {
+			/* Update payload type */
+			rtp_header *rtp = (rtp_header *)buffer;
+			rtp->type = VP8_PT;	/* FIXME We assume it's VP8 */
+			if(gateway != NULL)
+				gateway->relay_rtp(session->handle, 1, (char *)buffer, bytes);
 		}
+		playout->vnext++;
 	}
-	
-	g_free(buffer);
+	/* When should we be woken up next? */
+	gint64 next = -1;
+	if(janus_recordplay_frame_valid(aframes, playout->anext))
+		next = janus_recordplay_frame_position(aframes, playout->anext, 48);
+	if(janus_recordplay_frame_valid(vframes, playout->vnext)) {
+		gint64 vnext = janus_recordplay_frame_position(vframes, playout->vnext, 90);
+		if(next < 0 || vnext < next)
+			next = vnext;
+	}
+	return next;
+}
 
-	/* Get rid of the indexes */
-	janus_recordplay_frame_packet *tmp = NULL;
-	audio = session->aframes;
-	while(audio) {
-		tmp = audio->next;
-		g_free(audio);
-		audio = tmp;
+static gint64 janus_recordplay_playout_seek(void *data, gint64 position) {
+	janus_recordplay_playout *playout = (janus_recordplay_playout *)data;
+	gint64 target = position;
+	if(playout->vframes) {
+		/* Video can only resume from a keyframe: look for the last one before the position */
+		janus_recordplay_frames *vframes = playout->vframes;
+		playout->vnext = janus_recorder_index_find_keyframe(vframes->index,
+			janus_recordplay_frame_timestamp(vframes, position, 90));
+		target = janus_recordplay_frame_position(vframes, playout->vnext, 90);
 	}
-	session->aframes = NULL;
-	video = session->vframes;
-	while(video) {
-		tmp = video->next;
-		g_free(video);
-		video = tmp;
+	if(playout->aframes) {
+		/* Audio resumes together with video, or from the exact position if there's no video */
+		janus_recordplay_frames *aframes = playout->aframes;
+		playout->anext = janus_recordplay_frame_find(aframes, janus_recordplay_frame_timestamp(aframes, target, 48));
 	}
-	session->vframes = NULL;
+	JANUS_LOG(LOG_VERB, "Seeking to %"SCNi64"ms (asked for %"SCNi64"ms)\n", target/1000, position/1000);
+	return target;
+}
 
-	if(afile)
-		fclose(afile);
-	afile = NULL;
-	if(vfile)
-		fclose(vfile);
-	vfile = NULL;
+static void janus_recordplay_playout_done(void *data) {
+	janus_recordplay_playout *playout = (janus_recordplay_playout *)data;
+	janus_recordplay_session *session = playout->session;
 
-	if(session->recording->destroyed) {
+	/* We're done with the frames: they're only actually freed when no other viewer needs them */
+	janus_recordplay_frames_unref(playout->aframes);
+	janus_recordplay_frames_unref(playout->vframes);
+	g_free(playout);
+
+	if(session->recording && session->recording->destroyed) {
 		/* Remove from the list of viewers */
 		janus_mutex_lock(&session->recording->mutex);
 		session->recording->viewers = g_list_remove(session->recording->viewers, session);
@@ -2130,7 +2258,5 @@ static void *janus_recordplay_playout_thread(void *data) {
 	/* Tell the core to tear down the PeerConnection, hangup_media will do the rest */
 	gateway->close_pc(session->handle);
 	
-	JANUS_LOG(LOG_INFO, "Leaving playout thread\n");
-	g_thread_unref(g_thread_self());
-	return NULL;
+	JANUS_LOG(LOG_INFO, "Playout is over\n");
 }
@@ -17,7 +17,9 @@
  * nature of the implementation the only pre-recorded media files
  * that the plugins supports right now are raw mu-Law and a-Law files:
  * support is of course planned for other additional widespread formats
- * as well.
+ * as well. Each on-demand viewer is paced by the shared engine in the
+ * core, rather than by a dedicated thread, which means the plugin can
+ * pause it without losing its position in the file.
  *
  * For what concerns type 3., instead, the plugin is configured
  * to listen on a couple of ports for RTP: this means that the plugin
@@ -77,8 +79,9 @@ videoiface = network interface or IP address to bind to, if any (binds to all ot
 videopt = <video RTP payload type> (e.g., 100)
 videortpmap = RTP map of the video codec (e.g., VP8/90000)
 videofmtp = Codec specific parameters, if any
-videobufferkf = yes|no (whether the plugin should store the latest
-	keyframe and send it immediately for new viewers, EXPERIMENTAL)
+videobufferkf = yes|no (whether the plugin should cache the video from
+	the latest keyframe on, and send it immediately to new viewers so
+	that they don't have to wait for the next keyframe, EXPERIMENTAL)
 videosimulcast = yes|no (do|don't enable video simulcasting)
 videoport2 = second local port for receiving video frames (only for rtp, and simulcasting)
 videoport3 = third local port for receiving video frames (only for rtp, and simulcasting)
@@ -93,6 +96,22 @@ rtsp_user = RTSP authorization username (only if type=rtsp)
 rtsp_pwd = RTSP authorization password (only if type=rtsp)
 rtspiface = network interface IP address or device name to listen on when receiving RTSP streams
 \endverbatim
+ *
+ * By default, packets received by live mountpoints are relayed to all
+ * their viewers by the thread receiving them. For mountpoints with large
+ * audiences, you can configure a pool of relay threads instead (see the
+ * \c relay_threads property in the \c general section of the configuration
+ * file): viewers are then spread across the threads, each taking care of
+ * its own share of the viewers of every mountpoint, so that a single
+ * popular mountpoint can make use of more than one core.
+ *
+ * RTP mountpoints read the packets waiting on their sockets in batches
+ * (up to 16 at a time, by default; see the \c recv_batch property in the
+ * \c general section), which saves a syscall per packet on high bitrate
+ * streams. Counters on what was received (packets, bytes, reads, packets
+ * that were dropped, and packets the kernel discarded because the socket
+ * buffer was full) are returned, as an \c ingest object, in the responses
+ * to \c list and \c info requests, and when querying a viewer's handle.
  *
  * \section streamapi Streaming API
  *
@@ -142,6 +161,8 @@ rtspiface = network interface IP address or device name to listen on when receiv
 #include <errno.h>
 #include <sys/poll.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #ifdef HAVE_LIBCURL
 #include <curl/curl.h>
@@ -154,6 +175,7 @@ rtspiface = network interface IP address or device name to listen on when receiv
 #include "../rtp.h"
 #include "../rtcp.h"
 #include "../record.h"
+#include "../pacer.h"
 #include "../utils.h"
 #include "../ip-utils.h"
 
@@ -340,7 +362,6 @@ static janus_callbacks *gateway = NULL;
 static GThread *handler_thread;
 static GThread *watchdog;
 static void *janus_streaming_handler(void *data);
-static void *janus_streaming_ondemand_thread(void *data);
 static void *janus_streaming_filesource_thread(void *data);
 static void janus_streaming_relay_rtp_packet(gpointer data, gpointer user_data);
 static void *janus_streaming_relay_thread(void *data);
@@ -357,15 +378,34 @@ typedef enum janus_streaming_source {
 	janus_streaming_source_rtp,
 } janus_streaming_source;
 
-typedef struct janus_streaming_rtp_keyframe {
-	gboolean enabled;
-	/* If enabled, we store the packets of the last keyframe, to immediately send them for new viewers */
-	GList *latest_keyframe;
-	/* This is where we store packets while we're still collecting the whole keyframe */
-	GList *temp_keyframe;
-	guint32 temp_ts;
+/* GOP cache: if enabled, we keep all the video packets from the latest
+ * keyframe onwards (one cache per substream, when simulcasting), so that
+ * new viewers can be sent the whole group of pictures right away, rather
+ * than having to wait for the next keyframe to start decoding the video */
+#define JANUS_STREAMING_GOP_SLOTS		512
+/* New viewers get the cached packets in bursts, to avoid flooding them */
+#define JANUS_STREAMING_GOP_BURST		16
+#define JANUS_STREAMING_GOP_BURST_GAP	2000
+/* How long we keep catching up with the live stream, before giving up */
+#define JANUS_STREAMING_GOP_MAX_REPLAY	G_USEC_PER_SEC
+typedef struct janus_streaming_rtp_gop_slot {
+	char data[1500];
+	gint length;
+	uint32_t timestamp;
+	uint16_t seq_number;
+	gboolean keyframe;
+} janus_streaming_rtp_gop_slot;
+
+typedef struct janus_streaming_rtp_gop {
+	janus_streaming_rtp_gop_slot *slots;	/* Preallocated ring of packets, if enabled */
+	guint64 head;			/* Index of the first packet of the latest keyframe */
+	guint64 tail;			/* Index the next packet will be stored at */
+	guint64 frame_start;	/* Index of the first packet of the latest frame */
+	uint32_t last_ts;		/* Timestamp of the latest frame */
+	uint32_t keyframe_ts;	/* Timestamp of the latest keyframe */
+	gboolean valid;			/* Whether the packets from head to tail are a complete GOP */
 	janus_mutex mutex;
-} janus_streaming_rtp_keyframe;
+} janus_streaming_rtp_gop;
 
 #ifdef HAVE_LIBCURL
 typedef struct janus_streaming_buffer {
@@ -374,6 +414,15 @@ typedef struct janus_streaming_buffer {
 } janus_streaming_buffer;
 #endif
 
+/* Statistics on the packets an RTP source received */
+typedef struct janus_streaming_rtp_ingest {
+	guint64 packets;	/* Packets read from the sockets */
+	guint64 bytes;		/* Bytes read from the sockets */
+	guint64 batches;	/* Reads, each returning one or more packets */
+	guint64 dropped;	/* Packets we read but didn't relay (truncated, or mountpoint disabled) */
+	guint64 overflows;	/* Packets the kernel dropped because our socket buffers were full */
+} janus_streaming_rtp_ingest;
+
 typedef struct janus_streaming_rtp_source {
 	gint audio_port;
 	in_addr_t audio_mcast;
@@ -391,6 +440,7 @@ typedef struct janus_streaming_rtp_source {
 	gint64 last_received_audio;
 	gint64 last_received_video;
 	gint64 last_received_data;
+	janus_streaming_rtp_ingest ingest;
 #ifdef HAVE_LIBCURL
 	gboolean rtsp;
 	CURL *curl;
@@ -404,7 +454,8 @@ typedef struct janus_streaming_rtp_source {
 	int audio_rtcp_fd;
 	int video_rtcp_fd;
 #endif
-	janus_streaming_rtp_keyframe keyframe;
+	gboolean bufferkf;
+	janus_streaming_rtp_gop gop[3];
 	gboolean buffermsg;
 	void *last_msg;
 	janus_mutex buffermsg_mutex;
@@ -417,6 +468,69 @@ typedef struct janus_streaming_file_source {
 	char *filename;
 } janus_streaming_file_source;
 
+/* RTP sources read packets from their sockets in batches, via recvmmsg */
+#define JANUS_STREAMING_MAX_BATCH	64
+#define DEFAULT_RECV_BATCH	16
+static int recv_batch = DEFAULT_RECV_BATCH;
+typedef struct janus_streaming_reader {
+	struct mmsghdr msgs[JANUS_STREAMING_MAX_BATCH];
+	struct iovec iovs[JANUS_STREAMING_MAX_BATCH];
+	char buffers[JANUS_STREAMING_MAX_BATCH][1500];
+	char controls[JANUS_STREAMING_MAX_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+	uint32_t overflows[5];	/* Last SO_RXQ_OVFL counter we got on each socket */
+} janus_streaming_reader;
+
+/* Read all the packets available on a socket, up to the configured batch size:
+ * the length of each packet is in msgs[i].msg_len, and is 0 if it was truncated */
+static int janus_streaming_reader_read(janus_streaming_reader *reader, int fd, int slot, janus_streaming_rtp_ingest *ingest) {
+	int i = 0;
+	for(i=0; i<recv_batch; i++) {
+		reader->iovs[i].iov_base = reader->buffers[i];
+		reader->iovs[i].iov_len = sizeof(reader->buffers[i]);
+		memset(&reader->msgs[i], 0, sizeof(struct mmsghdr));
+		reader->msgs[i].msg_hdr.msg_iov = &reader->iovs[i];
+		reader->msgs[i].msg_hdr.msg_iovlen = 1;
+		reader->msgs[i].msg_hdr.msg_control = reader->controls[i];
+		reader->msgs[i].msg_hdr.msg_controllen = sizeof(reader->controls[i]);
+	}
+	int count = recvmmsg(fd, reader->msgs, recv_batch, MSG_DONTWAIT, NULL);
+	if(count < 1)
+		return 0;
+	ingest->batches++;
+	ingest->packets += count;
+	for(i=0; i<count; i++) {
+		struct msghdr *hdr = &reader->msgs[i].msg_hdr;
+		ingest->bytes += reader->msgs[i].msg_len;
+		if(hdr->msg_flags & MSG_TRUNC) {
+			ingest->dropped++;
+			reader->msgs[i].msg_len = 0;
+		}
+#ifdef SO_RXQ_OVFL
+		/* The kernel tells us how many packets it dropped on this socket so far */
+		struct cmsghdr *cmsg = NULL;
+		for(cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+			if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+				uint32_t overflows = 0;
+				memcpy(&overflows, CMSG_DATA(cmsg), sizeof(overflows));
+				ingest->overflows += (uint32_t)(overflows - reader->overflows[slot]);
+				reader->overflows[slot] = overflows;
+			}
+		}
+#endif
+	}
+	return count;
+}
+
+static json_t *janus_streaming_rtp_ingest_json(janus_streaming_rtp_ingest *ingest) {
+	json_t *info = json_object();
+	json_object_set_new(info, "packets", json_integer(ingest->packets));
+	json_object_set_new(info, "bytes", json_integer(ingest->bytes));
+	json_object_set_new(info, "batches", json_integer(ingest->batches));
+	json_object_set_new(info, "dropped", json_integer(ingest->dropped));
+	json_object_set_new(info, "overflows", json_integer(ingest->overflows));
+	return info;
+}
+
 /* used for audio/video fd and rtcp fd */
 typedef struct multiple_fds {
 	int fd;
@@ -452,6 +566,9 @@ typedef struct janus_streaming_mountpoint {
 	janus_streaming_codecs codecs;
 	gboolean audio, video, data;
 	GList/*<unowned janus_streaming_session>*/ *listeners;
+	struct janus_streaming_partition *partitions;	/* Listeners, split by relay thread */
+	volatile gint pending;	/* Packets queued to relay threads and not handled yet */
+	volatile gint users;	/* Threads or pacing tasks still using this mountpoint (e.g., GOP replays): we don't free it until they're done */
 	gint64 destroyed;
 	janus_mutex mutex;
 } janus_streaming_mountpoint;
@@ -521,10 +638,18 @@ typedef struct janus_streaming_session {
 	int templayer_target;	/* As above, but to handle transitions (e.g., wait for keyframe) */
 	gint64 last_relayed;	/* When we relayed the last packet (used to detect when substreams become unavailable) */
 	janus_vp8_simulcast_context simulcast_context;
+	volatile gint replaying;	/* Whether the cached GOP is being sent to this viewer, before the live stream */
+	volatile gint handover;	/* Whether live packets the GOP replay already sent must be skipped */
+	int handover_substream;	/* Substream the GOP replay was for */
+	uint16_t handover_seq;	/* Sequence number of the last packet the GOP replay sent */
+	volatile gint users;	/* Threads or pacing tasks still using this session (e.g., GOP replays): we don't free it until they're done */
+	guint worker;			/* Which relay thread sends this viewer packets from the mountpoint */
+	janus_pacer_task *ondemand;	/* Pacing task sending this viewer packets from an on-demand file mountpoint */
 	gboolean stopping;
 	volatile gint hangingup;
 	gint64 destroyed;	/* Time at which this session was marked as destroyed */
 } janus_streaming_session;
+static int janus_streaming_ondemand_start(janus_streaming_session *session);
 static GHashTable *sessions;
 static GList *old_sessions;
 static janus_mutex sessions_mutex = JANUS_MUTEX_INITIALIZER;
@@ -536,12 +661,288 @@ typedef struct janus_streaming_rtp_relay_packet {
 	gboolean is_rtp;	/* This may be a data packet and not RTP */
 	gboolean is_video;
 	gboolean is_keyframe;
+	gboolean is_replay;	/* Sent from the GOP cache, before the session is started */
 	gboolean simulcast;
 	int codec, substream;
 	uint32_t timestamp;
 	uint16_t seq_number;
 } janus_streaming_rtp_relay_packet;
 
+/* Relay threads: each of them takes care of a partition of the listeners
+ * of all mountpoints, so that the fan-out of a popular mountpoint is not
+ * limited to the single thread receiving its packets. A viewer is always
+ * handled by the same relay thread, so packets are sent in order. */
+#define MAX_RELAY_THREADS	64
+/* Initial size of the buffer relay threads copy packets to (it grows, if needed) */
+#define JANUS_STREAMING_RELAY_BUFFER	2048
+typedef struct janus_streaming_partition {
+	GList/*<unowned janus_streaming_session>*/ *listeners;
+	volatile gint count;
+	janus_mutex mutex;
+} janus_streaming_partition;
+typedef struct janus_streaming_relay_worker {
+	guint id;
+	GThread *thread;
+	GAsyncQueue *queue;
+	guint64 packets;
+} janus_streaming_relay_worker;
+static janus_streaming_relay_worker *relay_workers = NULL;
+static guint relay_workers_num = 0;
+static void *janus_streaming_relay_worker_thread(void *data);
+/* Packet handed to the relay threads: a single copy is shared by all of them */
+typedef struct janus_streaming_shared_packet {
+	janus_streaming_mountpoint *mountpoint;
+	janus_streaming_rtp_relay_packet packet;
+	volatile gint ref;
+	char buffer[];
+} janus_streaming_shared_packet;
+static janus_streaming_shared_packet relay_exit_packet;
+
+static void janus_streaming_shared_packet_unref(janus_streaming_shared_packet *shared) {
+	if(shared == NULL || shared == &relay_exit_packet)
+		return;
+	if(g_atomic_int_dec_and_test(&shared->ref))
+		g_free(shared);
+}
+
+/* Add a viewer to a mountpoint (mp->mutex must be locked) */
+static void janus_streaming_listener_add(janus_streaming_mountpoint *mp, janus_streaming_session *session) {
+	if(g_list_find(mp->listeners, session) != NULL)
+		return;
+	mp->listeners = g_list_append(mp->listeners, session);
+	if(relay_workers_num == 0)
+		return;
+	janus_streaming_partition *partitions = g_atomic_pointer_get(&mp->partitions);
+	guint i = 0;
+	if(partitions == NULL) {
+		partitions = g_malloc0(relay_workers_num * sizeof(janus_streaming_partition));
+		for(i=0; i<relay_workers_num; i++)
+			janus_mutex_init(&partitions[i].mutex);
+		g_atomic_pointer_set(&mp->partitions, partitions);
+	}
+	/* Pick the relay thread with the fewest viewers for this mountpoint */
+	guint worker = 0;
+	for(i=1; i<relay_workers_num; i++) {
+		if(g_atomic_int_get(&partitions[i].count) < g_atomic_int_get(&partitions[worker].count))
+			worker = i;
+	}
+	session->worker = worker;
+	janus_mutex_lock(&partitions[worker].mutex);
+	partitions[worker].listeners = g_list_append(partitions[worker].listeners, session);
+	g_atomic_int_inc(&partitions[worker].count);
+	janus_mutex_unlock(&partitions[worker].mutex);
+}
+
+/* Remove a viewer from a mountpoint (mp->mutex must be locked): when this
+ * returns, the relay thread that was serving it won't touch it anymore */
+static void janus_streaming_listener_remove(janus_streaming_mountpoint *mp, janus_streaming_session *session) {
+	if(g_list_find(mp->listeners, session) == NULL)
+		return;
+	mp->listeners = g_list_remove_all(mp->listeners, session);
+	janus_streaming_partition *partitions = g_atomic_pointer_get(&mp->partitions);
+	if(partitions == NULL || session->worker >= relay_workers_num)
+		return;
+	janus_streaming_partition *partition = &partitions[session->worker];
+	janus_mutex_lock(&partition->mutex);
+	if(g_list_find(partition->listeners, session) != NULL) {
+		partition->listeners = g_list_remove_all(partition->listeners, session);
+		g_atomic_int_dec_and_test(&partition->count);
+	}
+	janus_mutex_unlock(&partition->mutex);
+}
+
+/* Relay a packet to all the viewers of a mountpoint, or hand it to the relay threads to do that */
+static void janus_streaming_relay_to_listeners(janus_streaming_mountpoint *mp, janus_streaming_rtp_relay_packet *packet) {
+	janus_streaming_partition *partitions = g_atomic_pointer_get(&mp->partitions);
+	if(relay_workers_num == 0 || partitions == NULL) {
+		janus_mutex_lock_nodebug(&mp->mutex);
+		g_list_foreach(mp->listeners, janus_streaming_relay_rtp_packet, packet);
+		janus_mutex_unlock_nodebug(&mp->mutex);
+		return;
+	}
+	if(g_atomic_int_get(&stopping) || packet->data == NULL || packet->length < 1)
+		return;
+	janus_streaming_shared_packet *shared = NULL;
+	guint i = 0;
+	for(i=0; i<relay_workers_num; i++) {
+		if(g_atomic_int_get(&partitions[i].count) == 0)
+			continue;
+		if(shared == NULL) {
+			/* Copy the packet once, the reference we hold is released when we're done */
+			shared = g_malloc(sizeof(janus_streaming_shared_packet) + packet->length);
+			shared->mountpoint = mp;
+			shared->packet = *packet;
+			shared->packet.data = NULL;
+			memcpy(shared->buffer, packet->data, packet->length);
+			g_atomic_int_set(&shared->ref, 1);
+		}
+		g_atomic_int_inc(&shared->ref);
+		g_atomic_int_inc(&mp->pending);
+		g_async_queue_push(relay_workers[i].queue, shared);
+	}
+	janus_streaming_shared_packet_unref(shared);
+}
+
+/* Wait for the relay threads to be done with the packets of a mountpoint: queued
+ * packets point to the mountpoint, so we can't stop waiting until they're all gone */
+static void janus_streaming_relay_wait(janus_streaming_mountpoint *mp) {
+	gint64 start = janus_get_monotonic_time();
+	gboolean warned = FALSE;
+	while(g_atomic_int_get(&mp->pending) > 0) {
+		if(!warned && janus_get_monotonic_time()-start > G_USEC_PER_SEC) {
+			JANUS_LOG(LOG_WARN, "[%s] Relay threads still have %d packets queued, still waiting\n",
+				mp->name, g_atomic_int_get(&mp->pending));
+			warned = TRUE;
+		}
+		g_usleep(5000);
+	}
+}
+
+/* Add a video packet to a GOP cache */
+static void janus_streaming_rtp_gop_add(janus_streaming_rtp_gop *gop, janus_streaming_rtp_relay_packet *packet, gboolean keyframe) {
+	if(gop == NULL || gop->slots == NULL || packet->length > 1500)
+		return;
+	janus_mutex_lock(&gop->mutex);
+	if(gop->tail == 0 || packet->timestamp != gop->last_ts) {
+		/* First packet of a new frame */
+		gop->frame_start = gop->tail;
+		gop->last_ts = packet->timestamp;
+	}
+	janus_streaming_rtp_gop_slot *slot = &gop->slots[gop->tail % JANUS_STREAMING_GOP_SLOTS];
+	memcpy(slot->data, packet->data, packet->length);
+	slot->length = packet->length;
+	slot->timestamp = packet->timestamp;
+	slot->seq_number = packet->seq_number;
+	slot->keyframe = keyframe;
+	gop->tail++;
+	if(keyframe && (!gop->valid || packet->timestamp != gop->keyframe_ts)) {
+		/* New keyframe: the GOP starts from the first packet of this frame, which
+		 * may not be the one we detected the keyframe from (e.g., H.264 SPS/PPS) */
+		gop->head = gop->frame_start;
+		gop->keyframe_ts = packet->timestamp;
+		gop->valid = TRUE;
+	}
+	if(gop->valid && gop->tail - gop->head > JANUS_STREAMING_GOP_SLOTS) {
+		/* The GOP is too large for the cache, wait for the next keyframe */
+		JANUS_LOG(LOG_HUGE, "GOP too large (more than %d packets), waiting for the next keyframe\n", JANUS_STREAMING_GOP_SLOTS);
+		gop->valid = FALSE;
+	}
+	janus_mutex_unlock(&gop->mutex);
+}
+
+/* Sending a new viewer the cached GOP, before letting the live stream through, is a task
+ * of the pacing engine: each time it's woken up, it sends the next burst of packets */
+typedef struct janus_streaming_gop_replay {
+	janus_streaming_session *session;
+	janus_streaming_mountpoint *mountpoint;
+	janus_streaming_rtp_gop *gop;
+	int substream;
+	janus_streaming_rtp_gop_slot slots[JANUS_STREAMING_GOP_BURST];	/* Packets of the current burst */
+	janus_streaming_rtp_relay_packet packet;
+	guint64 next, sent;
+	uint16_t last_seq;
+	gint64 start;
+} janus_streaming_gop_replay;
+static gint64 janus_streaming_gop_replay_send(void *data, gint64 position) {
+	janus_streaming_gop_replay *replay = (janus_streaming_gop_replay *)data;
+	janus_streaming_session *session = replay->session;
+	janus_streaming_mountpoint *mountpoint = replay->mountpoint;
+	janus_streaming_rtp_gop *gop = replay->gop;
+	if(g_atomic_int_get(&stopping) || session->destroyed || session->stopping ||
+			g_atomic_int_get(&session->hangingup) || mountpoint->destroyed)
+		return -1;
+	/* Copy the packets of the next burst: if the cache moved on in the
+	 * meanwhile (e.g., a new keyframe), we start from its new head */
+	janus_mutex_lock(&gop->mutex);
+	if(!gop->valid || gop->slots == NULL || replay->next == gop->tail || session->paused ||
+			janus_get_monotonic_time() - replay->start >= JANUS_STREAMING_GOP_MAX_REPLAY) {
+		/* We're done: from now on, the viewer gets the live stream. We do this
+		 * with the lock held, so that no packet can fall in between; as the
+		 * relay threads may still have packets we sent already queued, we
+		 * tell them where the replay ended, so that they skip those */
+		if(replay->sent > 0) {
+			session->handover_substream = replay->substream;
+			session->handover_seq = replay->last_seq;
+			g_atomic_int_set(&session->handover, 1);
+		}
+		session->started = TRUE;
+		janus_mutex_unlock(&gop->mutex);
+		return -1;
+	}
+	if(replay->next < gop->head)
+		replay->next = gop->head;
+	int count = 0;
+	while(replay->next < gop->tail && count < JANUS_STREAMING_GOP_BURST) {
+		memcpy(&replay->slots[count], &gop->slots[replay->next % JANUS_STREAMING_GOP_SLOTS], sizeof(janus_streaming_rtp_gop_slot));
+		count++;
+		replay->next++;
+	}
+	janus_mutex_unlock(&gop->mutex);
+	int i = 0;
+	for(i=0; i<count; i++) {
+		if(session->paused)
+			break;
+		replay->packet.data = (rtp_header *)replay->slots[i].data;
+		replay->packet.length = replay->slots[i].length;
+		replay->packet.timestamp = replay->slots[i].timestamp;
+		replay->packet.seq_number = replay->slots[i].seq_number;
+		replay->packet.is_keyframe = replay->slots[i].keyframe;
+		janus_streaming_relay_rtp_packet(session, &replay->packet);
+		replay->last_seq = replay->packet.seq_number;
+		replay->sent++;
+	}
+	/* Wait a bit before the next burst, to avoid flooding the viewer */
+	return position + JANUS_STREAMING_GOP_BURST_GAP;
+}
+static void janus_streaming_gop_replay_done(void *data) {
+	janus_streaming_gop_replay *replay = (janus_streaming_gop_replay *)data;
+	janus_streaming_session *session = replay->session;
+	JANUS_LOG(LOG_VERB, "Sent %"SCNu64" cached video packets to the new viewer in %"SCNi64"ms\n",
+		replay->sent, (janus_get_monotonic_time()-replay->start)/1000);
+	g_atomic_int_set(&session->replaying, 0);
+	g_atomic_int_dec_and_test(&session->users);
+	g_atomic_int_dec_and_test(&replay->mountpoint->users);
+	g_free(replay);
+}
+static janus_pacer_callbacks janus_streaming_gop_replay_callbacks = {
+	.send = janus_streaming_gop_replay_send,
+	.done = janus_streaming_gop_replay_done,
+};
+static gboolean janus_streaming_gop_replay_start(janus_streaming_session *session, janus_streaming_mountpoint *mountpoint, int substream) {
+	janus_streaming_rtp_source *source = (janus_streaming_rtp_source *)mountpoint->source;
+	janus_streaming_gop_replay *replay = g_malloc0(sizeof(janus_streaming_gop_replay));
+	replay->session = session;
+	replay->mountpoint = mountpoint;
+	replay->gop = &source->gop[substream];
+	replay->substream = substream;
+	replay->packet.is_rtp = TRUE;
+	replay->packet.is_video = TRUE;
+	replay->packet.is_replay = TRUE;	/* This makes sure the packet is relayed even if the session hasn't started yet */
+	replay->packet.simulcast = source->simulcast;
+	replay->packet.substream = substream;
+	replay->packet.codec = mountpoint->codecs.video_codec;
+	replay->start = janus_get_monotonic_time();
+	g_atomic_int_set(&session->replaying, 1);
+	/* The task needs both the session and the mountpoint until it's done */
+	g_atomic_int_inc(&session->users);
+	g_atomic_int_inc(&mountpoint->users);
+	janus_pacer_task *task = janus_pacer_task_create(&janus_streaming_gop_replay_callbacks, replay);
+	if(task == NULL || janus_pacer_task_start(task, 0) < 0) {
+		JANUS_LOG(LOG_ERR, "[%s] Couldn't start sending the cached GOP\n", mountpoint->name);
+		if(task == NULL) {
+			janus_streaming_gop_replay_done(replay);
+		} else {
+			/* This will get rid of the replay state too */
+			janus_pacer_task_stop(task);
+			janus_pacer_task_unref(task);
+		}
+		return FALSE;
+	}
+	/* We don't need to control the task: it stops by itself when the viewer goes away */
+	janus_pacer_task_unref(task);
+	return TRUE;
+}
+
 
 /* Error codes */
 #define JANUS_STREAMING_ERROR_NO_MESSAGE			450
@@ -574,13 +975,15 @@ static void *janus_streaming_watchdog(void *data) {
 					sl = sl->next;
 					continue;
 				}
-				if(now-session->destroyed >= 5*G_USEC_PER_SEC) {
+				if(now-session->destroyed >= 5*G_USEC_PER_SEC && g_atomic_int_get(&session->users) == 0) {
 					/* We're lazy and actually get rid of the stuff only after a few seconds */
 					JANUS_LOG(LOG_VERB, "Freeing old Streaming session\n");
 					GList *rm = sl->next;
 					old_sessions = g_list_delete_link(old_sessions, sl);
 					sl = rm;
 					session->handle = NULL;
+					janus_pacer_task_unref(session->ondemand);
+					session->ondemand = NULL;
 					g_free(session);
 					session = NULL;
 					continue;
@@ -600,7 +1003,8 @@ static void *janus_streaming_watchdog(void *data) {
 					sl = sl->next;
 					continue;
 				}
-				if(now-mountpoint->destroyed >= 5*G_USEC_PER_SEC) {
+				if(now-mountpoint->destroyed >= 5*G_USEC_PER_SEC && g_atomic_int_get(&mountpoint->users) == 0 &&
+						g_atomic_int_get(&mountpoint->pending) == 0) {
 					/* We're lazy and actually get rid of the stuff only after a few seconds */
 					JANUS_LOG(LOG_VERB, "Freeing old Streaming mountpoint\n");
 					GList *rm = sl->next;
@@ -649,6 +1053,64 @@ int janus_streaming_init(janus_callbacks *callback, const char *config_path) {
 		janus_config_print(config);
 
 	mountpoints = g_hash_table_new_full(g_int64_hash, g_int64_equal, (GDestroyNotify)g_free, NULL);
+
+	/* Start the threads that will relay packets to viewers, if configured: each
+	 * takes care of part of the viewers of all the live mountpoints. By default
+	 * there are none, and each mountpoint relays its own packets inline */
+	relay_workers_num = 0;
+	if(config != NULL) {
+		janus_config_item *threads = janus_config_get_item_drilldown(config, "general", "relay_threads");
+		if(threads != NULL && threads->value != NULL) {
+			int num = atoi(threads->value);
+			if(num < 0 || num > MAX_RELAY_THREADS) {
+				JANUS_LOG(LOG_WARN, "Invalid number of relay threads (%d), using %u\n", num, relay_workers_num);
+			} else {
+				relay_workers_num = num;
+			}
+		}
+	}
+	if(relay_workers_num > 0) {
+		relay_workers = g_malloc0(relay_workers_num * sizeof(janus_streaming_relay_worker));
+		guint i = 0;
+		for(i=0; i<relay_workers_num; i++) {
+			janus_streaming_relay_worker *worker = &relay_workers[i];
+			worker->id = i;
+			worker->queue = g_async_queue_new();
+			GError *error = NULL;
+			char tname[16];
+			g_snprintf(tname, sizeof(tname), "srelay %u", i);
+			worker->thread = g_thread_try_new(tname, &janus_streaming_relay_worker_thread, worker, &error);
+			if(error != NULL) {
+				JANUS_LOG(LOG_FATAL, "Got error %d (%s) trying to launch the Streaming relay thread...\n", error->code, error->message ? error->message : "??");
+				/* Stop the threads we started, and relay from the mountpoint threads instead */
+				guint j = 0;
+				for(j=0; j<i; j++)
+					g_async_queue_push(relay_workers[j].queue, &relay_exit_packet);
+				for(j=0; j<i; j++)
+					g_thread_join(relay_workers[j].thread);
+				for(j=0; j<=i; j++)
+					g_async_queue_unref(relay_workers[j].queue);
+				g_free(relay_workers);
+				relay_workers = NULL;
+				relay_workers_num = 0;
+				break;
+			}
+		}
+	}
+	JANUS_LOG(LOG_INFO, "Using %u relay threads for the Streaming plugin\n", relay_workers_num);
+	/* How many packets should RTP sources read from their sockets at a time? */
+	if(config != NULL) {
+		janus_config_item *batch = janus_config_get_item_drilldown(config, "general", "recv_batch");
+		if(batch != NULL && batch->value != NULL) {
+			int num = atoi(batch->value);
+			if(num < 1 || num > JANUS_STREAMING_MAX_BATCH) {
+				JANUS_LOG(LOG_WARN, "Invalid receive batch size (%d), using %d\n", num, recv_batch);
+			} else {
+				recv_batch = num;
+			}
+		}
+	}
+
 	/* Parse configuration to populate the mountpoints */
 	if(config != NULL) {
 		/* Any admin key to limit who can "create"? */
@@ -712,11 +1174,6 @@ int janus_streaming_init(janus_callbacks *callback, const char *config_path) {
 				gboolean dodata = data && data->value && janus_is_true(data->value);
 				gboolean bufferkf = video && vkf && vkf->value && janus_is_true(vkf->value);
 				gboolean simulcast = video && vsc && vsc->value && janus_is_true(vsc->value);
-				if(simulcast && bufferkf) {
-					/* FIXME We'll need to take care of this */
-					JANUS_LOG(LOG_WARN, "Simulcasting enabled, so disabling buffering of keyframes\n");
-					bufferkf = FALSE;
-				}
 				gboolean buffermsg = data && dbm && dbm->value && janus_is_true(dbm->value);
 				if(!doaudio && !dovideo && !dodata) {
 					JANUS_LOG(LOG_ERR, "Can't add 'rtp' stream '%s', no audio, video or data have to be streamed...\n", cat->name);
@@ -1128,6 +1585,24 @@ void janus_streaming_destroy(void) {
 
 	/* FIXME We should destroy the sessions cleanly */
 	usleep(500000);
+	/* Stop the relay threads */
+	guint i = 0;
+	for(i=0; i<relay_workers_num; i++)
+		g_async_queue_push(relay_workers[i].queue, &relay_exit_packet);
+	for(i=0; i<relay_workers_num; i++) {
+		janus_streaming_relay_worker *worker = &relay_workers[i];
+		g_thread_join(worker->thread);
+		worker->thread = NULL;
+		janus_streaming_shared_packet *shared = NULL;
+		while((shared = g_async_queue_try_pop(worker->queue)) != NULL) {
+			g_atomic_int_dec_and_test(&shared->mountpoint->pending);
+			janus_streaming_shared_packet_unref(shared);
+		}
+		g_async_queue_unref(worker->queue);
+	}
+	g_free(relay_workers);
+	relay_workers = NULL;
+	relay_workers_num = 0;
 	janus_mutex_lock(&mountpoints_mutex);
 	g_hash_table_destroy(mountpoints);
 	janus_mutex_unlock(&mountpoints_mutex);
@@ -1210,7 +1685,7 @@ void janus_streaming_destroy_session(janus_plugin_session *handle, int *error) {
 	janus_streaming_mountpoint *mp = session->mountpoint;
 	if(mp) {
 		janus_mutex_lock(&mp->mutex);
-		mp->listeners = g_list_remove_all(mp->listeners, session);
+		janus_streaming_listener_remove(mp, session);
 		janus_mutex_unlock(&mp->mutex);
 	}
 	janus_mutex_lock(&sessions_mutex);
@@ -1240,6 +1715,24 @@ json_t *janus_streaming_query_session(janus_plugin_session *handle) {
 	if(mp) {
 		json_object_set_new(info, "mountpoint_id", json_integer(mp->id));
 		json_object_set_new(info, "mountpoint_name", mp->name ? json_string(mp->name) : NULL);
+		if(mp->streaming_source == janus_streaming_source_rtp && mp->source != NULL) {
+			janus_streaming_rtp_source *source = mp->source;
+			json_object_set_new(info, "ingest", janus_streaming_rtp_ingest_json(&source->ingest));
+		}
+		if(session->ondemand != NULL) {
+			/* How accurately is the pacing engine sending this viewer the file? */
+			janus_pacer_stats stats;
+			janus_pacer_task_get_stats(session->ondemand, &stats);
+			json_t *pacing = json_object();
+			json_object_set_new(pacing, "position", json_integer(janus_pacer_task_get_position(session->ondemand)/1000));
+			json_object_set_new(pacing, "paused", janus_pacer_task_is_paused(session->ondemand) ? json_true() : json_false());
+			json_object_set_new(pacing, "wakeups", json_integer(stats.wakeups));
+			json_object_set_new(pacing, "late-last-us", json_integer(stats.late_last));
+			json_object_set_new(pacing, "late-avg-us", json_integer(stats.late_avg));
+			json_object_set_new(pacing, "late-max-us", json_integer(stats.late_max));
+			json_object_set_new(pacing, "late-1ms", json_integer(stats.late_1ms));
+			json_object_set_new(info, "pacing", pacing);
+		}
 	}
 	json_object_set_new(info, "destroyed", json_integer(session->destroyed));
 	return info;
@@ -1317,6 +1810,7 @@ struct janus_plugin_result *janus_streaming_handle_message(janus_plugin_session
 					json_object_set_new(ml, "audio_age_ms", json_integer((now - source->last_received_audio) / 1000));
 				if(source->video_fd[0] != -1 || source->video_fd[1] != -1 || source->video_fd[2] != -1)
 					json_object_set_new(ml, "video_age_ms", json_integer((now - source->last_received_video) / 1000));
+				json_object_set_new(ml, "ingest", janus_streaming_rtp_ingest_json(&source->ingest));
 			}
 			json_array_append_new(list, ml);
 		}
@@ -1358,6 +1852,7 @@ struct janus_plugin_result *janus_streaming_handle_message(janus_plugin_session
 				json_object_set_new(ml, "video_age_ms", json_integer((now - source->last_received_video) / 1000));
 			if(source->data_fd != -1)
 				json_object_set_new(ml, "data_age_ms", json_integer((now - source->last_received_data) / 1000));
+			json_object_set_new(ml, "ingest", janus_streaming_rtp_ingest_json(&source->ingest));
 			janus_mutex_lock(&source->rec_mutex);
 			if(source->arc || source->vrc || source->drc) {
 				json_t *recording = json_object();
@@ -1494,11 +1989,6 @@ struct janus_plugin_result *janus_streaming_handle_message(janus_plugin_session
 				bufferkf = vkf ? json_is_true(vkf) : FALSE;
 				json_t *vsc = json_object_get(root, "videosimulcast");
 				simulcast = vsc ? json_is_true(vsc) : FALSE;
-				if(simulcast && bufferkf) {
-					/* FIXME We'll need to take care of this */
-					JANUS_LOG(LOG_WARN, "Simulcasting enabled, so disabling buffering of keyframes\n");
-					bufferkf = FALSE;
-				}
 				json_t *videoport2 = json_object_get(root, "videoport2");
 				vport2 = json_integer_value(videoport2);
 				json_t *videoport3 = json_object_get(root, "videoport3");
@@ -1823,7 +2313,7 @@ struct janus_plugin_result *janus_streaming_handle_message(janus_plugin_session
 					janus_config_add_item(config, mp->name, "videortpmap", mp->codecs.video_rtpmap);
 					if(mp->codecs.video_fmtp)
 						janus_config_add_item(config, mp->name, "videofmtp", mp->codecs.video_fmtp);
-					if(source->keyframe.enabled)
+					if(source->bufferkf)
 						janus_config_add_item(config, mp->name, "videobufferkf", "yes");
 					if(source->simulcast) {
 						janus_config_add_item(config, mp->name, "videosimulcast", "yes");
@@ -1956,7 +2446,7 @@ struct janus_plugin_result *janus_streaming_handle_message(janus_plugin_session
 				gateway->push_event(session->handle, &janus_streaming_plugin, NULL, event, NULL);
 				gateway->close_pc(session->handle);
 			}
-			mp->listeners = g_list_remove_all(mp->listeners, session);
+			janus_streaming_listener_remove(mp, session);
 			viewer = g_list_first(mp->listeners);
 		}
 		json_decref(event);
@@ -2315,24 +2805,42 @@ void janus_streaming_setup_media(janus_plugin_session *handle) {
 	if(session->destroyed)
 		return;
 	g_atomic_int_set(&session->hangingup, 0);
+	g_atomic_int_set(&session->handover, 0);
 	/* We only start streaming towards this user when we get this event */
 	janus_rtp_switching_context_reset(&session->context);
-	/* If this is related to a live RTP mountpoint, any keyframe we can shoot already? */
+	/* If this is related to a live RTP mountpoint, any GOP we can shoot already? */
+	gboolean replaying = FALSE;
 	janus_streaming_mountpoint *mountpoint = session->mountpoint;
 	if(mountpoint->streaming_source == janus_streaming_source_rtp) {
 		janus_streaming_rtp_source *source = mountpoint->source;
-		if(source->keyframe.enabled) {
-			JANUS_LOG(LOG_HUGE, "Any keyframe to send?\n");
-			janus_mutex_lock(&source->keyframe.mutex);
-			if(source->keyframe.latest_keyframe != NULL) {
-				JANUS_LOG(LOG_HUGE, "Yep! %d packets\n", g_list_length(source->keyframe.latest_keyframe));
-				GList *temp = source->keyframe.latest_keyframe;
-				while(temp) {
-					janus_streaming_relay_rtp_packet(session, temp->data);
-					temp = temp->next;
+		if(source->bufferkf && session->video) {
+			/* When simulcasting, pick the substream we're aiming for, or the closest one we have */
+			int substream = -1, i = 0;
+			for(i=0; i<3; i++) {
+				janus_streaming_rtp_gop *gop = &source->gop[i];
+				janus_mutex_lock(&gop->mutex);
+				gboolean valid = gop->slots != NULL && gop->valid;
+				janus_mutex_unlock(&gop->mutex);
+				if(valid && (substream == -1 || !source->simulcast || i <= session->substream_target))
+					substream = i;
+				if(!source->simulcast)
+					break;
+			}
+			if(substream != -1) {
+				JANUS_LOG(LOG_VERB, "Sending the cached GOP (substream %d) to the new viewer\n", substream);
+				if(source->simulcast && session->substream != substream) {
+					/* Start from the substream we have a GOP for: we'll switch to the target later, if needed */
+					session->substream = substream;
+					json_t *event = json_object();
+					json_object_set_new(event, "streaming", json_string("event"));
+					json_t *result = json_object();
+					json_object_set_new(result, "substream", json_integer(session->substream));
+					json_object_set_new(event, "result", result);
+					gateway->push_event(session->handle, &janus_streaming_plugin, NULL, event, NULL);
+					json_decref(event);
 				}
+				replaying = janus_streaming_gop_replay_start(session, mountpoint, substream);
 			}
-			janus_mutex_unlock(&source->keyframe.mutex);
 		}
 		if(source->buffermsg) {
 			JANUS_LOG(LOG_HUGE, "Any recent datachannel message to send?\n");
@@ -2344,7 +2852,9 @@ void janus_streaming_setup_media(janus_plugin_session *handle) {
 			janus_mutex_unlock(&source->buffermsg_mutex);
 		}
 	}
-	session->started = TRUE;
+	/* If we're sending the cached GOP, the task doing that will start the live stream when done */
+	if(!replaying)
+		session->started = TRUE;
 	/* Prepare JSON event */
 	json_t *event = json_object();
 	json_object_set_new(event, "streaming", json_string("event"));
@@ -2508,14 +3018,11 @@ static void *janus_streaming_handler(void *data) {
 				goto error;
 			}
 			if(mp->streaming_type == janus_streaming_type_on_demand) {
-				GError *error = NULL;
-				char tname[16];
-				g_snprintf(tname, sizeof(tname), "mp %"SCNu64, id_value);
-				g_thread_try_new(tname, &janus_streaming_ondemand_thread, session, &error);
-				if(error != NULL) {
-					JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the on-demand thread...\n", error->code, error->message ? error->message : "??");
+				/* The pacing engine will take care of sending this viewer the file */
+				if(janus_streaming_ondemand_start(session) < 0) {
+					JANUS_LOG(LOG_ERR, "Error starting the on-demand playout...\n");
 					error_code = JANUS_STREAMING_ERROR_UNKNOWN_ERROR;
-					g_snprintf(error_cause, 512, "Got error %d (%s) trying to launch the on-demand thread", error->code, error->message ? error->message : "??");
+					g_snprintf(error_cause, 512, "Error starting the on-demand playout");
 					goto error;
 				}
 			} else if(mp->streaming_source == janus_streaming_source_rtp) {
@@ -2629,7 +3136,7 @@ static void *janus_streaming_handler(void *data) {
 			json_object_set_new(result, "status", json_string("preparing"));
 			/* Add the user to the list of watchers and we're done */
 			janus_mutex_lock(&mp->mutex);
-			mp->listeners = g_list_append(mp->listeners, session);
+			janus_streaming_listener_add(mp, session);
 			janus_mutex_unlock(&mp->mutex);
 		} else if(!strcasecmp(request_text, "start")) {
 			if(session->mountpoint == NULL) {
@@ -2640,6 +3147,8 @@ static void *janus_streaming_handler(void *data) {
 			}
 			JANUS_LOG(LOG_VERB, "Starting the streaming\n");
 			session->paused = FALSE;
+			if(session->ondemand != NULL)
+				janus_pacer_task_resume(session->ondemand);
 			result = json_object();
 			/* We wait for the setup_media event to start: on the other hand, it may have already arrived */
 			json_object_set_new(result, "status", json_string(session->started ? "started" : "starting"));
@@ -2660,6 +3169,8 @@ static void *janus_streaming_handler(void *data) {
 			}
 			JANUS_LOG(LOG_VERB, "Pausing the streaming\n");
 			session->paused = TRUE;
+			if(session->ondemand != NULL)
+				janus_pacer_task_pause(session->ondemand);
 			result = json_object();
 			json_object_set_new(result, "status", json_string("pausing"));
 			/* Also notify event handlers */
@@ -2773,11 +3284,11 @@ static void *janus_streaming_handler(void *data) {
 			session->paused = TRUE;
 			/* Unsubscribe from the previous mountpoint and subscribe to the new one */
 			janus_mutex_lock(&oldmp->mutex);
-			oldmp->listeners = g_list_remove_all(oldmp->listeners, session);
+			janus_streaming_listener_remove(oldmp, session);
 			janus_mutex_unlock(&oldmp->mutex);
 			/* Subscribe to the new one */
 			janus_mutex_lock(&mp->mutex);
-			mp->listeners = g_list_append(mp->listeners, session);
+			janus_streaming_listener_add(mp, session);
 			janus_mutex_unlock(&mp->mutex);
 			session->mountpoint = mp;
 			session->paused = FALSE;
@@ -2793,7 +3304,7 @@ static void *janus_streaming_handler(void *data) {
 				gateway->notify_event(&janus_streaming_plugin, session->handle, info);
 			}
 		} else if(!strcasecmp(request_text, "stop")) {
-			if(session->stopping || !session->started) {
+			if(session->stopping || (!session->started && !g_atomic_int_get(&session->replaying))) {
 				/* Been there, done that: ignore */
 				janus_streaming_message_free(msg);
 				continue;
@@ -2817,7 +3328,7 @@ static void *janus_streaming_handler(void *data) {
 				if(g_list_find(mp->listeners, session) != NULL) {
 					JANUS_LOG(LOG_VERB, "  -- -- Found!\n");
 				}
-				mp->listeners = g_list_remove_all(mp->listeners, session);
+				janus_streaming_listener_remove(mp, session);
 				janus_mutex_unlock(&mp->mutex);
 			}
 			/* Also notify event handlers */
@@ -2951,6 +3462,13 @@ static int janus_streaming_create_fd(int port, in_addr_t mcast, const janus_netw
 		close(fd);
 		return -1;
 	}
+#ifdef SO_RXQ_OVFL
+	/* Ask the kernel to tell us when it drops packets because we're too slow */
+	int ovfl = 1;
+	if(setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &ovfl, sizeof(ovfl)) == -1) {
+		JANUS_LOG(LOG_WARN, "[%s] %s listener setsockopt SO_RXQ_OVFL failed, socket overflows won't be tracked\n", mountpointname, listenername);
+	}
+#endif
 	return fd;
 }
 
@@ -2990,27 +3508,14 @@ static void janus_streaming_rtp_source_free(janus_streaming_rtp_source *source)
 		close(source->video_rtcp_fd);
 	}
 #endif
-	janus_mutex_lock(&source->keyframe.mutex);
-	GList *temp = NULL;
-	while(source->keyframe.latest_keyframe) {
-		temp = g_list_first(source->keyframe.latest_keyframe);
-		source->keyframe.latest_keyframe = g_list_remove_link(source->keyframe.latest_keyframe, temp);
-		janus_streaming_rtp_relay_packet *pkt = (janus_streaming_rtp_relay_packet *)temp->data;
-		g_free(pkt->data);
-		g_free(pkt);
-		g_list_free(temp);
+	int i = 0;
+	for(i=0; i<3; i++) {
+		janus_mutex_lock(&source->gop[i].mutex);
+		g_free(source->gop[i].slots);
+		source->gop[i].slots = NULL;
+		source->gop[i].valid = FALSE;
+		janus_mutex_unlock(&source->gop[i].mutex);
 	}
-	source->keyframe.latest_keyframe = NULL;
-	while(source->keyframe.temp_keyframe) {
-		temp = g_list_first(source->keyframe.temp_keyframe);
-		source->keyframe.temp_keyframe = g_list_remove_link(source->keyframe.temp_keyframe, temp);
-		janus_streaming_rtp_relay_packet *pkt = (janus_streaming_rtp_relay_packet *)temp->data;
-		g_free(pkt->data);
-		g_free(pkt);
-		g_list_free(temp);
-	}
-	source->keyframe.latest_keyframe = NULL;
-	janus_mutex_unlock(&source->keyframe.mutex);
 	janus_mutex_lock(&source->buffermsg_mutex);
 	if(source->last_msg) {
 		janus_streaming_rtp_relay_packet *pkt = (janus_streaming_rtp_relay_packet *)source->last_msg;
@@ -3057,6 +3562,13 @@ static void janus_streaming_mountpoint_free(janus_streaming_mountpoint *mp) {
 	g_free(mp->pin);
 	janus_mutex_lock(&mp->mutex);
 	g_list_free(mp->listeners);
+	if(mp->partitions != NULL) {
+		guint i = 0;
+		for(i=0; i<relay_workers_num; i++)
+			g_list_free(mp->partitions[i].listeners);
+		g_free(mp->partitions);
+		mp->partitions = NULL;
+	}
 	janus_mutex_unlock(&mp->mutex);
 
 	if(mp->source != NULL && mp->source_destroy != NULL) {
@@ -3235,11 +3747,14 @@ janus_streaming_mountpoint *janus_streaming_create_rtp_source(
 	live_rtp_source->last_received_audio = janus_get_monotonic_time();
 	live_rtp_source->last_received_video = janus_get_monotonic_time();
 	live_rtp_source->last_received_data = janus_get_monotonic_time();
-	live_rtp_source->keyframe.enabled = bufferkf;
-	live_rtp_source->keyframe.latest_keyframe = NULL;
-	live_rtp_source->keyframe.temp_keyframe = NULL;
-	live_rtp_source->keyframe.temp_ts = 0;
-	janus_mutex_init(&live_rtp_source->keyframe.mutex);
+	live_rtp_source->bufferkf = dovideo && bufferkf;
+	int i = 0;
+	for(i=0; i<3; i++) {
+		janus_mutex_init(&live_rtp_source->gop[i].mutex);
+		/* The ring is preallocated, as we'll use it for all the video packets we get */
+		if(live_rtp_source->bufferkf && (i == 0 || live_rtp_source->simulcast))
+			live_rtp_source->gop[i].slots = g_malloc0(JANUS_STREAMING_GOP_SLOTS * sizeof(janus_streaming_rtp_gop_slot));
+	}
 	live_rtp_source->buffermsg = buffermsg;
 	live_rtp_source->last_msg = NULL;
 	janus_mutex_init(&live_rtp_source->buffermsg_mutex);
@@ -3726,6 +4241,9 @@ janus_streaming_mountpoint *janus_streaming_create_rtsp_source(
 	live_rtsp_source->data_iface = nil;
 	live_rtsp_source->reconnect_timer = 0;
 	janus_mutex_init(&live_rtsp_source->rtsp_mutex);
+	int i = 0;
+	for(i=0; i<3; i++)
+		janus_mutex_init(&live_rtsp_source->gop[i].mutex);
 	live_rtsp->source = live_rtsp_source;
 	live_rtsp->source_destroy = (GDestroyNotify) janus_streaming_rtp_source_free;
 	live_rtsp->listeners = NULL;
@@ -3771,105 +4289,127 @@ janus_streaming_mountpoint *janus_streaming_create_rtsp_source(
 }
 #endif
 
-/* FIXME Thread to send RTP packets from a file (on demand) */
-static void *janus_streaming_ondemand_thread(void *data) {
-	JANUS_LOG(LOG_VERB, "Filesource (on demand) RTP thread starting...\n");
-	janus_streaming_session *session = (janus_streaming_session *)data;
+/* On-demand file viewers are sent packets by the pacing engine: this is the state of the playout */
+#define JANUS_STREAMING_ONDEMAND_FRAME	20000	/* One frame every 20ms */
+typedef struct janus_streaming_ondemand {
+	janus_streaming_session *session;
+	janus_streaming_mountpoint *mountpoint;
+	FILE *audio;		/* The file we're sending */
+	long size;			/* Size of the file */
+	char *name;			/* Name of the mountpoint, for logging purposes */
+	char buf[1024];		/* Buffer for the RTP packets */
+	gint16 seq;			/* RTP sequence number */
+	gint32 ts;			/* RTP timestamp */
+	gint64 frame;		/* Next frame to send */
+} janus_streaming_ondemand;
+static gint64 janus_streaming_ondemand_send(void *data, gint64 position);
+static gint64 janus_streaming_ondemand_seek(void *data, gint64 position);
+static void janus_streaming_ondemand_done(void *data);
+static janus_pacer_callbacks janus_streaming_ondemand_callbacks = {
+	.send = janus_streaming_ondemand_send,
+	.seek = janus_streaming_ondemand_seek,
+	.done = janus_streaming_ondemand_done,
+};
+
+static int janus_streaming_ondemand_start(janus_streaming_session *session) {
+	JANUS_LOG(LOG_VERB, "Filesource (on demand) RTP playout starting...\n");
 	if(!session) {
 		JANUS_LOG(LOG_ERR, "Invalid session!\n");
-		g_thread_unref(g_thread_self());
-		return NULL;
+		return -1;
 	}
 	janus_streaming_mountpoint *mountpoint = session->mountpoint;
 	if(!mountpoint) {
 		JANUS_LOG(LOG_ERR, "Invalid mountpoint!\n");
-		g_thread_unref(g_thread_self());
-		return NULL;
+		return -1;
 	}
 	if(mountpoint->streaming_source != janus_streaming_source_file) {
 		JANUS_LOG(LOG_ERR, "[%s] Not an file source mountpoint!\n", mountpoint->name);
-		g_thread_unref(g_thread_self());
-		return NULL;
+		return -1;
 	}
 	if(mountpoint->streaming_type != janus_streaming_type_on_demand) {
 		JANUS_LOG(LOG_ERR, "[%s] Not an on-demand file source mountpoint!\n", mountpoint->name);
-		g_thread_unref(g_thread_self());
-		return NULL;
+		return -1;
 	}
 	janus_streaming_file_source *source = mountpoint->source;
 	if(source == NULL || source->filename == NULL) {
-		g_thread_unref(g_thread_self());
 		JANUS_LOG(LOG_ERR, "[%s] Invalid file source mountpoint!\n", mountpoint->name);
-		return NULL;
+		return -1;
 	}
 	JANUS_LOG(LOG_VERB, "[%s] Opening file source %s...\n", mountpoint->name, source->filename);
 	FILE *audio = fopen(source->filename, "rb");
 	if(!audio) {
 		JANUS_LOG(LOG_ERR, "[%s] Ooops, audio file missing!\n", mountpoint->name);
-		g_thread_unref(g_thread_self());
-		return NULL;
+		return -1;
 	}
 	JANUS_LOG(LOG_VERB, "[%s] Streaming audio file: %s\n", mountpoint->name, source->filename);
-	/* Buffer */
-	char *buf = g_malloc0(1024);
-	char *name = g_strdup(mountpoint->name ? mountpoint->name : "??");
+	janus_streaming_ondemand *od = g_malloc0(sizeof(janus_streaming_ondemand));
+	od->session = session;
+	od->mountpoint = mountpoint;
+	od->audio = audio;
+	fseek(audio, 0L, SEEK_END);
+	od->size = ftell(audio);
+	fseek(audio, 0L, SEEK_SET);
+	od->name = g_strdup(mountpoint->name ? mountpoint->name : "??");
 	/* Set up RTP */
-	gint16 seq = 1;
-	gint32 ts = 0;
-	rtp_header *header = (rtp_header *)buf;
+	od->seq = 1;
+	od->ts = 0;
+	rtp_header *header = (rtp_header *)od->buf;
 	header->version = 2;
 	header->markerbit = 1;
 	header->type = mountpoint->codecs.audio_pt;
-	header->seq_number = htons(seq);
-	header->timestamp = htonl(ts);
+	header->seq_number = htons(od->seq);
+	header->timestamp = htonl(od->ts);
 	header->ssrc = htonl(1);	/* The gateway will fix this anyway */
-	/* Timer */
-	struct timeval now, before;
-	gettimeofday(&before, NULL);
-	now.tv_sec = before.tv_sec;
-	now.tv_usec = before.tv_usec;
-	time_t passed, d_s, d_us;
-	/* Loop */
+	/* Hand the playout to the pacing engine (getting rid of the previous one, if any) */
+	janus_pacer_task *task = janus_pacer_task_create(&janus_streaming_ondemand_callbacks, od);
+	if(task == NULL || janus_pacer_task_start(task, 0) < 0) {
+		JANUS_LOG(LOG_ERR, "[%s] Couldn't start the on-demand playout\n", od->name);
+		if(task == NULL) {
+			janus_streaming_ondemand_done(od);
+		} else {
+			/* This will get rid of the playout state too */
+			janus_pacer_task_stop(task);
+			janus_pacer_task_unref(task);
+		}
+		return -1;
+	}
+	if(session->ondemand != NULL) {
+		janus_pacer_task_stop(session->ondemand);
+		janus_pacer_task_unref(session->ondemand);
+	}
+	session->ondemand = task;
+	return 0;
+}
+
+static gint64 janus_streaming_ondemand_send(void *data, gint64 position) {
+	janus_streaming_ondemand *od = (janus_streaming_ondemand *)data;
+	janus_streaming_session *session = od->session;
+	janus_streaming_mountpoint *mountpoint = od->mountpoint;
+	if(g_atomic_int_get(&stopping) || mountpoint->destroyed || session->stopping || session->destroyed)
+		return -1;
+	janus_streaming_file_source *source = mountpoint->source;
+	rtp_header *header = (rtp_header *)od->buf;
 	gint read = 0;
 	janus_streaming_rtp_relay_packet packet;
-	while(!g_atomic_int_get(&stopping) && !mountpoint->destroyed && !session->stopping && !session->destroyed) {
-		/* See if it's time to prepare a frame */
-		gettimeofday(&now, NULL);
-		d_s = now.tv_sec - before.tv_sec;
-		d_us = now.tv_usec - before.tv_usec;
-		if(d_us < 0) {
-			d_us += 1000000;
-			--d_s;
-		}
-		passed = d_s*1000000 + d_us;
-		if(passed < 18000) {	/* Let's wait about 18ms */
-			usleep(1000);
-			continue;
-		}
-		/* Update the reference time */
-		before.tv_usec += 20000;
-		if(before.tv_usec > 1000000) {
-			before.tv_sec++;
-			before.tv_usec -= 1000000;
-		}
-		/* If not started or paused, wait some more */
+	memset(&packet, 0, sizeof(packet));
+	/* Send all the frames that are due */
+	while(od->frame * JANUS_STREAMING_ONDEMAND_FRAME <= position) {
+		od->frame++;
+		/* If not started or paused, skip this frame */
 		if(!session->started || session->paused || !mountpoint->enabled)
 			continue;
 		/* Read frame from file... */
-		read = fread(buf + RTP_HEADER_SIZE, sizeof(char), 160, audio);
-		if(feof(audio)) {
+		read = fread(od->buf + RTP_HEADER_SIZE, sizeof(char), 160, od->audio);
+		if(feof(od->audio)) {
 			/* FIXME We're doing this forever... should this be configurable? */
-			JANUS_LOG(LOG_VERB, "[%s] Rewind! (%s)\n", name, source->filename);
-			fseek(audio, 0, SEEK_SET);
+			JANUS_LOG(LOG_VERB, "[%s] Rewind! (%s)\n", od->name, source->filename);
+			fseek(od->audio, 0, SEEK_SET);
 			continue;
 		}
 		if(read < 0)
-			break;
+			return -1;
 		if(mountpoint->active == FALSE)
 			mountpoint->active = TRUE;
-		//~ JANUS_LOG(LOG_VERB, " ... Preparing RTP packet (pt=%u, seq=%u, ts=%u)...\n",
-			//~ header->type, ntohs(header->seq_number), ntohl(header->timestamp));
-		//~ JANUS_LOG(LOG_VERB, " ... Read %d bytes from the audio file...\n", read);
 		/* Relay on all sessions */
 		packet.data = header;
 		packet.length = RTP_HEADER_SIZE + read;
@@ -3882,18 +4422,29 @@ static void *janus_streaming_ondemand_thread(void *data) {
 		/* Go! */
 		janus_streaming_relay_rtp_packet(session, &packet);
 		/* Update header */
-		seq++;
-		header->seq_number = htons(seq);
-		ts += 160;
-		header->timestamp = htonl(ts);
+		od->seq++;
+		header->seq_number = htons(od->seq);
+		od->ts += 160;
+		header->timestamp = htonl(od->ts);
 		header->markerbit = 0;
 	}
-	JANUS_LOG(LOG_VERB, "[%s] Leaving filesource (ondemand) thread\n", name);
-	g_free(name);
-	g_free(buf);
-	fclose(audio);
-	g_thread_unref(g_thread_self());
-	return NULL;
+	return od->frame * JANUS_STREAMING_ONDEMAND_FRAME;
+}
+
+static gint64 janus_streaming_ondemand_seek(void *data, gint64 position) {
+	janus_streaming_ondemand *od = (janus_streaming_ondemand *)data;
+	/* Each frame is 160 bytes, and the file loops: RTP timestamps and sequence numbers just go on */
+	od->frame = position / JANUS_STREAMING_ONDEMAND_FRAME;
+	fseek(od->audio, od->size > 0 ? (od->frame*160) % od->size : 0, SEEK_SET);
+	return od->frame * JANUS_STREAMING_ONDEMAND_FRAME;
+}
+
+static void janus_streaming_ondemand_done(void *data) {
+	janus_streaming_ondemand *od = (janus_streaming_ondemand *)data;
+	JANUS_LOG(LOG_VERB, "[%s] Leaving filesource (ondemand) playout\n", od->name);
+	g_free(od->name);
+	fclose(od->audio);
+	g_free(od);
 }
 
 /* FIXME Thread to send RTP packets from a file (live) */
@@ -3951,6 +4502,7 @@ static void *janus_streaming_filesource_thread(void *data) {
 	/* Loop */
 	gint read = 0;
 	janus_streaming_rtp_relay_packet packet;
+	memset(&packet, 0, sizeof(packet));
 	while(!g_atomic_int_get(&stopping) && !mountpoint->destroyed) {
 		/* See if it's time to prepare a frame */
 		gettimeofday(&now, NULL);
@@ -3999,9 +4551,7 @@ static void *janus_streaming_filesource_thread(void *data) {
 		packet.timestamp = ntohl(packet.data->timestamp);
 		packet.seq_number = ntohs(packet.data->seq_number);
 		/* Go! */
-		janus_mutex_lock_nodebug(&mountpoint->mutex);
-		g_list_foreach(mountpoint->listeners, janus_streaming_relay_rtp_packet, &packet);
-		janus_mutex_unlock_nodebug(&mountpoint->mutex);
+		janus_streaming_relay_to_listeners(mountpoint, &packet);
 		/* Update header */
 		seq++;
 		header->seq_number = htons(seq);
@@ -4009,6 +4559,7 @@ static void *janus_streaming_filesource_thread(void *data) {
 		header->timestamp = htonl(ts);
 		header->markerbit = 0;
 	}
+	janus_streaming_relay_wait(mountpoint);
 	JANUS_LOG(LOG_VERB, "[%s] Leaving filesource (live) thread\n", name);
 	g_free(name);
 	g_free(buf);
@@ -4047,12 +4598,10 @@ static void *janus_streaming_relay_thread(void *data) {
 	uint16_t a_last_seq = 0, a_base_seq = 0, a_base_seq_prev = 0,
 			v_last_seq[3] = {0, 0, 0}, v_base_seq[3] = {0, 0, 0}, v_base_seq_prev[3] = {0, 0, 0};
 	/* File descriptors */
-	socklen_t addrlen;
-	struct sockaddr_in remote;
 	int resfd = 0, bytes = 0;
 	struct pollfd fds[5];
-	char buffer[1500];
-	memset(buffer, 0, 1500);
+	/* Packets are read in batches, to save on syscalls */
+	janus_streaming_reader *reader = g_malloc0(sizeof(janus_streaming_reader));
 #ifdef HAVE_LIBCURL
 	/* In case this is an RTSP restreamer, we may have to send keep-alives from time to time */
 	gint64 now = janus_get_monotonic_time(), before = now, ka_timeout = 0;
@@ -4064,6 +4613,7 @@ static void *janus_streaming_relay_thread(void *data) {
 	/* Loop */
 	int num = 0;
 	janus_streaming_rtp_relay_packet packet;
+	memset(&packet, 0, sizeof(packet));
 	while(!g_atomic_int_get(&stopping) && !mountpoint->destroyed) {
 #ifdef HAVE_LIBCURL
 		/* Let's check regularly if the RTSP server seems to be gone */
@@ -4221,130 +4771,137 @@ static void *janus_streaming_relay_thread(void *data) {
 				mountpoint->enabled = FALSE;
 				break;
 			} else if(fds[i].revents & POLLIN) {
-				/* Got an RTP or data packet */
-				if(audio_fd != -1 && fds[i].fd == audio_fd) {
-					/* Got something audio (RTP) */
-					if(mountpoint->active == FALSE)
-						mountpoint->active = TRUE;
-					source->last_received_audio = janus_get_monotonic_time();
+				/* Got one or more RTP or data packets: read as many as we can in one go */
+				int slot = 4;
+				if(fds[i].fd == audio_fd)
+					slot = 0;
+				else if(fds[i].fd == video_fd[0])
+					slot = 1;
+				else if(fds[i].fd == video_fd[1])
+					slot = 2;
+				else if(fds[i].fd == video_fd[2])
+					slot = 3;
+				int count = janus_streaming_reader_read(reader, fds[i].fd, slot, &source->ingest);
+				int m = 0;
+				for(m=0; m<count; m++) {
+					char *buffer = reader->buffers[m];
+					bytes = reader->msgs[m].msg_len;
+					/* Got an RTP or data packet */
+					if(audio_fd != -1 && fds[i].fd == audio_fd) {
+						/* Got something audio (RTP) */
+						if(mountpoint->active == FALSE)
+							mountpoint->active = TRUE;
+						source->last_received_audio = janus_get_monotonic_time();
 #ifdef HAVE_LIBCURL
-					source->reconnect_timer = janus_get_monotonic_time();
+						source->reconnect_timer = janus_get_monotonic_time();
 #endif
-					addrlen = sizeof(remote);
-					bytes = recvfrom(audio_fd, buffer, 1500, 0, (struct sockaddr*)&remote, &addrlen);
-					if(bytes < 0) {
-						/* Failed to read? */
-						continue;
-					}
-					//~ JANUS_LOG(LOG_VERB, "************************\nGot %d bytes on the audio channel...\n", bytes);
-					/* If paused, ignore this packet */
-					if(!mountpoint->enabled)
+						if(bytes < 1) {
+							/* Empty or truncated packet, skip it */
+							continue;
+						}
+						//~ JANUS_LOG(LOG_VERB, "************************\nGot %d bytes on the audio channel...\n", bytes);
+						/* If paused, ignore this packet */
+						if(!mountpoint->enabled) {
+							source->ingest.dropped++;
+							continue;
+						}
+						rtp_header *rtp = (rtp_header *)buffer;
+						//~ JANUS_LOG(LOG_VERB, " ... parsed RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
+							//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
+						/* Relay on all sessions */
+						packet.data = rtp;
+						packet.length = bytes;
+						packet.is_rtp = TRUE;
+						packet.is_video = FALSE;
+						packet.is_keyframe = FALSE;
+						/* Do we have a new stream? */
+						if(ntohl(packet.data->ssrc) != a_last_ssrc) {
+							a_last_ssrc = ntohl(packet.data->ssrc);
+							JANUS_LOG(LOG_INFO, "[%s] New audio stream! (ssrc=%u)\n", name, a_last_ssrc);
+							a_base_ts_prev = a_last_ts;
+							a_base_ts = ntohl(packet.data->timestamp);
+							a_base_seq_prev = a_last_seq;
+							a_base_seq = ntohs(packet.data->seq_number);
+						}
+						a_last_ts = (ntohl(packet.data->timestamp)-a_base_ts)+a_base_ts_prev+960;	/* FIXME We're assuming Opus here... */
+						packet.data->timestamp = htonl(a_last_ts);
+						a_last_seq = (ntohs(packet.data->seq_number)-a_base_seq)+a_base_seq_prev+1;
+						packet.data->seq_number = htons(a_last_seq);
+						//~ JANUS_LOG(LOG_VERB, " ... updated RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
+							//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
+						packet.data->type = mountpoint->codecs.audio_pt;
+						/* Is there a recorder? */
+						janus_recorder_save_frame(source->arc, buffer, bytes);
+						/* Backup the actual timestamp and sequence number set by the restreamer, in case switching is involved */
+						packet.timestamp = ntohl(packet.data->timestamp);
+						packet.seq_number = ntohs(packet.data->seq_number);
+						/* Go! */
+						janus_streaming_relay_to_listeners(mountpoint, &packet);
 						continue;
-					rtp_header *rtp = (rtp_header *)buffer;
-					//~ JANUS_LOG(LOG_VERB, " ... parsed RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
-						//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-					/* Relay on all sessions */
-					packet.data = rtp;
-					packet.length = bytes;
-					packet.is_rtp = TRUE;
-					packet.is_video = FALSE;
-					packet.is_keyframe = FALSE;
-					/* Do we have a new stream? */
-					if(ntohl(packet.data->ssrc) != a_last_ssrc) {
-						a_last_ssrc = ntohl(packet.data->ssrc);
-						JANUS_LOG(LOG_INFO, "[%s] New audio stream! (ssrc=%u)\n", name, a_last_ssrc);
-						a_base_ts_prev = a_last_ts;
-						a_base_ts = ntohl(packet.data->timestamp);
-						a_base_seq_prev = a_last_seq;
-						a_base_seq = ntohs(packet.data->seq_number);
-					}
-					a_last_ts = (ntohl(packet.data->timestamp)-a_base_ts)+a_base_ts_prev+960;	/* FIXME We're assuming Opus here... */
-					packet.data->timestamp = htonl(a_last_ts);
-					a_last_seq = (ntohs(packet.data->seq_number)-a_base_seq)+a_base_seq_prev+1;
-					packet.data->seq_number = htons(a_last_seq);
-					//~ JANUS_LOG(LOG_VERB, " ... updated RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
-						//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-					packet.data->type = mountpoint->codecs.audio_pt;
-					/* Is there a recorder? */
-					janus_recorder_save_frame(source->arc, buffer, bytes);
-					/* Backup the actual timestamp and sequence number set by the restreamer, in case switching is involved */
-					packet.timestamp = ntohl(packet.data->timestamp);
-					packet.seq_number = ntohs(packet.data->seq_number);
-					/* Go! */
-					janus_mutex_lock(&mountpoint->mutex);
-					g_list_foreach(mountpoint->listeners, janus_streaming_relay_rtp_packet, &packet);
-					janus_mutex_unlock(&mountpoint->mutex);
-					continue;
-				} else if((video_fd[0] != -1 && fds[i].fd == video_fd[0]) ||
-						(video_fd[1] != -1 && fds[i].fd == video_fd[1]) ||
-						(video_fd[2] != -1 && fds[i].fd == video_fd[2])) {
-					/* Got something video (RTP) */
-					int index = -1;
-					if(fds[i].fd == video_fd[0])
-						index = 0;
-					else if(fds[i].fd == video_fd[1])
-						index = 1;
-					else if(fds[i].fd == video_fd[2])
-						index = 2;
-					if(mountpoint->active == FALSE)
-						mountpoint->active = TRUE;
-					source->last_received_video = janus_get_monotonic_time();
+					} else if((video_fd[0] != -1 && fds[i].fd == video_fd[0]) ||
+							(video_fd[1] != -1 && fds[i].fd == video_fd[1]) ||
+							(video_fd[2] != -1 && fds[i].fd == video_fd[2])) {
+						/* Got something video (RTP) */
+						int index = -1;
+						if(fds[i].fd == video_fd[0])
+							index = 0;
+						else if(fds[i].fd == video_fd[1])
+							index = 1;
+						else if(fds[i].fd == video_fd[2])
+							index = 2;
+						if(mountpoint->active == FALSE)
+							mountpoint->active = TRUE;
+						source->last_received_video = janus_get_monotonic_time();
 #ifdef HAVE_LIBCURL
-					source->reconnect_timer = janus_get_monotonic_time();
+						source->reconnect_timer = janus_get_monotonic_time();
 #endif
-					addrlen = sizeof(remote);
-					bytes = recvfrom(fds[i].fd, buffer, 1500, 0, (struct sockaddr*)&remote, &addrlen);
-					if(bytes < 0) {
-						/* Failed to read? */
-						continue;
-					}
-					//~ JANUS_LOG(LOG_VERB, "************************\nGot %d bytes on the video channel...\n", bytes);
-					rtp_header *rtp = (rtp_header *)buffer;
-					/* First of all, let's check if this is (part of) a keyframe that we may need to save it for future reference */
-					if(source->keyframe.enabled) {
-						if(source->keyframe.temp_ts > 0 && ntohl(rtp->timestamp) != source->keyframe.temp_ts) {
-							/* We received the last part of the keyframe, get rid of the old one and use this from now on */
-							JANUS_LOG(LOG_HUGE, "[%s] ... ... last part of keyframe received! ts=%"SCNu32", %d packets\n",
-								name, source->keyframe.temp_ts, g_list_length(source->keyframe.temp_keyframe));
-							source->keyframe.temp_ts = 0;
-							janus_mutex_lock(&source->keyframe.mutex);
-							GList *temp = NULL;
-							while(source->keyframe.latest_keyframe) {
-								temp = g_list_first(source->keyframe.latest_keyframe);
-								source->keyframe.latest_keyframe = g_list_remove_link(source->keyframe.latest_keyframe, temp);
-								janus_streaming_rtp_relay_packet *pkt = (janus_streaming_rtp_relay_packet *)temp->data;
-								g_free(pkt->data);
-								g_free(pkt);
-								g_list_free(temp);
-							}
-							source->keyframe.latest_keyframe = source->keyframe.temp_keyframe;
-							source->keyframe.temp_keyframe = NULL;
-							janus_mutex_unlock(&source->keyframe.mutex);
-						} else if(ntohl(rtp->timestamp) == source->keyframe.temp_ts) {
-							/* Part of the keyframe we're currently saving, store */
-							janus_mutex_lock(&source->keyframe.mutex);
-							JANUS_LOG(LOG_HUGE, "[%s] ... other part of keyframe received! ts=%"SCNu32"\n", name, source->keyframe.temp_ts);
-							janus_streaming_rtp_relay_packet *pkt = g_malloc0(sizeof(janus_streaming_rtp_relay_packet));
-							pkt->data = g_malloc0(bytes);
-							memcpy(pkt->data, buffer, bytes);
-							pkt->data->ssrc = htons(1);
-							pkt->data->type = mountpoint->codecs.video_pt;
-							packet.is_rtp = TRUE;
-							packet.is_video = TRUE;
-							packet.is_keyframe = TRUE;
-							pkt->length = bytes;
-							pkt->timestamp = source->keyframe.temp_ts;
-							pkt->seq_number = ntohs(rtp->seq_number);
-							source->keyframe.temp_keyframe = g_list_append(source->keyframe.temp_keyframe, pkt);
-							janus_mutex_unlock(&source->keyframe.mutex);
-						} else {
+						if(bytes < 1) {
+							/* Empty or truncated packet, skip it */
+							continue;
+						}
+						//~ JANUS_LOG(LOG_VERB, "************************\nGot %d bytes on the video channel...\n", bytes);
+						rtp_header *rtp = (rtp_header *)buffer;
+						/* If paused, ignore this packet */
+						if(!mountpoint->enabled) {
+							source->ingest.dropped++;
+							continue;
+						}
+						//~ JANUS_LOG(LOG_VERB, " ... parsed RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
+							//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
+						/* Relay on all sessions */
+						packet.data = rtp;
+						packet.length = bytes;
+						packet.is_rtp = TRUE;
+						packet.is_video = TRUE;
+						packet.is_keyframe = FALSE;
+						packet.simulcast = source->simulcast;
+						packet.substream = index;
+						packet.codec = mountpoint->codecs.video_codec;
+						/* Do we have a new stream? */
+						if(ntohl(packet.data->ssrc) != v_last_ssrc[index]) {
+							v_last_ssrc[index] = ntohl(packet.data->ssrc);
+							JANUS_LOG(LOG_INFO, "[%s] New video stream! (ssrc=%u, index %d)\n", name, v_last_ssrc[index], index);
+							v_base_ts_prev[index] = v_last_ts[index];
+							v_base_ts[index] = ntohl(packet.data->timestamp);
+							v_base_seq_prev[index] = v_last_seq[index];
+							v_base_seq[index] = ntohs(packet.data->seq_number);
+						}
+						v_last_ts[index] = (ntohl(packet.data->timestamp)-v_base_ts[index])+v_base_ts_prev[index]+4500;	/* FIXME We're assuming 15fps here... */
+						packet.data->timestamp = htonl(v_last_ts[index]);
+						v_last_seq[index] = (ntohs(packet.data->seq_number)-v_base_seq[index])+v_base_seq_prev[index]+1;
+						packet.data->seq_number = htons(v_last_seq[index]);
+						//~ JANUS_LOG(LOG_VERB, " ... updated RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
+							//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
+						packet.data->type = mountpoint->codecs.video_pt;
+						/* Is there a recorder? (FIXME notice we only record the first substream, if simulcasting) */
+						if(index == 0)
+							janus_recorder_save_frame(source->vrc, buffer, bytes);
+						/* Backup the actual timestamp and sequence number set by the restreamer, in case switching is involved */
+						packet.timestamp = ntohl(packet.data->timestamp);
+						packet.seq_number = ntohs(packet.data->seq_number);
+						/* Update the GOP cache, if enabled, before relaying, so that new viewers miss nothing */
+						if(source->gop[index].slots != NULL) {
 							gboolean kf = FALSE;
-							/* Parse RTP header first */
-							rtp_header *header = (rtp_header *)buffer;
-							guint32 timestamp = ntohl(header->timestamp);
-							guint16 seq = ntohs(header->seq_number);
-							JANUS_LOG(LOG_HUGE, "Checking if packet (size=%d, seq=%"SCNu16", ts=%"SCNu32") is a key frame...\n",
-								bytes, seq, timestamp);
 							int plen = 0;
 							char *payload = janus_rtp_payload(buffer, bytes, &plen);
 							if(payload) {
@@ -4361,116 +4918,58 @@ static void *janus_streaming_relay_thread(void *data) {
 									default:
 										break;
 								}
-								if(kf) {
-									/* New keyframe, start saving it */
-									source->keyframe.temp_ts = ntohl(rtp->timestamp);
-									JANUS_LOG(LOG_HUGE, "[%s] New keyframe received! ts=%"SCNu32"\n", name, source->keyframe.temp_ts);
-									janus_mutex_lock(&source->keyframe.mutex);
-									janus_streaming_rtp_relay_packet *pkt = g_malloc0(sizeof(janus_streaming_rtp_relay_packet));
-									pkt->data = g_malloc0(bytes);
-									memcpy(pkt->data, buffer, bytes);
-									pkt->data->ssrc = htons(1);
-									pkt->data->type = mountpoint->codecs.video_pt;
-									packet.is_rtp = TRUE;
-									packet.is_video = TRUE;
-									packet.is_keyframe = TRUE;
-									pkt->length = bytes;
-									pkt->timestamp = source->keyframe.temp_ts;
-									pkt->seq_number = ntohs(rtp->seq_number);
-									source->keyframe.temp_keyframe = g_list_append(source->keyframe.temp_keyframe, pkt);
-									janus_mutex_unlock(&source->keyframe.mutex);
-								}
 							}
+							janus_streaming_rtp_gop_add(&source->gop[index], &packet, kf);
 						}
-					}
-					/* If paused, ignore this packet */
-					if(!mountpoint->enabled)
+						/* Go! */
+						janus_streaming_relay_to_listeners(mountpoint, &packet);
 						continue;
-					//~ JANUS_LOG(LOG_VERB, " ... parsed RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
-						//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-					/* Relay on all sessions */
-					packet.data = rtp;
-					packet.length = bytes;
-					packet.is_rtp = TRUE;
-					packet.is_video = TRUE;
-					packet.is_keyframe = FALSE;
-					packet.simulcast = source->simulcast;
-					packet.substream = index;
-					packet.codec = mountpoint->codecs.video_codec;
-					/* Do we have a new stream? */
-					if(ntohl(packet.data->ssrc) != v_last_ssrc[index]) {
-						v_last_ssrc[index] = ntohl(packet.data->ssrc);
-						JANUS_LOG(LOG_INFO, "[%s] New video stream! (ssrc=%u, index %d)\n", name, v_last_ssrc[index], index);
-						v_base_ts_prev[index] = v_last_ts[index];
-						v_base_ts[index] = ntohl(packet.data->timestamp);
-						v_base_seq_prev[index] = v_last_seq[index];
-						v_base_seq[index] = ntohs(packet.data->seq_number);
-					}
-					v_last_ts[index] = (ntohl(packet.data->timestamp)-v_base_ts[index])+v_base_ts_prev[index]+4500;	/* FIXME We're assuming 15fps here... */
-					packet.data->timestamp = htonl(v_last_ts[index]);
-					v_last_seq[index] = (ntohs(packet.data->seq_number)-v_base_seq[index])+v_base_seq_prev[index]+1;
-					packet.data->seq_number = htons(v_last_seq[index]);
-					//~ JANUS_LOG(LOG_VERB, " ... updated RTP packet (ssrc=%u, pt=%u, seq=%u, ts=%u)...\n",
-						//~ ntohl(rtp->ssrc), rtp->type, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
-					packet.data->type = mountpoint->codecs.video_pt;
-					/* Is there a recorder? (FIXME notice we only record the first substream, if simulcasting) */
-					if(index == 0)
-						janus_recorder_save_frame(source->vrc, buffer, bytes);
-					/* Backup the actual timestamp and sequence number set by the restreamer, in case switching is involved */
-					packet.timestamp = ntohl(packet.data->timestamp);
-					packet.seq_number = ntohs(packet.data->seq_number);
-					/* Go! */
-					janus_mutex_lock(&mountpoint->mutex);
-					g_list_foreach(mountpoint->listeners, janus_streaming_relay_rtp_packet, &packet);
-					janus_mutex_unlock(&mountpoint->mutex);
-					continue;
-				} else if(data_fd != -1 && fds[i].fd == data_fd) {
-					/* Got something data (text) */
-					if(mountpoint->active == FALSE)
-						mountpoint->active = TRUE;
-					source->last_received_data = janus_get_monotonic_time();
+					} else if(data_fd != -1 && fds[i].fd == data_fd) {
+						/* Got something data (text) */
+						if(mountpoint->active == FALSE)
+							mountpoint->active = TRUE;
+						source->last_received_data = janus_get_monotonic_time();
 #ifdef HAVE_LIBCURL
-					source->reconnect_timer = janus_get_monotonic_time();
+						source->reconnect_timer = janus_get_monotonic_time();
 #endif
-					addrlen = sizeof(remote);
-					bytes = recvfrom(data_fd, buffer, 1500, 0, (struct sockaddr*)&remote, &addrlen);
-					if(bytes < 0) {
-						/* Failed to read? */
-						continue;
-					}
-					/* Get a string out of the data */
-					char *text = g_malloc0(bytes+1);
-					memcpy(text, buffer, bytes);
-					*(text+bytes) = '\0';
-					/* Relay on all sessions */
-					packet.data = (rtp_header *)text;
-					packet.length = bytes+1;
-					packet.is_rtp = FALSE;
-					/* Is there a recorder? */
-					janus_recorder_save_frame(source->drc, text, strlen(text));
-					/* Are we keeping track of the last message being relayed? */
-					if(source->buffermsg) {
-						janus_mutex_lock(&source->buffermsg_mutex);
-						janus_streaming_rtp_relay_packet *pkt = g_malloc0(sizeof(janus_streaming_rtp_relay_packet));
-						pkt->data = g_malloc0(bytes+1);
-						memcpy(pkt->data, text, bytes+1);
+						if(bytes < 1) {
+							/* Empty or truncated packet, skip it */
+							continue;
+						}
+						/* Get a string out of the data */
+						char *text = g_malloc0(bytes+1);
+						memcpy(text, buffer, bytes);
+						*(text+bytes) = '\0';
+						/* Relay on all sessions */
+						packet.data = (rtp_header *)text;
+						packet.length = bytes+1;
 						packet.is_rtp = FALSE;
-						pkt->length = bytes+1;
-						janus_mutex_unlock(&source->buffermsg_mutex);
+						/* Is there a recorder? */
+						janus_recorder_save_frame(source->drc, text, strlen(text));
+						/* Are we keeping track of the last message being relayed? */
+						if(source->buffermsg) {
+							janus_mutex_lock(&source->buffermsg_mutex);
+							janus_streaming_rtp_relay_packet *pkt = g_malloc0(sizeof(janus_streaming_rtp_relay_packet));
+							pkt->data = g_malloc0(bytes+1);
+							memcpy(pkt->data, text, bytes+1);
+							packet.is_rtp = FALSE;
+							pkt->length = bytes+1;
+							janus_mutex_unlock(&source->buffermsg_mutex);
+						}
+						/* Go! */
+						janus_streaming_relay_to_listeners(mountpoint, &packet);
+						packet.data = NULL;
+						g_free(text);
+						continue;
 					}
-					/* Go! */
-					janus_mutex_lock(&mountpoint->mutex);
-					g_list_foreach(mountpoint->listeners, janus_streaming_relay_rtp_packet, &packet);
-					janus_mutex_unlock(&mountpoint->mutex);
-					packet.data = NULL;
-					g_free(text);
-					continue;
 				}
 			}
 		}
 	}
 
-	/* Notify users this mountpoint is done */
+	/* Make sure the relay threads are done with our packets, then notify users this mountpoint is done */
+	g_free(reader);
+	janus_streaming_relay_wait(mountpoint);
 	janus_mutex_lock(&mountpoint->mutex);
 	GList *viewer = g_list_first(mountpoint->listeners);
 	/* Prepare JSON event */
@@ -4490,7 +4989,7 @@ static void *janus_streaming_relay_thread(void *data) {
 			gateway->push_event(session->handle, &janus_streaming_plugin, NULL, event, NULL);
 			gateway->close_pc(session->handle);
 		}
-		mountpoint->listeners = g_list_remove_all(mountpoint->listeners, session);
+		janus_streaming_listener_remove(mountpoint, session);
 		viewer = g_list_first(mountpoint->listeners);
 	}
 	json_decref(event);
@@ -4502,6 +5001,41 @@ static void *janus_streaming_relay_thread(void *data) {
 	return NULL;
 }
 
+/* Thread relaying packets to its partition of the viewers of each mountpoint */
+static void *janus_streaming_relay_worker_thread(void *data) {
+	janus_streaming_relay_worker *worker = (janus_streaming_relay_worker *)data;
+	JANUS_LOG(LOG_VERB, "Joining Streaming relay thread #%u\n", worker->id);
+	/* Relaying rewrites the packet in place for each viewer, so we can't
+	 * use the shared copy directly, as other relay threads may be using it */
+	gint buffer_size = JANUS_STREAMING_RELAY_BUFFER;
+	char *buffer = g_malloc(buffer_size);
+	janus_streaming_rtp_relay_packet packet;
+	janus_streaming_shared_packet *shared = NULL;
+	while(TRUE) {
+		shared = g_async_queue_pop(worker->queue);
+		if(shared == &relay_exit_packet)
+			break;
+		janus_streaming_mountpoint *mp = shared->mountpoint;
+		janus_streaming_partition *partition = &mp->partitions[worker->id];
+		packet = shared->packet;
+		if(packet.length > buffer_size) {
+			buffer_size = packet.length;
+			buffer = g_realloc(buffer, buffer_size);
+		}
+		memcpy(buffer, shared->buffer, packet.length);
+		packet.data = (rtp_header *)buffer;
+		janus_streaming_shared_packet_unref(shared);
+		janus_mutex_lock_nodebug(&partition->mutex);
+		g_list_foreach(partition->listeners, janus_streaming_relay_rtp_packet, &packet);
+		janus_mutex_unlock_nodebug(&partition->mutex);
+		worker->packets++;
+		g_atomic_int_dec_and_test(&mp->pending);
+	}
+	g_free(buffer);
+	JANUS_LOG(LOG_VERB, "Leaving Streaming relay thread #%u\n", worker->id);
+	return NULL;
+}
+
 static void janus_streaming_relay_rtp_packet(gpointer data, gpointer user_data) {
 	janus_streaming_rtp_relay_packet *packet = (janus_streaming_rtp_relay_packet *)user_data;
 	if(!packet || !packet->data || packet->length < 1) {
@@ -4513,10 +5047,22 @@ static void janus_streaming_relay_rtp_packet(gpointer data, gpointer user_data)
 		//~ JANUS_LOG(LOG_ERR, "Invalid session...\n");
 		return;
 	}
-	if(!packet->is_keyframe && (!session->started || session->paused)) {
+	if(!packet->is_keyframe && !packet->is_replay && (!session->started || session->paused)) {
 		//~ JANUS_LOG(LOG_ERR, "Streaming not started yet for this session...\n");
 		return;
 	}
+	if(packet->is_replay && session->paused) {
+		/* The viewer paused while we were sending the cached GOP */
+		return;
+	}
+	if(packet->is_rtp && packet->is_video && !packet->is_replay && g_atomic_int_get(&session->handover) &&
+			packet->substream == session->handover_substream) {
+		/* The GOP replay sent this viewer the cached packets up to a certain sequence
+		 * number already: skip those the relay threads had queued in the meanwhile */
+		if((int16_t)(packet->seq_number - session->handover_seq) <= 0)
+			return;
+		g_atomic_int_set(&session->handover, 0);
+	}
 
 	if(packet->is_rtp) {
 		/* Make sure there hasn't been a publisher switch by checking the SSRC */
@@ -126,6 +126,13 @@ rec_dir = <folder where recordings should be stored, when enabled>
  * include the correct \c admin_key value in an "admin_key" property
  * will succeed, and will be rejected otherwise.
  * 
+ * By default, packets coming from a publisher are relayed to all its
+ * viewers by the thread that received them. For rooms with large
+ * audiences (e.g., webinars), you can configure a pool of \c relay_workers
+ * in the plugin settings instead: publishers with at least \c relay_threshold
+ * viewers will have their viewers split among the workers, which will
+ * relay the packets to them in parallel.
+ * 
  * Actual API docs: TBD.
  * 
  * \ingroup plugins
@@ -147,6 +154,7 @@ rec_dir = <folder where recordings should be stored, when enabled>
 #include "../utils.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <time.h>
 
 
 /* Plugin information */
@@ -172,6 +180,7 @@ void janus_videoroom_create_session(janus_plugin_session *handle, int *error);
 struct janus_plugin_result *janus_videoroom_handle_message(janus_plugin_session *handle, char *transaction, json_t *message, json_t *jsep);
 void janus_videoroom_setup_media(janus_plugin_session *handle);
 void janus_videoroom_incoming_rtp(janus_plugin_session *handle, int video, char *buf, int len);
+void janus_videoroom_incoming_rtp_batch(janus_plugin_session *handle, int video, char **bufs, int *lens, int count);
 void janus_videoroom_incoming_rtcp(janus_plugin_session *handle, int video, char *buf, int len);
 void janus_videoroom_incoming_data(janus_plugin_session *handle, char *buf, int len);
 void janus_videoroom_slow_link(janus_plugin_session *handle, int uplink, int video);
@@ -197,6 +206,7 @@ static janus_plugin janus_videoroom_plugin =
 		.handle_message = janus_videoroom_handle_message,
 		.setup_media = janus_videoroom_setup_media,
 		.incoming_rtp = janus_videoroom_incoming_rtp,
+		.incoming_rtp_batch = janus_videoroom_incoming_rtp_batch,
 		.incoming_rtcp = janus_videoroom_incoming_rtcp,
 		.incoming_data = janus_videoroom_incoming_data,
 		.slow_link = janus_videoroom_slow_link,
@@ -581,6 +591,8 @@ typedef struct janus_videoroom_participant {
 	janus_mutex rtp_forwarders_mutex;
 	int udp_sock; /* The udp socket on which to forward rtp packets */
 	gboolean kicked;	/* Whether this participant has been kicked */
+	gboolean relay_sharded;	/* Whether packets from this publisher are relayed by the relay workers */
+	struct janus_videoroom_relay_shard **relay_shards;	/* Listeners of this publisher for each relay worker */
 } janus_videoroom_participant;
 static void janus_videoroom_participant_free(janus_videoroom_participant *p);
 static void janus_videoroom_rtp_forwarder_free_helper(gpointer data);
@@ -593,6 +605,7 @@ typedef struct janus_videoroom_listener {
 	janus_videoroom_participant *feed;	/* Participant this listener is subscribed to */
 	guint32 pvt_id;		/* Private ID of the participant that is subscribing (if available/provided) */
 	janus_rtp_switching_context context;	/* Needed in case there are publisher switches on this listener */
+	guint relay_shard;		/* Which relay worker handles this listener, when the publisher is sharded */
 	int substream;			/* Which VP8 simulcast substream we should forward, in case the publisher is simulcasting */
 	int substream_target;	/* As above, but to handle transitions (e.g., wait for keyframe) */
 	int templayer;			/* Which VP8 simulcast temporal layer we should forward, in case the publisher is simulcasting */
@@ -618,6 +631,8 @@ typedef struct janus_videoroom_rtp_relay_packet {
 	uint32_t ssrc[3];
 	uint32_t timestamp;
 	uint16_t seq_number;
+	/* Copy of the packet shared by all listeners, if any */
+	janus_plugin_rtp_shared *shared;
 	/* The following are only relevant if we're doing VP9 SVC*/
 	gboolean svc;
 	int spatial_layer;
@@ -625,6 +640,232 @@ typedef struct janus_videoroom_rtp_relay_packet {
 	uint8_t pbit, dbit, ubit, bbit, ebit;
 } janus_videoroom_rtp_relay_packet;
 
+/* Relay workers: when configured, publishers with many listeners don't relay
+ * packets to all of them on their own thread, but split their listeners in
+ * shards and have a worker thread per shard relay the packets in parallel.
+ * A listener always belongs to the same shard, which preserves the order of
+ * the packets it gets, and each worker has a bounded queue: if a worker is
+ * lagging behind, packets for its shard are dropped rather than queued */
+#define JANUS_VIDEOROOM_RELAY_MAX_WORKERS	32
+#define JANUS_VIDEOROOM_RELAY_DEFAULT_THRESHOLD	50
+#define JANUS_VIDEOROOM_RELAY_DEFAULT_QUEUE	256
+typedef struct janus_videoroom_relay_item {
+	janus_videoroom_rtp_relay_packet packet;
+	janus_plugin_rtp_shared *buffer;	/* Copy of the packet this job owns a reference to */
+} janus_videoroom_relay_item;
+/* Listeners of a publisher served by the same worker: the list is only rebuilt when
+ * subscriptions change, and jobs hold a reference to the version they were queued with */
+typedef struct janus_videoroom_relay_shard {
+	volatile gint ref;
+	GSList *listeners;
+} janus_videoroom_relay_shard;
+/* Used to wait for a worker to be done with what was queued so far */
+typedef struct janus_videoroom_relay_barrier {
+	volatile gint ref;
+	gboolean done;
+	janus_mutex mutex;
+	janus_condition cond;
+} janus_videoroom_relay_barrier;
+typedef struct janus_videoroom_relay_job {
+	janus_videoroom_relay_shard *shard;	/* Listeners to relay the packets to */
+	janus_videoroom_relay_barrier *barrier;	/* If set, this job only signals the barrier */
+	guint count;		/* How many packets this job contains */
+	janus_videoroom_relay_item items[];
+} janus_videoroom_relay_job;
+static janus_videoroom_relay_job relay_exit_job;
+typedef struct janus_videoroom_relay_worker {
+	guint id;
+	GThread *thread;
+	GAsyncQueue *jobs;
+	volatile gint dropped;
+} janus_videoroom_relay_worker;
+static janus_videoroom_relay_worker *relay_workers = NULL;
+static guint relay_workers_num = 0;
+static guint relay_threshold = JANUS_VIDEOROOM_RELAY_DEFAULT_THRESHOLD;
+static guint relay_queue_size = JANUS_VIDEOROOM_RELAY_DEFAULT_QUEUE;
+static volatile gint relay_shard_next = 0;
+/* Maximum number of packets from a batch we relay (and queue to workers) in one go */
+#define JANUS_VIDEOROOM_BATCH_MAX	32
+
+static void janus_videoroom_relay_shard_unref(janus_videoroom_relay_shard *shard) {
+	if(shard != NULL && g_atomic_int_dec_and_test(&shard->ref)) {
+		g_slist_free(shard->listeners);
+		g_free(shard);
+	}
+}
+
+static void janus_videoroom_relay_barrier_unref(janus_videoroom_relay_barrier *barrier) {
+	if(barrier != NULL && g_atomic_int_dec_and_test(&barrier->ref)) {
+		janus_mutex_destroy(&barrier->mutex);
+		janus_condition_destroy(&barrier->cond);
+		g_free(barrier);
+	}
+}
+
+static void janus_videoroom_relay_job_free(janus_videoroom_relay_job *job) {
+	if(!job || job == &relay_exit_job)
+		return;
+	guint i = 0;
+	for(i=0; i<job->count; i++) {
+		if(job->items[i].buffer != NULL)
+			gateway->rtp_shared_unref(job->items[i].buffer);
+	}
+	janus_videoroom_relay_shard_unref(job->shard);
+	janus_videoroom_relay_barrier_unref(job->barrier);
+	g_free(job);
+}
+
+/* Helper to rebuild the per-worker lists of listeners of a publisher: this only needs
+ * to happen when a listener subscribes, unsubscribes or switches, rather than for each
+ * packet. Must be called with the listeners mutex locked */
+static void janus_videoroom_relay_shards_update(janus_videoroom_participant *participant) {
+	if(relay_workers == NULL)
+		return;
+	if(participant->relay_shards == NULL)
+		participant->relay_shards = g_malloc0(relay_workers_num * sizeof(janus_videoroom_relay_shard *));
+	GSList *lists[JANUS_VIDEOROOM_RELAY_MAX_WORKERS];
+	memset(lists, 0, sizeof(lists));
+	GSList *l = participant->listeners;
+	while(l != NULL) {
+		janus_videoroom_listener *listener = (janus_videoroom_listener *)l->data;
+		if(listener != NULL)
+			lists[listener->relay_shard % relay_workers_num] = g_slist_prepend(lists[listener->relay_shard % relay_workers_num], listener);
+		l = l->next;
+	}
+	guint w = 0;
+	for(w=0; w<relay_workers_num; w++) {
+		janus_videoroom_relay_shard *shard = NULL;
+		if(lists[w] != NULL) {
+			shard = g_malloc(sizeof(janus_videoroom_relay_shard));
+			shard->ref = 1;
+			shard->listeners = g_slist_reverse(lists[w]);
+		}
+		/* Jobs that are already queued keep on using the previous version */
+		janus_videoroom_relay_shard_unref(participant->relay_shards[w]);
+		participant->relay_shards[w] = shard;
+	}
+}
+
+/* Helper to wait until the worker serving a listener has relayed all the packets queued so far:
+ * used before a listener switches publisher or is freed, so that no worker is still using it */
+static void janus_videoroom_relay_flush(janus_videoroom_listener *listener) {
+	if(relay_workers == NULL || listener == NULL || g_atomic_int_get(&stopping))
+		return;
+	janus_videoroom_relay_worker *worker = &relay_workers[listener->relay_shard % relay_workers_num];
+	janus_videoroom_relay_barrier *barrier = g_malloc0(sizeof(janus_videoroom_relay_barrier));
+	barrier->ref = 2;	/* One for us, one for the job */
+	janus_mutex_init(&barrier->mutex);
+	janus_condition_init(&barrier->cond);
+	janus_videoroom_relay_job *job = g_malloc0(sizeof(janus_videoroom_relay_job));
+	job->barrier = barrier;
+	g_async_queue_push(worker->jobs, job);
+	janus_mutex_lock(&barrier->mutex);
+	while(!barrier->done && !g_atomic_int_get(&stopping)) {
+		/* Wake up once in a while, in case the worker is leaving */
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec++;
+		janus_condition_timedwait(&barrier->cond, &barrier->mutex, &ts);
+	}
+	janus_mutex_unlock(&barrier->mutex);
+	janus_videoroom_relay_barrier_unref(barrier);
+}
+
+static void *janus_videoroom_relay_thread(void *data) {
+	janus_videoroom_relay_worker *worker = (janus_videoroom_relay_worker *)data;
+	JANUS_LOG(LOG_VERB, "Joining VideoRoom relay worker #%u\n", worker->id);
+	janus_videoroom_relay_job *job = NULL;
+	guint i = 0;
+	while(g_atomic_int_get(&initialized) && !g_atomic_int_get(&stopping)) {
+		job = g_async_queue_pop(worker->jobs);
+		if(job == NULL)
+			continue;
+		if(job == &relay_exit_job)
+			break;
+		if(job->barrier != NULL) {
+			/* Somebody's waiting for us to get here */
+			janus_mutex_lock(&job->barrier->mutex);
+			job->barrier->done = TRUE;
+			janus_condition_signal(&job->barrier->cond);
+			janus_mutex_unlock(&job->barrier->mutex);
+		}
+		for(i=0; i<job->count; i++)
+			g_slist_foreach(job->shard->listeners, janus_videoroom_relay_rtp_packet, &job->items[i].packet);
+		janus_videoroom_relay_job_free(job);
+	}
+	JANUS_LOG(LOG_VERB, "Leaving VideoRoom relay worker #%u\n", worker->id);
+	return NULL;
+}
+
+/* Helper to hand one or more packets to the relay workers, rather than relaying them to
+ * all the listeners ourselves: each worker gets a single job for all the packets. Returns
+ * FALSE if the publisher doesn't have enough listeners for that to be worth it. Must be
+ * called with the listeners mutex locked */
+static gboolean janus_videoroom_relay_rtp_sharded(janus_videoroom_participant *participant,
+		janus_videoroom_rtp_relay_packet *packets, char **bufs, int *lens, int count) {
+	if(relay_workers == NULL || participant->listeners == NULL || count < 1)
+		return FALSE;
+	if(!participant->relay_sharded) {
+		/* Only start sharding when the audience is large enough: once we did, we keep
+		 * on doing it, or the same listener may end up being served by two threads */
+		guint num = 0;
+		GSList *l = participant->listeners;
+		while(l != NULL && num < relay_threshold) {
+			num++;
+			l = l->next;
+		}
+		if(num < relay_threshold)
+			return FALSE;
+		JANUS_LOG(LOG_VERB, "Publisher %"SCNu64" has at least %u listeners, relaying via workers\n",
+			participant->user_id, relay_threshold);
+		participant->relay_sharded = TRUE;
+	}
+	if(participant->relay_shards == NULL)
+		janus_videoroom_relay_shards_update(participant);
+	/* Simulcast changes the payload for each listener, so in that case each
+	 * shard gets its own copy of the packet, while otherwise they share one */
+	janus_plugin_rtp_shared *shared[JANUS_VIDEOROOM_BATCH_MAX];
+	int i = 0;
+	for(i=0; i<count; i++)
+		shared[i] = (packets[i].ssrc[0] != 0) ? NULL : gateway->rtp_shared_new(bufs[i], lens[i]);
+	guint w = 0;
+	for(w=0; w<relay_workers_num; w++) {
+		janus_videoroom_relay_shard *shard = participant->relay_shards[w];
+		if(shard == NULL)
+			continue;
+		janus_videoroom_relay_worker *worker = &relay_workers[w];
+		if(g_async_queue_length(worker->jobs) >= (gint)relay_queue_size) {
+			/* This worker is lagging behind, drop the packets for the listeners in its shard */
+			g_atomic_int_add(&worker->dropped, count);
+			JANUS_LOG(LOG_HUGE, "Relay worker #%u queue is full, dropping %d packets\n", worker->id, count);
+			continue;
+		}
+		janus_videoroom_relay_job *job = g_malloc(sizeof(janus_videoroom_relay_job) + count*sizeof(janus_videoroom_relay_item));
+		g_atomic_int_inc(&shard->ref);
+		job->shard = shard;
+		job->barrier = NULL;
+		job->count = count;
+		for(i=0; i<count; i++) {
+			janus_videoroom_relay_item *item = &job->items[i];
+			item->packet = packets[i];
+			if(shared[i] == NULL) {
+				item->buffer = gateway->rtp_shared_new(bufs[i], lens[i]);
+				item->packet.shared = NULL;
+			} else {
+				gateway->rtp_shared_ref(shared[i]);
+				item->buffer = shared[i];
+				item->packet.shared = shared[i];
+			}
+			item->packet.data = (rtp_header *)item->buffer->buffer;
+		}
+		g_async_queue_push(worker->jobs, job);
+	}
+	for(i=0; i<count; i++) {
+		if(shared[i] != NULL)
+			gateway->rtp_shared_unref(shared[i]);
+	}
+	return TRUE;
+}
 
 /* Error codes */
 #define JANUS_VIDEOROOM_ERROR_UNKNOWN_ERROR		499
@@ -818,6 +1059,35 @@ int janus_videoroom_init(janus_callbacks *callback, const char *config_path) {
 		if(!notify_events && callback->events_is_enabled()) {
 			JANUS_LOG(LOG_WARN, "Notification of events to handlers disabled for %s\n", JANUS_VIDEOROOM_NAME);
 		}
+		/* Should we relay packets from publishers with large audiences in parallel? */
+		janus_config_item *item = janus_config_get_item_drilldown(config, "general", "relay_workers");
+		if(item != NULL && item->value != NULL) {
+			int workers = atoi(item->value);
+			if(workers < 0) {
+				JANUS_LOG(LOG_WARN, "Invalid relay_workers value, not using relay workers\n");
+				workers = 0;
+			} else if(workers > JANUS_VIDEOROOM_RELAY_MAX_WORKERS) {
+				JANUS_LOG(LOG_WARN, "Too many relay workers, using %d\n", JANUS_VIDEOROOM_RELAY_MAX_WORKERS);
+				workers = JANUS_VIDEOROOM_RELAY_MAX_WORKERS;
+			}
+			relay_workers_num = workers;
+		}
+		item = janus_config_get_item_drilldown(config, "general", "relay_threshold");
+		if(item != NULL && item->value != NULL) {
+			if(atoi(item->value) > 0) {
+				relay_threshold = atoi(item->value);
+			} else {
+				JANUS_LOG(LOG_WARN, "Invalid relay_threshold value, using default: %u\n", relay_threshold);
+			}
+		}
+		item = janus_config_get_item_drilldown(config, "general", "relay_queue");
+		if(item != NULL && item->value != NULL) {
+			if(atoi(item->value) > 0) {
+				relay_queue_size = atoi(item->value);
+			} else {
+				JANUS_LOG(LOG_WARN, "Invalid relay_queue value, using default: %u\n", relay_queue_size);
+			}
+		}
 		/* Iterate on all rooms */
 		GList *cl = janus_config_get_categories(config);
 		while(cl != NULL) {
@@ -1009,6 +1279,28 @@ int janus_videoroom_init(janus_callbacks *callback, const char *config_path) {
 		janus_config_destroy(config);
 		return -1;
 	}
+	/* Launch the relay workers, if needed */
+	if(relay_workers_num > 0) {
+		relay_workers = g_malloc0(relay_workers_num * sizeof(janus_videoroom_relay_worker));
+		guint i = 0;
+		for(i=0; i<relay_workers_num; i++) {
+			janus_videoroom_relay_worker *worker = &relay_workers[i];
+			worker->id = i+1;
+			worker->jobs = g_async_queue_new_full((GDestroyNotify) janus_videoroom_relay_job_free);
+			char tname[16];
+			g_snprintf(tname, sizeof(tname), "vroom relay %u", worker->id);
+			worker->thread = g_thread_try_new(tname, janus_videoroom_relay_thread, worker, &error);
+			if(error != NULL) {
+				g_atomic_int_set(&initialized, 0);
+				JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the VideoRoom relay worker #%u...\n",
+					error->code, error->message ? error->message : "??", worker->id);
+				janus_config_destroy(config);
+				return -1;
+			}
+		}
+		JANUS_LOG(LOG_INFO, "Using %u relay workers for publishers with at least %u listeners (queue: %u packets)\n",
+			relay_workers_num, relay_threshold, relay_queue_size);
+	}
 	JANUS_LOG(LOG_INFO, "%s initialized!\n", JANUS_VIDEOROOM_NAME);
 	return 0;
 }
@@ -1027,6 +1319,21 @@ void janus_videoroom_destroy(void) {
 		g_thread_join(watchdog);
 		watchdog = NULL;
 	}
+	if(relay_workers != NULL) {
+		guint i = 0;
+		for(i=0; i<relay_workers_num; i++) {
+			janus_videoroom_relay_worker *worker = &relay_workers[i];
+			g_async_queue_push(worker->jobs, &relay_exit_job);
+			if(worker->thread != NULL) {
+				g_thread_join(worker->thread);
+				worker->thread = NULL;
+			}
+			g_async_queue_unref(worker->jobs);
+			worker->jobs = NULL;
+		}
+		g_free(relay_workers);
+		relay_workers = NULL;
+	}
 
 	/* FIXME We should destroy the sessions cleanly */
 	janus_mutex_lock(&sessions_mutex);
@@ -2557,17 +2864,11 @@ void janus_videoroom_setup_media(janus_plugin_session *handle) {
 	}
 }
 
-void janus_videoroom_incoming_rtp(janus_plugin_session *handle, int video, char *buf, int len) {
-	if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized) || !gateway)
-		return;
-	janus_videoroom_session *session = (janus_videoroom_session *)handle->plugin_handle;
-	if(!session || session->destroyed || !session->participant || session->participant_type != janus_videoroom_p_type_publisher)
-		return;
-	janus_videoroom_participant *participant = (janus_videoroom_participant *)session->participant;
+/* Helper to process an RTP packet from a publisher (talk detection, forwarders and
+ * recording), and prepare it for relaying: returns FALSE if it must not be relayed */
+static gboolean janus_videoroom_incoming_rtp_prepare(janus_videoroom_participant *participant,
+		int video, char *buf, int len, janus_videoroom_rtp_relay_packet *packet) {
 	janus_videoroom *videoroom = participant->room;
-
-	if(participant->kicked)
-		return;
 	/* In case this is an audio packet and we're doing talk detection, check the audio level extension */
 	if(!video && videoroom->audiolevel_event && participant->audio_active) {
 		int level = 0;
@@ -2606,148 +2907,221 @@ void janus_videoroom_incoming_rtp(janus_plugin_session *handle, int video, char
 						json_object_set_new(info, "videoroom", json_string(participant->talking ? "talking" : "stopped-talking"));
 						json_object_set_new(info, "room", json_integer(participant->room->room_id));
 						json_object_set_new(info, "id", json_integer(participant->user_id));
-						gateway->notify_event(&janus_videoroom_plugin, session->handle, info);
+						gateway->notify_event(&janus_videoroom_plugin, participant->session->handle, info);
 					}
 				}
 			}
 		}
 	}
 
-	if((!video && participant->audio_active) || (video && participant->video_active)) {
-		rtp_header *rtp = (rtp_header *)buf;
+	if((!video && !participant->audio_active) || (video && !participant->video_active))
+		return FALSE;
+	rtp_header *rtp = (rtp_header *)buf;
+	uint32_t ssrc = ntohl(rtp->ssrc);
+	int sc = -1;
+	/* Check if we're simulcasting, and if so, keep track of the "layer" */
+	if(video && participant->ssrc[0] != 0) {
+		if(ssrc == participant->ssrc[0])
+			sc = 0;
+		else if(ssrc == participant->ssrc[1])
+			sc = 1;
+		else if(ssrc == participant->ssrc[2])
+			sc = 2;
+	} else {
+		/* Set the SSRC of the publisher */
+		rtp->ssrc = htonl(video ? participant->video_ssrc : participant->audio_ssrc);
+	}
+	/* Set the payload type of the publisher */
+	rtp->type = video ? participant->video_pt : participant->audio_pt;
+	/* Forward RTP to the appropriate port for the rtp_forwarders associated with this publisher, if there are any */
+	janus_mutex_lock(&participant->rtp_forwarders_mutex);
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, participant->rtp_forwarders);
+	while(participant->udp_sock > 0 && g_hash_table_iter_next(&iter, NULL, &value)) {
+		janus_videoroom_rtp_forwarder* rtp_forward = (janus_videoroom_rtp_forwarder*)value;
+		/* Check if payload type and/or SSRC need to be overwritten for this forwarder */
+		int pt = rtp->type;
 		uint32_t ssrc = ntohl(rtp->ssrc);
-		int sc = -1;
-		/* Check if we're simulcasting, and if so, keep track of the "layer" */
-		if(video && participant->ssrc[0] != 0) {
-			if(ssrc == participant->ssrc[0])
-				sc = 0;
-			else if(ssrc == participant->ssrc[1])
-				sc = 1;
-			else if(ssrc == participant->ssrc[2])
-				sc = 2;
-		} else {
-			/* Set the SSRC of the publisher */
-			rtp->ssrc = htonl(video ? participant->video_ssrc : participant->audio_ssrc);
-		}
-		/* Set the payload type of the publisher */
-		rtp->type = video ? participant->video_pt : participant->audio_pt;
-		/* Forward RTP to the appropriate port for the rtp_forwarders associated with this publisher, if there are any */
-		janus_mutex_lock(&participant->rtp_forwarders_mutex);
-		GHashTableIter iter;
-		gpointer value;
-		g_hash_table_iter_init(&iter, participant->rtp_forwarders);
-		while(participant->udp_sock > 0 && g_hash_table_iter_next(&iter, NULL, &value)) {
-			janus_videoroom_rtp_forwarder* rtp_forward = (janus_videoroom_rtp_forwarder*)value;
-			/* Check if payload type and/or SSRC need to be overwritten for this forwarder */
-			int pt = rtp->type;
-			uint32_t ssrc = ntohl(rtp->ssrc);
-			if(rtp_forward->payload_type > 0)
-				rtp->type = rtp_forward->payload_type;
-			if(rtp_forward->ssrc > 0)
-				rtp->ssrc = htonl(rtp_forward->ssrc);
-			if(video && rtp_forward->is_video && rtp_forward->substream == sc) {
-				if(sendto(participant->udp_sock, buf, len, 0, (struct sockaddr*)&rtp_forward->serv_addr, sizeof(rtp_forward->serv_addr)) < 0) {
-					JANUS_LOG(LOG_HUGE, "Error forwarding RTP video packet for %s... %s (len=%d)...\n",
-						participant->display, strerror(errno), len);
-				}
-			} else if(!video && !rtp_forward->is_video && !rtp_forward->is_data) {
-				if(sendto(participant->udp_sock, buf, len, 0, (struct sockaddr*)&rtp_forward->serv_addr, sizeof(rtp_forward->serv_addr)) < 0) {
-					JANUS_LOG(LOG_HUGE, "Error forwarding RTP audio packet for %s... %s (len=%d)...\n",
-						participant->display, strerror(errno), len);
-				}
+		if(rtp_forward->payload_type > 0)
+			rtp->type = rtp_forward->payload_type;
+		if(rtp_forward->ssrc > 0)
+			rtp->ssrc = htonl(rtp_forward->ssrc);
+		if(video && rtp_forward->is_video && rtp_forward->substream == sc) {
+			if(sendto(participant->udp_sock, buf, len, 0, (struct sockaddr*)&rtp_forward->serv_addr, sizeof(rtp_forward->serv_addr)) < 0) {
+				JANUS_LOG(LOG_HUGE, "Error forwarding RTP video packet for %s... %s (len=%d)...\n",
+					participant->display, strerror(errno), len);
+			}
+		} else if(!video && !rtp_forward->is_video && !rtp_forward->is_data) {
+			if(sendto(participant->udp_sock, buf, len, 0, (struct sockaddr*)&rtp_forward->serv_addr, sizeof(rtp_forward->serv_addr)) < 0) {
+				JANUS_LOG(LOG_HUGE, "Error forwarding RTP audio packet for %s... %s (len=%d)...\n",
+					participant->display, strerror(errno), len);
 			}
-			/* Restore original values of payload type and SSRC before going on */
-			rtp->type = pt;
-			rtp->ssrc = htonl(ssrc);
-		}
-		janus_mutex_unlock(&participant->rtp_forwarders_mutex);
-		if(sc < 1) {
-			/* Save the frame if we're recording
-			 * FIXME: for video, we're currently only recording the base substream, when simulcasting */
-			janus_recorder_save_frame(video ? participant->vrc : participant->arc, buf, len);
 		}
-		/* Done, relay it */
-		janus_videoroom_rtp_relay_packet packet;
-		packet.data = rtp;
-		packet.length = len;
-		packet.is_video = video;
-		packet.svc = FALSE;
-		if(video && videoroom->do_svc) {
-			/* We're doing SVC: let's parse this packet to see which layers are there */
-			int plen = 0;
-			char *payload = janus_rtp_payload(buf, len, &plen);
-			if(payload == NULL)
-				return;
-			uint8_t pbit = 0, dbit = 0, ubit = 0, bbit = 0, ebit = 0;
-			int found = 0, spatial_layer = 0, temporal_layer = 0;
-			if(janus_vp9_parse_svc(payload, plen, &found, &spatial_layer, &temporal_layer, &pbit, &dbit, &ubit, &bbit, &ebit) == 0) {
-				if(found) {
-					packet.svc = TRUE;
-					packet.spatial_layer = spatial_layer;
-					packet.temporal_layer = temporal_layer;
-					packet.pbit = pbit;
-					packet.dbit = dbit;
-					packet.ubit = ubit;
-					packet.bbit = bbit;
-					packet.ebit = ebit;
-				}
+		/* Restore original values of payload type and SSRC before going on */
+		rtp->type = pt;
+		rtp->ssrc = htonl(ssrc);
+	}
+	janus_mutex_unlock(&participant->rtp_forwarders_mutex);
+	if(sc < 1) {
+		/* Save the frame if we're recording
+		 * FIXME: for video, we're currently only recording the base substream, when simulcasting */
+		janus_recorder_save_frame(video ? participant->vrc : participant->arc, buf, len);
+	}
+	/* Done, prepare it for relaying */
+	packet->data = rtp;
+	packet->length = len;
+	packet->is_video = video;
+	packet->svc = FALSE;
+	if(video && videoroom->do_svc) {
+		/* We're doing SVC: let's parse this packet to see which layers are there */
+		int plen = 0;
+		char *payload = janus_rtp_payload(buf, len, &plen);
+		if(payload == NULL)
+			return FALSE;
+		uint8_t pbit = 0, dbit = 0, ubit = 0, bbit = 0, ebit = 0;
+		int found = 0, spatial_layer = 0, temporal_layer = 0;
+		if(janus_vp9_parse_svc(payload, plen, &found, &spatial_layer, &temporal_layer, &pbit, &dbit, &ubit, &bbit, &ebit) == 0) {
+			if(found) {
+				packet->svc = TRUE;
+				packet->spatial_layer = spatial_layer;
+				packet->temporal_layer = temporal_layer;
+				packet->pbit = pbit;
+				packet->dbit = dbit;
+				packet->ubit = ubit;
+				packet->bbit = bbit;
+				packet->ebit = ebit;
 			}
 		}
-		packet.ssrc[0] = (sc != -1 ? participant->ssrc[0] : 0);
-		packet.ssrc[1] = (sc != -1 ? participant->ssrc[1] : 0);
-		packet.ssrc[2] = (sc != -1 ? participant->ssrc[2] : 0);
-		/* Backup the actual timestamp and sequence number set by the publisher, in case switching is involved */
-		packet.timestamp = ntohl(packet.data->timestamp);
-		packet.seq_number = ntohs(packet.data->seq_number);
-		/* Go: some viewers may decide to drop the packet, but that's up to them */
-		janus_mutex_lock_nodebug(&participant->listeners_mutex);
-		g_slist_foreach(participant->listeners, janus_videoroom_relay_rtp_packet, &packet);
-		janus_mutex_unlock_nodebug(&participant->listeners_mutex);
-		
-		/* Check if we need to send any REMB, FIR or PLI back to this publisher */
-		if(video && participant->video_active) {
-			/* Did we send a REMB already, or is it time to send one? */
-			gboolean send_remb = FALSE;
-			if(participant->remb_latest == 0 && participant->remb_startup > 0) {
-				/* Still in the starting phase, send the ramp-up REMB feedback */
-				send_remb = TRUE;
-			} else if(participant->remb_latest > 0 && janus_get_monotonic_time()-participant->remb_latest >= 5*G_USEC_PER_SEC) {
-				/* 5 seconds have passed since the last REMB, send a new one */
-				send_remb = TRUE;
-			}		
-			if(send_remb) {
-				/* We send a few incremental REMB messages at startup */
-				uint32_t bitrate = (participant->bitrate ? participant->bitrate : 256*1024);
-				if(participant->remb_startup > 0) {
-					bitrate = bitrate/participant->remb_startup;
-					participant->remb_startup--;
-				}
-				JANUS_LOG(LOG_VERB, "Sending REMB (%s, %"SCNu32")\n", participant->display, bitrate);
-				char rtcpbuf[24];
-				janus_rtcp_remb((char *)(&rtcpbuf), 24, bitrate);
-				gateway->relay_rtcp(handle, video, rtcpbuf, 24);
-				if(participant->remb_startup == 0)
-					participant->remb_latest = janus_get_monotonic_time();
+	}
+	packet->ssrc[0] = (sc != -1 ? participant->ssrc[0] : 0);
+	packet->ssrc[1] = (sc != -1 ? participant->ssrc[1] : 0);
+	packet->ssrc[2] = (sc != -1 ? participant->ssrc[2] : 0);
+	/* Backup the actual timestamp and sequence number set by the publisher, in case switching is involved */
+	packet->timestamp = ntohl(packet->data->timestamp);
+	packet->seq_number = ntohs(packet->data->seq_number);
+	packet->shared = NULL;
+	return TRUE;
+}
+
+/* Helper to relay one or more prepared packets to all the listeners of a publisher:
+ * the listeners mutex is only locked once, however many packets there are */
+static void janus_videoroom_relay_rtp_batch(janus_videoroom_participant *participant,
+		janus_videoroom_rtp_relay_packet *packets, char **bufs, int *lens, int count) {
+	/* Go: some viewers may decide to drop the packets, but that's up to them */
+	janus_mutex_lock_nodebug(&participant->listeners_mutex);
+	if(!janus_videoroom_relay_rtp_sharded(participant, packets, bufs, lens, count)) {
+		int i = 0;
+		for(i=0; i<count; i++) {
+			janus_videoroom_rtp_relay_packet *packet = &packets[i];
+			if(packet->ssrc[0] == 0 && participant->listeners != NULL && participant->listeners->next != NULL) {
+				/* More than one listener and no simulcast (which changes the payload for each
+				 * listener): have them all share the same copy of the packet, rather than
+				 * having the core copy it for each of them */
+				packet->shared = gateway->rtp_shared_new(bufs[i], lens[i]);
 			}
-			/* Generate FIR/PLI too, if needed */
-			if(video && participant->video_active && (participant->room->fir_freq > 0)) {
-				/* FIXME Very ugly hack to generate RTCP every tot seconds/frames */
-				gint64 now = janus_get_monotonic_time();
-				if((now-participant->fir_latest) >= ((gint64)participant->room->fir_freq*G_USEC_PER_SEC)) {
-					/* FIXME We send a FIR every tot seconds */
-					participant->fir_latest = now;
-					char rtcpbuf[24];
-					janus_rtcp_fir((char *)&rtcpbuf, 20, &participant->fir_seq);
-					JANUS_LOG(LOG_VERB, "Sending FIR to %"SCNu64" (%s)\n", participant->user_id, participant->display ? participant->display : "??");
-					gateway->relay_rtcp(handle, video, rtcpbuf, 20);
-					/* Send a PLI too, just in case... */
-					janus_rtcp_pli((char *)&rtcpbuf, 12);
-					JANUS_LOG(LOG_VERB, "Sending PLI to %"SCNu64" (%s)\n", participant->user_id, participant->display ? participant->display : "??");
-					gateway->relay_rtcp(handle, video, rtcpbuf, 12);
-				}
+			g_slist_foreach(participant->listeners, janus_videoroom_relay_rtp_packet, packet);
+			if(packet->shared != NULL) {
+				gateway->rtp_shared_unref(packet->shared);
+				packet->shared = NULL;
 			}
 		}
 	}
+	janus_mutex_unlock_nodebug(&participant->listeners_mutex);
+}
+
+/* Helper to check if we need to send any REMB, FIR or PLI back to a publisher */
+static void janus_videoroom_incoming_rtp_feedback(janus_plugin_session *handle, janus_videoroom_participant *participant) {
+	if(!participant->video_active)
+		return;
+	/* Did we send a REMB already, or is it time to send one? */
+	gboolean send_remb = FALSE;
+	if(participant->remb_latest == 0 && participant->remb_startup > 0) {
+		/* Still in the starting phase, send the ramp-up REMB feedback */
+		send_remb = TRUE;
+	} else if(participant->remb_latest > 0 && janus_get_monotonic_time()-participant->remb_latest >= 5*G_USEC_PER_SEC) {
+		/* 5 seconds have passed since the last REMB, send a new one */
+		send_remb = TRUE;
+	}		
+	if(send_remb) {
+		/* We send a few incremental REMB messages at startup */
+		uint32_t bitrate = (participant->bitrate ? participant->bitrate : 256*1024);
+		if(participant->remb_startup > 0) {
+			bitrate = bitrate/participant->remb_startup;
+			participant->remb_startup--;
+		}
+		JANUS_LOG(LOG_VERB, "Sending REMB (%s, %"SCNu32")\n", participant->display, bitrate);
+		char rtcpbuf[24];
+		janus_rtcp_remb((char *)(&rtcpbuf), 24, bitrate);
+		gateway->relay_rtcp(handle, 1, rtcpbuf, 24);
+		if(participant->remb_startup == 0)
+			participant->remb_latest = janus_get_monotonic_time();
+	}
+	/* Generate FIR/PLI too, if needed */
+	if(participant->room->fir_freq > 0) {
+		/* FIXME Very ugly hack to generate RTCP every tot seconds/frames */
+		gint64 now = janus_get_monotonic_time();
+		if((now-participant->fir_latest) >= ((gint64)participant->room->fir_freq*G_USEC_PER_SEC)) {
+			/* FIXME We send a FIR every tot seconds */
+			participant->fir_latest = now;
+			char rtcpbuf[24];
+			janus_rtcp_fir((char *)&rtcpbuf, 20, &participant->fir_seq);
+			JANUS_LOG(LOG_VERB, "Sending FIR to %"SCNu64" (%s)\n", participant->user_id, participant->display ? participant->display : "??");
+			gateway->relay_rtcp(handle, 1, rtcpbuf, 20);
+			/* Send a PLI too, just in case... */
+			janus_rtcp_pli((char *)&rtcpbuf, 12);
+			JANUS_LOG(LOG_VERB, "Sending PLI to %"SCNu64" (%s)\n", participant->user_id, participant->display ? participant->display : "??");
+			gateway->relay_rtcp(handle, 1, rtcpbuf, 12);
+		}
+	}
+}
+
+void janus_videoroom_incoming_rtp(janus_plugin_session *handle, int video, char *buf, int len) {
+	if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized) || !gateway)
+		return;
+	janus_videoroom_session *session = (janus_videoroom_session *)handle->plugin_handle;
+	if(!session || session->destroyed || !session->participant || session->participant_type != janus_videoroom_p_type_publisher)
+		return;
+	janus_videoroom_participant *participant = (janus_videoroom_participant *)session->participant;
+	if(participant->kicked)
+		return;
+	janus_videoroom_rtp_relay_packet packet;
+	if(!janus_videoroom_incoming_rtp_prepare(participant, video, buf, len, &packet))
+		return;
+	janus_videoroom_relay_rtp_batch(participant, &packet, &buf, &len, 1);
+	if(video)
+		janus_videoroom_incoming_rtp_feedback(handle, participant);
+}
+
+void janus_videoroom_incoming_rtp_batch(janus_plugin_session *handle, int video, char **bufs, int *lens, int count) {
+	if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized) || !gateway)
+		return;
+	janus_videoroom_session *session = (janus_videoroom_session *)handle->plugin_handle;
+	if(!session || session->destroyed || !session->participant || session->participant_type != janus_videoroom_p_type_publisher)
+		return;
+	janus_videoroom_participant *participant = (janus_videoroom_participant *)session->participant;
+	if(participant->kicked)
+		return;
+	/* Process all the packets first, and then relay those we can relay in a single go */
+	janus_videoroom_rtp_relay_packet packets[JANUS_VIDEOROOM_BATCH_MAX];
+	char *rbufs[JANUS_VIDEOROOM_BATCH_MAX];
+	int rlens[JANUS_VIDEOROOM_BATCH_MAX];
+	int i = 0, relayed = 0, ready = 0;
+	while(i < count) {
+		ready = 0;
+		for(; i<count && ready<JANUS_VIDEOROOM_BATCH_MAX; i++) {
+			if(!janus_videoroom_incoming_rtp_prepare(participant, video, bufs[i], lens[i], &packets[ready]))
+				continue;
+			rbufs[ready] = bufs[i];
+			rlens[ready] = lens[i];
+			ready++;
+		}
+		if(ready > 0)
+			janus_videoroom_relay_rtp_batch(participant, packets, rbufs, rlens, ready);
+		relayed += ready;
+	}
+	if(video && relayed > 0)
+		janus_videoroom_incoming_rtp_feedback(handle, participant);
 }
 
 void janus_videoroom_incoming_rtcp(janus_plugin_session *handle, int video, char *buf, int len) {
@@ -3013,6 +3387,7 @@ void janus_videoroom_hangup_media(janus_plugin_session *handle) {
 				l->feed = NULL;
 			}
 		}
+		janus_videoroom_relay_shards_update(participant);
 		janus_mutex_unlock(&participant->listeners_mutex);
 		janus_videoroom_leave_or_unpublish(participant, FALSE, FALSE);
 		/* Also notify event handlers */
@@ -3032,6 +3407,7 @@ void janus_videoroom_hangup_media(janus_plugin_session *handle) {
 			if(publisher != NULL) {
 				janus_mutex_lock(&publisher->listeners_mutex);
 				publisher->listeners = g_slist_remove(publisher->listeners, listener);
+				janus_videoroom_relay_shards_update(publisher);
 				janus_mutex_unlock(&publisher->listeners_mutex);
 				listener->feed = NULL;
 				if(listener->pvt_id > 0) {
@@ -3386,6 +3762,7 @@ static void *janus_videoroom_handler(void *data) {
 					listener->room = videoroom;
 					listener->feed = publisher;
 					listener->pvt_id = pvt_id;
+					listener->relay_shard = (guint)g_atomic_int_add(&relay_shard_next, 1);
 					/* Initialize the listener context */
 					janus_rtp_switching_context_reset(&listener->context);
 					listener->audio_offered = offer_audio ? json_is_true(offer_audio) : TRUE;	/* True by default */
@@ -3433,6 +3810,7 @@ static void *janus_videoroom_handler(void *data) {
 					}
 					janus_mutex_lock(&publisher->listeners_mutex);
 					publisher->listeners = g_slist_append(publisher->listeners, listener);
+					janus_videoroom_relay_shards_update(publisher);
 					janus_mutex_unlock(&publisher->listeners_mutex);
 					if(owner != NULL) {
 						janus_mutex_lock(&owner->listeners_mutex);
@@ -3908,9 +4286,13 @@ static void *janus_videoroom_handler(void *data) {
 				if(prev_feed) {
 					janus_mutex_lock(&prev_feed->listeners_mutex);
 					prev_feed->listeners = g_slist_remove(prev_feed->listeners, listener);
+					janus_videoroom_relay_shards_update(prev_feed);
 					janus_mutex_unlock(&prev_feed->listeners_mutex);
 					listener->feed = NULL;
 				}
+				/* Make sure no relay worker is still sending us packets from the previous publisher,
+				 * or they may end up interleaved with the new ones and break the switching context */
+				janus_videoroom_relay_flush(listener);
 				/* Subscribe to the new one */
 				listener->audio = audio ? json_is_true(audio) : TRUE;	/* True by default */
 				if(!publisher->audio)
@@ -3931,6 +4313,7 @@ static void *janus_videoroom_handler(void *data) {
 				}
 				janus_mutex_lock(&publisher->listeners_mutex);
 				publisher->listeners = g_slist_append(publisher->listeners, listener);
+				janus_videoroom_relay_shards_update(publisher);
 				janus_mutex_unlock(&publisher->listeners_mutex);
 				listener->feed = publisher;
 				/* Send a FIR to the new publisher */
@@ -3964,6 +4347,7 @@ static void *janus_videoroom_handler(void *data) {
 				if(publisher != NULL) {
 					janus_mutex_lock(&publisher->listeners_mutex);
 					publisher->listeners = g_slist_remove(publisher->listeners, listener);
+					janus_videoroom_relay_shards_update(publisher);
 					janus_mutex_unlock(&publisher->listeners_mutex);
 					listener->feed = NULL;
 				}
@@ -4308,6 +4692,36 @@ error:
 	return NULL;
 }
 
+/* Helper to send a packet to a listener, after fixing its sequence number and timestamp:
+ * if there's a shared copy of the packet, we only compute the header for this listener
+ * and let the core apply it when sending, otherwise we update the packet in place */
+static void janus_videoroom_relay_rtp_to_listener(janus_videoroom_session *session, janus_videoroom_listener *listener,
+		janus_videoroom_rtp_relay_packet *packet, int step, gboolean set_marker) {
+	if(gateway == NULL)
+		return;
+	if(packet->shared != NULL) {
+		rtp_header header;
+		memcpy(&header, packet->data, sizeof(rtp_header));
+		janus_rtp_header_update(&header, &listener->context, packet->is_video, step);
+		janus_plugin_rtp_overlay overlay;
+		overlay.ssrc = 0;
+		overlay.timestamp = ntohl(header.timestamp);
+		overlay.seq_number = ntohs(header.seq_number);
+		overlay.markerbit = set_marker ? 1 : -1;
+		gateway->relay_rtp_shared(session->handle, packet->is_video, packet->shared, &overlay);
+		return;
+	}
+	janus_rtp_header_update(packet->data, &listener->context, packet->is_video, step);
+	if(set_marker)
+		packet->data->markerbit = 1;
+	gateway->relay_rtp(session->handle, packet->is_video, (char *)packet->data, packet->length);
+	if(set_marker)
+		packet->data->markerbit = 0;
+	/* Restore the timestamp and sequence number to what the publisher set them to */
+	packet->data->timestamp = htonl(packet->timestamp);
+	packet->data->seq_number = htons(packet->seq_number);
+}
+
 /* Helper to quickly relay RTP packets from publishers to subscribers */
 static void janus_videoroom_relay_rtp_packet(gpointer data, gpointer user_data) {
 	janus_videoroom_rtp_relay_packet *packet = (janus_videoroom_rtp_relay_packet *)user_data;
@@ -4432,19 +4846,8 @@ static void janus_videoroom_relay_rtp_packet(gpointer data, gpointer user_data)
 			 * one of the layers the user wants, as there may be dependencies involved */
 			JANUS_LOG(LOG_HUGE, "Sending packet (spatial=%d, temporal=%d)\n",
 				packet->spatial_layer, packet->temporal_layer);
-			/* Fix sequence number and timestamp (publisher switching may be involved) */
-			janus_rtp_header_update(packet->data, &listener->context, TRUE, 4500);
-			if(override_mark_bit && !has_marker_bit) {
-				packet->data->markerbit = 1;
-			}
-			if(gateway != NULL)
-				gateway->relay_rtp(session->handle, packet->is_video, (char *)packet->data, packet->length);
-			if(override_mark_bit && !has_marker_bit) {
-				packet->data->markerbit = 0;
-			}
-			/* Restore the timestamp and sequence number to what the publisher set them to */
-			packet->data->timestamp = htonl(packet->timestamp);
-			packet->data->seq_number = htons(packet->seq_number);
+			/* Fix sequence number and timestamp (publisher switching may be involved), and send the packet */
+			janus_videoroom_relay_rtp_to_listener(session, listener, packet, 4500, override_mark_bit && !has_marker_bit);
 		} else if(packet->ssrc[0] != 0) {
 			/* Handle simulcast: don't relay if it's not the SSRC we wanted to handle */
 			uint32_t ssrc = ntohl(packet->data->ssrc);
@@ -4556,14 +4959,8 @@ static void janus_videoroom_relay_rtp_packet(gpointer data, gpointer user_data)
 			/* Restore the original payload descriptor as well, as it will be needed by the next viewer */
 			memcpy(payload, vp8pd, sizeof(vp8pd));
 		} else {
-			/* Fix sequence number and timestamp (publisher switching may be involved) */
-			janus_rtp_header_update(packet->data, &listener->context, TRUE, 4500);
-			/* Send the packet */
-			if(gateway != NULL)
-				gateway->relay_rtp(session->handle, packet->is_video, (char *)packet->data, packet->length);
-			/* Restore the timestamp and sequence number to what the publisher set them to */
-			packet->data->timestamp = htonl(packet->timestamp);
-			packet->data->seq_number = htons(packet->seq_number);
+			/* Fix sequence number and timestamp (publisher switching may be involved), and send the packet */
+			janus_videoroom_relay_rtp_to_listener(session, listener, packet, 4500, FALSE);
 		}
 	} else {
 		/* Check if this listener is subscribed to this medium */
@@ -4571,14 +4968,8 @@ static void janus_videoroom_relay_rtp_packet(gpointer data, gpointer user_data)
 			/* Nope, don't relay */
 			return;
 		}
-		/* Fix sequence number and timestamp (publisher switching may be involved) */
-		janus_rtp_header_update(packet->data, &listener->context, FALSE, 960);
-		/* Send the packet */
-		if(gateway != NULL)
-			gateway->relay_rtp(session->handle, packet->is_video, (char *)packet->data, packet->length);
-		/* Restore the timestamp and sequence number to what the publisher set them to */
-		packet->data->timestamp = htonl(packet->timestamp);
-		packet->data->seq_number = htons(packet->seq_number);
+		/* Fix sequence number and timestamp (publisher switching may be involved), and send the packet */
+		janus_videoroom_relay_rtp_to_listener(session, listener, packet, 960, FALSE);
 	}
 
 	return;
@@ -4624,6 +5015,8 @@ static void janus_videoroom_free(janus_videoroom *room) {
 
 static void janus_videoroom_listener_free(janus_videoroom_listener *l) {
 	JANUS_LOG(LOG_VERB, "Freeing listener\n");
+	/* Jobs queued before the listener unsubscribed may still reference it */
+	janus_videoroom_relay_flush(l);
 	g_free(l);
 }
 
@@ -4664,6 +5057,13 @@ static void janus_videoroom_participant_free(janus_videoroom_participant *p) {
 	p->rtp_forwarders = NULL;
 	janus_mutex_unlock(&p->rtp_forwarders_mutex);
 	g_slist_free(p->listeners);
+	if(p->relay_shards != NULL) {
+		guint w = 0;
+		for(w=0; w<relay_workers_num; w++)
+			janus_videoroom_relay_shard_unref(p->relay_shards[w]);
+		g_free(p->relay_shards);
+		p->relay_shards = NULL;
+	}
 
 	janus_mutex_destroy(&p->listeners_mutex);
 	janus_mutex_destroy(&p->rtp_forwarders_mutex);
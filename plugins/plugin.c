@@ -38,3 +38,29 @@ void janus_plugin_result_destroy(janus_plugin_result *result) {
 	g_free(result);
 }
 
+janus_plugin_rtp_shared *janus_plugin_rtp_shared_new(char *buf, int len) {
+	if(buf == NULL || len < 1)
+		return NULL;
+	/* The buffer is allocated together with the packet itself */
+	janus_plugin_rtp_shared *packet = (janus_plugin_rtp_shared *)g_malloc(sizeof(janus_plugin_rtp_shared) + len);
+	if(packet == NULL)
+		return NULL;
+	packet->buffer = (char *)(packet + 1);
+	memcpy(packet->buffer, buf, len);
+	packet->length = len;
+	g_atomic_int_set(&packet->ref, 1);
+	return packet;
+}
+
+void janus_plugin_rtp_shared_ref(janus_plugin_rtp_shared *packet) {
+	if(packet == NULL)
+		return;
+	g_atomic_int_inc(&packet->ref);
+}
+
+void janus_plugin_rtp_shared_unref(janus_plugin_rtp_shared *packet) {
+	if(packet == NULL)
+		return;
+	if(g_atomic_int_dec_and_test(&packet->ref))
+		g_free(packet);
+}
@@ -19,6 +19,7 @@
  * important thing is that it MUST be a JSON object, as it will be included
  * as such within the Janus session/handle protocol;
  * - \c relay_rtp(): to send/relay the peer an RTP packet;
+ * - \c relay_rtp_shared(): to send/relay the peer an RTP packet shared with other peers;
  * - \c relay_rtcp(): to send/relay the peer an RTCP message.
  * - \c relay_data(): to send/relay the peer a SCTP DataChannel message.
  * 
@@ -62,6 +63,7 @@ janus_plugin *create(void) {
  * - \c handle_message(): a callback to notify you the peer sent you a message/request;
  * - \c setup_media(): a callback to notify you the peer PeerConnection is now ready to be used;
  * - \c incoming_rtp(): a callback to notify you a peer has sent you a RTP packet;
+ * - \c incoming_rtp_batch(): a callback to notify you a peer has sent you several RTP packets in a row;
  * - \c incoming_rtcp(): a callback to notify you a peer has sent you a RTCP message;
  * - \c incoming_data(): a callback to notify you a peer has sent you a message on a SCTP DataChannel;
  * - \c slow_link(): a callback to notify you a peer has sent a lot of NACKs recently, and the media path may be slow;
@@ -70,7 +72,8 @@ janus_plugin *create(void) {
  * - \c destroy_session(): this method is called by the gateway to destroy a session between you and a peer.
  * 
  * All the above methods and callbacks, except for \c incoming_rtp ,
- * \c incoming_rtcp , \c incoming_data and \c slow_link , are mandatory:
+ * \c incoming_rtp_batch , \c incoming_rtcp , \c incoming_data and
+ * \c slow_link , are mandatory:
  * the Janus core will reject a plugin that doesn't implement any of the
  * mandatory callbacks. The previously mentioned ones, instead, are
  * optional, so you're free to implement only those you care about. If
@@ -80,7 +83,12 @@ janus_plugin *create(void) {
  * can't care less about RTP or RTCP, \c incoming_rtp and \c incoming_rtcp
  * can be left out. Finally, \c slow_link is just there as a helper, some
  * additional information you may be interested about, but you're not
- * forced to receive it if you don't care.
+ * forced to receive it if you don't care. As to \c incoming_rtp_batch ,
+ * it's only used when batched receiving is enabled in the gateway
+ * configuration: in that case, RTP packets received in a row are
+ * delivered to the plugin all at once (always for the same medium
+ * and in the order they were received) rather than via \c incoming_rtp ,
+ * which is still used for plugins that don't implement it.
  * 
  * The gateway \c janus_callbacks interface is provided to a plugin, together
  * with the path to the configurations files folder, in the \c init() method.
@@ -167,7 +175,7 @@ janus_plugin *create(void) {
  * gateway or it will crash.
  * 
  */
-#define JANUS_PLUGIN_API_VERSION	8
+#define JANUS_PLUGIN_API_VERSION	9
 
 /*! \brief Initialization of all plugin properties to NULL
  * 
@@ -199,6 +207,7 @@ static janus_plugin janus_echotest_plugin =
 		.handle_message = NULL,			\
 		.setup_media = NULL,			\
 		.incoming_rtp = NULL,			\
+		.incoming_rtp_batch = NULL,		\
 		.incoming_rtcp = NULL,			\
 		.incoming_data = NULL,			\
 		.slow_link = NULL,				\
@@ -216,6 +225,10 @@ typedef struct janus_plugin janus_plugin;
 typedef struct janus_plugin_session janus_plugin_session;
 /*! \brief Result of individual requests passed to plugins */
 typedef struct janus_plugin_result janus_plugin_result;
+/*! \brief Reference-counted RTP packet plugins can share among several peers */
+typedef struct janus_plugin_rtp_shared janus_plugin_rtp_shared;
+/*! \brief Per-peer changes to the RTP header of a shared packet */
+typedef struct janus_plugin_rtp_overlay janus_plugin_rtp_overlay;
 
 /*! \brief Plugin-Gateway session mapping */
 struct janus_plugin_session {
@@ -228,6 +241,38 @@ struct janus_plugin_session {
 	int stopped:1;
 };
 
+/*! \brief Reference-counted RTP packet
+ * \details Plugins relaying the same packet to many peers (e.g., a publisher
+ * and its subscribers in the VideoRoom) can wrap it in a shared packet
+ * via \c rtp_shared_new and relay it with \c relay_rtp_shared instead
+ * of \c relay_rtp : the payload is then only copied once, and kept around
+ * by the core until the last peer it was queued for has sent it. As such,
+ * a shared packet MUST NOT be modified after it has been relayed at least
+ * once: anything that needs to change for a specific peer has to be
+ * passed as a janus_plugin_rtp_overlay instead. */
+struct janus_plugin_rtp_shared {
+	/*! \brief The packet data (buffer) */
+	char *buffer;
+	/*! \brief The buffer length */
+	int length;
+	/*! \brief Reference counter */
+	volatile gint ref;
+};
+
+/*! \brief RTP header overlay
+ * \details This is applied by the core to its own copy of the header of a
+ * shared packet, right before encrypting it for a specific peer */
+struct janus_plugin_rtp_overlay {
+	/*! \brief SSRC to set in the header (0 to keep the original one) */
+	uint32_t ssrc;
+	/*! \brief RTP timestamp to set in the header */
+	uint32_t timestamp;
+	/*! \brief Sequence number to set in the header */
+	uint16_t seq_number;
+	/*! \brief Marker bit to set in the header (-1 to keep the original one) */
+	int8_t markerbit;
+};
+
 /*! \brief The plugin session and callbacks interface */
 struct janus_plugin {
 	/*! \brief Plugin initialization/constructor
@@ -279,6 +324,15 @@ struct janus_plugin {
 	 * @param[in] buf The packet data (buffer)
 	 * @param[in] len The buffer lenght */
 	void (* const incoming_rtp)(janus_plugin_session *handle, int video, char *buf, int len);
+	/*! \brief Method to handle several incoming RTP packets from a peer in a single call
+	 * \note Only used when batched receiving is enabled: all packets are of the same medium,
+	 * and the buffers are only valid until the method returns
+	 * @param[in] handle The plugin/gateway session used for this peer
+	 * @param[in] video Whether these are audio or video frames
+	 * @param[in] bufs The packets data (buffers)
+	 * @param[in] lens The buffers lengths
+	 * @param[in] count The number of packets in the batch */
+	void (* const incoming_rtp_batch)(janus_plugin_session *handle, int video, char **bufs, int *lens, int count);
 	/*! \brief Method to handle an incoming RTCP packet from a peer
 	 * @param[in] handle The plugin/gateway session used for this peer
 	 * @param[in] video Whether this is related to an audio or a video stream
@@ -378,6 +432,28 @@ struct janus_callbacks {
 	 * @param[in] event The event to notify as a Jansson json_t object */
 	void (* const notify_event)(janus_plugin *plugin, janus_plugin_session *handle, json_t *event);
 
+	/*! \brief Callback to create a shared RTP packet out of a buffer
+	 * \note The buffer is copied, and the packet starts with a single
+	 * reference, that the plugin must release with \c rtp_shared_unref when done
+	 * @param[in] buf The packet data (buffer)
+	 * @param[in] len The buffer length
+	 * @returns A new janus_plugin_rtp_shared instance */
+	janus_plugin_rtp_shared *(* const rtp_shared_new)(char *buf, int len);
+	/*! \brief Callback to increase the references to a shared RTP packet
+	 * @param[in] packet The janus_plugin_rtp_shared instance */
+	void (* const rtp_shared_ref)(janus_plugin_rtp_shared *packet);
+	/*! \brief Callback to decrease the references to a shared RTP packet, freeing it when they reach zero
+	 * @param[in] packet The janus_plugin_rtp_shared instance */
+	void (* const rtp_shared_unref)(janus_plugin_rtp_shared *packet);
+	/*! \brief Callback to relay a shared RTP packet to a peer
+	 * \note The core takes its own reference to the packet, if needed, so
+	 * the plugin is free to release its own as soon as this returns
+	 * @param[in] handle The plugin/gateway session used for this peer
+	 * @param[in] video Whether this is an audio or a video frame
+	 * @param[in] packet The janus_plugin_rtp_shared instance to relay
+	 * @param[in] overlay Header changes to apply for this peer, if any (copied by the core) */
+	void (* const relay_rtp_shared)(janus_plugin_session *handle, int video, janus_plugin_rtp_shared *packet, janus_plugin_rtp_overlay *overlay);
+
 };
 
 /*! \brief The hook that plugins need to implement to be created from the gateway */
@@ -447,5 +523,25 @@ janus_plugin_result *janus_plugin_result_new(janus_plugin_result_type type, cons
 void janus_plugin_result_destroy(janus_plugin_result *result);
 ///@}
 
+/** @name Janus shared RTP packets
+ * @brief Helpers the core uses to implement the shared RTP packet callbacks
+ */
+///@{
+/*! \brief Helper to create a janus_plugin_rtp_shared instance, with a single reference
+ * @param[in] buf The packet data (buffer) to copy
+ * @param[in] len The buffer length
+ * @returns A valid janus_plugin_rtp_shared instance, if successful, or NULL otherwise */
+janus_plugin_rtp_shared *janus_plugin_rtp_shared_new(char *buf, int len);
+
+/*! \brief Helper to increase the references to a janus_plugin_rtp_shared instance
+ * @param[in] packet The janus_plugin_rtp_shared instance */
+void janus_plugin_rtp_shared_ref(janus_plugin_rtp_shared *packet);
+
+/*! \brief Helper to decrease the references to a janus_plugin_rtp_shared instance
+ * @note The instance is freed when the last reference is released
+ * @param[in] packet The janus_plugin_rtp_shared instance */
+void janus_plugin_rtp_shared_unref(janus_plugin_rtp_shared *packet);
+///@}
+
 
 #endif
@@ -55,15 +55,21 @@
 #else
 #include <endian.h>
 #endif
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <glib.h>
 #include <jansson.h>
 
 #include "../debug.h"
+#include "../record-index.h"
 #include "pp-rtp.h"
 #include "pp-webm.h"
 #include "pp-h264.h"
@@ -79,9 +85,39 @@ int janus_log_level = 4;
 gboolean janus_log_timestamps = FALSE;
 gboolean janus_log_colors = TRUE;
 
-static janus_pp_frame_packet *list = NULL, *last = NULL;
+/* Frame packets are all allocated in a single array, which is sorted
+ * once when we're done parsing, and only then linked in playout order */
+static janus_pp_frame_packet *frames = NULL, *list = NULL;
+static size_t frames_count = 0, frames_size = 0;
 int working = 0;
 
+/* Get a new frame packet from the array, growing it if needed */
+static janus_pp_frame_packet *janus_pp_frame_new(void) {
+	if(frames_count == frames_size) {
+		frames_size = frames_size ? frames_size*2 : 4096;
+		frames = g_realloc(frames, frames_size * sizeof(janus_pp_frame_packet));
+	}
+	janus_pp_frame_packet *p = &frames[frames_count++];
+	memset(p, 0, sizeof(janus_pp_frame_packet));
+	return p;
+}
+
+/* Playout order: timestamp first (already extended to 64 bits, so that
+ * wrap-arounds and resets are taken into account), then sequence number
+ * (again taking wrap-arounds into account) for packets of the same frame,
+ * and finally the position in the file, which makes the sort stable */
+static int janus_pp_frame_compare(const void *a, const void *b) {
+	const janus_pp_frame_packet *first = (const janus_pp_frame_packet *)a;
+	const janus_pp_frame_packet *second = (const janus_pp_frame_packet *)b;
+	if(first->ts != second->ts)
+		return first->ts < second->ts ? -1 : 1;
+	if(first->seq != second->seq)
+		return (int16_t)(first->seq - second->seq) < 0 ? -1 : 1;
+	if(first->offset != second->offset)
+		return first->offset < second->offset ? -1 : 1;
+	return 0;
+}
+
 
 /* Signal handler */
 void janus_pp_handle_signal(int signum);
@@ -137,15 +173,31 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 	}
-	FILE *file = fopen(source, "rb");
-	if(file == NULL) {
+	int fd = open(source, O_RDONLY);
+	if(fd < 0) {
 		JANUS_LOG(LOG_ERR, "Could not open file %s\n", source);
 		return -1;
 	}
-	fseek(file, 0L, SEEK_END);
-	long fsize = ftell(file);
-	fseek(file, 0L, SEEK_SET);
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size == 0) {
+		JANUS_LOG(LOG_ERR, "Could not get the size of file %s, or file is empty\n", source);
+		close(fd);
+		return -1;
+	}
+	long fsize = st.st_size;
 	JANUS_LOG(LOG_INFO, "File is %zu bytes\n", fsize);
+	/* Map the whole recording: frames are read straight from memory, rather than with a seek and a read each */
+	char *data_map = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data_map == MAP_FAILED) {
+		JANUS_LOG(LOG_ERR, "Could not map file %s: %d (%s)\n", source, errno, strerror(errno));
+		return -1;
+	}
+	/* Packets are mostly read in the order they were written */
+	madvise(data_map, fsize, MADV_SEQUENTIAL);
+	janus_pp_source recording = { .data = data_map, .size = fsize };
+	/* If the recording comes with an index, we don't need to scan all the frames */
+	janus_recorder_index *index = janus_recorder_index_load(source, fsize);
 
 	/* Handle SIGINT */
 	working = 1;
@@ -169,10 +221,13 @@ int main(int argc, char *argv[])
 			/* We only needed to parse the header */
 			exit(0);
 		}
+		if(index != NULL && parsed_header) {
+			/* The index already tells us where the packets are */
+			break;
+		}
 		/* Read frame header */
 		skip = 0;
-		fseek(file, offset, SEEK_SET);
-		bytes = fread(prebuffer, sizeof(char), 8, file);
+		bytes = janus_pp_source_read(&recording, offset, prebuffer, 8);
 		if(bytes != 8 || prebuffer[0] != 'M') {
 			JANUS_LOG(LOG_WARN, "Invalid header at offset %ld (%s), the processing will stop here...\n",
 				offset, bytes != 8 ? "not enough bytes" : "wrong prefix");
@@ -181,14 +236,15 @@ int main(int argc, char *argv[])
 		if(prebuffer[1] == 'E') {
 			/* Either the old .mjr format header ('MEETECHO' header followed by 'audio' or 'video'), or a frame */
 			offset += 8;
-			bytes = fread(&len, sizeof(uint16_t), 1, file);
+			len = 0;
+			bytes = janus_pp_source_read(&recording, offset, &len, sizeof(uint16_t));
 			len = ntohs(len);
 			offset += 2;
 			if(len == 5 && !parsed_header) {
 				/* This is the main header */
 				parsed_header = TRUE;
 				JANUS_LOG(LOG_WARN, "Old .mjr header format\n");
-				bytes = fread(prebuffer, sizeof(char), 5, file);
+				bytes = janus_pp_source_read(&recording, offset, prebuffer, 5);
 				if(prebuffer[0] == 'v') {
 					JANUS_LOG(LOG_INFO, "This is a video recording, assuming VP8\n");
 					video = 1;
@@ -230,15 +286,20 @@ int main(int argc, char *argv[])
 		} else if(prebuffer[1] == 'J') {
 			/* New .mjr format, the header may contain useful info */
 			offset += 8;
-			bytes = fread(&len, sizeof(uint16_t), 1, file);
+			len = 0;
+			bytes = janus_pp_source_read(&recording, offset, &len, sizeof(uint16_t));
 			len = ntohs(len);
 			offset += 2;
 			if(len > 0 && !parsed_header) {
 				/* This is the info header */
 				JANUS_LOG(LOG_WARN, "New .mjr header format\n");
-				bytes = fread(prebuffer, sizeof(char), len, file);
+				if(len >= sizeof(prebuffer)) {
+					JANUS_LOG(LOG_WARN, "Info header too large (%"SCNu16" bytes)...\n", len);
+					exit(1);
+				}
+				bytes = janus_pp_source_read(&recording, offset, prebuffer, len);
 				parsed_header = TRUE;
-				prebuffer[len] = '\0';
+				prebuffer[bytes] = '\0';
 				json_error_t error;
 				json_t *info = json_loads(prebuffer, 0, &error);
 				if(!info) {
@@ -363,12 +424,70 @@ int main(int argc, char *argv[])
 	times_resetted = 0;
 	post_reset_pkts = 0;
 	uint64_t max32 = UINT32_MAX;
+	gboolean indexed = FALSE;
+	if(index != NULL && !data) {
+		/* The index is already in playout order, so we only need to
+		 * read the RTP headers to fill in the rest of the details */
+		JANUS_LOG(LOG_INFO, "Using the index (%zu packets)\n", index->count);
+		indexed = TRUE;
+		frames_size = index->count > 0 ? index->count : 1;
+		frames = g_malloc(frames_size * sizeof(janus_pp_frame_packet));
+		size_t i = 0;
+		for(i=0; working && i<index->count; i++) {
+			janus_recorder_index_entry *entry = &index->entries[i];
+			if(entry->length < 12 || entry->length > 2000)
+				continue;
+			if(entry->offset > (guint64)fsize || entry->length > (guint64)fsize - entry->offset) {
+				JANUS_LOG(LOG_WARN, "Index entry out of the file (offset %"SCNu64", length %"SCNu16"), skipping\n",
+					entry->offset, entry->length);
+				continue;
+			}
+			bytes = janus_pp_source_read(&recording, entry->offset, prebuffer, 16);
+			if(bytes != 16) {
+				JANUS_LOG(LOG_WARN, "Error reading RTP header at offset %"SCNu64", skipping\n", entry->offset);
+				continue;
+			}
+			janus_pp_rtp_header *rtp = (janus_pp_rtp_header *)prebuffer;
+			skip = 0;
+			if(rtp->csrccount)
+				skip += rtp->csrccount*4;
+			if(rtp->extension) {
+				janus_pp_rtp_header_extension *ext = (janus_pp_rtp_header_extension *)(prebuffer+12);
+				skip += 4 + ntohs(ext->length)*4;
+			}
+			uint8_t padlen = 0;
+			if(rtp->padding && janus_pp_source_read(&recording, entry->offset + entry->length - 1, &padlen, 1) != 1) {
+				JANUS_LOG(LOG_WARN, "Error reading RTP padding at offset %"SCNu64", skipping\n", entry->offset);
+				continue;
+			}
+			janus_pp_frame_packet *p = janus_pp_frame_new();
+			p->seq = entry->seq;
+			p->pt = rtp->type;
+			p->ts = entry->timestamp;
+			p->len = entry->length;
+			p->drop = 0;
+			if(rtp->padding) {
+				/* There's padding data, let's check the last byte to see how much data we should skip */
+				p->len -= padlen;
+				if((p->len - skip - 12) <= 0) {
+					/* Only padding, take note that we should drop the packet later */
+					p->drop = 1;
+				}
+			}
+			p->offset = entry->offset;
+			p->skip = skip;
+			count++;
+		}
+		/* Nothing left to scan */
+		offset = fsize;
+	}
+	janus_recorder_index_free(index);
+	index = NULL;
 	/* Start loop */
 	while(working && offset < fsize) {
 		/* Read frame header */
 		skip = 0;
-		fseek(file, offset, SEEK_SET);
-		bytes = fread(prebuffer, sizeof(char), 8, file);
+		bytes = janus_pp_source_read(&recording, offset, prebuffer, 8);
 		if(bytes != 8 || prebuffer[0] != 'M') {
 			/* Broken packet? Stop here */
 			break;
@@ -376,10 +495,16 @@ int main(int argc, char *argv[])
 		prebuffer[8] = '\0';
 		JANUS_LOG(LOG_VERB, "Header: %s\n", prebuffer);
 		offset += 8;
-		bytes = fread(&len, sizeof(uint16_t), 1, file);
+		len = 0;
+		bytes = janus_pp_source_read(&recording, offset, &len, sizeof(uint16_t));
 		len = ntohs(len);
 		JANUS_LOG(LOG_VERB, "  -- Length: %"SCNu16"\n", len);
 		offset += 2;
+		if(bytes != sizeof(uint16_t) || offset + len > fsize) {
+			/* Truncated packet? Stop here */
+			JANUS_LOG(LOG_WARN, "Truncated packet at offset %ld, the processing will stop here...\n", offset);
+			break;
+		}
 		if(prebuffer[1] == 'J' || (!data && len < 12)) {
 			/* Not RTP, skip */
 			JANUS_LOG(LOG_VERB, "  -- Not RTP, skipping\n");
@@ -395,36 +520,25 @@ int main(int argc, char *argv[])
 		if(data) {
 			/* Things are simpler for data, no reordering is needed: start by the data time */
 			gint64 when = 0;
-			bytes = fread(&when, sizeof(gint64), 1, file);
+			bytes = janus_pp_source_read(&recording, offset, &when, sizeof(gint64));
 			when = ntohll(when);
 			offset += sizeof(gint64);
 			len -= sizeof(gint64);
-			/* Generate frame packet and insert in the ordered list */
-			janus_pp_frame_packet *p = g_malloc0(sizeof(janus_pp_frame_packet));
-			if(p == NULL) {
-				JANUS_LOG(LOG_ERR, "Memory error!\n");
-				return -1;
-			}
+			/* Generate frame packet: data is already in the right order */
+			janus_pp_frame_packet *p = janus_pp_frame_new();
 			/* We "abuse" the timestamp field for the timing info */
 			p->ts = when-c_time;
 			p->len = len;
 			p->drop = 0;
 			p->offset = offset;
 			p->skip = 0;
-			p->next = NULL;
-			p->prev = NULL;
-			if(list == NULL) {
-				list = p;
-			} else {
-				last->next = p;
-			}
-			last = p;
 			/* Done */
 			offset += len;
 			continue;
 		}
 		/* Only read RTP header */
-		bytes = fread(prebuffer, sizeof(char), 16, file);
+		memset(prebuffer, 0, 16);
+		bytes = janus_pp_source_read(&recording, offset, prebuffer, 16);
 		janus_pp_rtp_header *rtp = (janus_pp_rtp_header *)prebuffer;
 		JANUS_LOG(LOG_VERB, "  -- RTP packet (ssrc=%"SCNu32", pt=%"SCNu16", ext=%"SCNu16", seq=%"SCNu16", ts=%"SCNu32")\n",
 				ntohl(rtp->ssrc), rtp->type, rtp->extension, ntohs(rtp->seq_number), ntohl(rtp->timestamp));
@@ -438,12 +552,8 @@ int main(int argc, char *argv[])
 				ntohs(ext->type), ntohs(ext->length));
 			skip += 4 + ntohs(ext->length)*4;
 		}
-		/* Generate frame packet and insert in the ordered list */
-		janus_pp_frame_packet *p = g_malloc0(sizeof(janus_pp_frame_packet));
-		if(p == NULL) {
-			JANUS_LOG(LOG_ERR, "Memory error!\n");
-			return -1;
-		}
+		/* Generate frame packet: we'll sort them all when we're done */
+		janus_pp_frame_packet *p = janus_pp_frame_new();
 		p->seq = ntohs(rtp->seq_number);
 		p->pt = rtp->type;
 		/* Due to resets, we need to mess a bit with the original timestamps */
@@ -487,9 +597,7 @@ int main(int argc, char *argv[])
 		p->drop = 0;
 		if(rtp->padding) {
 			/* There's padding data, let's check the last byte to see how much data we should skip */
-			fseek(file, offset + len - 1, SEEK_SET);
-			bytes = fread(prebuffer, sizeof(char), 1, file);
-			uint8_t padlen = (uint8_t)prebuffer[0];
+			uint8_t padlen = (uint8_t)recording.data[offset + len - 1];
 			JANUS_LOG(LOG_VERB, "Padding at sequence number %hu: %d/%d\n",
 				ntohs(rtp->seq_number), padlen, p->len);
 			p->len -= padlen;
@@ -504,80 +612,22 @@ int main(int argc, char *argv[])
 		/* Fill in the rest of the details */
 		p->offset = offset;
 		p->skip = skip;
-		p->next = NULL;
-		p->prev = NULL;
-		if(list == NULL) {
-			/* First element becomes the list itself (and the last item), at least for now */
-			list = p;
-			last = p;
-		} else {
-			/* Check where we should insert this, starting from the end */
-			int added = 0;
-			janus_pp_frame_packet *tmp = last;
-			while(tmp) {
-				if(tmp->ts < p->ts) {
-					/* The new timestamp is greater than the last one we have, append */
-					added = 1;
-					if(tmp->next != NULL) {
-						/* We're inserting */
-						tmp->next->prev = p;
-						p->next = tmp->next;
-					} else {
-						/* Update the last packet */
-						last = p;
-					}
-					tmp->next = p;
-					p->prev = tmp;
-					break;
-				} else if(tmp->ts == p->ts) {
-					/* Same timestamp, check the sequence number */
-					if(tmp->seq < p->seq && (abs(tmp->seq - p->seq) < 10000)) {
-						/* The new sequence number is greater than the last one we have, append */
-						added = 1;
-						if(tmp->next != NULL) {
-							/* We're inserting */
-							tmp->next->prev = p;
-							p->next = tmp->next;
-						} else {
-							/* Update the last packet */
-							last = p;
-						}
-						tmp->next = p;
-						p->prev = tmp;
-						break;
-					} else if(tmp->seq > p->seq && (abs(tmp->seq - p->seq) > 10000)) {
-						/* The new sequence number (resetted) is greater than the last one we have, append */
-						added = 1;
-						if(tmp->next != NULL) {
-							/* We're inserting */
-							tmp->next->prev = p;
-							p->next = tmp->next;
-						} else {
-							/* Update the last packet */
-							last = p;
-						}
-						tmp->next = p;
-						p->prev = tmp;
-						break;
-					}
-				}
-				/* If either the timestamp ot the sequence number we just got is smaller, keep going back */
-				tmp = tmp->prev;
-			}
-			if(!added) {
-				/* We reached the start */
-				p->next = list;
-				list->prev = p;
-				list = p;
-			}
-		}
 		/* Skip data for now */
 		offset += len;
 		count++;
 	}
 	if(!working)
 		exit(0);
-	
+	/* Sort the packets in playout order, unless they already are (data, or an index), and link them */
+	if(!data && !indexed && frames_count > 1)
+		qsort(frames, frames_count, sizeof(janus_pp_frame_packet), janus_pp_frame_compare);
+	size_t i = 0;
+	for(i=0; i<frames_count; i++) {
+		frames[i].prev = i > 0 ? &frames[i-1] : NULL;
+		frames[i].next = i < frames_count-1 ? &frames[i+1] : NULL;
+	}
+	list = frames_count > 0 ? frames : NULL;
+
 	JANUS_LOG(LOG_INFO, "Counted %"SCNu32" RTP packets\n", count);
 	janus_pp_frame_packet *tmp = list;
 	count = 0;
@@ -594,12 +644,12 @@ int main(int argc, char *argv[])
 	if(video) {
 		/* Look for maximum width and height, if possible, and for the average framerate */
 		if(vp8 || vp9) {
-			if(janus_pp_webm_preprocess(file, list, vp8) < 0) {
+			if(janus_pp_webm_preprocess(&recording, list, vp8) < 0) {
 				JANUS_LOG(LOG_ERR, "Error pre-processing %s RTP frames...\n", vp8 ? "VP8" : "VP9");
 				exit(1);
 			}
 		} else if(h264) {
-			if(janus_pp_h264_preprocess(file, list) < 0) {
+			if(janus_pp_h264_preprocess(&recording, list) < 0) {
 				JANUS_LOG(LOG_ERR, "Error pre-processing H.264 RTP frames...\n");
 				exit(1);
 			}
@@ -646,25 +696,25 @@ int main(int argc, char *argv[])
 	/* Loop */
 	if(!video && !data) {
 		if(opus) {
-			if(janus_pp_opus_process(file, list, &working) < 0) {
+			if(janus_pp_opus_process(&recording, list, &working) < 0) {
 				JANUS_LOG(LOG_ERR, "Error processing Opus RTP frames...\n");
 			}
 		} else if(g711) {
-			if(janus_pp_g711_process(file, list, &working) < 0) {
+			if(janus_pp_g711_process(&recording, list, &working) < 0) {
 				JANUS_LOG(LOG_ERR, "Error processing G.711 RTP frames...\n");
 			}
 		}
 	} else if(data) {
-		if(janus_pp_srt_process(file, list, &working) < 0) {
+		if(janus_pp_srt_process(&recording, list, &working) < 0) {
 			JANUS_LOG(LOG_ERR, "Error processing text data frames...\n");
 		}
 	} else {
 		if(vp8 || vp9) {
-			if(janus_pp_webm_process(file, list, vp8, &working) < 0) {
+			if(janus_pp_webm_process(&recording, list, vp8, &working) < 0) {
 				JANUS_LOG(LOG_ERR, "Error processing %s RTP frames...\n", vp8 ? "VP8" : "VP9");
 			}
 		} else {
-			if(janus_pp_h264_process(file, list, &working) < 0) {
+			if(janus_pp_h264_process(&recording, list, &working) < 0) {
 				JANUS_LOG(LOG_ERR, "Error processing H.264 RTP frames...\n");
 			}
 		}
@@ -686,9 +736,9 @@ int main(int argc, char *argv[])
 			janus_pp_g711_close();
 		}
 	}
-	fclose(file);
-	
-	file = fopen(destination, "rb");
+	munmap(data_map, fsize);
+
+	FILE *file = fopen(destination, "rb");
 	if(file == NULL) {
 		JANUS_LOG(LOG_INFO, "No destination file %s??\n", destination);
 	} else {
@@ -698,12 +748,7 @@ int main(int argc, char *argv[])
 		JANUS_LOG(LOG_INFO, "%s is %zu bytes\n", destination, fsize);
 		fclose(file);
 	}
-	janus_pp_frame_packet *temp = list, *next = NULL;
-	while(temp) {
-		next = temp->next;
-		g_free(temp);
-		temp = next;
-	}
+	g_free(frames);
 
 	JANUS_LOG(LOG_INFO, "Bye!\n");
 	return 0;
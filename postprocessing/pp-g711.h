@@ -17,7 +17,7 @@
 #include "pp-rtp.h"
 
 int janus_pp_g711_create(char *destination);
-int janus_pp_g711_process(FILE *file, janus_pp_frame_packet *list, int *working);
+int janus_pp_g711_process(janus_pp_source *source, janus_pp_frame_packet *list, int *working);
 void janus_pp_g711_close(void);
 
 #endif
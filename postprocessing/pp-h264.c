@@ -184,8 +184,8 @@ static void janus_pp_h264_parse_sps(char *buffer, int *width, int *height) {
 }
 
 
-int janus_pp_h264_preprocess(FILE *file, janus_pp_frame_packet *list) {
-	if(!file || !list)
+int janus_pp_h264_preprocess(janus_pp_source *source, janus_pp_frame_packet *list) {
+	if(!source || !list)
 		return -1;
 	janus_pp_frame_packet *tmp = list;
 	int bytes = 0, min_ts_diff = 0, max_ts_diff = 0;
@@ -206,9 +206,8 @@ int janus_pp_h264_preprocess(FILE *file, janus_pp_frame_packet *list) {
 			}
 		}
 		/* Parse H264 header now */
-		fseek(file, tmp->offset+12+tmp->skip, SEEK_SET);
 		int len = tmp->len-12-tmp->skip;
-		bytes = fread(prebuffer, sizeof(char), len, file);
+		bytes = janus_pp_source_read(source, tmp->offset+12+tmp->skip, prebuffer, len);
 		if(bytes != len)
 			JANUS_LOG(LOG_WARN, "Didn't manage to read all the bytes we needed (%d < %d)...\n", bytes, len);
 		if((prebuffer[0] & 0x1F) == 7) {
@@ -270,8 +269,8 @@ int janus_pp_h264_preprocess(FILE *file, janus_pp_frame_packet *list) {
 	return 0;
 }
 
-int janus_pp_h264_process(FILE *file, janus_pp_frame_packet *list, int *working) {
-	if(!file || !list || !working)
+int janus_pp_h264_process(janus_pp_source *source, janus_pp_frame_packet *list, int *working) {
+	if(!source || !list || !working)
 		return -1;
 	janus_pp_frame_packet *tmp = list;
 
@@ -296,9 +295,8 @@ int janus_pp_h264_process(FILE *file, janus_pp_frame_packet *list, int *working)
 			}
 			/* RTP payload */
 			buffer = start;
-			fseek(file, tmp->offset+12+tmp->skip, SEEK_SET);
 			len = tmp->len-12-tmp->skip;
-			bytes = fread(buffer, sizeof(char), len, file);
+			bytes = janus_pp_source_read(source, tmp->offset+12+tmp->skip, buffer, len);
 			if(bytes != len)
 				JANUS_LOG(LOG_WARN, "Didn't manage to read all the bytes we needed (%d < %d)...\n", bytes, len);
 			/* H.264 depay */
@@ -18,8 +18,8 @@
 
 /* H.264 stuff */
 int janus_pp_h264_create(char *destination);
-int janus_pp_h264_preprocess(FILE *file, janus_pp_frame_packet *list);
-int janus_pp_h264_process(FILE *file, janus_pp_frame_packet *list, int *working);
+int janus_pp_h264_preprocess(janus_pp_source *source, janus_pp_frame_packet *list);
+int janus_pp_h264_process(janus_pp_source *source, janus_pp_frame_packet *list, int *working);
 void janus_pp_h264_close(void);
 
 
@@ -67,8 +67,8 @@ int janus_pp_opus_create(char *destination) {
 	return 0;
 }
 
-int janus_pp_opus_process(FILE *file, janus_pp_frame_packet *list, int *working) {
-	if(!file || !list || !working)
+int janus_pp_opus_process(janus_pp_source *source, janus_pp_frame_packet *list, int *working) {
+	if(!source || !list || !working)
 		return -1;
 	janus_pp_frame_packet *tmp = list;
 	long int offset = 0;
@@ -104,9 +104,8 @@ int janus_pp_opus_process(FILE *file, janus_pp_frame_packet *list, int *working)
 		len = 0;
 		/* RTP payload */
 		offset = tmp->offset+12+tmp->skip;
-		fseek(file, offset, SEEK_SET);
 		len = tmp->len-12-tmp->skip;
-		bytes = fread(buffer, sizeof(char), len, file);
+		bytes = janus_pp_source_read(source, offset, buffer, len);
 		if(bytes != len)
 			JANUS_LOG(LOG_WARN, "Didn't manage to read all the bytes we needed (%d < %d)...\n", bytes, len);
 		if(last_seq == 0)
@@ -17,7 +17,7 @@
 #include "pp-rtp.h"
 
 int janus_pp_opus_create(char *destination);
-int janus_pp_opus_process(FILE *file, janus_pp_frame_packet *list, int *working);
+int janus_pp_opus_process(janus_pp_source *source, janus_pp_frame_packet *list, int *working);
 void janus_pp_opus_close(void);
 
 #endif
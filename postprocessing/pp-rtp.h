@@ -3,8 +3,10 @@
  * \copyright GNU General Public License v3
  * \brief    Helper structures to handle RTP post-processing (headers)
  * \details  A few structures to ease the post-processing of RTP frames:
- * the RTP header, its extensions (that we just skip), and a linked list
- * we use to re-order them for post-processing audio/video later on.
+ * the RTP header, its extensions (that we just skip), the frame packets
+ * we re-order for post-processing audio/video later on (allocated as a
+ * single array, and linked in playout order once sorted), and the
+ * recording they're read from (mapped in memory).
  * 
  * \ingroup postprocessing
  * \ref postprocessing
@@ -13,6 +15,7 @@
 #ifndef _JANUS_PP_RTP
 #define _JANUS_PP_RTP
 
+#include <string.h>
 
 typedef struct janus_pp_rtp_header
 {
@@ -54,5 +57,20 @@ typedef struct janus_pp_frame_packet {
 	struct janus_pp_frame_packet *prev;
 } janus_pp_frame_packet;
 
+typedef struct janus_pp_source {
+	const char *data;	/* Content of the .mjr file, mapped in memory */
+	size_t size;		/* Size of the .mjr file */
+} janus_pp_source;
+
+/* Copy part of the recording to a buffer: just as fread, returns how many bytes were actually copied */
+static inline int janus_pp_source_read(janus_pp_source *source, long offset, void *buffer, int len) {
+	if(source == NULL || source->data == NULL || offset < 0 || (size_t)offset >= source->size || len <= 0)
+		return 0;
+	if((size_t)offset + len > source->size)
+		len = source->size - offset;
+	memcpy(buffer, source->data + offset, len);
+	return len;
+}
+
 
 #endif
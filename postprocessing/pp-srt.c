@@ -50,14 +50,11 @@ int janus_pp_srt_create(char *destination) {
 	return 0;
 }
 
-int janus_pp_srt_process(FILE *file, janus_pp_frame_packet *list, int *working) {
-	if(!file || !list || !working || !srt_file)
+int janus_pp_srt_process(janus_pp_source *source, janus_pp_frame_packet *list, int *working) {
+	if(!source || !list || !working || !srt_file)
 		return -1;
 	janus_pp_frame_packet *tmp = list;
 	uint seq = 0;
-	uint bytes = 0;
-	uint16_t bufsize = 1500;
-	uint8_t *buffer = g_malloc0(bufsize);
 	char srt_buffer[2048], from[20], to[20];
 	size_t buflen = 0;
 
@@ -82,21 +79,12 @@ int janus_pp_srt_process(FILE *file, janus_pp_frame_packet *list, int *working)
 		if(fwrite(srt_buffer, sizeof(char), buflen, srt_file) != buflen) {
 			JANUS_LOG(LOG_ERR, "Couldn't write header text...\n");
 		}
-		/* Now let's read the content and write it to the file */
-		fseek(file, tmp->offset, SEEK_SET);
-		JANUS_LOG(LOG_VERB, "Reading %d bytes...\n", tmp->len);
-		uint16_t total = tmp->len;
-		while(total > 0) {
-			bytes = fread(buffer, sizeof(char), total > bufsize ? bufsize : total, file);
-			if(bytes == 0) {
-				JANUS_LOG(LOG_ERR, "Error reading from file...\n");
-				break;
-			}
-			JANUS_LOG(LOG_VERB, "Read %d bytes...\n", bytes);
-			if(fwrite(buffer, sizeof(char), bytes, srt_file) != bytes) {
-				JANUS_LOG(LOG_ERR, "Couldn't write all the buffer...\n");
-			}
-			total -= bytes;
+		/* Now let's write the content to the file, straight from the recording */
+		JANUS_LOG(LOG_VERB, "Writing %d bytes...\n", tmp->len);
+		if(tmp->offset < 0 || (size_t)tmp->offset + tmp->len > source->size) {
+			JANUS_LOG(LOG_ERR, "Text packet out of the recording boundaries...\n");
+		} else if(fwrite(source->data + tmp->offset, sizeof(char), tmp->len, srt_file) != tmp->len) {
+			JANUS_LOG(LOG_ERR, "Couldn't write all the buffer...\n");
 		}
 		/* Write the trailer line returns */
 		g_snprintf(srt_buffer, 2048, "\n\n");
@@ -104,11 +92,9 @@ int janus_pp_srt_process(FILE *file, janus_pp_frame_packet *list, int *working)
 		if(fwrite(srt_buffer, sizeof(char), buflen, srt_file) != buflen) {
 			JANUS_LOG(LOG_ERR, "Couldn't write trailer text...\n");
 		}
-		fflush(srt_file);
 		/* Next? */
 		tmp = tmp->next;
 	}
-	g_free(buffer);
 
 	return 0;
 }
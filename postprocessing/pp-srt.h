@@ -17,7 +17,7 @@
 #include "pp-rtp.h"
 
 int janus_pp_srt_create(char *destination);
-int janus_pp_srt_process(FILE *file, janus_pp_frame_packet *list, int *working);
+int janus_pp_srt_process(janus_pp_source *source, janus_pp_frame_packet *list, int *working);
 void janus_pp_srt_close(void);
 
 #endif
@@ -128,8 +128,8 @@ int janus_pp_webm_create(char *destination, int vp8) {
 	return 0;
 }
 
-int janus_pp_webm_preprocess(FILE *file, janus_pp_frame_packet *list, int vp8) {
-	if(!file || !list)
+int janus_pp_webm_preprocess(janus_pp_source *source, janus_pp_frame_packet *list, int vp8) {
+	if(!source || !list)
 		return -1;
 	janus_pp_frame_packet *tmp = list;
 	int bytes = 0, min_ts_diff = 0, max_ts_diff = 0;
@@ -158,8 +158,7 @@ int janus_pp_webm_preprocess(FILE *file, janus_pp_frame_packet *list, int vp8) {
 		if(vp8) {
 			/* https://tools.ietf.org/html/draft-ietf-payload-vp8 */
 			/* Read the first bytes of the payload, and get the first octet (VP8 Payload Descriptor) */
-			fseek(file, tmp->offset+12+tmp->skip, SEEK_SET);
-			bytes = fread(prebuffer, sizeof(char), 16, file);
+			bytes = janus_pp_source_read(source, tmp->offset+12+tmp->skip, prebuffer, 16);
 			if(bytes != 16)
 				JANUS_LOG(LOG_WARN, "Didn't manage to read all the bytes we needed (%d < 16)...\n", bytes);
 			char *buffer = (char *)&prebuffer;
@@ -226,8 +225,7 @@ int janus_pp_webm_preprocess(FILE *file, janus_pp_frame_packet *list, int vp8) {
 		} else {
 			/* https://tools.ietf.org/html/draft-ietf-payload-vp9 */
 			/* Read the first bytes of the payload, and get the first octet (VP9 Payload Descriptor) */
-			fseek(file, tmp->offset+12+tmp->skip, SEEK_SET);
-			bytes = fread(prebuffer, sizeof(char), 16, file);
+			bytes = janus_pp_source_read(source, tmp->offset+12+tmp->skip, prebuffer, 16);
 			if(bytes != 16)
 				JANUS_LOG(LOG_WARN, "Didn't manage to read all the bytes we needed (%d < 16)...\n", bytes);
 			char *buffer = (char *)&prebuffer;
@@ -312,8 +310,8 @@ int janus_pp_webm_preprocess(FILE *file, janus_pp_frame_packet *list, int vp8) {
 	return 0;
 }
 
-int janus_pp_webm_process(FILE *file, janus_pp_frame_packet *list, int vp8, int *working) {
-	if(!file || !list || !working)
+int janus_pp_webm_process(janus_pp_source *source, janus_pp_frame_packet *list, int vp8, int *working) {
+	if(!source || !list || !working)
 		return -1;
 	janus_pp_frame_packet *tmp = list;
 
@@ -338,9 +336,8 @@ int janus_pp_webm_process(FILE *file, janus_pp_frame_packet *list, int vp8, int
 			}
 			/* RTP payload */
 			buffer = start;
-			fseek(file, tmp->offset+12+tmp->skip, SEEK_SET);
 			len = tmp->len-12-tmp->skip;
-			bytes = fread(buffer, sizeof(char), len, file);
+			bytes = janus_pp_source_read(source, tmp->offset+12+tmp->skip, buffer, len);
 			if(bytes != len)
 				JANUS_LOG(LOG_WARN, "Didn't manage to read all the bytes we needed (%d < %d)...\n", bytes, len);
 			if(vp8) {
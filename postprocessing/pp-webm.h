@@ -18,8 +18,8 @@
 
 /* WebM stuff */
 int janus_pp_webm_create(char *destination, int vp8);
-int janus_pp_webm_preprocess(FILE *file, janus_pp_frame_packet *list, int vp8);
-int janus_pp_webm_process(FILE *file, janus_pp_frame_packet *list, int vp8, int *working);
+int janus_pp_webm_preprocess(janus_pp_source *source, janus_pp_frame_packet *list, int vp8);
+int janus_pp_webm_process(janus_pp_source *source, janus_pp_frame_packet *list, int vp8, int *working);
 void janus_pp_webm_close(void);
 
 
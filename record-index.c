@@ -0,0 +1,235 @@
+/*! \file    record-index.c
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU General Public License v3
+ * \brief    Frame index for Janus recordings
+ * \details  Implementation of the index the recorder can save next to a
+ * .mjr file, to make it cheap to open a recording and seek into it. The
+ * index file starts with a \c MJRIDX01 signature, followed by the size
+ * of the recording it refers to (64 bits) and the number of entries (64
+ * bits). Each entry is then 21 bytes: offset (64 bits), extended RTP
+ * timestamp (64 bits), sequence number (16 bits), length (16 bits) and
+ * flags (8 bits, where 0x01 means keyframe). All values are in network
+ * byte order.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+
+#include "record-index.h"
+#include "debug.h"
+
+#define htonll(x) ((1==htonl(1)) ? (x) : ((guint64)htonl((x) & 0xFFFFFFFF) << 32) | htonl((x) >> 32))
+#define ntohll(x) ((1==ntohl(1)) ? (x) : ((guint64)ntohl((x) & 0xFFFFFFFF) << 32) | ntohl((x) >> 32))
+
+/* Signature of index files */
+static const char *index_header = "MJRIDX01";
+/* Size of an entry in the file */
+#define JANUS_RECORDER_INDEX_ENTRY_SIZE	21
+/* Flags */
+#define JANUS_RECORDER_INDEX_KEYFRAME	0x01
+
+
+janus_recorder_index *janus_recorder_index_create(void) {
+	janus_recorder_index *index = g_malloc0(sizeof(janus_recorder_index));
+	index->size = 1024;
+	index->entries = g_malloc(index->size * sizeof(janus_recorder_index_entry));
+	return index;
+}
+
+void janus_recorder_index_add(janus_recorder_index *index, guint64 offset,
+		uint32_t timestamp, uint16_t seq, uint16_t length, gboolean keyframe) {
+	if(index == NULL)
+		return;
+	if(index->count == index->size) {
+		index->size *= 2;
+		index->entries = g_realloc(index->entries, index->size * sizeof(janus_recorder_index_entry));
+	}
+	/* Extend the timestamp: we start from 2^32, so that packets that arrive
+	 * out of order right at the beginning don't end up before zero */
+	if(index->count == 0) {
+		index->last_ext_ts = ((guint64)1 << 32) + timestamp;
+	} else {
+		index->last_ext_ts += (gint32)(timestamp - index->last_ts);
+	}
+	index->last_ts = timestamp;
+	janus_recorder_index_entry *entry = &index->entries[index->count];
+	entry->offset = offset;
+	entry->timestamp = index->last_ext_ts;
+	entry->seq = seq;
+	entry->length = length;
+	entry->keyframe = keyframe;
+	index->count++;
+}
+
+/* Playout order: timestamp first, and sequence number (taking wrap-arounds into account) for packets of the same frame */
+static int janus_recorder_index_compare(const void *a, const void *b) {
+	const janus_recorder_index_entry *first = (const janus_recorder_index_entry *)a;
+	const janus_recorder_index_entry *second = (const janus_recorder_index_entry *)b;
+	if(first->timestamp != second->timestamp)
+		return first->timestamp < second->timestamp ? -1 : 1;
+	return (int16_t)(first->seq - second->seq);
+}
+
+/* Update the list of keyframes, after the entries have been sorted: a keyframe
+ * starts at the first packet with its timestamp (e.g., H.264 SPS/PPS), no
+ * matter which of its packets was flagged, and is only listed once */
+static void janus_recorder_index_update_keyframes(janus_recorder_index *index) {
+	g_free(index->keyframes);
+	index->keyframes = g_malloc(MAX(index->count, 1) * sizeof(size_t));
+	index->keyframes_count = 0;
+	size_t i = 0, start = 0;
+	for(i=0; i<index->count; i++) {
+		if(i == 0 || index->entries[i].timestamp != index->entries[i-1].timestamp)
+			start = i;
+		if(!index->entries[i].keyframe)
+			continue;
+		if(index->keyframes_count > 0 && index->keyframes[index->keyframes_count-1] == start)
+			continue;
+		index->keyframes[index->keyframes_count++] = start;
+	}
+}
+
+void janus_recorder_index_sort(janus_recorder_index *index) {
+	if(index == NULL)
+		return;
+	qsort(index->entries, index->count, sizeof(janus_recorder_index_entry), janus_recorder_index_compare);
+	janus_recorder_index_update_keyframes(index);
+}
+
+int janus_recorder_index_save(janus_recorder_index *index, const char *path, guint64 file_size) {
+	if(index == NULL || path == NULL)
+		return -1;
+	janus_recorder_index_sort(index);
+	FILE *file = fopen(path, "wb");
+	if(file == NULL) {
+		JANUS_LOG(LOG_ERR, "Error creating index %s: %d (%s)\n", path, errno, strerror(errno));
+		return -2;
+	}
+	/* Serialize everything in a single buffer, and write it in one go */
+	size_t len = strlen(index_header) + 2*sizeof(guint64) + index->count*JANUS_RECORDER_INDEX_ENTRY_SIZE;
+	char *buffer = g_malloc(len), *p = buffer;
+	memcpy(p, index_header, strlen(index_header));
+	p += strlen(index_header);
+	guint64 value = htonll(file_size);
+	memcpy(p, &value, sizeof(guint64));
+	p += sizeof(guint64);
+	value = htonll((guint64)index->count);
+	memcpy(p, &value, sizeof(guint64));
+	p += sizeof(guint64);
+	size_t i = 0;
+	for(i=0; i<index->count; i++) {
+		janus_recorder_index_entry *entry = &index->entries[i];
+		value = htonll(entry->offset);
+		memcpy(p, &value, sizeof(guint64));
+		value = htonll(entry->timestamp);
+		memcpy(p+8, &value, sizeof(guint64));
+		uint16_t value16 = htons(entry->seq);
+		memcpy(p+16, &value16, sizeof(uint16_t));
+		value16 = htons(entry->length);
+		memcpy(p+18, &value16, sizeof(uint16_t));
+		*(p+20) = entry->keyframe ? JANUS_RECORDER_INDEX_KEYFRAME : 0;
+		p += JANUS_RECORDER_INDEX_ENTRY_SIZE;
+	}
+	int res = 0;
+	if(fwrite(buffer, sizeof(char), len, file) != len) {
+		JANUS_LOG(LOG_ERR, "Error saving index %s: %d (%s)\n", path, errno, strerror(errno));
+		res = -3;
+	}
+	g_free(buffer);
+	fclose(file);
+	return res;
+}
+
+janus_recorder_index *janus_recorder_index_load(const char *recording, guint64 file_size) {
+	if(recording == NULL)
+		return NULL;
+	char path[1024];
+	g_snprintf(path, sizeof(path), "%s.%s", recording, JANUS_RECORDER_INDEX_EXTENSION);
+	gchar *buffer = NULL;
+	gsize len = 0;
+	if(!g_file_get_contents(path, &buffer, &len, NULL)) {
+		/* No index */
+		return NULL;
+	}
+	size_t header_len = strlen(index_header) + 2*sizeof(guint64);
+	if(len < header_len || memcmp(buffer, index_header, strlen(index_header))) {
+		JANUS_LOG(LOG_WARN, "Invalid index %s, ignoring it\n", path);
+		g_free(buffer);
+		return NULL;
+	}
+	char *p = buffer + strlen(index_header);
+	guint64 value = 0;
+	memcpy(&value, p, sizeof(guint64));
+	if(ntohll(value) != file_size) {
+		JANUS_LOG(LOG_WARN, "Stale index %s (recording is %"SCNu64" bytes, index is for %"SCNu64"), ignoring it\n",
+			path, file_size, (guint64)ntohll(value));
+		g_free(buffer);
+		return NULL;
+	}
+	memcpy(&value, p+8, sizeof(guint64));
+	guint64 count = ntohll(value);
+	if(count > (len - header_len) / JANUS_RECORDER_INDEX_ENTRY_SIZE) {
+		JANUS_LOG(LOG_WARN, "Truncated index %s, ignoring it\n", path);
+		g_free(buffer);
+		return NULL;
+	}
+	p += 2*sizeof(guint64);
+	janus_recorder_index *index = g_malloc0(sizeof(janus_recorder_index));
+	index->size = count > 0 ? count : 1;
+	index->entries = g_malloc(index->size * sizeof(janus_recorder_index_entry));
+	index->count = count;
+	size_t i = 0;
+	for(i=0; i<count; i++) {
+		janus_recorder_index_entry *entry = &index->entries[i];
+		memcpy(&value, p, sizeof(guint64));
+		entry->offset = ntohll(value);
+		memcpy(&value, p+8, sizeof(guint64));
+		entry->timestamp = ntohll(value);
+		uint16_t value16 = 0;
+		memcpy(&value16, p+16, sizeof(uint16_t));
+		entry->seq = ntohs(value16);
+		memcpy(&value16, p+18, sizeof(uint16_t));
+		entry->length = ntohs(value16);
+		entry->keyframe = (*(p+20) & JANUS_RECORDER_INDEX_KEYFRAME) ? TRUE : FALSE;
+		if(entry->offset + entry->length > file_size) {
+			JANUS_LOG(LOG_WARN, "Invalid entry in index %s, ignoring it\n", path);
+			g_free(buffer);
+			janus_recorder_index_free(index);
+			return NULL;
+		}
+		p += JANUS_RECORDER_INDEX_ENTRY_SIZE;
+	}
+	g_free(buffer);
+	janus_recorder_index_update_keyframes(index);
+	JANUS_LOG(LOG_VERB, "Loaded index %s (%zu packets, %zu keyframes)\n", path, index->count, index->keyframes_count);
+	return index;
+}
+
+size_t janus_recorder_index_find_keyframe(janus_recorder_index *index, guint64 timestamp) {
+	if(index == NULL || index->keyframes_count == 0)
+		return 0;
+	/* Binary search on the keyframes for the last one that's not after the timestamp */
+	size_t low = 0, high = index->keyframes_count;
+	while(low < high) {
+		size_t mid = low + (high - low)/2;
+		if(index->entries[index->keyframes[mid]].timestamp <= timestamp)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low > 0 ? index->keyframes[low-1] : 0;
+}
+
+void janus_recorder_index_free(janus_recorder_index *index) {
+	if(index == NULL)
+		return;
+	g_free(index->entries);
+	index->entries = NULL;
+	g_free(index->keyframes);
+	index->keyframes = NULL;
+	g_free(index);
+}
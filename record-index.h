@@ -0,0 +1,116 @@
+/*! \file    record-index.h
+ * \author   Lorenzo Miniero <lorenzo@meetecho.com>
+ * \copyright GNU General Public License v3
+ * \brief    Frame index for Janus recordings (headers)
+ * \details  Implementation of the index the recorder can save next to a
+ * .mjr file (e.g., \c rec.mjr.idx for \c rec.mjr), to make it cheap to
+ * open a recording and seek into it. Recordings that come with an index
+ * have a \c MJR00002 signature rather than \c MJR00001 , but are
+ * otherwise identical to the ones without, so that readers that don't
+ * know about the index can still process them by scanning the frames.
+ *
+ * The index lists, for each RTP packet in the recording, the offset of
+ * the packet in the .mjr file, its length, its sequence number, its RTP
+ * timestamp (extended to 64 bits, to take wrap-arounds into account) and
+ * whether or not it's the start of a keyframe. Entries are sorted in
+ * timestamp (and then sequence number) order, i.e., the order packets
+ * should be played in, so that readers don't have to reorder them and
+ * can find the keyframe closest to a specific time via a binary search.
+ * An index also records the size of the .mjr file it refers to, so
+ * that a stale index (e.g., for a recording that was modified after the
+ * fact) can be detected and ignored.
+ *
+ * \ingroup core
+ * \ref core
+ */
+
+#ifndef _JANUS_RECORD_INDEX_H
+#define _JANUS_RECORD_INDEX_H
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <glib.h>
+
+
+/*! \brief Extension appended to the name of a recording to get the name of its index */
+#define JANUS_RECORDER_INDEX_EXTENSION	"idx"
+
+/*! \brief Index entry, one per RTP packet */
+typedef struct janus_recorder_index_entry {
+	/*! \brief Offset of the packet in the recording */
+	guint64 offset;
+	/*! \brief RTP timestamp, extended to 64 bits */
+	guint64 timestamp;
+	/*! \brief RTP sequence number */
+	uint16_t seq;
+	/*! \brief Length of the packet */
+	uint16_t length;
+	/*! \brief Whether the packet is the start of a keyframe */
+	gboolean keyframe;
+} janus_recorder_index_entry;
+
+/*! \brief Frame index of a recording */
+typedef struct janus_recorder_index {
+	/*! \brief Index entries */
+	janus_recorder_index_entry *entries;
+	/*! \brief Number of entries */
+	size_t count;
+	/*! \brief Number of entries there's room for */
+	size_t size;
+	/*! \brief Positions of the entries that start a keyframe, in timestamp order */
+	size_t *keyframes;
+	/*! \brief Number of keyframes */
+	size_t keyframes_count;
+	/*! \brief Last RTP timestamp that was added, to extend the next ones */
+	uint32_t last_ts;
+	/*! \brief Extended version of last_ts */
+	guint64 last_ext_ts;
+} janus_recorder_index;
+
+
+/*! \brief Create a new, empty, index
+ * @returns A new janus_recorder_index instance */
+janus_recorder_index *janus_recorder_index_create(void);
+
+/*! \brief Add an RTP packet to an index
+ * \note Packets should be added in the order they're written to the
+ * recording: they'll only be sorted when the index is saved
+ * @param[in] index The janus_recorder_index instance
+ * @param[in] offset The offset of the packet in the recording
+ * @param[in] timestamp The RTP timestamp of the packet
+ * @param[in] seq The RTP sequence number of the packet
+ * @param[in] length The length of the packet
+ * @param[in] keyframe Whether the packet is the start of a keyframe */
+void janus_recorder_index_add(janus_recorder_index *index, guint64 offset,
+	uint32_t timestamp, uint16_t seq, uint16_t length, gboolean keyframe);
+
+/*! \brief Sort an index in playout order, and update the list of its keyframes
+ * \note This is useful to build an index for a recording that doesn't come with one
+ * @param[in] index The janus_recorder_index instance */
+void janus_recorder_index_sort(janus_recorder_index *index);
+
+/*! \brief Sort an index, and save it to a file
+ * @param[in] index The janus_recorder_index instance
+ * @param[in] path Path of the index file to create
+ * @param[in] file_size Size of the recording the index refers to
+ * @returns 0 in case of success, a negative integer otherwise */
+int janus_recorder_index_save(janus_recorder_index *index, const char *path, guint64 file_size);
+
+/*! \brief Load the index of a recording, if there's a valid one
+ * @param[in] recording Path of the .mjr recording
+ * @param[in] file_size Size of the recording, to make sure the index is not stale
+ * @returns A janus_recorder_index instance, or NULL if there's no index for the recording, or it's invalid */
+janus_recorder_index *janus_recorder_index_load(const char *recording, guint64 file_size);
+
+/*! \brief Find the last keyframe at or before a specific time
+ * @param[in] index The janus_recorder_index instance
+ * @param[in] timestamp The extended RTP timestamp to look for
+ * @returns The position of the entry the keyframe starts at, or the first entry if there's no such keyframe */
+size_t janus_recorder_index_find_keyframe(janus_recorder_index *index, guint64 timestamp);
+
+/*! \brief Free an index
+ * @param[in] index The janus_recorder_index instance to free */
+void janus_recorder_index_free(janus_recorder_index *index);
+
+#endif
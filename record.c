@@ -11,6 +11,17 @@
  * \note If you want to record both audio and video, you'll have to use
  * two different recorders. Any muxing in the same container will have
  * to be done in the post-processing phase.
+ *
+ * Frames are copied to fixed-size staging buffers (chunks), taken from a
+ * global pool whose size is bounded by the configured memory budget. Full
+ * chunks are queued on the recorder, and the recorder is handed to one of
+ * the I/O threads when enough data is queued or when the oldest queued
+ * data is getting stale (the I/O threads also check that regularly on
+ * their own, for recorders that stopped receiving frames): the I/O thread
+ * writes all the queued chunks at once with pwritev(), and gives them
+ * back to the pool. A recorder is only ever handled by one I/O thread at
+ * a time, so data is written in order; data that couldn't be written is
+ * retried a few times, before giving up on the recording.
  * 
  * \ingroup core
  * \ref core
@@ -18,6 +29,10 @@
  
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
 #include <errno.h>
 
 #include <glib.h>
@@ -26,6 +41,7 @@
 #include "record.h"
 #include "debug.h"
 #include "utils.h"
+#include "rtp.h"
 
 #define htonll(x) ((1==htonl(1)) ? (x) : ((gint64)htonl((x) & 0xFFFFFFFF) << 32) | htonl((x) >> 32))
 #define ntohll(x) ((1==ntohl(1)) ? (x) : ((gint64)ntohl((x) & 0xFFFFFFFF) << 32) | ntohl((x) >> 32))
@@ -33,6 +49,8 @@
 
 /* Info header in the structured recording */
 static const char *header = "MJR00001";
+/* Info header in the structured recording, when it comes with an index */
+static const char *header_indexed = "MJR00002";
 /* Frame header in the structured recording */
 static const char *frame_header = "MEETECHO";
 
@@ -40,9 +58,104 @@ static const char *frame_header = "MEETECHO";
 static gboolean rec_tempname = FALSE;
 /* Extension to add in case tempnames is true (default="tmp" --> ".tmp") */
 static char *rec_tempext = NULL;
+/* Whether audio/video recordings should come with a frame index (default=false) */
+static gboolean rec_index = FALSE;
+
+/* Staging buffers: each open recorder keeps the one it's filling until it's
+ * full or stale, so they're small enough for many idle recorders to fit the budget */
+#define JANUS_RECORDER_CHUNK_SIZE	16384
+struct janus_recorder_chunk {
+	size_t size;
+	size_t written;	/* Data before this offset is on disk already (partial writes) */
+	gint64 created;
+	char data[JANUS_RECORDER_CHUNK_SIZE];
+};
+/* A recorder is handed to the I/O threads when this much data is queued... */
+#define JANUS_RECORDER_FLUSH_BYTES	262144
+/* ...or when the oldest data that is staged is this old */
+#define JANUS_RECORDER_FLUSH_INTERVAL	G_USEC_PER_SEC
+/* How long to wait for room to stage a frame, when overflow is set to wait */
+#define JANUS_RECORDER_OVERFLOW_WAIT_MAX	50000
+/* How many writes in a row can fail, before we give up on a recording */
+#define JANUS_RECORDER_MAX_FAILURES	3
+#ifndef IOV_MAX
+#define IOV_MAX	1024
+#endif
+
+/* I/O settings */
+static int rec_io_threads = 2;
+static size_t rec_budget = 64*1024*1024;
+static janus_recorder_overflow rec_overflow = JANUS_RECORDER_OVERFLOW_DROP;
+/* Pool of staging buffers */
+static GQueue rec_chunks = G_QUEUE_INIT;
+static size_t rec_chunks_allocated = 0;
+static janus_mutex rec_chunks_mutex = JANUS_MUTEX_INITIALIZER;
+static janus_condition rec_chunks_cond = PTHREAD_COND_INITIALIZER;
+/* I/O threads, and the queue of recorders waiting for them */
+static GThread **rec_threads = NULL;
+static GAsyncQueue *rec_queue = NULL;
+static janus_recorder rec_exit;
+static void *janus_recorder_io_thread(void *data);
+/* Indexes waiting for the I/O threads to sort and save them, when recordings are closed */
+typedef struct janus_recorder_index_job {
+	janus_recorder_index *index;
+	char *path;
+	guint64 file_size;
+} janus_recorder_index_job;
+static GAsyncQueue *rec_index_queue = NULL;
+/* Sentinel we queue to have an I/O thread take care of the queued indexes */
+static janus_recorder rec_index_wakeup;
+/* Open recorders, which the I/O threads check regularly for stale data */
+static GList *rec_recorders = NULL;
+static gint64 rec_last_sweep = 0;
+static janus_mutex rec_recorders_mutex = JANUS_MUTEX_INITIALIZER;
+
+/* Sort and save an index, and get rid of it */
+static void janus_recorder_index_job_run(janus_recorder_index_job *job) {
+	if(janus_recorder_index_save(job->index, job->path, job->file_size) == 0)
+		JANUS_LOG(LOG_INFO, "Index saved (%zu packets): %s\n", job->index->count, job->path);
+	janus_recorder_index_free(job->index);
+	g_free(job->path);
+	g_free(job);
+}
+
+void janus_recorder_set_io(int threads, size_t budget, janus_recorder_overflow overflow) {
+	if(threads > 0)
+		rec_io_threads = threads;
+	/* Make sure there's room for at least a few chunks per thread */
+	if(budget > 0)
+		rec_budget = MAX(budget, (size_t)(4*rec_io_threads*JANUS_RECORDER_CHUNK_SIZE));
+	rec_overflow = overflow;
+}
+
+void janus_recorder_set_index(gboolean enabled) {
+	rec_index = enabled;
+}
 
 void janus_recorder_init(gboolean tempnames, const char *extension) {
 	JANUS_LOG(LOG_INFO, "Initializing recorder code\n");
+	JANUS_LOG(LOG_INFO, "  -- Using %d I/O threads, and up to %zuKB for staging buffers (%s when full)\n",
+		rec_io_threads, rec_budget/1024, rec_overflow == JANUS_RECORDER_OVERFLOW_WAIT ? "wait" : "drop");
+	rec_queue = g_async_queue_new();
+	rec_index_queue = g_async_queue_new();
+	rec_threads = g_malloc0(rec_io_threads * sizeof(GThread *));
+	int i = 0;
+	for(i=0; i<rec_io_threads; i++) {
+		GError *error = NULL;
+		char tname[16];
+		g_snprintf(tname, sizeof(tname), "recorder io %d", i);
+		rec_threads[i] = g_thread_try_new(tname, &janus_recorder_io_thread, NULL, &error);
+		if(error != NULL) {
+			/* We can live with fewer threads, as long as there's at least one */
+			JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the recorder I/O thread...\n", error->code, error->message ? error->message : "??");
+			g_error_free(error);
+			break;
+		}
+	}
+	if(i == 0) {
+		JANUS_LOG(LOG_FATAL, "No recorder I/O thread could be started, recordings will fail\n");
+	}
+	rec_io_threads = i;
 	if(tempnames) {
 		rec_tempname = TRUE;
 		if(extension == NULL) {
@@ -56,11 +169,322 @@ void janus_recorder_init(gboolean tempnames, const char *extension) {
 }
 
 void janus_recorder_deinit(void) {
+	/* Stop the I/O threads */
+	int i = 0;
+	for(i=0; i<rec_io_threads; i++)
+		g_async_queue_push(rec_queue, &rec_exit);
+	for(i=0; i<rec_io_threads; i++)
+		g_thread_join(rec_threads[i]);
+	g_free(rec_threads);
+	rec_threads = NULL;
+	g_async_queue_unref(rec_queue);
+	rec_queue = NULL;
+	/* Save the indexes the I/O threads didn't get to */
+	janus_recorder_index_job *job = NULL;
+	while((job = g_async_queue_try_pop(rec_index_queue)) != NULL)
+		janus_recorder_index_job_run(job);
+	g_async_queue_unref(rec_index_queue);
+	rec_index_queue = NULL;
+	/* Get rid of the staging buffers */
+	janus_mutex_lock(&rec_chunks_mutex);
+	janus_recorder_chunk *chunk = NULL;
+	while((chunk = g_queue_pop_head(&rec_chunks)) != NULL)
+		g_free(chunk);
+	rec_chunks_allocated = 0;
+	janus_mutex_unlock(&rec_chunks_mutex);
 	rec_tempname = FALSE;
 	g_free(rec_tempext);
 }
 
 
+/* Get a staging buffer from the pool, or allocate one if the budget allows it */
+static janus_recorder_chunk *janus_recorder_chunk_get(void) {
+	janus_recorder_chunk *chunk = NULL;
+	janus_mutex_lock(&rec_chunks_mutex);
+	chunk = g_queue_pop_head(&rec_chunks);
+	if(chunk == NULL && rec_chunks_allocated + sizeof(janus_recorder_chunk) <= rec_budget) {
+		chunk = g_malloc(sizeof(janus_recorder_chunk));
+		rec_chunks_allocated += sizeof(janus_recorder_chunk);
+	}
+	janus_mutex_unlock(&rec_chunks_mutex);
+	if(chunk != NULL) {
+		chunk->size = 0;
+		chunk->written = 0;
+		chunk->created = 0;
+	}
+	return chunk;
+}
+
+/* Wait for the I/O threads to give some staging buffers back, until a deadline
+ * (real time): this must not be called with a recorder mutex locked, as the
+ * I/O threads need it to write the data that would give the buffers back */
+static gboolean janus_recorder_chunk_wait(gint64 deadline) {
+	janus_mutex_lock(&rec_chunks_mutex);
+	while(g_queue_is_empty(&rec_chunks) && rec_chunks_allocated + sizeof(janus_recorder_chunk) > rec_budget) {
+		if(janus_get_real_time() >= deadline)
+			break;
+		struct timespec ts;
+		ts.tv_sec = deadline / G_USEC_PER_SEC;
+		ts.tv_nsec = (deadline % G_USEC_PER_SEC) * 1000;
+		janus_condition_timedwait(&rec_chunks_cond, &rec_chunks_mutex, &ts);
+	}
+	gboolean room = !g_queue_is_empty(&rec_chunks) || rec_chunks_allocated + sizeof(janus_recorder_chunk) <= rec_budget;
+	janus_mutex_unlock(&rec_chunks_mutex);
+	return room;
+}
+
+/* Give a staging buffer back to the pool */
+static void janus_recorder_chunk_release(janus_recorder_chunk *chunk) {
+	if(chunk == NULL)
+		return;
+	janus_mutex_lock(&rec_chunks_mutex);
+	g_queue_push_head(&rec_chunks, chunk);
+	janus_condition_signal(&rec_chunks_cond);
+	janus_mutex_unlock(&rec_chunks_mutex);
+}
+
+/* Hand a recorder to the I/O threads, unless it's been handed already */
+static void janus_recorder_schedule(janus_recorder *recorder) {
+	if(rec_queue != NULL && g_atomic_int_compare_and_exchange(&recorder->scheduled, 0, 1))
+		g_async_queue_push(rec_queue, recorder);
+}
+
+/* Queue the current staging buffer of a recorder for writing (recorder->mutex locked) */
+static void janus_recorder_seal(janus_recorder *recorder) {
+	janus_recorder_chunk *chunk = recorder->chunk;
+	if(chunk == NULL)
+		return;
+	recorder->chunk = NULL;
+	if(chunk->size == 0) {
+		janus_recorder_chunk_release(chunk);
+		return;
+	}
+	if(g_queue_is_empty(recorder->pending))
+		recorder->pending_since = chunk->created;
+	g_queue_push_tail(recorder->pending, chunk);
+}
+
+/* Make sure there's room for len more bytes in the staging buffers of a recorder (recorder->mutex locked) */
+static gboolean janus_recorder_reserve(janus_recorder *recorder, size_t len) {
+	size_t room = recorder->chunk ? (JANUS_RECORDER_CHUNK_SIZE - recorder->chunk->size) : 0;
+	room += g_queue_get_length(recorder->spare) * JANUS_RECORDER_CHUNK_SIZE;
+	while(room < len) {
+		janus_recorder_chunk *chunk = janus_recorder_chunk_get();
+		if(chunk == NULL)
+			return FALSE;
+		g_queue_push_tail(recorder->spare, chunk);
+		room += JANUS_RECORDER_CHUNK_SIZE;
+	}
+	return TRUE;
+}
+
+/* Same as janus_recorder_reserve(), but waiting a bit for room if overflow is set to
+ * wait: the mutex is released while waiting, so the state of the recorder may change
+ * in the meanwhile (recorder->mutex locked) */
+static gboolean janus_recorder_reserve_wait(janus_recorder *recorder, size_t len) {
+	gint64 deadline = 0;
+	while(!janus_recorder_reserve(recorder, len)) {
+		if(rec_overflow != JANUS_RECORDER_OVERFLOW_WAIT)
+			return FALSE;
+		if(deadline == 0)
+			deadline = janus_get_real_time() + JANUS_RECORDER_OVERFLOW_WAIT_MAX;
+		/* Make sure what we have staged gets written, to free some room */
+		if(!g_queue_is_empty(recorder->pending))
+			janus_recorder_schedule(recorder);
+		janus_mutex_unlock_nodebug(&recorder->mutex);
+		gboolean room = janus_recorder_chunk_wait(deadline);
+		janus_mutex_lock_nodebug(&recorder->mutex);
+		if(!room || !recorder->writable || recorder->failed)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Copy data to the staging buffers of a recorder, after janus_recorder_reserve() (recorder->mutex locked) */
+static void janus_recorder_stage(janus_recorder *recorder, const void *data, size_t len) {
+	const char *buffer = (const char *)data;
+	while(len > 0) {
+		if(recorder->chunk != NULL && recorder->chunk->size == JANUS_RECORDER_CHUNK_SIZE)
+			janus_recorder_seal(recorder);
+		if(recorder->chunk == NULL) {
+			recorder->chunk = g_queue_pop_head(recorder->spare);
+			recorder->chunk->created = janus_get_monotonic_time();
+		}
+		janus_recorder_chunk *chunk = recorder->chunk;
+		size_t bytes = MIN(len, JANUS_RECORDER_CHUNK_SIZE - chunk->size);
+		memcpy(chunk->data + chunk->size, buffer, bytes);
+		chunk->size += bytes;
+		recorder->stats.queued += bytes;
+		recorder->size += bytes;
+		buffer += bytes;
+		len -= bytes;
+	}
+	if(recorder->stats.queued > recorder->stats.queued_max)
+		recorder->stats.queued_max = recorder->stats.queued;
+}
+
+/* Check if the staged data of a recorder should be written now (recorder->mutex locked) */
+static void janus_recorder_check_flush(janus_recorder *recorder) {
+	gint64 now = janus_get_monotonic_time();
+	if(recorder->chunk != NULL && recorder->chunk->size > 0 &&
+			now - recorder->chunk->created >= JANUS_RECORDER_FLUSH_INTERVAL) {
+		/* This staging buffer has been around for a while, don't wait for it to be full */
+		janus_recorder_seal(recorder);
+	}
+	if(g_queue_is_empty(recorder->pending))
+		return;
+	if(g_queue_get_length(recorder->pending) * JANUS_RECORDER_CHUNK_SIZE >= JANUS_RECORDER_FLUSH_BYTES ||
+			now - recorder->pending_since >= JANUS_RECORDER_FLUSH_INTERVAL)
+		janus_recorder_schedule(recorder);
+}
+
+/* Check all the open recorders for stale data: recorders only check that
+ * themselves when saving a frame, which an idle recorder won't do */
+static void janus_recorder_sweep(void) {
+	gint64 now = janus_get_monotonic_time();
+	janus_mutex_lock(&rec_recorders_mutex);
+	if(now - rec_last_sweep < JANUS_RECORDER_FLUSH_INTERVAL/2) {
+		janus_mutex_unlock(&rec_recorders_mutex);
+		return;
+	}
+	rec_last_sweep = now;
+	GList *l = rec_recorders;
+	while(l) {
+		janus_recorder *recorder = (janus_recorder *)l->data;
+		janus_mutex_lock_nodebug(&recorder->mutex);
+		if(recorder->writable && !recorder->failed)
+			janus_recorder_check_flush(recorder);
+		janus_mutex_unlock_nodebug(&recorder->mutex);
+		l = l->next;
+	}
+	janus_mutex_unlock(&rec_recorders_mutex);
+}
+
+/* Get rid of all the staged data of a recorder, after we gave up on it (recorder->mutex locked) */
+static void janus_recorder_discard(janus_recorder *recorder) {
+	janus_recorder_chunk *chunk = NULL;
+	while((chunk = g_queue_pop_head(recorder->pending)) != NULL) {
+		recorder->stats.queued -= chunk->size - chunk->written;
+		janus_recorder_chunk_release(chunk);
+	}
+}
+
+/* Thread writing the staged data of recorders to disk */
+static void *janus_recorder_io_thread(void *data) {
+	JANUS_LOG(LOG_VERB, "Joining recorder I/O thread\n");
+	struct iovec iov[IOV_MAX];
+	janus_recorder_chunk *chunks[IOV_MAX];
+	while(TRUE) {
+		/* Don't wait forever, as we also take care of flushing idle recorders */
+		janus_recorder *recorder = g_async_queue_timeout_pop(rec_queue, JANUS_RECORDER_FLUSH_INTERVAL/2);
+		if(recorder == &rec_exit)
+			break;
+		janus_recorder_sweep();
+		if(recorder == NULL)
+			continue;
+		if(recorder == &rec_index_wakeup) {
+			/* A recording was closed, and its index needs saving */
+			janus_recorder_index_job *job = g_async_queue_try_pop(rec_index_queue);
+			if(job != NULL)
+				janus_recorder_index_job_run(job);
+			continue;
+		}
+		/* Take all the staging buffers queued so far */
+		janus_mutex_lock_nodebug(&recorder->mutex);
+		int num = 0;
+		while(num < IOV_MAX && !g_queue_is_empty(recorder->pending)) {
+			chunks[num] = g_queue_pop_head(recorder->pending);
+			iov[num].iov_base = chunks[num]->data + chunks[num]->written;
+			iov[num].iov_len = chunks[num]->size - chunks[num]->written;
+			num++;
+		}
+		if(!g_queue_is_empty(recorder->pending))
+			recorder->pending_since = ((janus_recorder_chunk *)g_queue_peek_head(recorder->pending))->created;
+		int fd = recorder->fd;
+		off_t offset = recorder->offset;
+		gboolean failed = recorder->failed;
+		janus_mutex_unlock_nodebug(&recorder->mutex);
+		/* Write them all at once, outside of the lock */
+		gint64 start = janus_get_monotonic_time();
+		ssize_t written = 0;
+		int first = 0, error = 0;
+		while(!failed && first < num) {
+			ssize_t res = pwritev(fd, iov+first, num-first, offset+written);
+			if(res < 0 && errno == EINTR)
+				continue;
+			if(res <= 0) {
+				error = res < 0 ? errno : EIO;
+				break;
+			}
+			written += res;
+			/* Take care of partial writes */
+			while(first < num && (size_t)res >= iov[first].iov_len) {
+				res -= iov[first].iov_len;
+				first++;
+			}
+			if(first < num) {
+				iov[first].iov_base = (char *)iov[first].iov_base + res;
+				iov[first].iov_len -= res;
+			}
+		}
+		gint64 latency = janus_get_monotonic_time() - start;
+		/* Give back the staging buffers that were written */
+		int i = 0;
+		for(i=0; i<first; i++)
+			janus_recorder_chunk_release(chunks[i]);
+		/* Update the statistics, and check if there's more to write: we only
+		 * move on by what was actually written, so that there are no holes */
+		janus_mutex_lock_nodebug(&recorder->mutex);
+		recorder->offset += written;
+		recorder->stats.written += written;
+		recorder->stats.queued -= written;
+		if(first < num) {
+			if(!failed) {
+				JANUS_LOG(LOG_ERR, "Error saving frames to %s: %d (%s)\n", recorder->filename, error, strerror(error));
+				recorder->stats.errors++;
+				recorder->failures++;
+			}
+			if(!recorder->failed && recorder->failures < JANUS_RECORDER_MAX_FAILURES) {
+				/* Put what we couldn't write back in the queue, we'll try again later */
+				chunks[first]->written = chunks[first]->size - iov[first].iov_len;
+				for(i=num-1; i>=first; i--)
+					g_queue_push_head(recorder->pending, chunks[i]);
+				recorder->pending_since = janus_get_monotonic_time();
+			} else {
+				/* Writing keeps failing: give up, rather than leaving holes in the file */
+				if(!recorder->failed) {
+					JANUS_LOG(LOG_ERR, "Too many errors saving frames to %s, giving up on the recording\n", recorder->filename);
+					recorder->failed = 1;
+				}
+				for(i=first; i<num; i++) {
+					recorder->stats.queued -= iov[i].iov_len;
+					janus_recorder_chunk_release(chunks[i]);
+				}
+				janus_recorder_discard(recorder);
+			}
+		} else {
+			recorder->failures = 0;
+		}
+		recorder->stats.writes++;
+		recorder->stats.latency_last = latency;
+		if(latency > recorder->stats.latency_max)
+			recorder->stats.latency_max = latency;
+		recorder->stats.latency_total += latency;
+		g_atomic_int_set(&recorder->scheduled, 0);
+		if(!g_queue_is_empty(recorder->pending)) {
+			/* Either more data was staged in the meanwhile, or we're closing */
+			if(!recorder->writable || g_queue_get_length(recorder->pending) * JANUS_RECORDER_CHUNK_SIZE >= JANUS_RECORDER_FLUSH_BYTES ||
+					janus_get_monotonic_time() - recorder->pending_since >= JANUS_RECORDER_FLUSH_INTERVAL)
+				janus_recorder_schedule(recorder);
+		}
+		janus_condition_broadcast(&recorder->cond);
+		janus_mutex_unlock_nodebug(&recorder->mutex);
+	}
+	JANUS_LOG(LOG_VERB, "Leaving recorder I/O thread\n");
+	return NULL;
+}
+
+
 janus_recorder *janus_recorder_create(const char *dir, const char *codec, const char *filename) {
 	janus_recorder_medium type = JANUS_RECORDER_AUDIO;
 	if(codec == NULL) {
@@ -89,7 +513,7 @@ janus_recorder *janus_recorder_create(const char *dir, const char *codec, const
 	}
 	rc->dir = NULL;
 	rc->filename = NULL;
-	rc->file = NULL;
+	rc->fd = -1;
 	rc->codec = g_strdup(codec);
 	rc->created = janus_get_real_time();
 	if(dir != NULL) {
@@ -141,15 +565,15 @@ janus_recorder *janus_recorder_create(const char *dir, const char *codec, const
 	}
 	/* Try opening the file now */
 	if(dir == NULL) {
-		rc->file = fopen(newname, "wb");
+		rc->fd = open(newname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 	} else {
 		char path[1024];
 		memset(path, 0, 1024);
 		g_snprintf(path, 1024, "%s/%s", dir, newname);
-		rc->file = fopen(path, "wb");
+		rc->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 	}
-	if(rc->file == NULL) {
-		JANUS_LOG(LOG_ERR, "fopen error: %d\n", errno);
+	if(rc->fd < 0) {
+		JANUS_LOG(LOG_ERR, "open error: %d\n", errno);
 		return NULL;
 	}
 	if(dir)
@@ -157,11 +581,27 @@ janus_recorder *janus_recorder_create(const char *dir, const char *codec, const
 	rc->filename = g_strdup(newname);
 	rc->type = type;
 	/* Write the first part of the header */
-	fwrite(header, sizeof(char), strlen(header), rc->file);
+	const char *signature = header;
+	if(rec_index && type != JANUS_RECORDER_DATA) {
+		/* We'll also save an index of the frames when closing */
+		signature = header_indexed;
+		rc->index = janus_recorder_index_create();
+	}
+	if(write(rc->fd, signature, strlen(signature)) != (ssize_t)strlen(signature)) {
+		JANUS_LOG(LOG_ERR, "Error writing the header of %s: %d\n", rc->filename, errno);
+	}
+	rc->offset = strlen(signature);
+	rc->size = rc->offset;
 	rc->writable = 1;
 	/* We still need to also write the info header first */
 	rc->header = 0;
+	rc->spare = g_queue_new();
+	rc->pending = g_queue_new();
 	janus_mutex_init(&rc->mutex);
+	janus_condition_init(&rc->cond);
+	janus_mutex_lock(&rec_recorders_mutex);
+	rec_recorders = g_list_prepend(rec_recorders, rc);
+	janus_mutex_unlock(&rec_recorders_mutex);
 	return rc;
 }
 
@@ -173,11 +613,11 @@ int janus_recorder_save_frame(janus_recorder *recorder, char *buffer, uint lengt
 		janus_mutex_unlock_nodebug(&recorder->mutex);
 		return -2;
 	}
-	if(!recorder->file) {
+	if(recorder->fd < 0) {
 		janus_mutex_unlock_nodebug(&recorder->mutex);
 		return -3;
 	}
-	if(!recorder->writable) {
+	if(!recorder->writable || recorder->failed) {
 		janus_mutex_unlock_nodebug(&recorder->mutex);
 		return -4;
 	}
@@ -199,47 +639,111 @@ int janus_recorder_save_frame(janus_recorder *recorder, char *buffer, uint lengt
 		gchar *info_text = json_dumps(info, JSON_PRESERVE_ORDER);
 		json_decref(info);
 		uint16_t info_bytes = htons(strlen(info_text));
-		fwrite(&info_bytes, sizeof(uint16_t), 1, recorder->file);
-		fwrite(info_text, sizeof(char), strlen(info_text), recorder->file);
+		if(!janus_recorder_reserve_wait(recorder, sizeof(uint16_t) + strlen(info_text))) {
+			/* We'll try again with the next frame */
+			free(info_text);
+			recorder->stats.dropped++;
+			janus_mutex_unlock_nodebug(&recorder->mutex);
+			return -5;
+		}
+		janus_recorder_stage(recorder, &info_bytes, sizeof(uint16_t));
+		janus_recorder_stage(recorder, info_text, strlen(info_text));
 		free(info_text);
 		/* Done */
 		recorder->header = 1;
 	}
+	/* Make sure there's room for the whole frame: if not, we drop it */
+	size_t needed = strlen(frame_header) + sizeof(uint16_t) + length;
+	if(recorder->type == JANUS_RECORDER_DATA)
+		needed += sizeof(gint64);
+	if(!janus_recorder_reserve_wait(recorder, needed)) {
+		recorder->stats.dropped++;
+		if(recorder->stats.dropped == 1 || recorder->stats.dropped % 1000 == 0) {
+			JANUS_LOG(LOG_WARN, "Recorder I/O can't keep up, dropped %"SCNu64" frames so far: %s\n",
+				recorder->stats.dropped, recorder->filename);
+		}
+		/* Make sure what we have staged gets written, to free some room */
+		if(!g_queue_is_empty(recorder->pending))
+			janus_recorder_schedule(recorder);
+		janus_mutex_unlock_nodebug(&recorder->mutex);
+		return -5;
+	}
 	/* Write frame header */
-	fwrite(frame_header, sizeof(char), strlen(frame_header), recorder->file);
+	janus_recorder_stage(recorder, frame_header, strlen(frame_header));
 	uint16_t header_bytes = htons(recorder->type == JANUS_RECORDER_DATA ? (length+sizeof(gint64)) : length);
-	fwrite(&header_bytes, sizeof(uint16_t), 1, recorder->file);
+	janus_recorder_stage(recorder, &header_bytes, sizeof(uint16_t));
 	if(recorder->type == JANUS_RECORDER_DATA) {
 		/* If it's data, then we need to prepend timing related info, as it's not there by itself */
 		gint64 now = htonll(janus_get_real_time());
-		fwrite(&now, sizeof(gint64), 1, recorder->file);
-	}
-	/* Save packet on file */
-	int temp = 0, tot = length;
-	while(tot > 0) {
-		temp = fwrite(buffer+length-tot, sizeof(char), tot, recorder->file);
-		if(temp <= 0) {
-			JANUS_LOG(LOG_ERR, "Error saving frame...\n");
-			janus_mutex_unlock_nodebug(&recorder->mutex);
-			return -5;
+		janus_recorder_stage(recorder, &now, sizeof(gint64));
+	}
+	if(recorder->index != NULL && length >= 12) {
+		/* Keep track of where the packet is, and whether it's the start of a keyframe */
+		rtp_header *rtp = (rtp_header *)buffer;
+		gboolean keyframe = FALSE;
+		if(recorder->type == JANUS_RECORDER_VIDEO) {
+			int plen = 0;
+			char *payload = janus_rtp_payload(buffer, length, &plen);
+			if(payload != NULL) {
+				if(!strcasecmp(recorder->codec, "vp8"))
+					keyframe = janus_vp8_is_keyframe(payload, plen);
+				else if(!strcasecmp(recorder->codec, "vp9"))
+					keyframe = janus_vp9_is_keyframe(payload, plen);
+				else if(!strcasecmp(recorder->codec, "h264"))
+					keyframe = janus_h264_is_keyframe(payload, plen);
+			}
 		}
-		tot -= temp;
+		janus_recorder_index_add(recorder->index, recorder->size, ntohl(rtp->timestamp),
+			ntohs(rtp->seq_number), length, keyframe);
 	}
+	/* Save packet: the I/O threads will write it to the file later */
+	janus_recorder_stage(recorder, buffer, length);
+	recorder->stats.frames++;
+	janus_recorder_check_flush(recorder);
 	/* Done */
 	janus_mutex_unlock_nodebug(&recorder->mutex);
 	return 0;
 }
 
+void janus_recorder_get_stats(janus_recorder *recorder, janus_recorder_stats *stats) {
+	if(!recorder || !stats)
+		return;
+	janus_mutex_lock_nodebug(&recorder->mutex);
+	*stats = recorder->stats;
+	janus_mutex_unlock_nodebug(&recorder->mutex);
+	stats->latency_avg = stats->writes ? stats->latency_total/(gint64)stats->writes : 0;
+}
+
 int janus_recorder_close(janus_recorder *recorder) {
 	if(!recorder || !recorder->writable)
 		return -1;
+	/* The I/O threads don't need to check this recorder for stale data anymore */
+	janus_mutex_lock(&rec_recorders_mutex);
+	rec_recorders = g_list_remove(rec_recorders, recorder);
+	janus_mutex_unlock(&rec_recorders_mutex);
 	janus_mutex_lock_nodebug(&recorder->mutex);
 	recorder->writable = 0;
-	if(recorder->file) {
-		fseek(recorder->file, 0L, SEEK_END);
-		size_t fsize = ftell(recorder->file);
-		fseek(recorder->file, 0L, SEEK_SET);
-		JANUS_LOG(LOG_INFO, "File is %zu bytes: %s\n", fsize, recorder->filename);
+	/* Have the I/O threads write whatever is still staged, and wait for them */
+	janus_recorder_seal(recorder);
+	janus_recorder_chunk *chunk = NULL;
+	while((chunk = g_queue_pop_head(recorder->spare)) != NULL)
+		janus_recorder_chunk_release(chunk);
+	if(rec_io_threads > 0) {
+		while(!g_queue_is_empty(recorder->pending) || g_atomic_int_get(&recorder->scheduled)) {
+			if(!g_queue_is_empty(recorder->pending))
+				janus_recorder_schedule(recorder);
+			janus_condition_wait(&recorder->cond, &recorder->mutex);
+		}
+	} else {
+		while((chunk = g_queue_pop_head(recorder->pending)) != NULL)
+			janus_recorder_chunk_release(chunk);
+		recorder->stats.queued = 0;
+	}
+	if(recorder->fd > -1) {
+		JANUS_LOG(LOG_INFO, "File is %zu bytes: %s\n", (size_t)recorder->offset, recorder->filename);
+		JANUS_LOG(LOG_VERB, "  -- %"SCNu64" frames saved, %"SCNu64" dropped, %"SCNu64" writes (max %"SCNi64"us), up to %zu bytes queued\n",
+			recorder->stats.frames, recorder->stats.dropped, recorder->stats.writes,
+			recorder->stats.latency_max, recorder->stats.queued_max);
 	}
 	if(rec_tempname) {
 		/* We need to rename the file, to remove the temporary extension */
@@ -265,6 +769,26 @@ int janus_recorder_close(janus_recorder *recorder) {
 			recorder->filename = g_strdup(newname);
 		}
 	}
+	if(recorder->index != NULL) {
+		/* Save the index of the frames next to the recording: sorting and writing
+		 * it may take a while for long recordings, so an I/O thread does that */
+		char path[1024];
+		if(recorder->dir)
+			g_snprintf(path, 1024, "%s/%s.%s", recorder->dir, recorder->filename, JANUS_RECORDER_INDEX_EXTENSION);
+		else
+			g_snprintf(path, 1024, "%s.%s", recorder->filename, JANUS_RECORDER_INDEX_EXTENSION);
+		janus_recorder_index_job *job = g_malloc0(sizeof(janus_recorder_index_job));
+		job->index = recorder->index;
+		job->path = g_strdup(path);
+		job->file_size = recorder->offset;
+		recorder->index = NULL;
+		if(rec_io_threads > 0 && rec_index_queue != NULL) {
+			g_async_queue_push(rec_index_queue, job);
+			g_async_queue_push(rec_queue, &rec_index_wakeup);
+		} else {
+			janus_recorder_index_job_run(job);
+		}
+	}
 	janus_mutex_unlock_nodebug(&recorder->mutex);
 	return 0;
 }
@@ -278,8 +802,15 @@ int janus_recorder_free(janus_recorder *recorder) {
 	recorder->dir = NULL;
 	g_free(recorder->filename);
 	recorder->filename = NULL;
-	fclose(recorder->file);
-	recorder->file = NULL;
+	if(recorder->fd > -1)
+		close(recorder->fd);
+	recorder->fd = -1;
+	g_queue_free(recorder->spare);
+	recorder->spare = NULL;
+	g_queue_free(recorder->pending);
+	recorder->pending = NULL;
+	janus_recorder_index_free(recorder->index);
+	recorder->index = NULL;
 	g_free(recorder->codec);
 	recorder->codec = NULL;
 	janus_mutex_unlock_nodebug(&recorder->mutex);
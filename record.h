@@ -11,6 +11,19 @@
  * \note If you want to record both audio and video, you'll have to use
  * two different recorders. Any muxing in the same container will have
  * to be done in the post-processing phase.
+ *
+ * Saving a frame never touches the disk: frames are only copied to the
+ * staging buffers of the recorder, which are handed to a small pool of
+ * I/O threads to be written, in large vectored writes, when enough data
+ * has been collected or some time has passed. The memory that can be
+ * used for staging buffers is bounded: when the I/O threads can't keep
+ * up, new frames are dropped, optionally after waiting a bit for some
+ * room to become available (see janus_recorder_set_io()).
+ *
+ * Audio and video recordings can optionally come with an index of their
+ * frames (see janus_recorder_set_index() and record-index.h), which
+ * allows readers to open them and seek into them without having to scan
+ * the whole file first.
  * 
  * \ingroup core
  * \ref core
@@ -24,7 +37,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <glib.h>
+
 #include "mutex.h"
+#include "record-index.h"
 
 
 /*! \brief Media types we can record */
@@ -34,14 +50,57 @@ typedef enum janus_recorder_medium {
 	JANUS_RECORDER_DATA
 } janus_recorder_medium;
 
+/*! \brief What to do when there's no room left to stage a frame */
+typedef enum janus_recorder_overflow {
+	/*! \brief Drop the frame right away */
+	JANUS_RECORDER_OVERFLOW_DROP = 0,
+	/*! \brief Wait a little for the I/O threads to free some room, and drop the frame if they don't */
+	JANUS_RECORDER_OVERFLOW_WAIT
+} janus_recorder_overflow;
+
+/*! \brief Statistics on a recorder */
+typedef struct janus_recorder_stats {
+	/*! \brief Frames that were saved */
+	guint64 frames;
+	/*! \brief Frames that were dropped, because there was no room to stage them */
+	guint64 dropped;
+	/*! \brief Bytes written to the file */
+	guint64 written;
+	/*! \brief Writes performed by the I/O threads */
+	guint64 writes;
+	/*! \brief Writes that failed */
+	guint64 errors;
+	/*! \brief How long the last write took, in microseconds */
+	gint64 latency_last;
+	/*! \brief How long the slowest write took, in microseconds */
+	gint64 latency_max;
+	/*! \brief How long writes took on average, in microseconds */
+	gint64 latency_avg;
+	/*! \brief How long all writes took, in microseconds */
+	gint64 latency_total;
+	/*! \brief Bytes currently staged and waiting to be written */
+	size_t queued;
+	/*! \brief Maximum number of bytes that were ever waiting to be written */
+	size_t queued_max;
+} janus_recorder_stats;
+
+/*! \brief Staging buffer for a recorder (opaque) */
+typedef struct janus_recorder_chunk janus_recorder_chunk;
+
 /*! \brief Structure that represents a recorder */
 typedef struct janus_recorder {
 	/*! \brief Absolute path to the directory where the recorder file is stored */ 
 	char *dir;
 	/*! \brief Filename of this recorder file */ 
 	char *filename;
-	/*! \brief Recording file */
-	FILE *file;
+	/*! \brief Recording file descriptor */
+	int fd;
+	/*! \brief Offset in the file the I/O threads will write the next staged data at */
+	off_t offset;
+	/*! \brief Size the file will have when everything staged so far has been written */
+	guint64 size;
+	/*! \brief Index of the frames in the recording, if enabled */
+	janus_recorder_index *index;
 	/*! \brief Codec the packets to record are encoded in ("vp8", "opus", "h264", "g711", "vp9") */
 	char *codec;
 	/*! \brief When the recording file has been created */
@@ -52,10 +111,38 @@ typedef struct janus_recorder {
 	int header:1;
 	/*! \brief Whether this recorder instance can be used for writing or not */ 
 	int writable:1;
+	/*! \brief Whether writing to the file kept failing, and we gave up on it */
+	int failed:1;
+	/*! \brief How many writes in a row failed */
+	int failures;
+	/*! \brief Staging buffer frames are currently copied to */
+	janus_recorder_chunk *chunk;
+	/*! \brief Staging buffers reserved for the frame being saved */
+	GQueue *spare;
+	/*! \brief Full staging buffers, waiting to be written by the I/O threads */
+	GQueue *pending;
+	/*! \brief When the oldest of the pending staging buffers was started */
+	gint64 pending_since;
+	/*! \brief Whether this recorder is queued to, or being written by, an I/O thread */
+	volatile gint scheduled;
+	/*! \brief Statistics on this recorder */
+	janus_recorder_stats stats;
 	/*! \brief Mutex to lock/unlock this recorder instance */ 
 	janus_mutex mutex;
+	/*! \brief Condition to wait for the I/O threads to write everything, when closing */
+	janus_condition cond;
 } janus_recorder;
 
+/*! \brief Configure how recordings are written to disk
+ * \note This must be called before janus_recorder_init() to have any effect
+ * @param[in] threads Number of I/O threads writing recordings to disk (default=2)
+ * @param[in] budget Maximum amount of memory, in bytes, to use for frames waiting to be written (default=64MB)
+ * @param[in] overflow What to do with frames when the budget has been used up */
+void janus_recorder_set_io(int threads, size_t budget, janus_recorder_overflow overflow);
+/*! \brief Configure whether audio/video recordings should come with a frame index
+ * \note This must be called before janus_recorder_init() to have any effect
+ * @param[in] enabled Whether an index should be saved next to each recording */
+void janus_recorder_set_index(gboolean enabled);
 /*! \brief Initialize the recorder code
  * @param[in] tempnames Whether the filenames should have a temporary extension, while saving, or not
  * @param[in] extension Extension to add in case tempnames is true */
@@ -72,12 +159,20 @@ void janus_recorder_deinit(void);
  * @returns A valid janus_recorder instance in case of success, NULL otherwise */
 janus_recorder *janus_recorder_create(const char *dir, const char *codec, const char *filename);
 /*! \brief Save an RTP frame in the recorder
+ * \note The frame is only copied to a staging buffer, and written to
+ * disk later on by an I/O thread: as such, this never blocks on the disk
  * @param[in] recorder The janus_recorder instance to save the frame to
  * @param[in] buffer The frame data to save
  * @param[in] length The frame data length
  * @returns 0 in case of success, a negative integer otherwise */
 int janus_recorder_save_frame(janus_recorder *recorder, char *buffer, uint length);
+/*! \brief Get the statistics of a recorder
+ * @param[in] recorder The janus_recorder instance
+ * @param[out] stats Where to write the statistics */
+void janus_recorder_get_stats(janus_recorder *recorder, janus_recorder_stats *stats);
 /*! \brief Close the recorder
+ * \note This waits for the I/O threads to write whatever is still staged,
+ * while the index of the frames, if any, is saved by an I/O thread shortly after
  * @param[in] recorder The janus_recorder instance to close
  * @returns 0 in case of success, a negative integer otherwise */
 int janus_recorder_close(janus_recorder *recorder);
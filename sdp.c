@@ -278,6 +278,9 @@ int janus_sdp_process(void *ice_handle, janus_sdp *remote_sdp) {
 				g_free(stream->rpass);
 			stream->rpass = g_strdup(rpass);
 		}
+		/* Keep track of the payload types we may get on this stream */
+		if(m->type == JANUS_SDP_AUDIO || m->type == JANUS_SDP_VIDEO)
+			janus_ice_stream_set_payload_types(stream, m->type == JANUS_SDP_VIDEO, m->ptypes);
 		/* Now look for candidates and other info */
 		tempA = m->attributes;
 		while(tempA) {
@@ -344,6 +347,8 @@ int janus_sdp_process(void *ice_handle, janus_sdp *remote_sdp) {
 			}
 			tempA = tempA->next;
 		}
+		/* Update the table we use to classify incoming packets by SSRC */
+		janus_ice_stream_update_peer_ssrcs(stream);
 		temp = temp->next;
 	}
 	if(ruser)
@@ -615,6 +620,7 @@ int janus_sdp_parse_ssrc_group(void *ice_stream, const char *group_attr, int vid
 					case 3:
 						if(fid) {
 							JANUS_LOG(LOG_WARN, "[%"SCNu64"] Found one too many retransmission SSRC (rtx): %"SCNu64"\n", handle->handle_id, ssrc);
+							janus_ice_stream_add_peer_ssrc(stream, ssrc, JANUS_ICE_SSRC_VIDEO_RTX, 0);
 						} else if(sim) {
 							stream->video_ssrc_peer_sim_2 = ssrc;
 							JANUS_LOG(LOG_VERB, "[%"SCNu64"] Peer video SSRC (sim-2): %"SCNu32"\n", handle->handle_id, stream->video_ssrc_peer_sim_2);
@@ -623,7 +629,13 @@ int janus_sdp_parse_ssrc_group(void *ice_stream, const char *group_attr, int vid
 						}
 						break;
 					default:
-						JANUS_LOG(LOG_WARN, "[%"SCNu64"] Don't know what to do with video SSRC: %"SCNu64"\n", handle->handle_id, ssrc);
+						if(sim) {
+							/* More simulcast layers than we have fields for: we can still recognize them */
+							JANUS_LOG(LOG_VERB, "[%"SCNu64"] Peer video SSRC (sim-%d): %"SCNu64"\n", handle->handle_id, i-1, ssrc);
+							janus_ice_stream_add_peer_ssrc(stream, ssrc, JANUS_ICE_SSRC_VIDEO_SIM, i-1);
+						} else {
+							JANUS_LOG(LOG_WARN, "[%"SCNu64"] Don't know what to do with video SSRC: %"SCNu64"\n", handle->handle_id, ssrc);
+						}
 						break;
 				}
 			}